@@ -0,0 +1,584 @@
+/* DDSketch; see ddsketch.h. */
+
+#include "float.h"
+#include "math.h"
+#include "stdlib.h"
+#include "string.h"
+
+#include "encoding.h"
+#include "ddsketch.h"
+
+// A sparse store becomes dense once its range of indexes is at most this
+// many times its number of buckets, when the dense array of 8-byte counts
+// is no bigger than the 16-byte buckets. A dense store becomes sparse again
+// if it would grow to twice that, so stores don't switch back and forth.
+#define DDSKETCH_DENSE_RATIO 2
+
+static void *ddAlloc(size_t size) {
+    return histkAllocator()->alloc(size);
+}
+
+static void ddFree(void *p) {
+    histkAllocator()->free(p);
+}
+
+static void initDDStore(struct DDStore *s) {
+    memset(s, 0, sizeof(*s));
+}
+
+static void clearDDStore(struct DDStore *s) {
+    if (s->buckets != NULL) { ddFree(s->buckets); }
+    if (s->counts != NULL) { ddFree(s->counts); }
+    initDDStore(s);
+}
+
+static void copyDDStore(struct DDStore *dst, const struct DDStore *src) {
+    *dst = *src;
+    if (src->buckets != NULL) {
+        dst->buckets = ddAlloc(src->capacity * sizeof(*src->buckets));
+        memcpy(dst->buckets, src->buckets,
+               src->numBuckets * sizeof(*src->buckets));
+    }
+    if (src->counts != NULL) {
+        dst->counts = ddAlloc(src->capacity * sizeof(*src->counts));
+        memcpy(dst->counts, src->counts,
+               src->numBuckets * sizeof(*src->counts));
+    }
+}
+
+static size_t ddStoreMemUsage(const struct DDStore *s) {
+    return s->capacity * (s->dense ? sizeof(*s->counts) :
+                          sizeof(*s->buckets));
+}
+
+// The i-th lowest index the store counts, and its count, for i below
+// numBuckets. Dense stores may count 0 for an index.
+static inline int ddStoreIndex(const struct DDStore *s, int i) {
+    return s->dense ? s->offset + i : s->buckets[i].index;
+}
+
+static inline uint64_t ddStoreCount(const struct DDStore *s, int i) {
+    return s->dense ? s->counts[i] : s->buckets[i].count;
+}
+
+// Make the dense store s count exactly the indexes lo to hi, where hi is at
+// least its highest index, folding the counts of any indexes below lo into
+// lo's.
+static void setDenseRange(struct DDStore *s, int lo, int hi) {
+    int n = hi - lo + 1;
+    uint64_t *counts = s->counts;
+    if (n > s->capacity) {
+        s->capacity = n > 2 * s->capacity ? n : 2 * s->capacity;
+        counts = ddAlloc(s->capacity * sizeof(*counts));
+    }
+    uint64_t folded = 0;
+    int from = 0, to = 0, len = 0;
+    if (s->numBuckets > 0) {
+        for (; from < s->numBuckets && s->offset + from < lo; from++) {
+            folded += s->counts[from];
+        }
+        // Nothing is left to move if every index was folded.
+        len = s->numBuckets - from;
+        to = len > 0 ? s->offset + from - lo : 0;
+        memmove(counts + to, s->counts + from, len * sizeof(*counts));
+    }
+    memset(counts, 0, to * sizeof(*counts));
+    memset(counts + to + len, 0, (n - to - len) * sizeof(*counts));
+    counts[0] += folded;
+    if (counts != s->counts) {
+        if (s->counts != NULL) { ddFree(s->counts); }
+        s->counts = counts;
+    }
+    s->offset = lo;
+    s->numBuckets = n;
+}
+
+// The lowest index a store may keep once its highest is hi.
+static inline int ddStoreFloor(int hi, int maxBuckets) {
+    return hi - maxBuckets + 1;
+}
+
+static void addToSparse(struct DDStore *s, int index, uint64_t count,
+                        int maxBuckets);
+
+static void makeSparse(struct DDStore *s) {
+    int n = 0;
+    for (int i = 0; i < s->numBuckets; i++) { n += s->counts[i] > 0; }
+    s->buckets = ddAlloc(n * sizeof(*s->buckets));
+    for (int i = 0, j = 0; i < s->numBuckets; i++) {
+        if (s->counts[i] == 0) { continue; }
+        s->buckets[j].index = s->offset + i;
+        s->buckets[j++].count = s->counts[i];
+    }
+    ddFree(s->counts);
+    s->counts = NULL;
+    s->numBuckets = s->capacity = n;
+    s->dense = 0;
+}
+
+static void addToDense(struct DDStore *s, int index, uint64_t count,
+                       int maxBuckets) {
+    if (s->numBuckets == 0) {
+        setDenseRange(s, index, index);
+    } else if (index < s->offset || index >= s->offset + s->numBuckets) {
+        int hi = s->offset + s->numBuckets - 1;
+        if (index > hi) { hi = index; }
+        int lo = index < s->offset ? index : s->offset;
+        if (lo < ddStoreFloor(hi, maxBuckets)) {
+            lo = ddStoreFloor(hi, maxBuckets);
+        }
+        int n = 1;
+        for (int i = 0; i < s->numBuckets; i++) { n += s->counts[i] > 0; }
+        if (hi - lo + 1 > 2 * DDSKETCH_DENSE_RATIO * n) {
+            makeSparse(s);
+            addToSparse(s, index, count, maxBuckets);
+            return;
+        }
+        setDenseRange(s, lo, hi);
+    }
+    if (index < s->offset) { index = s->offset; }
+    s->counts[index - s->offset] += count;
+}
+
+static void makeDense(struct DDStore *s) {
+    struct DDBucket *buckets = s->buckets;
+    int n = s->numBuckets;
+    s->buckets = NULL;
+    s->numBuckets = s->capacity = 0;
+    s->dense = 1;
+    setDenseRange(s, buckets[0].index, buckets[n - 1].index);
+    for (int i = 0; i < n; i++) {
+        s->counts[buckets[i].index - s->offset] = buckets[i].count;
+    }
+    ddFree(buckets);
+}
+
+static void addToSparse(struct DDStore *s, int index, uint64_t count,
+                        int maxBuckets) {
+    int n = s->numBuckets;
+    if (n > 0) {
+        int hi = s->buckets[n - 1].index;
+        int floor = ddStoreFloor(index > hi ? index : hi, maxBuckets);
+        if (index < floor) { index = floor; }
+        // Collapse the buckets below the floor into one at it.
+        int below = 0;
+        uint64_t folded = 0;
+        for (; below < n && s->buckets[below].index < floor; below++) {
+            folded += s->buckets[below].count;
+        }
+        if (below > 0) {
+            int keep = below - 1;
+            if (below < n && s->buckets[below].index == floor) {
+                s->buckets[below].count += folded;
+                keep = below;
+            } else {
+                s->buckets[keep].index = floor;
+                s->buckets[keep].count = folded;
+            }
+            memmove(s->buckets, s->buckets + keep,
+                    (n - keep) * sizeof(*s->buckets));
+            s->numBuckets = n -= keep;
+        }
+    }
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (s->buckets[mid].index < index) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < n && s->buckets[lo].index == index) {
+        s->buckets[lo].count += count;
+        return;
+    }
+    if (n == s->capacity) {
+        s->capacity = s->capacity > 0 ? 2 * s->capacity : 4;
+        s->buckets = histkAllocator()->realloc(
+            s->buckets, s->capacity * sizeof(*s->buckets));
+    }
+    memmove(s->buckets + lo + 1, s->buckets + lo,
+            (n - lo) * sizeof(*s->buckets));
+    s->buckets[lo].index = index;
+    s->buckets[lo].count = count;
+    s->numBuckets = ++n;
+    int64_t span = (int64_t)s->buckets[n - 1].index - s->buckets[0].index + 1;
+    if (span <= DDSKETCH_DENSE_RATIO * (int64_t)n) { makeDense(s); }
+}
+
+static void addToDDStore(struct DDStore *s, int index, uint64_t count,
+                         int maxBuckets) {
+    if (s->dense) {
+        addToDense(s, index, count, maxBuckets);
+    } else {
+        addToSparse(s, index, count, maxBuckets);
+    }
+}
+
+// Add src's counts to dst's, two dense stores, as one sum of arrays.
+static void mergeDense(struct DDStore *dst, const struct DDStore *src,
+                       int maxBuckets) {
+    int hi = src->offset + src->numBuckets - 1, lo = src->offset;
+    if (dst->numBuckets > 0) {
+        if (dst->offset + dst->numBuckets - 1 > hi) {
+            hi = dst->offset + dst->numBuckets - 1;
+        }
+        if (dst->offset < lo) { lo = dst->offset; }
+    }
+    if (lo < ddStoreFloor(hi, maxBuckets)) {
+        lo = ddStoreFloor(hi, maxBuckets);
+    }
+    setDenseRange(dst, lo, hi);
+    int i = 0;
+    for (; i < src->numBuckets && src->offset + i < lo; i++) {
+        dst->counts[0] += src->counts[i];
+    }
+    uint64_t *restrict d = dst->counts + (src->offset + i - lo);
+    const uint64_t *restrict c = src->counts + i;
+    for (int j = 0, n = src->numBuckets - i; j < n; j++) { d[j] += c[j]; }
+}
+
+static void mergeDDStores(struct DDStore *dst, const struct DDStore *src,
+                          int maxBuckets) {
+    if (src->numBuckets == 0) { return; }
+    if (dst->numBuckets == 0 && src->dense) {
+        clearDDStore(dst);
+        copyDDStore(dst, src);
+        int hi = src->offset + src->numBuckets - 1;
+        if (src->offset < ddStoreFloor(hi, maxBuckets)) {
+            setDenseRange(dst, ddStoreFloor(hi, maxBuckets), hi);
+        }
+    } else if (dst->dense && src->dense) {
+        mergeDense(dst, src, maxBuckets);
+    } else {
+        for (int i = 0; i < src->numBuckets; i++) {
+            uint64_t c = ddStoreCount(src, i);
+            if (c > 0) {
+                addToDDStore(dst, ddStoreIndex(src, i), c, maxBuckets);
+            }
+        }
+    }
+}
+
+static uint64_t ddStoreTotal(const struct DDStore *s) {
+    uint64_t total = 0;
+    for (int i = 0; i < s->numBuckets; i++) { total += ddStoreCount(s, i); }
+    return total;
+}
+
+struct DDSketch *createDDSketch(double relativeAccuracy, int maxBuckets) {
+    struct DDSketch *d = ddAlloc(sizeof(*d));
+    d->relativeAccuracy = relativeAccuracy;
+    d->maxBuckets = maxBuckets;
+    d->logGamma = log((1 + relativeAccuracy) / (1 - relativeAccuracy));
+    d->totalCount = 0;
+    d->zeroCount = 0;
+    d->min = DBL_MAX;
+    d->max = -DBL_MAX;
+    initDDStore(&d->positive);
+    initDDStore(&d->negative);
+    return d;
+}
+
+struct DDSketch *copyDDSketch(const struct DDSketch *d) {
+    struct DDSketch *c = ddAlloc(sizeof(*c));
+    *c = *d;
+    copyDDStore(&c->positive, &d->positive);
+    copyDDStore(&c->negative, &d->negative);
+    return c;
+}
+
+void freeDDSketch(struct DDSketch *d) {
+    clearDDStore(&d->positive);
+    clearDDStore(&d->negative);
+    ddFree(d);
+}
+
+size_t ddsketchMemUsage(const struct DDSketch *d) {
+    return sizeof(*d) + ddStoreMemUsage(&d->positive) +
+        ddStoreMemUsage(&d->negative);
+}
+
+// The index of the bucket that counts magnitude m, which is at least
+// DBL_MIN, as a real number: the bucket is its ceiling.
+static inline double ddRealIndex(const struct DDSketch *d, double m) {
+    return log(m < DBL_MAX ? m : DBL_MAX) / d->logGamma;
+}
+
+// The value a bucket stands for, within the relative accuracy of any
+// magnitude it counts.
+static inline double ddBucketValue(const struct DDSketch *d, int index) {
+    double gamma = exp(d->logGamma);
+    return exp(index * d->logGamma) * 2 / (gamma + 1);
+}
+
+void ddsketchAdd(struct DDSketch *d, double value, unsigned long long count) {
+    double m = fabs(value);
+    if (m < DBL_MIN) {
+        d->zeroCount += count;
+    } else {
+        addToDDStore(value > 0 ? &d->positive : &d->negative,
+                     (int)ceil(ddRealIndex(d, m)), count, d->maxBuckets);
+    }
+    d->totalCount += count;
+    if (value < d->min) { d->min = value; }
+    if (value > d->max) { d->max = value; }
+}
+
+int ddsketchMerge(struct DDSketch *dst, const struct DDSketch *src) {
+    if (dst->relativeAccuracy != src->relativeAccuracy) {
+        return HISTK_ERR_INVALID;
+    }
+    struct DDSketch *copy = NULL;
+    if (dst == src) { src = copy = copyDDSketch(src); }
+    mergeDDStores(&dst->positive, &src->positive, dst->maxBuckets);
+    mergeDDStores(&dst->negative, &src->negative, dst->maxBuckets);
+    dst->zeroCount += src->zeroCount;
+    dst->totalCount += src->totalCount;
+    if (src->min < dst->min) { dst->min = src->min; }
+    if (src->max > dst->max) { dst->max = src->max; }
+    if (copy != NULL) { freeDDSketch(copy); }
+    return HISTK_OK;
+}
+
+static inline double clampValue(const struct DDSketch *d, double v) {
+    return v < d->min ? d->min : v > d->max ? d->max : v;
+}
+
+// The value of the bucket holding the value of rank q * (totalCount - 1),
+// counting from the most negative.
+double ddsketchQuantile(const struct DDSketch *d, double q) {
+    if (d->totalCount == 0) { return NAN; }
+    if (q <= 0) { return d->min; }
+    if (q >= 1) { return d->max; }
+    double rank = q * (d->totalCount - 1);
+    uint64_t seen = 0;
+    const struct DDStore *s = &d->negative;
+    for (int i = s->numBuckets - 1; i >= 0; i--) {
+        if ((seen += ddStoreCount(s, i)) > rank) {
+            return clampValue(d, -ddBucketValue(d, ddStoreIndex(s, i)));
+        }
+    }
+    if ((seen += d->zeroCount) > rank) { return clampValue(d, 0); }
+    s = &d->positive;
+    for (int i = 0; i < s->numBuckets; i++) {
+        if ((seen += ddStoreCount(s, i)) > rank) {
+            return clampValue(d, ddBucketValue(d, ddStoreIndex(s, i)));
+        }
+    }
+    return d->max;
+}
+
+// Buckets are taken to hold values spread evenly over their range of
+// indexes, so the bucket that v falls in counts in part.
+long long ddsketchCountLessThanOrEqual(const struct DDSketch *d, double v) {
+    if (d->totalCount == 0 || v < d->min) { return 0; }
+    if (v >= d->max) { return d->totalCount; }
+    double m = fabs(v), count = 0;
+    if (v < 0 && m >= DBL_MIN) {
+        // Values at most v have magnitudes at least m.
+        double r = ddRealIndex(d, m);
+        const struct DDStore *s = &d->negative;
+        for (int i = 0; i < s->numBuckets; i++) {
+            int index = ddStoreIndex(s, i);
+            if (index > r) {
+                count += ddStoreCount(s, i) *
+                    (index - r < 1 ? index - r : 1);
+            }
+        }
+        return llround(count);
+    }
+    count = ddStoreTotal(&d->negative) + d->zeroCount;
+    if (m < DBL_MIN) { return count; }
+    double r = ddRealIndex(d, m);
+    const struct DDStore *s = &d->positive;
+    for (int i = 0; i < s->numBuckets; i++) {
+        int index = ddStoreIndex(s, i);
+        if (index > r + 1) { break; }
+        count += ddStoreCount(s, i) * (r - (index - 1) < 1 ?
+                                       r - (index - 1) : 1);
+    }
+    return llround(count);
+}
+
+// A sketch is serialized as its relative accuracy, maxBuckets, zero count,
+// min and max, then each store, positive first, as its number of nonempty
+// buckets followed by the first one's index, the gaps between the rest, and
+// each one's count, all varints.
+#define DDSKETCH_BUCKET_MAX (2 * HISTK_VARINT_MAX)
+
+static size_t ddStoreSerializedSize(const struct DDStore *s) {
+    return HISTK_VARINT_MAX + s->numBuckets * DDSKETCH_BUCKET_MAX;
+}
+
+size_t ddsketchSerializedSize(const struct DDSketch *d) {
+    return 8 + 2 * HISTK_VARINT_MAX + 8 + 8 +
+        ddStoreSerializedSize(&d->positive) +
+        ddStoreSerializedSize(&d->negative);
+}
+
+static unsigned char *putDDStore(unsigned char *p, const struct DDStore *s) {
+    int n = 0;
+    for (int i = 0; i < s->numBuckets; i++) { n += ddStoreCount(s, i) > 0; }
+    p = putVarint(p, n);
+    int64_t last = 0;
+    for (int i = 0; i < s->numBuckets; i++) {
+        uint64_t c = ddStoreCount(s, i);
+        if (c == 0) { continue; }
+        int64_t index = ddStoreIndex(s, i);
+        p = putSignedVarint(p, index - last);
+        p = putVarint(p, c);
+        last = index;
+    }
+    return p;
+}
+
+size_t serializeDDSketch(const struct DDSketch *d, unsigned char *buf) {
+    unsigned char *p = putDouble(buf, d->relativeAccuracy);
+    p = putVarint(p, d->maxBuckets);
+    p = putVarint(p, d->zeroCount);
+    p = putDouble(p, d->min);
+    p = putDouble(p, d->max);
+    p = putDDStore(p, &d->positive);
+    p = putDDStore(p, &d->negative);
+    return p - buf;
+}
+
+// Read a store into s, adding its counts to *total. Returns a pointer past
+// it, or NULL if it isn't valid.
+static const unsigned char *getDDStore(const unsigned char *p,
+                                       const unsigned char *end,
+                                       struct DDStore *s, int maxBuckets,
+                                       uint64_t *total) {
+    uint64_t n;
+    if ((p = getVarintBounded(p, end, &n)) == NULL ||
+        n > (uint64_t)maxBuckets) {
+        return NULL;
+    }
+    if (n == 0) { return p; }
+    struct DDBucket *buckets = ddAlloc(n * sizeof(*buckets));
+    int64_t index = 0;
+    for (uint64_t i = 0; i < n; i++) {
+        int64_t gap;
+        uint64_t c;
+        if ((p = getSignedVarintBounded(p, end, &gap)) == NULL ||
+            (i > 0 && gap < 1) || gap > INT32_MAX || gap < INT32_MIN ||
+            (index += gap) > INT32_MAX || index < INT32_MIN ||
+            (p = getVarintBounded(p, end, &c)) == NULL || c == 0) {
+            ddFree(buckets);
+            return NULL;
+        }
+        buckets[i].index = index;
+        buckets[i].count = c;
+        *total += c;
+    }
+    if (index - buckets[0].index >= maxBuckets) {
+        ddFree(buckets);
+        return NULL;
+    }
+    s->buckets = buckets;
+    s->numBuckets = s->capacity = n;
+    if (index - buckets[0].index + 1 <= DDSKETCH_DENSE_RATIO * (int64_t)n) {
+        makeDense(s);
+    }
+    return p;
+}
+
+struct DDSketch *deserializeDDSketch(const unsigned char *buf, size_t len) {
+    const unsigned char *p = buf, *end = buf + len;
+    double relativeAccuracy, min, max;
+    uint64_t maxBuckets, zeroCount;
+    if ((p = getDoubleBounded(p, end, &relativeAccuracy)) == NULL ||
+        !(relativeAccuracy >= DDSKETCH_MIN_RELATIVE_ACCURACY &&
+          relativeAccuracy <= DDSKETCH_MAX_RELATIVE_ACCURACY) ||
+        (p = getVarintBounded(p, end, &maxBuckets)) == NULL ||
+        maxBuckets < DDSKETCH_MIN_BUCKETS ||
+        maxBuckets > DDSKETCH_MAX_BUCKETS ||
+        (p = getVarintBounded(p, end, &zeroCount)) == NULL ||
+        (p = getDoubleBounded(p, end, &min)) == NULL ||
+        (p = getDoubleBounded(p, end, &max)) == NULL) {
+        return NULL;
+    }
+    struct DDSketch *d = createDDSketch(relativeAccuracy, maxBuckets);
+    uint64_t total = zeroCount;
+    if ((p = getDDStore(p, end, &d->positive, maxBuckets, &total)) == NULL ||
+        (p = getDDStore(p, end, &d->negative, maxBuckets, &total)) == NULL ||
+        p != end || (total > 0 && !(min <= max))) {
+        freeDDSketch(d);
+        return NULL;
+    }
+    d->zeroCount = zeroCount;
+    d->totalCount = total;
+    d->min = min;
+    d->max = max;
+    return d;
+}
+
+// The engine.
+
+static const struct HistKEngineOption ddsketchOptions[] = {
+    {"RELATIVE-ACCURACY", DDSKETCH_MIN_RELATIVE_ACCURACY,
+     DDSKETCH_MAX_RELATIVE_ACCURACY, DDSKETCH_DEFAULT_RELATIVE_ACCURACY, 0},
+    {"BUCKETS", DDSKETCH_MIN_BUCKETS, DDSKETCH_MAX_BUCKETS,
+     DDSKETCH_DEFAULT_BUCKETS, 1}
+};
+
+static void *engineCreate(const double *options) {
+    return createDDSketch(options[0], (int)options[1]);
+}
+
+static void *engineCopy(const void *s) {
+    return copyDDSketch(s);
+}
+
+static void engineFree(void *s) {
+    freeDDSketch(s);
+}
+
+static size_t engineMemUsage(const void *s) {
+    return ddsketchMemUsage(s);
+}
+
+static void engineAdd(void *s, double value, unsigned long long count) {
+    ddsketchAdd(s, value, count);
+}
+
+static unsigned long long engineTotalCount(const void *s) {
+    return ((const struct DDSketch *)s)->totalCount;
+}
+
+static double engineQuantile(const void *s, double q) {
+    return ddsketchQuantile(s, q);
+}
+
+static long long engineCount(const void *s, double v) {
+    return ddsketchCountLessThanOrEqual(s, v);
+}
+
+static const char *engineMerge(void *dst, const void *src) {
+    if (ddsketchMerge(dst, src) != HISTK_OK) {
+        return "ERR can't merge DDSketches with different relative "
+            "accuracies.";
+    }
+    return NULL;
+}
+
+static size_t engineSerializedSize(const void *s) {
+    return ddsketchSerializedSize(s);
+}
+
+static size_t engineSerialize(const void *s, unsigned char *buf) {
+    return serializeDDSketch(s, buf);
+}
+
+static void *engineDeserialize(const unsigned char *buf, size_t len) {
+    return deserializeDDSketch(buf, len);
+}
+
+const struct HistKEngine ddsketchEngine = {
+    "ddsketch", 2, ddsketchOptions, 2,
+    engineCreate, engineCopy, engineFree, engineMemUsage, engineAdd,
+    engineTotalCount, engineQuantile, NULL, engineCount, engineMerge,
+    engineSerializedSize, engineSerialize, engineDeserialize
+};
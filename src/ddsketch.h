@@ -0,0 +1,95 @@
+/* DDSketch, as described in Masson, Rim and Lee's "DDSketch: A Fast and
+ * Fully-Mergeable Quantile Sketch with Relative-Error Guarantees"
+ * (https://arxiv.org/abs/1908.10693), and the module's "ddsketch" engine.
+ *
+ * Values are counted in logarithmic buckets: with gamma = (1 + a) / (1 - a)
+ * for a relative accuracy a, bucket i counts the values whose magnitude is in
+ * (gamma^(i-1), gamma^i], so adding a value is a log and an increment, and
+ * any quantile is within a relative error of a of the true one. Positive and
+ * negative values have a store of buckets each, and values too small to index
+ * a count of their own.
+ *
+ * A store is sparse, a sorted list of (index, count) pairs, while its indexes
+ * are spread out, and becomes dense, an array of counts for a range of
+ * indexes, once that takes no more memory. Either way it keeps at most
+ * maxBuckets indexes: beyond that the lowest ones are collapsed into one, so
+ * only quantiles of the smallest magnitudes lose their guarantee. Merging
+ * dense stores adds one array of counts to the other.
+ */
+
+#ifndef DDSKETCH_H
+#define DDSKETCH_H
+
+#include "stddef.h"
+#include "stdint.h"
+
+#include "engine.h"
+#include "libhistk.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DDSKETCH_DEFAULT_RELATIVE_ACCURACY 0.01
+#define DDSKETCH_MIN_RELATIVE_ACCURACY 0.0001
+#define DDSKETCH_MAX_RELATIVE_ACCURACY 0.5
+#define DDSKETCH_DEFAULT_BUCKETS 2048
+#define DDSKETCH_MIN_BUCKETS 16
+#define DDSKETCH_MAX_BUCKETS 65536
+
+struct DDBucket {
+    int32_t index;
+    uint64_t count;
+};
+
+struct DDStore {
+    int dense;
+    // Sparse stores hold numBuckets buckets sorted by index; dense ones the
+    // counts of numBuckets indexes from offset on, some of them 0.
+    int numBuckets;
+    int capacity;
+    int offset;
+    struct DDBucket *buckets;
+    uint64_t *counts;
+};
+
+struct DDSketch {
+    double relativeAccuracy;
+    int maxBuckets;
+    // log(gamma), which indexes are scaled by.
+    double logGamma;
+    uint64_t totalCount;
+    // Values whose magnitude is below DBL_MIN.
+    uint64_t zeroCount;
+    // Only meaningful once the sketch holds values.
+    double min;
+    double max;
+    // Negative values are indexed by their magnitude.
+    struct DDStore positive;
+    struct DDStore negative;
+};
+
+struct DDSketch *createDDSketch(double relativeAccuracy, int maxBuckets);
+struct DDSketch *copyDDSketch(const struct DDSketch *d);
+void freeDDSketch(struct DDSketch *d);
+size_t ddsketchMemUsage(const struct DDSketch *d);
+
+void ddsketchAdd(struct DDSketch *d, double value, unsigned long long count);
+// Add everything in src to dst, which may be src. Returns HISTK_OK, or
+// HISTK_ERR_INVALID, leaving dst as it was, if the two don't have the same
+// relative accuracy.
+int ddsketchMerge(struct DDSketch *dst, const struct DDSketch *src);
+double ddsketchQuantile(const struct DDSketch *d, double q);
+long long ddsketchCountLessThanOrEqual(const struct DDSketch *d, double v);
+
+size_t ddsketchSerializedSize(const struct DDSketch *d);
+size_t serializeDDSketch(const struct DDSketch *d, unsigned char *buf);
+struct DDSketch *deserializeDDSketch(const unsigned char *buf, size_t len);
+
+extern const struct HistKEngine ddsketchEngine;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
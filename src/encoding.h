@@ -0,0 +1,77 @@
+/* The building blocks of histk's portable encodings, shared by libhistk and
+ * the sketch engines: varints and little-endian doubles.
+ */
+
+#ifndef HISTK_ENCODING_H
+#define HISTK_ENCODING_H
+
+#include "stdint.h"
+#include "string.h"
+
+// The most bytes a varint takes.
+#define HISTK_VARINT_MAX 10
+
+static inline unsigned char *putVarint(unsigned char *p, uint64_t v) {
+    for (; v >= 0x80; v >>= 7) { *p++ = v | 0x80; }
+    *p++ = v;
+    return p;
+}
+
+static inline const unsigned char *getVarint(const unsigned char *p,
+                                             uint64_t *v) {
+    *v = 0;
+    for (int shift = 0; ; shift += 7) {
+        *v |= (uint64_t)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80)) { return p; }
+    }
+}
+
+// Like getVarint, but return NULL rather than read past end.
+static inline const unsigned char *getVarintBounded(const unsigned char *p,
+                                                    const unsigned char *end,
+                                                    uint64_t *v) {
+    *v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        *v |= (uint64_t)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80)) { return p; }
+    }
+    return NULL;
+}
+
+// Signed varints zigzag, so small negative numbers stay short.
+static inline unsigned char *putSignedVarint(unsigned char *p, int64_t v) {
+    return putVarint(p, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+static inline const unsigned char *getSignedVarintBounded(
+    const unsigned char *p, const unsigned char *end, int64_t *v) {
+    uint64_t u;
+    if ((p = getVarintBounded(p, end, &u)) != NULL) {
+        *v = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+    }
+    return p;
+}
+
+static inline unsigned char *putDouble(unsigned char *p, double v) {
+    uint64_t b;
+    memcpy(&b, &v, sizeof(b));
+    for (int i = 0; i < 8; i++) { *p++ = b >> 8 * i; }
+    return p;
+}
+
+static inline const unsigned char *getDouble(const unsigned char *p,
+                                             double *v) {
+    uint64_t b = 0;
+    for (int i = 0; i < 8; i++) { b |= (uint64_t)*p++ << 8 * i; }
+    memcpy(v, &b, sizeof(b));
+    return p;
+}
+
+// Like getDouble, but return NULL rather than read past end.
+static inline const unsigned char *getDoubleBounded(const unsigned char *p,
+                                                    const unsigned char *end,
+                                                    double *v) {
+    return end - p < 8 ? NULL : getDouble(p, v);
+}
+
+#endif
@@ -0,0 +1,66 @@
+/* Sketch engines. Besides the histogram sketch in libhistk, the module can
+ * keep other kinds of quantile sketches in keys, chosen per key with
+ * HISTK.CREATE key ENGINE <name>. Each engine is a library of its own, like
+ * libhistk, and describes itself to the module with a struct HistKEngine,
+ * whose functions take and return its sketches as void pointers.
+ */
+
+#ifndef HISTK_ENGINE_H
+#define HISTK_ENGINE_H
+
+#include "stddef.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The most options an engine takes.
+#define HISTK_ENGINE_MAX_OPTIONS 4
+
+// A numeric option HISTK.CREATE takes for an engine, as NAME value.
+struct HistKEngineOption {
+    const char *name;
+    double min;
+    double max;
+    double defaultValue;
+    // Whether the value must be an integer.
+    int integer;
+};
+
+struct HistKEngine {
+    // What HISTK.CREATE's ENGINE argument calls it.
+    const char *name;
+    // Saved with its sketches in RDB files and dumps, so it never changes.
+    unsigned char id;
+    const struct HistKEngineOption *options;
+    int numOptions;
+    // Return a new, empty sketch with the given options, one value per
+    // option in the order options lists them, each within its bounds, or
+    // NULL if the options don't make sense together.
+    void *(*create)(const double *options);
+    void *(*copy)(const void *s);
+    void (*free)(void *s);
+    size_t (*memUsage)(const void *s);
+    void (*add)(void *s, double value, unsigned long long count);
+    unsigned long long (*totalCount)(const void *s);
+    // Only called on sketches that hold values.
+    double (*quantile)(const void *s, double q);
+    // Set out[i] to the qs[i]-quantile for each of the n qs, for engines
+    // that can find many at once faster than one at a time, or NULL.
+    void (*quantiles)(const void *s, const double *qs, int n, double *out);
+    long long (*countLessThanOrEqual)(const void *s, double v);
+    // Merge src into dst, which src may be. Returns NULL, or an error to
+    // reply with if the two can't be merged, in which case dst is unchanged.
+    const char *(*merge)(void *dst, const void *src);
+    // Serialization as the module saves sketches to RDB files and dumps
+    // them. deserialize returns NULL if buf doesn't hold a valid sketch.
+    size_t (*serializedSize)(const void *s);
+    size_t (*serialize)(const void *s, unsigned char *buf);
+    void *(*deserialize)(const unsigned char *buf, size_t len);
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
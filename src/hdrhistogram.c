@@ -0,0 +1,335 @@
+/* HDR histograms; see hdrhistogram.h. */
+
+#include "float.h"
+#include "math.h"
+#include "stdlib.h"
+#include "string.h"
+
+#include "encoding.h"
+#include "hdrhistogram.h"
+
+// Merges add counts a block at a time: ways vectors of lanes counts each.
+#define HDR_LANES 2
+#define HDR_WAYS 4
+#define HDR_BLOCK (HDR_LANES * HDR_WAYS)
+
+typedef uint64_t HdrLanes
+    __attribute__((vector_size(HDR_LANES * sizeof(uint64_t))));
+
+static int paddedCounts(int numCounts) {
+    return (numCounts + HDR_BLOCK - 1) / HDR_BLOCK * HDR_BLOCK;
+}
+
+static int log2Floor(uint64_t v) {
+    return 63 - __builtin_clzll(v);
+}
+
+struct HdrHistogram *createHdrHistogram(int64_t lowest, int64_t highest,
+                                        int significantDigits) {
+    if (lowest < 1 || highest < 2 * lowest ||
+        significantDigits < HDR_MIN_SIGNIFICANT_DIGITS ||
+        significantDigits > HDR_MAX_SIGNIFICANT_DIGITS) {
+        return NULL;
+    }
+    // Sub-buckets need to tell apart every integer up to twice
+    // 10^significantDigits.
+    int64_t singleUnitLimit = 2;
+    for (int i = 0; i < significantDigits; i++) { singleUnitLimit *= 10; }
+    int subBucketCountMagnitude = log2Floor(singleUnitLimit - 1) + 1;
+    int halfMagnitude = subBucketCountMagnitude - 1;
+    int unitMagnitude = log2Floor(lowest);
+    if (unitMagnitude + subBucketCountMagnitude > 62) { return NULL; }
+    int64_t subBucketCount = (int64_t)1 << subBucketCountMagnitude;
+    // Each bucket after the first doubles the range.
+    int numBuckets = 1;
+    for (int64_t limit = subBucketCount << unitMagnitude; limit <= highest;
+         numBuckets++) {
+        if (limit > INT64_MAX / 2) {
+            numBuckets++;
+            break;
+        }
+        limit <<= 1;
+    }
+    int64_t numCounts = (int64_t)(numBuckets + 1) * (subBucketCount / 2);
+    if (numCounts > HDR_MAX_COUNTS) { return NULL; }
+
+    size_t size = sizeof(struct HdrHistogram) +
+        paddedCounts(numCounts) * sizeof(uint64_t);
+    struct HdrHistogram *h = histkAllocator()->alloc(size);
+    memset(h, 0, size);
+    h->lowest = lowest;
+    h->highest = highest;
+    h->significantDigits = significantDigits;
+    h->unitMagnitude = unitMagnitude;
+    h->subBucketHalfCountMagnitude = halfMagnitude;
+    h->subBucketMask = (subBucketCount - 1) << unitMagnitude;
+    h->numCounts = numCounts;
+    h->min = DBL_MAX;
+    h->max = -DBL_MAX;
+    return h;
+}
+
+size_t hdrMemUsage(const struct HdrHistogram *h) {
+    return sizeof(*h) + paddedCounts(h->numCounts) * sizeof(uint64_t);
+}
+
+struct HdrHistogram *copyHdrHistogram(const struct HdrHistogram *h) {
+    struct HdrHistogram *c = histkAllocator()->alloc(hdrMemUsage(h));
+    memcpy(c, h, hdrMemUsage(h));
+    return c;
+}
+
+void freeHdrHistogram(struct HdrHistogram *h) {
+    histkAllocator()->free(h);
+}
+
+// The index of the count for v, which is from 0 to h->highest: the bucket is
+// the power of two v falls in, past the first subBucketCount values, and
+// the sub-bucket v's top bits.
+static inline int countsIndex(const struct HdrHistogram *h, int64_t v) {
+    int bucket = log2Floor(v | h->subBucketMask) - h->unitMagnitude -
+        h->subBucketHalfCountMagnitude;
+    int64_t subBucket = v >> (bucket + h->unitMagnitude);
+    return ((bucket + 1) << h->subBucketHalfCountMagnitude) +
+        (subBucket - ((int64_t)1 << h->subBucketHalfCountMagnitude));
+}
+
+// The lowest value counted at index i, and how many values are.
+static inline int64_t indexValue(const struct HdrHistogram *h, int i,
+                                 int64_t *size) {
+    int half = 1 << h->subBucketHalfCountMagnitude;
+    int bucket = (i >> h->subBucketHalfCountMagnitude) - 1;
+    int64_t subBucket = (i & (half - 1)) + half;
+    if (bucket < 0) {
+        subBucket -= half;
+        bucket = 0;
+    }
+    *size = (int64_t)1 << (bucket + h->unitMagnitude);
+    return subBucket << (bucket + h->unitMagnitude);
+}
+
+// Round v to an integer in the histogram's range.
+static inline int64_t hdrValue(const struct HdrHistogram *h, double v) {
+    v = v > 0 ? v : 0;
+    v = v < h->highest ? v : h->highest;
+    return (int64_t)(v + 0.5);
+}
+
+void hdrAdd(struct HdrHistogram *h, double value, unsigned long long count) {
+    h->counts[countsIndex(h, hdrValue(h, value))] += count;
+    h->totalCount += count;
+    h->min = value < h->min ? value : h->min;
+    h->max = value > h->max ? value : h->max;
+}
+
+static int sameLayout(const struct HdrHistogram *a,
+                      const struct HdrHistogram *b) {
+    return a->lowest == b->lowest && a->highest == b->highest &&
+        a->significantDigits == b->significantDigits;
+}
+
+int hdrMerge(struct HdrHistogram *dst, const struct HdrHistogram *src) {
+    if (!sameLayout(dst, src)) { return HISTK_ERR_INVALID; }
+    // Counts are added in place, so src may be dst.
+    for (int i = 0; i < paddedCounts(dst->numCounts); i += HDR_BLOCK) {
+#pragma GCC unroll 4
+        for (int w = 0; w < HDR_WAYS; w++) {
+            HdrLanes a, b;
+            memcpy(&a, dst->counts + i + w * HDR_LANES, sizeof(a));
+            memcpy(&b, src->counts + i + w * HDR_LANES, sizeof(b));
+            a += b;
+            memcpy(dst->counts + i + w * HDR_LANES, &a, sizeof(a));
+        }
+    }
+    dst->totalCount += src->totalCount;
+    if (src->min < dst->min) { dst->min = src->min; }
+    if (src->max > dst->max) { dst->max = src->max; }
+    return HISTK_OK;
+}
+
+static inline double clampValue(const struct HdrHistogram *h, double v) {
+    return v < h->min ? h->min : v > h->max ? h->max : v;
+}
+
+// The middle of the range of values counted where the q * totalCount-th
+// value is.
+double hdrQuantile(const struct HdrHistogram *h, double q) {
+    if (h->totalCount == 0) { return NAN; }
+    if (q <= 0) { return h->min; }
+    if (q >= 1) { return h->max; }
+    uint64_t rank = (uint64_t)(q * h->totalCount + 0.5);
+    if (rank == 0) { rank = 1; }
+    uint64_t seen = 0;
+    for (int i = 0; i < h->numCounts; i++) {
+        if ((seen += h->counts[i]) >= rank) {
+            int64_t size, lowest = indexValue(h, i, &size);
+            return clampValue(h, lowest + size / 2);
+        }
+    }
+    return h->max;
+}
+
+// Values are taken to be spread evenly over the range of each count, so the
+// count that v falls in counts in part.
+long long hdrCountLessThanOrEqual(const struct HdrHistogram *h, double v) {
+    if (h->totalCount == 0 || v < h->min) { return 0; }
+    if (v >= h->max) { return h->totalCount; }
+    // Values were rounded, so the ones at most v are at most its floor.
+    int64_t iv = hdrValue(h, floor(v));
+    int index = countsIndex(h, iv);
+    uint64_t count = 0;
+    for (int i = 0; i < index; i++) { count += h->counts[i]; }
+    int64_t size, lowest = indexValue(h, index, &size);
+    return count + llround((double)h->counts[index] * (iv - lowest + 1) / size);
+}
+
+// A histogram is serialized as its lowest and highest values and
+// significant digits as varints, its min and max, its total count as a
+// varint, then its counts up to the last that isn't 0 as signed varints,
+// where -n stands for n counts of 0.
+static size_t hdrHeaderSize(void) {
+    return 3 * HISTK_VARINT_MAX + 8 + 8 + HISTK_VARINT_MAX;
+}
+
+size_t hdrSerializedSize(const struct HdrHistogram *h) {
+    int nonzero = 0;
+    for (int i = 0; i < h->numCounts; i++) { nonzero += h->counts[i] > 0; }
+    // Every count but 0 may follow a run of 0s.
+    return hdrHeaderSize() + 2 * nonzero * HISTK_VARINT_MAX;
+}
+
+size_t serializeHdrHistogram(const struct HdrHistogram *h,
+                             unsigned char *buf) {
+    unsigned char *p = putVarint(buf, h->lowest);
+    p = putVarint(p, h->highest);
+    p = putVarint(p, h->significantDigits);
+    p = putDouble(p, h->min);
+    p = putDouble(p, h->max);
+    p = putVarint(p, h->totalCount);
+    int64_t zeros = 0;
+    for (int i = 0; i < h->numCounts; i++) {
+        if (h->counts[i] == 0) {
+            zeros++;
+            continue;
+        }
+        if (zeros > 0) { p = putSignedVarint(p, -zeros); }
+        zeros = 0;
+        p = putSignedVarint(p, h->counts[i]);
+    }
+    return p - buf;
+}
+
+struct HdrHistogram *deserializeHdrHistogram(const unsigned char *buf,
+                                             size_t len) {
+    const unsigned char *p = buf, *end = buf + len;
+    uint64_t lowest, highest, digits, total;
+    double min, max;
+    if ((p = getVarintBounded(p, end, &lowest)) == NULL ||
+        (p = getVarintBounded(p, end, &highest)) == NULL ||
+        (p = getVarintBounded(p, end, &digits)) == NULL ||
+        lowest > HDR_MAX_LOWEST || highest > HDR_MAX_HIGHEST ||
+        digits > HDR_MAX_SIGNIFICANT_DIGITS ||
+        (p = getDoubleBounded(p, end, &min)) == NULL ||
+        (p = getDoubleBounded(p, end, &max)) == NULL ||
+        (p = getVarintBounded(p, end, &total)) == NULL) {
+        return NULL;
+    }
+    struct HdrHistogram *h = createHdrHistogram(lowest, highest, digits);
+    if (h == NULL) { return NULL; }
+    uint64_t sum = 0;
+    int64_t i = 0;
+    while (p != NULL && p < end) {
+        int64_t c;
+        if ((p = getSignedVarintBounded(p, end, &c)) == NULL ||
+            c == 0 || i >= h->numCounts) {
+            p = NULL;
+        } else if (c < 0) {
+            // A run of 0s must be followed by a count. Compare before
+            // subtracting: i - c overflows for runs near INT64_MIN.
+            if (c <= i - h->numCounts) {
+                p = NULL;
+            } else {
+                i -= c;
+            }
+        } else {
+            h->counts[i++] = c;
+            sum += c;
+        }
+    }
+    if (p == NULL || sum != total || (total > 0 && !(min <= max))) {
+        freeHdrHistogram(h);
+        return NULL;
+    }
+    h->totalCount = total;
+    h->min = min;
+    h->max = max;
+    return h;
+}
+
+// The engine.
+
+static const struct HistKEngineOption hdrOptions[] = {
+    {"LOWEST", 1, HDR_MAX_LOWEST, HDR_DEFAULT_LOWEST, 1},
+    {"HIGHEST", 2, HDR_MAX_HIGHEST, HDR_DEFAULT_HIGHEST, 1},
+    {"SIGNIFICANT-DIGITS", HDR_MIN_SIGNIFICANT_DIGITS,
+     HDR_MAX_SIGNIFICANT_DIGITS, HDR_DEFAULT_SIGNIFICANT_DIGITS, 1}
+};
+
+static void *engineCreate(const double *options) {
+    return createHdrHistogram(options[0], options[1], options[2]);
+}
+
+static void *engineCopy(const void *s) {
+    return copyHdrHistogram(s);
+}
+
+static void engineFree(void *s) {
+    freeHdrHistogram(s);
+}
+
+static size_t engineMemUsage(const void *s) {
+    return hdrMemUsage(s);
+}
+
+static void engineAdd(void *s, double value, unsigned long long count) {
+    hdrAdd(s, value, count);
+}
+
+static unsigned long long engineTotalCount(const void *s) {
+    return ((const struct HdrHistogram *)s)->totalCount;
+}
+
+static double engineQuantile(const void *s, double q) {
+    return hdrQuantile(s, q);
+}
+
+static long long engineCount(const void *s, double v) {
+    return hdrCountLessThanOrEqual(s, v);
+}
+
+static const char *engineMerge(void *dst, const void *src) {
+    if (hdrMerge(dst, src) != HISTK_OK) {
+        return "ERR can't merge HDR histograms with different ranges or "
+            "significant digits.";
+    }
+    return NULL;
+}
+
+static size_t engineSerializedSize(const void *s) {
+    return hdrSerializedSize(s);
+}
+
+static size_t engineSerialize(const void *s, unsigned char *buf) {
+    return serializeHdrHistogram(s, buf);
+}
+
+static void *engineDeserialize(const unsigned char *buf, size_t len) {
+    return deserializeHdrHistogram(buf, len);
+}
+
+const struct HistKEngine hdrEngine = {
+    "hdr", 3, hdrOptions, 3,
+    engineCreate, engineCopy, engineFree, engineMemUsage, engineAdd,
+    engineTotalCount, engineQuantile, NULL, engineCount, engineMerge,
+    engineSerializedSize, engineSerialize, engineDeserialize
+};
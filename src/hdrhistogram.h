@@ -0,0 +1,84 @@
+/* An HDR histogram, after Gil Tene's HdrHistogram
+ * (http://hdrhistogram.org), and the module's "hdr" engine.
+ *
+ * Values are rounded to integers and counted in log-linear buckets: each
+ * power of two from the lowest value up to the highest is split into
+ * subBucketCount / 2 linear sub-buckets, enough to tell apart values that
+ * differ in their significantDigits-th significant digit. All the counts are
+ * allocated up front, so a histogram's size only depends on its range and
+ * precision, adding a value is a few shifts to find its count, and merging two
+ * histograms with the same layout adds their counts, a few vectors at a time.
+ * Values outside the range are counted as the nearest value in it.
+ */
+
+#ifndef HDRHISTOGRAM_H
+#define HDRHISTOGRAM_H
+
+#include "stddef.h"
+#include "stdint.h"
+
+#include "engine.h"
+#include "libhistk.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Microsecond latencies from 1us to a minute, to 2 significant digits.
+#define HDR_DEFAULT_LOWEST 1
+#define HDR_DEFAULT_HIGHEST 60000000
+#define HDR_DEFAULT_SIGNIFICANT_DIGITS 2
+#define HDR_MAX_LOWEST 1e12
+#define HDR_MAX_HIGHEST 4e18
+#define HDR_MIN_SIGNIFICANT_DIGITS 1
+#define HDR_MAX_SIGNIFICANT_DIGITS 4
+// The most counts a histogram may have, 8MB of them.
+#define HDR_MAX_COUNTS (1 << 20)
+
+struct HdrHistogram {
+    int64_t lowest;
+    int64_t highest;
+    int significantDigits;
+    // The layout of the counts, which follows from the three above.
+    int unitMagnitude;
+    int subBucketHalfCountMagnitude;
+    int64_t subBucketMask;
+    int numCounts;
+    uint64_t totalCount;
+    // Only meaningful once the histogram holds values, and not rounded.
+    double min;
+    double max;
+    // numCounts counts, padded with zeros to a whole number of blocks for
+    // merges.
+    uint64_t counts[];
+};
+
+// Returns NULL if highest is less than twice lowest, or the histogram would
+// need more than HDR_MAX_COUNTS counts.
+struct HdrHistogram *createHdrHistogram(int64_t lowest, int64_t highest,
+                                        int significantDigits);
+struct HdrHistogram *copyHdrHistogram(const struct HdrHistogram *h);
+void freeHdrHistogram(struct HdrHistogram *h);
+size_t hdrMemUsage(const struct HdrHistogram *h);
+
+void hdrAdd(struct HdrHistogram *h, double value, unsigned long long count);
+// Add everything in src to dst, which may be src. Returns HISTK_OK, or
+// HISTK_ERR_INVALID, leaving dst as it was, if the two don't have the same
+// layout.
+int hdrMerge(struct HdrHistogram *dst, const struct HdrHistogram *src);
+double hdrQuantile(const struct HdrHistogram *h, double q);
+long long hdrCountLessThanOrEqual(const struct HdrHistogram *h, double v);
+
+size_t hdrSerializedSize(const struct HdrHistogram *h);
+size_t serializeHdrHistogram(const struct HdrHistogram *h,
+                             unsigned char *buf);
+struct HdrHistogram *deserializeHdrHistogram(const unsigned char *buf,
+                                             size_t len);
+
+extern const struct HistKEngine hdrEngine;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
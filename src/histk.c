@@ -6,35 +6,43 @@
  * This implementation is mostly a port of github.com/aaw/histosketch to C as
  * a Redis module.
  *
- * The histogram sketch consists of a fixed number of (value, count) centroids
- * sorted by increasing value. Each time a value V is added to the sketch, it's
- * either merged into an existing centroid with the same value or added as a
- * (V, 1) centroid and then the two centroids in the sketch that have values
- * closest together are merged. Quantiles and counts are estimated by finding
- * the two centroids (V1, C1) and (V2, C2) in the sketch bordering the desired
- * value and using the area under the trapezoid defined by (V1, 0), (V1, C1),
- * (V2, 0), (V2, C2) to guide the estimate.
+ * The sketch itself lives in libhistk.c; this file is the Redis module around
+ * it: the data type, its commands and how they're stored and replicated.
  */
 
 #include "float.h"
 #include "math.h"
+#include "pthread.h"
 #include "stdlib.h"
 #include "string.h"
+#include "strings.h"
 
+#include "ddsketch.h"
+#include "engine.h"
+#include "hdrhistogram.h"
+#include "kll.h"
+#include "libhistk.h"
 #include "redismodule.h"
+#include "tdigest.h"
 
 #define HISTK_MODULE_VERSION 1
-#define HISTK_ENCODING_VERSION 0
+#define HISTK_ENCODING_VERSION 1
+
+// Version 1 of the RDB encoding saves each sketch as a single string (see
+// serializeHistK). Version 0 saved each field separately and is still loaded.
+// It predates compact sketches, so their layout is packed into the high bits
+// of the word that holds maxCentroids. Those bits are clear for full sketches
+// with 64-bit counts, which is how they were always saved.
+#define HISTK_RDB_VALUETYPE_SHIFT 16
+#define HISTK_RDB_COUNTWIDTH_SHIFT 24
 
-#define HISTK_DEFAULT_NUM_CENTROIDS 64
-#define HISTK_MAX_NUM_CENTROIDS 2048
 #define HISTK_DEFAULT_MERGE_ARRAY_SIZE HISTK_DEFAULT_NUM_CENTROIDS * 3
-#define HISTK_EPSILON 10e-7
 
 #define STR_HELPER(x) #x
 #define STR(x) STR_HELPER(x)
 #define HISTK_STR_MAX_CENTROIDS STR(HISTK_MAX_NUM_CENTROIDS)
 #define HISTK_ERRORMSG_COUNTNOTINT    "ERR count is not an integer."
+#define HISTK_ERRORMSG_COUNTNOTPOSITIVE "ERR count must be positive."
 #define HISTK_ERRORMSG_VALUENOTDOUBLE "ERR value is not a double."
 #define HISTK_ERRORMSG_BADQUANTILE    "ERR argument must be in the range " \
                                       "[0.0, 1.0]."
@@ -42,458 +50,2610 @@
 #define HISTK_ERRORMSG_CENTROIDLIMIT  "ERR invalid size: number of centroids " \
                                       "must be at most " \
                                       HISTK_STR_MAX_CENTROIDS "."
+#define HISTK_ERRORMSG_CENTROIDMIN    "ERR invalid size: number of centroids " \
+                                      "must be at least 1."
+#define HISTK_ERRORMSG_BADPRECISION   "ERR precision must be COMPACT or FULL."
+#define HISTK_ERRORMSG_BADSERIALIZED  "ERR invalid serialized sketch."
+#define HISTK_ERRORMSG_SYNTAX         "ERR syntax error."
+#define HISTK_ERRORMSG_BUSYKEY        "BUSYKEY Target key name already exists."
+#define HISTK_ERRORMSG_BADPATCH       "ERR invalid patch."
+#define HISTK_ERRORMSG_PATCHMISMATCH  "ERR patch doesn't apply to the sketch."
+#define HISTK_ERRORMSG_BADENGINE      "ERR unknown engine."
+#define HISTK_ERRORMSG_BADOPTION      "ERR unknown option for this engine."
+#define HISTK_ERRORMSG_BADOPTIONS     "ERR invalid options for this engine."
+#define HISTK_ERRORMSG_ENGINEMISMATCH "ERR can't merge sketches from " \
+                                      "different engines."
 #define UNUSED(x) (void)(x)
 
 static RedisModuleType *HistKType;
+// Slab allocation. A fork child saving an RDB file or rewriting the AOF shares
+// the parent's memory until the parent writes to it, and then each page
+// written to is copied along with every other sketch on it. When the module
+// is loaded with SLABS, sketches up to a page in size are carved out of 64KB
+// slabs of one size class each, packed so that none straddles two pages.
+// Slabs belong to one of two pools: hot sketches, the ones written again
+// within a few seconds of their last write, are kept apart from the rest, so
+// that the pages copied during a fork are mostly full of sketches that are
+// being written anyway. Which slots are free and when each sketch was last
+// written are recorded outside the slabs, so neither freeing a sketch nor
+// keeping track of it writes to its page.
+#define HISTK_SLAB_SIZE (64 * 1024)
+#define HISTK_PAGE_SIZE 4096
+#define HISTK_SLAB_MAX_SLOTS (HISTK_SLAB_SIZE / 64)
+#define HISTK_SLAB_COLD 0
+#define HISTK_SLAB_HOT 1
 
-struct Centroid {
-    double value;
-    long long count;
+struct Slab {
+    unsigned char *base;
+    // Other slabs of the same size and pool with free slots.
+    struct Slab *prev, *next;
+    // Writes to sketches in the slab, and how many came while a child was
+    // running.
+    unsigned long long writes;
+    unsigned long long forkWrites;
+    unsigned short slotSize;
+    unsigned short numSlots;
+    unsigned short used;
+    unsigned char pool;
+    // One bit per slot, set if the slot is free.
+    uint64_t free[HISTK_SLAB_MAX_SLOTS / 64];
+    // When the sketch in each slot was last written, in seconds.
+    uint32_t lastWrite[];
+};
+
+static int useSlabs;
+// Sketches written again within this many seconds are hot.
+static long long slabHotSeconds;
+// Whether a child was running when the current command started.
+static int slabForking;
+// The pool new sketches are allocated from.
+static int slabPool;
+// Every slab, sorted by address.
+static struct Slab **slabs;
+static int numSlabs, slabsSize;
+// Slabs with free slots, by slot size in cache lines and pool.
+static struct Slab *partialSlabs[HISTK_PAGE_SIZE / 64 + 1][2];
+
+static inline unsigned char *slabSlot(const struct Slab *s, int i) {
+    int perPage = HISTK_PAGE_SIZE / s->slotSize;
+    return s->base + i / perPage * HISTK_PAGE_SIZE +
+        i % perPage * s->slotSize;
+}
+
+static inline int slabSlotIndex(const struct Slab *s, const void *p) {
+    size_t off = (uintptr_t)p - (uintptr_t)s->base;
+    return off / HISTK_PAGE_SIZE * (HISTK_PAGE_SIZE / s->slotSize) +
+        off % HISTK_PAGE_SIZE / s->slotSize;
+}
+
+// Return the index of the first slab that starts after p.
+static int slabsAfter(const void *p) {
+    int lo = 0, hi = numSlabs;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if ((uintptr_t)p < (uintptr_t)slabs[mid]->base) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+// Return the slab p was allocated from, or NULL if it wasn't.
+static struct Slab *findSlab(const void *p) {
+    if (!useSlabs) { return NULL; }
+    int i = slabsAfter(p);
+    if (i == 0) { return NULL; }
+    struct Slab *s = slabs[i - 1];
+    return (uintptr_t)p < (uintptr_t)s->base + HISTK_SLAB_SIZE ? s : NULL;
+}
+
+static void linkSlab(struct Slab *s) {
+    struct Slab **head = &partialSlabs[s->slotSize / 64][s->pool];
+    s->prev = NULL;
+    s->next = *head;
+    if (*head != NULL) { (*head)->prev = s; }
+    *head = s;
+}
+
+static void unlinkSlab(struct Slab *s) {
+    if (s->prev != NULL) {
+        s->prev->next = s->next;
+    } else {
+        partialSlabs[s->slotSize / 64][s->pool] = s->next;
+    }
+    if (s->next != NULL) { s->next->prev = s->prev; }
+}
+
+static struct Slab *newSlab(size_t slotSize, int pool) {
+    int numSlots = HISTK_SLAB_SIZE / HISTK_PAGE_SIZE *
+        (HISTK_PAGE_SIZE / slotSize);
+    size_t size = sizeof(struct Slab) + numSlots * sizeof(uint32_t);
+    struct Slab *s = RedisModule_Alloc(size);
+    memset(s, 0, size);
+    s->base = RedisModule_Alloc(HISTK_SLAB_SIZE);
+    s->slotSize = slotSize;
+    s->numSlots = numSlots;
+    s->pool = pool;
+    for (int i = 0; i < numSlots; i++) {
+        s->free[i / 64] |= 1ULL << (i % 64);
+    }
+    if (numSlabs == slabsSize) {
+        slabsSize = slabsSize ? slabsSize * 2 : 16;
+        slabs = RedisModule_Realloc(slabs, slabsSize * sizeof(*slabs));
+    }
+    int i = slabsAfter(s->base);
+    memmove(slabs + i + 1, slabs + i, (numSlabs - i) * sizeof(*slabs));
+    slabs[i] = s;
+    numSlabs++;
+    linkSlab(s);
+    return s;
+}
+
+static void releaseSlab(struct Slab *s) {
+    unlinkSlab(s);
+    int i = slabsAfter(s->base) - 1;
+    memmove(slabs + i, slabs + i + 1, (numSlabs - i - 1) * sizeof(*slabs));
+    numSlabs--;
+    RedisModule_Free(s->base);
+    RedisModule_Free(s);
+}
+
+// Allocate size bytes, where size is one of histkAllocSize's classes, from a
+// slab in the current pool if slabs are in use and size fits in a page.
+static void *slabAlloc(size_t size) {
+    if (!useSlabs || size > HISTK_PAGE_SIZE) {
+        return RedisModule_Alloc(size);
+    }
+    struct Slab *s = partialSlabs[size / 64][slabPool];
+    if (s == NULL) { s = newSlab(size, slabPool); }
+    int w = 0;
+    while (s->free[w] == 0) { w++; }
+    int b = __builtin_ctzll(s->free[w]);
+    s->free[w] &= ~(1ULL << b);
+    s->lastWrite[w * 64 + b] = 0;
+    if (++s->used == s->numSlots) { unlinkSlab(s); }
+    return slabSlot(s, w * 64 + b);
+}
+
+// Free p, which came from slabAlloc. A slab whose last sketch is freed is
+// released unless it's the only one of its size and pool with free slots.
+static void slabFree(void *p) {
+    struct Slab *s = findSlab(p);
+    if (s == NULL) {
+        RedisModule_Free(p);
+        return;
+    }
+    int i = slabSlotIndex(s, p);
+    if (s->used-- == s->numSlots) { linkSlab(s); }
+    s->free[i / 64] |= 1ULL << (i % 64);
+    if (s->used == 0 &&
+        (s->next != NULL || partialSlabs[s->slotSize / 64][s->pool] != s)) {
+        releaseSlab(s);
+    }
+}
+
+// Let to, a copy of from, inherit from's write history.
+static void copyLastWrite(const void *to, const void *from) {
+    struct Slab *ts = findSlab(to), *fs = findSlab(from);
+    if (ts != NULL && fs != NULL) {
+        ts->lastWrite[slabSlotIndex(ts, to)] =
+            fs->lastWrite[slabSlotIndex(fs, from)];
+    }
+}
+
+static inline uint32_t slabClock(void) {
+    return RedisModule_Milliseconds() / 1000;
+}
+
+// Record that p, if it's in a slab, was just written.
+static void markWritten(const void *p) {
+    struct Slab *s = findSlab(p);
+    if (s != NULL) { s->lastWrite[slabSlotIndex(s, p)] = slabClock(); }
+}
+
+// Get ready for a command running in ctx that may write to sketches.
+static void beginSlabWrite(RedisModuleCtx *ctx) {
+    if (!useSlabs) { return; }
+    slabForking = (RedisModule_GetContextFlags(ctx) &
+                   REDISMODULE_CTX_FLAGS_ACTIVE_CHILD) != 0;
+    slabPool = HISTK_SLAB_COLD;
+}
+
+
+// Return a sketch for a key: an empty one, created to be written to (see
+// placeHistK).
+static struct HistK *newHistK(unsigned short int maxCentroids,
+                              unsigned char valueType) {
+    struct HistK *h = createHistK(maxCentroids, valueType);
+    markWritten(h);
+    return h;
+}
+
+static void retractHistK(const struct HistK *h);
+
+// Free h, a sketch that was stored in a key, retracting its snapshot.
+static void dropHistK(struct HistK *h) {
+    retractHistK(h);
+    freeHistK(h);
+}
+
+// Store h, a copy of the sketch key holds now, in its place, and free the old
+// one. h inherits its write history. Unlike a bare
+// RedisModule_ModuleTypeSetValue, this keeps the key's TTL. Where Redis can,
+// only its pointer to the sketch is swapped: setting the value allocates a new
+// object for the key and rewrites its entry in the keyspace, dirtying more
+// pages that a fork child may be sharing.
+static void replaceHistK(RedisModuleKey *key, struct HistK *h) {
+    copyLastWrite(h, RedisModule_ModuleTypeGetValue(key));
+    if (RedisModule_ModuleTypeReplaceValue != NULL) {
+        void *old;
+        RedisModule_ModuleTypeReplaceValue(key, HistKType, h, &old);
+        dropHistK(old);
+        return;
+    }
+    mstime_t ttl = RedisModule_GetExpire(key);
+    RedisModule_ModuleTypeSetValue(key, HistKType, h);
+    if (ttl != REDISMODULE_NO_EXPIRE) {
+        RedisModule_SetExpire(key, ttl);
+    }
+}
+
+// Record a write to h, the sketch in key, which is in slab s, and move it to
+// the hot pool if it was last written within slabHotSeconds or to the cold
+// pool if it wasn't. Sketches stay where they are while a child is running:
+// moving one writes to the page holding Redis's pointer to it, which costs as
+// much as writing to the page it's on. Any copies of h the command makes come
+// from h's pool.
+static struct HistK *placeHistK(RedisModuleKey *key, struct HistK *h,
+                                struct Slab *s) {
+    uint32_t now = slabClock();
+    int pool = now - s->lastWrite[slabSlotIndex(s, h)] <= slabHotSeconds ?
+        HISTK_SLAB_HOT : HISTK_SLAB_COLD;
+    s->writes++;
+    if (slabForking) {
+        s->forkWrites++;
+        pool = s->pool;
+    }
+    slabPool = pool;
+    if (pool != s->pool) {
+        // Hot sketches get all the room they'll need up front, so they don't
+        // have to grow into a new slot while a child is running.
+        h = copyHistK(h, pool == HISTK_SLAB_HOT ? h->maxCentroids : h->capacity,
+                      h->valueType, h->countWidth);
+        replaceHistK(key, h);
+        // Sketches that outgrow a page get pages of their own.
+        if ((s = findSlab(h)) == NULL) { return h; }
+    }
+    s->lastWrite[slabSlotIndex(s, h)] = now;
+    return h;
+}
+
+// Return the sketch stored in key, unpacking it in place first if it's packed,
+// for the caller to write to. key must be open for writing.
+static struct HistK *expandHistK(RedisModuleKey *key) {
+    struct HistK *h = RedisModule_ModuleTypeGetValue(key);
+    retractHistK(h);
+    if (isPacked(h)) {
+        h = unpackHistK(h);
+        replaceHistK(key, h);
+    }
+    struct Slab *s = findSlab(h);
+    if (s != NULL) { h = placeHistK(key, h, s); }
+    return h;
+}
+
+// Return the sketch stored in key for reading. Packed sketches stay packed:
+// they're unpacked into a copy that the caller gives back with releaseHistK.
+static struct HistK *readHistK(RedisModuleKey *key) {
+    struct HistK *h = RedisModule_ModuleTypeGetValue(key);
+    return isPacked(h) ? unpackHistK(h) : h;
+}
+
+static void releaseHistK(RedisModuleKey *key, struct HistK *h) {
+    if (h != RedisModule_ModuleTypeGetValue(key)) { freeHistK(h); }
+}
+
+// Snapshots. Commands that run on workers (see WORKERS) read sketches from
+// snapshots: unpacked copies taken under the GIL that nothing writes to, which
+// workers then read without the GIL. Writers never wait for readers. Writing
+// to or freeing a sketch retracts its snapshot, so that later readers take a
+// new one and workers can tell that the sketch changed, and the old one is
+// freed by whichever reader is done with it last. Readers of a sketch that
+// doesn't change in between share a snapshot, so a hot sketch is copied at
+// most once per write however many commands read it at once.
+struct HistKSnapshot {
+    // The sketch this is a snapshot of, or NULL once it's been retracted.
+    const struct HistK *source;
+    // Number of readers using the snapshot.
+    int refs;
+    // The copy, allocated outside slabs so that any thread can free it.
+    struct HistK *h;
+};
+
+// Snapshots by the address of their source. Sketches retract their snapshots
+// before they're written to or freed, so an address is never mistaken for a
+// sketch that used to live there. snapshotMutex guards the dict and the refs
+// and source of every snapshot.
+static RedisModuleDict *snapshots;
+static pthread_mutex_t snapshotMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void retractHistK(const struct HistK *h) {
+    if (snapshots == NULL) { return; }
+    pthread_mutex_lock(&snapshotMutex);
+    struct HistKSnapshot *s;
+    if (RedisModule_DictSize(snapshots) > 0 &&
+        RedisModule_DictDelC(snapshots, &h, sizeof(h), &s) ==
+        REDISMODULE_OK) {
+        s->source = NULL;
+    }
+    pthread_mutex_unlock(&snapshotMutex);
+}
+
+// Return a snapshot of the sketch in key for a reader to give back with
+// releaseSnapshot. Must be called under the GIL.
+static struct HistKSnapshot *takeSnapshot(RedisModuleKey *key) {
+    const struct HistK *h = RedisModule_ModuleTypeGetValue(key);
+    pthread_mutex_lock(&snapshotMutex);
+    struct HistKSnapshot *s = RedisModule_DictGetC(snapshots, &h, sizeof(h),
+                                                   NULL);
+    if (s != NULL) { s->refs++; }
+    pthread_mutex_unlock(&snapshotMutex);
+    if (s != NULL) { return s; }
+
+    // Only threads holding the GIL add snapshots, so h can be copied without
+    // holding the lock.
+    s = RedisModule_Alloc(sizeof(*s));
+    s->source = h;
+    s->refs = 1;
+    s->h = scratchCopyHistK(h, h->numCentroids, h->countWidth);
+    pthread_mutex_lock(&snapshotMutex);
+    RedisModule_DictSetC(snapshots, &s->source, sizeof(h), s);
+    pthread_mutex_unlock(&snapshotMutex);
+    return s;
+}
+
+// Return a snapshot of h, a sketch that isn't stored in any key, taking over
+// h, which must have been allocated outside slabs.
+static struct HistKSnapshot *wrapSnapshot(struct HistK *h) {
+    struct HistKSnapshot *s = RedisModule_Alloc(sizeof(*s));
+    s->source = NULL;
+    s->refs = 1;
+    s->h = h;
+    return s;
+}
+
+// Whether s is still a snapshot of h: h hasn't been written to since s was
+// taken.
+static int isSnapshotOf(struct HistKSnapshot *s, const struct HistK *h) {
+    pthread_mutex_lock(&snapshotMutex);
+    int current = h != NULL && s->source == h;
+    pthread_mutex_unlock(&snapshotMutex);
+    return current;
+}
+
+static void releaseSnapshot(struct HistKSnapshot *s) {
+    pthread_mutex_lock(&snapshotMutex);
+    int last = --s->refs == 0;
+    if (last && s->source != NULL) {
+        RedisModule_DictDelC(snapshots, &s->source, sizeof(s->source), NULL);
+    }
+    pthread_mutex_unlock(&snapshotMutex);
+    if (last) {
+        RedisModule_Free(s->h);
+        RedisModule_Free(s);
+    }
+}
+
+// Whether write commands replicate their effects on sketches as patches (see
+// HISTK.PATCH) instead of replicating themselves. Patches spare replicas from
+// redoing the work of each command, and keep them identical to the master
+// even where the master broke ties between centroids at random.
+static int replicateEffects;
+
+// Return a copy of h, the sketch a write command is about to change, to pass
+// to replicateHistK once it's done. Returns NULL if h is NULL or if the
+// command will be replicated verbatim.
+static struct HistK *snapshotHistK(const struct HistK *h) {
+    if (!replicateEffects || h == NULL) { return NULL; }
+    return copyHistK(h, h->numCentroids, h->valueType, h->countWidth);
+}
+
+// Replicate the change to the sketch in keyname from before, a snapshot from
+// snapshotHistK, to after as a patch.
+static void replicatePatch(RedisModuleCtx *ctx, RedisModuleString *keyname,
+                           const struct HistK *before,
+                           const struct HistK *after) {
+    unsigned char *buf = RedisModule_Alloc(patchSize(after));
+    size_t len = writeHistKPatch(before, after, buf);
+    RedisModule_Replicate(ctx, "HISTK.PATCH", "sb", keyname, (const char *)buf,
+                          len);
+    RedisModule_Free(buf);
+}
+
+// Replicate a write command that changed the sketch in keyname from before,
+// a snapshot from snapshotHistK, to after. before is freed.
+static void replicateHistK(RedisModuleCtx *ctx, RedisModuleString *keyname,
+                           struct HistK *before, const struct HistK *after) {
+    if (!replicateEffects) {
+        RedisModule_ReplicateVerbatim(ctx);
+        return;
+    }
+    replicatePatch(ctx, keyname, before, after);
+    if (before != NULL) { freeHistK(before); }
+}
+
+// Coalesced replication. When the module is loaded with COALESCE-ADDS <ms>,
+// HISTK.ADD doesn't replicate itself. The first ADD to a key since it was
+// last flushed marks the key pending, with a snapshot of its sketch if the
+// module replicates effects, and a timer flushes every pending key at most
+// <ms> milliseconds later with a single command per key: a patch against the
+// snapshot or, when replicating verbatim or once anything but HISTK.ADD has
+// touched the key, a HISTK.RESTORE of the whole sketch, since the replica's
+// copy may no longer match the snapshot. The module's other write commands
+// flush the keys they touch before changing them, so replicas see changes in
+// order, and keyspace notifications catch other commands that touch pending
+// keys. ADDs inside MULTI or scripts are never deferred, so transactions
+// still replicate as a unit.
+static mstime_t coalesceMs = -1;
+static RedisModuleDict *pendingHistKs;
+static int flushScheduled;
+
+struct PendingHistK {
+    int whole;              // Replicate the whole sketch, not a patch.
+    struct HistK *before;   // What to patch against, NULL for an empty key.
 };
 
-struct HistK {
-    // Array of centroids, sorted by increasing value.
-    struct Centroid *cs;
-    // Total number of values observed by the sketch.
-    unsigned long long totalCount;
-    // Minimum value observed by the sketch.
+// Pending keys are looked up by their db number followed by their name.
+static char *pendingKey(int db, RedisModuleString *keyname, size_t *len) {
+    size_t n;
+    const char *name = RedisModule_StringPtrLen(keyname, &n);
+    char *k = RedisModule_Alloc(sizeof(db) + n);
+    memcpy(k, &db, sizeof(db));
+    memcpy(k + sizeof(db), name, n);
+    *len = sizeof(db) + n;
+    return k;
+}
+
+static void wholePendingHistK(struct PendingHistK *p) {
+    p->whole = 1;
+    if (p->before != NULL) { freeHistK(p->before); }
+    p->before = NULL;
+}
+
+// Whether an ADD running in ctx should leave replicating itself to a flush.
+static int deferringAdds(RedisModuleCtx *ctx) {
+    return coalesceMs >= 0 &&
+        !(RedisModule_GetContextFlags(ctx) &
+          (REDISMODULE_CTX_FLAGS_MULTI | REDISMODULE_CTX_FLAGS_LUA |
+           REDISMODULE_CTX_FLAGS_REPLICATED | REDISMODULE_CTX_FLAGS_LOADING));
+}
+
+static void flushTimer(RedisModuleCtx *ctx, void *data);
+
+// Mark keyname pending, if it isn't already, before an ADD changes h, the
+// sketch it holds (NULL if it's empty), and make sure a flush is coming.
+static void deferHistK(RedisModuleCtx *ctx, RedisModuleString *keyname,
+                       const struct HistK *h) {
+    size_t len;
+    char *k = pendingKey(RedisModule_GetSelectedDb(ctx), keyname, &len);
+    int nokey;
+    RedisModule_DictGetC(pendingHistKs, k, len, &nokey);
+    if (nokey) {
+        struct PendingHistK *p = RedisModule_Alloc(sizeof(*p));
+        p->whole = !replicateEffects;
+        p->before = snapshotHistK(h);
+        RedisModule_DictSetC(pendingHistKs, k, len, p);
+    }
+    RedisModule_Free(k);
+    if (!flushScheduled) {
+        RedisModule_CreateTimer(ctx, coalesceMs, flushTimer, NULL);
+        flushScheduled = 1;
+    }
+}
+
+// Replicate the changes to the pending key k, len bytes long, and free p.
+static void flushPendingHistK(RedisModuleCtx *ctx, const char *k, size_t len,
+                              struct PendingHistK *p) {
+    int db;
+    memcpy(&db, k, sizeof(db));
+    int selected = RedisModule_GetSelectedDb(ctx);
+    RedisModule_SelectDb(ctx, db);
+    RedisModuleString *keyname =
+        RedisModule_CreateString(ctx, k + sizeof(db), len - sizeof(db));
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, keyname, REDISMODULE_READ);
+    // If the sketch is gone, whatever deleted or overwrote it replicated
+    // itself, and there's nothing left to flush.
+    if (RedisModule_KeyType(key) != REDISMODULE_KEYTYPE_EMPTY &&
+        RedisModule_ModuleTypeGetType(key) == HistKType) {
+        struct HistK *h = readHistK(key);
+        if (!p->whole) {
+            replicatePatch(ctx, keyname, p->before, h);
+        } else {
+            size_t n;
+            unsigned char *buf = dumpHistK(h, &n);
+            RedisModule_Replicate(ctx, "HISTK.RESTORE", "sbc", keyname,
+                                  (const char *)buf, n, "REPLACE");
+            RedisModule_Free(buf);
+            mstime_t ttl = RedisModule_GetExpire(key);
+            if (ttl != REDISMODULE_NO_EXPIRE) {
+                RedisModule_Replicate(ctx, "PEXPIREAT", "sl", keyname,
+                                      RedisModule_Milliseconds() + ttl);
+            }
+        }
+        releaseHistK(key, h);
+    }
+    RedisModule_CloseKey(key);
+    RedisModule_FreeString(ctx, keyname);
+    RedisModule_SelectDb(ctx, selected);
+    wholePendingHistK(p);
+    RedisModule_Free(p);
+}
+
+// Flush keyname if it's pending, ahead of a command that's about to change
+// it or replicate something that reads it.
+static void flushHistK(RedisModuleCtx *ctx, RedisModuleString *keyname) {
+    if (pendingHistKs == NULL || RedisModule_DictSize(pendingHistKs) == 0) {
+        return;
+    }
+    size_t len;
+    char *k = pendingKey(RedisModule_GetSelectedDb(ctx), keyname, &len);
+    struct PendingHistK *p;
+    if (RedisModule_DictDelC(pendingHistKs, k, len, &p) == REDISMODULE_OK) {
+        flushPendingHistK(ctx, k, len, p);
+    }
+    RedisModule_Free(k);
+}
+
+static void flushAllHistKs(RedisModuleCtx *ctx) {
+    if (pendingHistKs == NULL || RedisModule_DictSize(pendingHistKs) == 0) {
+        return;
+    }
+    RedisModuleDict *pending = pendingHistKs;
+    pendingHistKs = RedisModule_CreateDict(NULL);
+    RedisModuleDictIter *it =
+        RedisModule_DictIteratorStartC(pending, "^", NULL, 0);
+    char *k;
+    size_t len;
+    struct PendingHistK *p;
+    while ((k = RedisModule_DictNextC(it, &len, (void **)&p)) != NULL) {
+        flushPendingHistK(ctx, k, len, p);
+    }
+    RedisModule_DictIteratorStop(it);
+    RedisModule_FreeDict(NULL, pending);
+}
+
+static void flushTimer(RedisModuleCtx *ctx, void *data) {
+    UNUSED(data);
+    flushScheduled = 0;
+    flushAllHistKs(ctx);
+}
+
+// Flush every pending key right away from a callback that may run where
+// Redis wouldn't propagate commands replicated through its own context until
+// later, if at all: commands replicated through a thread-safe context are
+// propagated immediately.
+static void flushAllHistKsNow(void) {
+    RedisModuleCtx *ctx = RedisModule_GetThreadSafeContext(NULL);
+    flushAllHistKs(ctx);
+    RedisModule_FreeThreadSafeContext(ctx);
+}
+
+// A command other than the module's touched keyname. The replica's copy of a
+// pending key may not match its snapshot anymore, and renaming, moving or
+// copying a pending key carries changes the replica hasn't seen to another
+// key, which has to be flushed whole too.
+static int onKeyspaceEvent(RedisModuleCtx *ctx, int type, const char *event,
+                           RedisModuleString *keyname) {
+    UNUSED(type);
+    if (RedisModule_DictSize(pendingHistKs) == 0) { return REDISMODULE_OK; }
+    size_t len;
+    char *k = pendingKey(RedisModule_GetSelectedDb(ctx), keyname, &len);
+    int nokey;
+    struct PendingHistK *p = RedisModule_DictGetC(pendingHistKs, k, len,
+                                                  &nokey);
+    if (!nokey) {
+        wholePendingHistK(p);
+    } else if (strcmp(event, "rename_to") == 0 ||
+               strcmp(event, "move_to") == 0 ||
+               strcmp(event, "copy_to") == 0) {
+        p = RedisModule_Alloc(sizeof(*p));
+        p->whole = 1;
+        p->before = NULL;
+        RedisModule_DictSetC(pendingHistKs, k, len, p);
+    }
+    RedisModule_Free(k);
+    return REDISMODULE_OK;
+}
+
+static void onServerEvent(RedisModuleCtx *ctx, RedisModuleEvent e,
+                          uint64_t subevent, void *data) {
+    UNUSED(ctx);
+    if (RedisModule_DictSize(pendingHistKs) == 0) { return; }
+    if (e.id == REDISMODULE_EVENT_FLUSHDB) {
+        // Keys are deleted without notifications, so snapshots of them are
+        // stale if they're written again.
+        if (subevent != REDISMODULE_SUBEVENT_FLUSHDB_START) { return; }
+        RedisModuleDictIter *it =
+            RedisModule_DictIteratorStartC(pendingHistKs, "^", NULL, 0);
+        struct PendingHistK *p;
+        while (RedisModule_DictNextC(it, NULL, (void **)&p) != NULL) {
+            wholePendingHistK(p);
+        }
+        RedisModule_DictIteratorStop(it);
+    } else if (e.id == REDISMODULE_EVENT_SWAPDB) {
+        // Pending changes move with their keys, as do the replica's copies.
+        RedisModuleSwapDbInfo *info = data;
+        RedisModuleDict *pending = pendingHistKs;
+        pendingHistKs = RedisModule_CreateDict(NULL);
+        RedisModuleDictIter *it =
+            RedisModule_DictIteratorStartC(pending, "^", NULL, 0);
+        char *k;
+        size_t len;
+        struct PendingHistK *p;
+        while ((k = RedisModule_DictNextC(it, &len, (void **)&p)) != NULL) {
+            int db;
+            memcpy(&db, k, sizeof(db));
+            if (db == info->dbnum_first) {
+                db = info->dbnum_second;
+            } else if (db == info->dbnum_second) {
+                db = info->dbnum_first;
+            }
+            char *swapped = RedisModule_Alloc(len);
+            memcpy(swapped, &db, sizeof(db));
+            memcpy(swapped + sizeof(db), k + sizeof(db), len - sizeof(db));
+            RedisModule_DictSetC(pendingHistKs, swapped, len, p);
+            RedisModule_Free(swapped);
+        }
+        RedisModule_DictIteratorStop(it);
+        RedisModule_FreeDict(NULL, pending);
+    } else if (e.id == REDISMODULE_EVENT_PERSISTENCE &&
+               subevent <= REDISMODULE_SUBEVENT_PERSISTENCE_SYNC_RDB_START) {
+        // An RDB file records how far the replication stream got, and
+        // replicas that load it resume from there.
+        flushAllHistKsNow();
+    }
+}
+
+// Some commands need everything pending in the AOF and the replication
+// stream before they run. A master that's demoted resyncs from the offset
+// it reached, so anything not replicated by then would survive on the old
+// master alone, and SHUTDOWN writes out the AOF for the last time. Redis
+// reports role changes and shutdowns only once it's too late to replicate,
+// so flush as those commands are dispatched instead.
+static void filterFlushingCommands(RedisModuleCommandFilterCtx *fctx) {
+    if (RedisModule_DictSize(pendingHistKs) == 0) { return; }
+    size_t len;
+    const char *cmd = RedisModule_StringPtrLen(
+        (RedisModuleString *)RedisModule_CommandFilterArgGet(fctx, 0), &len);
+    if ((len == 9 && strncasecmp(cmd, "replicaof", len) == 0) ||
+        (len == 7 && strncasecmp(cmd, "slaveof", len) == 0) ||
+        (len == 8 && strncasecmp(cmd, "failover", len) == 0) ||
+        (len == 8 && strncasecmp(cmd, "shutdown", len) == 0)) {
+        flushAllHistKsNow();
+    }
+}
+
+// Replace h, the sketch stored in key, with a copy that has room for an
+// operation on it that failed with err: one with room for at least n centroids
+// if err is HISTK_ERR_FULL, or with wider counts if it's HISTK_ERR_OVERFLOW.
+// Returns the copy.
+static struct HistK *makeRoom(RedisModuleKey *key, struct HistK *h, int err,
+                              unsigned int n) {
+    struct HistK *nh = err == HISTK_ERR_FULL ? growHistK(h, n) : widenHistK(h);
+    replaceHistK(key, nh);
+    return nh;
+}
+
+// Parse an optional COMPACT or FULL argument into a value type. Returns
+// REDISMODULE_ERR if the argument is neither.
+static int parseValueType(RedisModuleString *arg, unsigned char *valueType) {
+    size_t len;
+    const char *s = RedisModule_StringPtrLen(arg, &len);
+    if (len == 7 && strncasecmp(s, "compact", len) == 0) {
+        *valueType = HISTK_VALUES_FLOAT;
+    } else if (len == 4 && strncasecmp(s, "full", len) == 0) {
+        *valueType = HISTK_VALUES_DOUBLE;
+    } else {
+        return REDISMODULE_ERR;
+    }
+    return REDISMODULE_OK;
+}
+
+// Parse the value and optional count at argv[*iarg] for HISTK.ADD into c,
+// advancing *iarg past them. Returns an error message if they're invalid.
+static const char *parseAddArg(RedisModuleString **argv, int argc, int *iarg,
+                               struct Centroid *c) {
+    c->count = 1;
+    if (RedisModule_StringToDouble(argv[(*iarg)++], &c->value) !=
+        REDISMODULE_OK) {
+        return HISTK_ERRORMSG_VALUENOTDOUBLE;
+    } else if (argc > *iarg &&
+               RedisModule_StringToLongLong(argv[(*iarg)++], &c->count) !=
+               REDISMODULE_OK) {
+        return HISTK_ERRORMSG_COUNTNOTINT;
+    } else if (c->count < 1) {
+        return HISTK_ERRORMSG_COUNTNOTPOSITIVE;
+    }
+    return NULL;
+}
+
+// See the asynchronous ingest section below.
+static int ingestingAdds(RedisModuleCtx *ctx);
+static void drainHistK(RedisModuleCtx *ctx, RedisModuleString *keyname);
+static struct HistK *readQueuedHistK(RedisModuleCtx *ctx, RedisModuleKey *key,
+                                     RedisModuleString *keyname);
+static int hasQueuedValues(RedisModuleCtx *ctx, RedisModuleString *keyname);
+static int queueAddCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+                           int argc, RedisModuleKey *key);
+
+// Engines. HISTK.CREATE key ENGINE <name> creates a key that holds a sketch
+// from one of the engines below (see engine.h) rather than a histogram
+// sketch. These keys are a data type of their own, so the rest of the module
+// never sees them: HISTK.ADD, HISTK.QUANTILE, HISTK.COUNT, HISTK.MERGESTORE,
+// HISTK.DUMP and HISTK.RESTORE check for them first and hand them to the
+// functions here, and the other commands treat them as the wrong type. Their
+// commands always run on the main thread and are replicated verbatim.
+//
+// Dumps of these sketches start with HISTK_ENGINE_DUMP_VERSION where dumps of
+// histogram sketches have their version, then the engine's id, then the
+// sketch as the engine serializes it, which is also how it's saved to RDB
+// files.
+#define HISTK_ENGINE_DUMP_VERSION 2
+#define HISTK_ENGINE_BHTT "bhtt"
+
+static RedisModuleType *EngineType;
+
+static const struct HistKEngine *engines[] = {
+    &tdigestEngine,
+    &ddsketchEngine,
+    &hdrEngine,
+    &kllEngine
+};
+
+#define HISTK_NUM_ENGINES (sizeof(engines) / sizeof(engines[0]))
+
+// HISTK.CREATE's options for histogram sketches.
+static const struct HistKEngineOption bhttOptions[] = {
+    {"CENTROIDS", 1, HISTK_MAX_NUM_CENTROIDS, HISTK_DEFAULT_NUM_CENTROIDS, 1}
+};
+
+struct EngineSketch {
+    const struct HistKEngine *engine;
+    void *s;
+};
+
+static const struct HistKEngine *findEngine(unsigned char id) {
+    for (size_t i = 0; i < HISTK_NUM_ENGINES; i++) {
+        if (engines[i]->id == id) { return engines[i]; }
+    }
+    return NULL;
+}
+
+static struct EngineSketch *newEngineSketch(const struct HistKEngine *e,
+                                            void *s) {
+    struct EngineSketch *es = RedisModule_Alloc(sizeof(*es));
+    es->engine = e;
+    es->s = s;
+    return es;
+}
+
+static void freeEngineSketch(struct EngineSketch *es) {
+    es->engine->free(es->s);
+    RedisModule_Free(es);
+}
+
+// Return the engine sketch in key, or NULL if key holds something else.
+static struct EngineSketch *getEngineSketch(RedisModuleKey *key) {
+    if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY ||
+        RedisModule_ModuleTypeGetType(key) != EngineType) {
+        return NULL;
+    }
+    return RedisModule_ModuleTypeGetValue(key);
+}
+
+// HISTK.ADD to the engine sketch in key, once the command has checked that
+// it is one.
+static int addToEngine(RedisModuleCtx *ctx, RedisModuleString **argv,
+                       int argc, RedisModuleKey *key) {
+    struct EngineSketch *es = getEngineSketch(key);
+    const char *errmsg = NULL;
+    for (int iarg = 2; iarg < argc && errmsg == NULL;) {
+        struct Centroid c;
+        if ((errmsg = parseAddArg(argv, argc, &iarg, &c)) == NULL) {
+            es->engine->add(es->s, c.value, c.count);
+        }
+    }
+    if (errmsg != NULL) {
+        RedisModule_ReplyWithError(ctx, errmsg);
+    } else {
+        RedisModule_ReplyWithLongLong(ctx, es->engine->totalCount(es->s));
+    }
+    RedisModule_ReplicateVerbatim(ctx);
+    return REDISMODULE_OK;
+}
+
+// Whether any of the n keys named in keynames holds an engine sketch.
+static int anyEngineSketch(RedisModuleCtx *ctx, RedisModuleString **keynames,
+                           int n) {
+    for (int i = 0; i < n; i++) {
+        RedisModuleKey *key = RedisModule_OpenKey(ctx, keynames[i],
+                                                  REDISMODULE_READ);
+        if (getEngineSketch(key) != NULL) { return 1; }
+    }
+    return 0;
+}
+
+// HISTK.MERGESTORE when one of its keys holds an engine sketch. Every key
+// must then hold a sketch from the same engine or nothing. The sources are
+// merged into a copy of the destination, so nothing changes if the engine
+// can't merge one of them.
+static int mergeEngineSketches(RedisModuleCtx *ctx, RedisModuleString **argv,
+                               int argc) {
+    const struct HistKEngine *e = NULL;
+    for (int iarg = 1; iarg < argc; iarg++) {
+        // An empty key may still have adds queued for a histogram sketch.
+        drainHistK(ctx, argv[iarg]);
+        RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[iarg],
+                                                  REDISMODULE_READ);
+        if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY) {
+            continue;
+        }
+        struct EngineSketch *es = getEngineSketch(key);
+        if (RedisModule_ModuleTypeGetType(key) != HistKType && es == NULL) {
+            return RedisModule_ReplyWithError(
+                ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+        }
+        if (es == NULL || (e != NULL && es->engine != e)) {
+            return RedisModule_ReplyWithError(
+                ctx, HISTK_ERRORMSG_ENGINEMISMATCH);
+        }
+        e = es->engine;
+    }
+
+    RedisModuleKey *dest = RedisModule_OpenKey(
+        ctx, argv[1], REDISMODULE_READ|REDISMODULE_WRITE);
+    struct EngineSketch *es = getEngineSketch(dest);
+    void *s = es != NULL ? e->copy(es->s) : NULL;
+    for (int iarg = 2; iarg < argc; iarg++) {
+        struct EngineSketch *src = getEngineSketch(
+            RedisModule_OpenKey(ctx, argv[iarg], REDISMODULE_READ));
+        if (src == NULL) { continue; }
+        if (s == NULL) {
+            s = e->copy(src->s);
+            continue;
+        }
+        const char *errmsg = e->merge(s, src->s);
+        if (errmsg != NULL) {
+            e->free(s);
+            return RedisModule_ReplyWithError(ctx, errmsg);
+        }
+    }
+    if (es != NULL) {
+        e->free(es->s);
+        es->s = s;
+    } else {
+        es = newEngineSketch(e, s);
+        RedisModule_ModuleTypeSetValue(dest, EngineType, es);
+    }
+    RedisModule_ReplyWithLongLong(ctx, e->totalCount(s));
+    RedisModule_ReplicateVerbatim(ctx);
+    return REDISMODULE_OK;
+}
+
+// Parse HISTK.CREATE's options, argv[0..argc), as NAME value pairs that
+// options describes, into values, one per option in order. Replies with an
+// error and returns REDISMODULE_ERR if they aren't valid.
+static int parseEngineOptions(RedisModuleCtx *ctx, RedisModuleString **argv,
+                              int argc,
+                              const struct HistKEngineOption *options,
+                              int numOptions, double *values) {
+    for (int i = 0; i < numOptions; i++) {
+        values[i] = options[i].defaultValue;
+    }
+    if (argc % 2 != 0) {
+        RedisModule_ReplyWithError(ctx, HISTK_ERRORMSG_SYNTAX);
+        return REDISMODULE_ERR;
+    }
+    for (int iarg = 0; iarg < argc; iarg += 2) {
+        size_t len;
+        const char *name = RedisModule_StringPtrLen(argv[iarg], &len);
+        int i = 0;
+        while (i < numOptions && (strlen(options[i].name) != len ||
+                                  strncasecmp(options[i].name, name, len))) {
+            i++;
+        }
+        if (i == numOptions) {
+            RedisModule_ReplyWithError(ctx, HISTK_ERRORMSG_BADOPTION);
+            return REDISMODULE_ERR;
+        }
+        int ok;
+        if (options[i].integer) {
+            long long v = 0;
+            ok = RedisModule_StringToLongLong(argv[iarg + 1], &v) ==
+                REDISMODULE_OK;
+            values[i] = v;
+        } else {
+            ok = RedisModule_StringToDouble(argv[iarg + 1], &values[i]) ==
+                REDISMODULE_OK;
+        }
+        if (!ok ||
+            !(values[i] >= options[i].min && values[i] <= options[i].max)) {
+            char err[128];
+            snprintf(err, sizeof(err),
+                     options[i].integer ?
+                     "ERR %s must be an integer from %.0f to %.0f." :
+                     "ERR %s must be a number from %g to %g.",
+                     options[i].name, options[i].min, options[i].max);
+            RedisModule_ReplyWithError(ctx, err);
+            return REDISMODULE_ERR;
+        }
+    }
+    return REDISMODULE_OK;
+}
+
+/* HISTK.CREATE <KEY> [ENGINE <NAME>] [<OPTION> <VALUE> ...]
+   Create an empty sketch in KEY with the given engine, bhtt (the histogram
+   sketch) if none is given, and options. KEY must not already exist.
+*/
+int CreateCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    beginSlabWrite(ctx);
+    if (argc < 2) return RedisModule_WrongArity(ctx);
+    const struct HistKEngine *e = NULL;
+    int iarg = 2;
+    size_t len;
+    const char *arg = argc > 3 ? RedisModule_StringPtrLen(argv[2], &len) : "";
+    if (argc > 3 && len == 6 && strncasecmp(arg, "engine", len) == 0) {
+        const char *name = RedisModule_StringPtrLen(argv[3], &len);
+        iarg = 4;
+        for (size_t i = 0; i < HISTK_NUM_ENGINES; i++) {
+            if (strlen(engines[i]->name) == len &&
+                strncasecmp(engines[i]->name, name, len) == 0) {
+                e = engines[i];
+            }
+        }
+        if (e == NULL && (len != strlen(HISTK_ENGINE_BHTT) ||
+                          strncasecmp(HISTK_ENGINE_BHTT, name, len) != 0)) {
+            return RedisModule_ReplyWithError(ctx, HISTK_ERRORMSG_BADENGINE);
+        }
+    }
+    double values[HISTK_ENGINE_MAX_OPTIONS];
+    if (parseEngineOptions(ctx, argv + iarg, argc - iarg,
+                           e != NULL ? e->options : bhttOptions,
+                           e != NULL ? e->numOptions : 1,
+                           values) != REDISMODULE_OK) {
+        return REDISMODULE_OK;
+    }
+    void *s = NULL;
+    if (e != NULL && (s = e->create(values)) == NULL) {
+        return RedisModule_ReplyWithError(ctx, HISTK_ERRORMSG_BADOPTIONS);
+    }
+    drainHistK(ctx, argv[1]);
+    RedisModuleKey *key = RedisModule_OpenKey(
+        ctx, argv[1], REDISMODULE_READ|REDISMODULE_WRITE);
+    if (RedisModule_KeyType(key) != REDISMODULE_KEYTYPE_EMPTY) {
+        if (s != NULL) { e->free(s); }
+        return RedisModule_ReplyWithError(ctx, HISTK_ERRORMSG_BUSYKEY);
+    }
+    flushHistK(ctx, argv[1]);
+    if (e != NULL) {
+        RedisModule_ModuleTypeSetValue(
+            key, EngineType, newEngineSketch(e, s));
+    } else {
+        RedisModule_ModuleTypeSetValue(
+            key, HistKType,
+            newHistK((unsigned short int)values[0], HISTK_VALUES_DOUBLE));
+    }
+    RedisModule_ReplyWithSimpleString(ctx, "OK");
+    RedisModule_ReplicateVerbatim(ctx);
+    return REDISMODULE_OK;
+}
+
+// Return es as HISTK.DUMP does, in a buffer the caller frees, and set *len to
+// the number of bytes in it.
+static unsigned char *dumpEngineSketch(const struct EngineSketch *es,
+                                       size_t *len) {
+    unsigned char *buf = RedisModule_Alloc(
+        2 + es->engine->serializedSize(es->s));
+    buf[0] = HISTK_ENGINE_DUMP_VERSION;
+    buf[1] = es->engine->id;
+    *len = 2 + es->engine->serialize(es->s, buf + 2);
+    return buf;
+}
+
+// Return the engine sketch that a dump of one holds, or NULL if it isn't
+// valid.
+static struct EngineSketch *restoreEngineSketch(const unsigned char *buf,
+                                                size_t len) {
+    const struct HistKEngine *e;
+    void *s;
+    if (len < 2 || buf[0] != HISTK_ENGINE_DUMP_VERSION ||
+        (e = findEngine(buf[1])) == NULL ||
+        (s = e->deserialize(buf + 2, len - 2)) == NULL) {
+        return NULL;
+    }
+    return newEngineSketch(e, s);
+}
+
+/* HISTK.ADD <KEY> <VALUE1> [<COUNT1>] [<VALUE2> <COUNT2>, ...]
+   Add values to the sketch. Returns the total number of values observed by the
+   sketch.
+*/
+int AddCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    beginSlabWrite(ctx);
+
+    if (argc < 3) return RedisModule_WrongArity(ctx);
+    // Only keys with nothing queued are added to right away, so there's
+    // nothing to apply first unless adds can't be queued at all.
+    int queue = ingestingAdds(ctx);
+    if (!queue) { drainHistK(ctx, argv[1]); }
+    RedisModuleKey *key = RedisModule_OpenKey(
+        ctx, argv[1], REDISMODULE_READ|REDISMODULE_WRITE);
+    int keytype = RedisModule_KeyType(key);
+    if (getEngineSketch(key) != NULL) {
+        return addToEngine(ctx, argv, argc, key);
+    }
+    if (keytype != REDISMODULE_KEYTYPE_EMPTY &&
+        RedisModule_ModuleTypeGetType(key) != HistKType) {
+        return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+    if (queue && queueAddCommand(ctx, argv, argc, key) == REDISMODULE_OK) {
+        return REDISMODULE_OK;
+    }
+
+    struct HistK *h = NULL, *before = NULL;
+    if (keytype != REDISMODULE_KEYTYPE_EMPTY) {
+        h = expandHistK(key);
+    }
+    int defer = deferringAdds(ctx);
+    if (defer) {
+        deferHistK(ctx, argv[1], h);
+    } else {
+        flushHistK(ctx, argv[1]);
+        before = snapshotHistK(h);
+    }
+    if (h == NULL) {
+        h = newHistK(HISTK_DEFAULT_NUM_CENTROIDS, HISTK_VALUES_DOUBLE);
+        RedisModule_ModuleTypeSetValue(key, HistKType, h);
+    }
+
+    // Values before a bad argument are still added, so the command is
+    // replicated either way.
+    const char *errmsg = NULL;
+    for (int iarg = 2; iarg < argc && errmsg == NULL;) {
+        struct Centroid c;
+        if ((errmsg = parseAddArg(argv, argc, &iarg, &c)) == NULL) {
+            int err;
+            while ((err = histkAdd(h, c.value, c.count)) != HISTK_OK) {
+                h = makeRoom(key, h, err, h->numCentroids + 1);
+            }
+        }
+    }
+
+    if (errmsg != NULL) {
+        RedisModule_ReplyWithError(ctx, errmsg);
+    } else {
+        RedisModule_ReplyWithLongLong(ctx, h->totalCount);
+    }
+    if (!defer) { replicateHistK(ctx, argv[1], before, h); }
+    return REDISMODULE_OK;
+}
+
+/* HISTK.QUANTILE <KEY> <Q> [<Q> ...]
+   Returns the q-quantile for any 0.0 <= Q <= 1.0, or an array of the
+   quantiles for each Q if given more than one.
+ */
+int QuantileCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    if (argc < 3) return RedisModule_WrongArity(ctx);
+    int n = argc - 2;
+    double *qs = RedisModule_PoolAlloc(ctx, 2 * n * sizeof(double));
+    double *out = qs + n;
+    for (int i = 0; i < n; i++) {
+        if (RedisModule_StringToDouble(argv[i + 2], &qs[i]) ==
+            REDISMODULE_ERR) {
+            return RedisModule_ReplyWithError(
+                ctx, HISTK_ERRORMSG_VALUENOTDOUBLE);
+        }
+        if (qs[i] < 0.0 || qs[i] > 1.0) {
+            return RedisModule_ReplyWithError(ctx, HISTK_ERRORMSG_BADQUANTILE);
+        }
+    }
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx,argv[1],
+                                              REDISMODULE_READ);
+    int keytype = RedisModule_KeyType(key);
+    struct EngineSketch *es = getEngineSketch(key);
+    if (es != NULL) {
+        if (es->engine->totalCount(es->s) == 0) {
+            return RedisModule_ReplyWithError(ctx, HISTK_ERRORMSG_EMPTYSKETCH);
+        }
+        if (es->engine->quantiles != NULL) {
+            es->engine->quantiles(es->s, qs, n, out);
+        } else {
+            for (int i = 0; i < n; i++) {
+                out[i] = es->engine->quantile(es->s, qs[i]);
+            }
+        }
+    } else if (keytype != REDISMODULE_KEYTYPE_EMPTY &&
+               RedisModule_ModuleTypeGetType(key) != HistKType) {
+        return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
+    } else {
+        struct HistK *h = readQueuedHistK(ctx, key, argv[1]);
+        if (h == NULL) {
+            return RedisModule_ReplyWithError(ctx,
+                                              HISTK_ERRORMSG_EMPTYSKETCH);
+        }
+        for (int i = 0; i < n; i++) { out[i] = histkQuantile(h, qs[i]); }
+        releaseHistK(key, h);
+    }
+
+    if (n == 1) { return RedisModule_ReplyWithDouble(ctx, out[0]); }
+    RedisModule_ReplyWithArray(ctx, n);
+    for (int i = 0; i < n; i++) { RedisModule_ReplyWithDouble(ctx, out[i]); }
+    return REDISMODULE_OK;
+}
+
+/* HISTK.COUNT <KEY> [<V>]
+   Returns an estimate of of the number of values <= V in the sketch. If V is
+   omitted, returns the total number of values observed by the sketch so far.
+*/
+int CountCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    if (argc < 2 || argc > 3) return RedisModule_WrongArity(ctx);
+    RedisModuleKey *key = RedisModule_OpenKey(ctx,argv[1],
+                                              REDISMODULE_READ);
+    int keytype = RedisModule_KeyType(key);
+    struct EngineSketch *es = getEngineSketch(key);
+    if (es == NULL && keytype != REDISMODULE_KEYTYPE_EMPTY &&
+        RedisModule_ModuleTypeGetType(key) != HistKType) {
+        return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    // Values queued for an empty key count as a sketch.
+    struct HistK *h = es == NULL ? readQueuedHistK(ctx, key, argv[1]) : NULL;
+    if (es == NULL && h == NULL) {
+        return RedisModule_ReplyWithError(ctx, HISTK_ERRORMSG_EMPTYSKETCH);
+    }
+    long long count;
+    double v;
+    if (argc == 2) {
+        count = es != NULL ? (long long)es->engine->totalCount(es->s) :
+            (long long)h->totalCount;
+    } else if (RedisModule_StringToDouble(argv[2], &v) == REDISMODULE_ERR) {
+        if (h != NULL) { releaseHistK(key, h); }
+        return RedisModule_ReplyWithError(ctx, HISTK_ERRORMSG_VALUENOTDOUBLE);
+    } else {
+        count = es != NULL ? es->engine->countLessThanOrEqual(es->s, v) :
+            histkCountLessThanOrEqual(h, v);
+    }
+    RedisModule_ReplyWithLongLong(ctx, count);
+    if (h != NULL) { releaseHistK(key, h); }
+    return REDISMODULE_OK;
+}
+
+// The centroids of the sketches a command is merging into one of them, and
+// the extremes of their values.
+struct MergeInput {
+    struct Centroid *centroids;
+    int count;
+    int maxSize;
     double min;
-    // Maximum value observed by the sketch.
     double max;
-    // Current number of centroids in the sketch.
-    unsigned short int numCentroids;
-    // Maximum number of centroids allowed in the sketch.
-    unsigned short int maxCentroids;
 };
 
-struct HistK *createHistK(unsigned short int maxCentroids) {
-    struct HistK *h;
-    h = RedisModule_Alloc(sizeof(*h));
-    h->totalCount = 0;
-    h->numCentroids = 0;
-    h->min = DBL_MAX;
-    h->max = DBL_MIN;
-    // Allocate one more centroid than we need as a workspace for adding new
-    // values to the sketch. We'll add the centroid as a singleton then merge
-    // the two closest centroids.
-    h->cs = RedisModule_Alloc((maxCentroids + 1) * sizeof(struct Centroid));
-    h->maxCentroids = maxCentroids;
+static void addToMerge(struct MergeInput *m, const struct HistK *h) {
+    for (int i = 0; i < h->numCentroids; i++) {
+        struct Centroid c = {getValue(h, i), getCount(h, i)};
+        m->maxSize = addToDynamicCentroidArray(&m->centroids, m->count++,
+                                               m->maxSize, c);
+    }
+    if (h->min < m->min) m->min = h->min;
+    if (h->max > m->max) m->max = h->max;
+}
+
+// Start merging other sketches into h, or into an empty sketch if h is NULL.
+static void beginMerge(struct MergeInput *m, const struct HistK *h) {
+    m->count = 0;
+    m->maxSize = HISTK_DEFAULT_MERGE_ARRAY_SIZE;
+    m->centroids = RedisModule_Alloc(
+        HISTK_DEFAULT_MERGE_ARRAY_SIZE * sizeof(struct Centroid));
+    if (h == NULL) {
+        m->min = DBL_MAX;
+        m->max = DBL_MIN;
+        return;
+    }
+    m->min = h->min;
+    m->max = h->max;
+    addToMerge(m, h);
+}
+
+// Store the n centroids that everything added to m merged into, which m holds
+// now, in h, the sketch stored in key. Returns the sketch that key holds
+// afterwards.
+static struct HistK *storeMerge(RedisModuleKey *key, struct HistK *h,
+                                struct MergeInput *m, int n) {
+    int err;
+    while ((err = setCentroids(h, m->centroids, n)) != HISTK_OK) {
+        h = makeRoom(key, h, err, n);
+    }
+    RedisModule_Free(m->centroids);
+    h->min = m->min;
+    h->max = m->max;
+    return h;
+}
+
+// Merge everything added to m into h, the sketch stored in key. Returns the
+// sketch that key holds afterwards.
+static struct HistK *finishMerge(RedisModuleKey *key, struct HistK *h,
+                                 struct MergeInput *m) {
+    int n = mergeCentroidList(m->centroids, m->count, m->centroids,
+                              h->maxCentroids);
+    return storeMerge(key, h, m, n);
+}
+
+// Asynchronous ingest. When the module is loaded with ASYNC-ADDS <centroids>,
+// HISTK.ADD to a sketch with at least that many centroids only parses its
+// arguments on the main thread. The values go on a queue for their key and
+// the command replies right away with the total count the sketch will have.
+// A background thread takes values off each queue in batches, sorts them and
+// adds up the counts of equal values without holding the GIL, then locks it
+// and merges the batches of every queue it got to into their keys at once.
+// Adding a value to a big sketch means scanning all its centroids, while
+// merging a sorted batch into it costs about as much as a few adds no matter
+// how many values the batch holds, though the centroids come out a little
+// different. Small batches are added a value at a time.
+//
+// Pushing onto a queue is lock-free (see mpscPush), so the main thread never
+// waits on the background thread to queue values. Only one thread at a time
+// takes values off a queue, under its lock: the background thread while it
+// builds a batch, or the main thread when a command needs the key's sketch to
+// be up to date. The module's write commands apply what's queued for the keys
+// they touch before anything else, and its read-only commands read a copy of
+// the sketch with the queued values applied, leaving the key as it is. Other
+// commands apply the queues of the keys they may touch first (see
+// filterIngestCommands), and values queued for a key that expires or is
+// evicted are dropped along with the key. ADDs inside MULTI, scripts, replicated streams or loading are
+// applied right away, as are ADDs to keys with too many values queued.
+#define HISTK_INGEST_BATCH_MAX 4096
+#define HISTK_INGEST_QUEUE_MAX 65536
+#define HISTK_INGEST_ROUND_MAX 1024
+#define HISTK_INGEST_MERGE_MIN 16
+
+// An intrusive multi-producer, single-consumer queue (Dmitry Vyukov's).
+// Producers never wait; a consumer may find the queue briefly empty while a
+// push is halfway done.
+struct MpscNode {
+    struct MpscNode *next;
+};
+
+struct Mpsc {
+    struct MpscNode *head;  // Last node pushed.
+    struct MpscNode *tail;  // Next node to pop.
+    struct MpscNode stub;
+};
+
+static void mpscInit(struct Mpsc *q) {
+    q->stub.next = NULL;
+    q->head = q->tail = &q->stub;
+}
+
+static void mpscPush(struct Mpsc *q, struct MpscNode *n) {
+    __atomic_store_n(&n->next, NULL, __ATOMIC_RELAXED);
+    struct MpscNode *prev = __atomic_exchange_n(&q->head, n, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+}
+
+static struct MpscNode *mpscPop(struct Mpsc *q) {
+    struct MpscNode *tail = q->tail;
+    struct MpscNode *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (tail == &q->stub) {
+        if (next == NULL) { return NULL; }
+        q->tail = tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+    if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) { return NULL; }
+    mpscPush(q, &q->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next == NULL) { return NULL; }
+    q->tail = next;
+    return tail;
+}
+
+// The values of one HISTK.ADD.
+struct IngestValues {
+    struct MpscNode node;
+    int n;
+    struct Centroid cs[];
+};
+
+struct IngestQueue {
+    struct MpscNode ready;  // Link in readyQueues. Must come first.
+    struct Mpsc values;
+    // Set while the queue is on readyQueues or about to be.
+    int scheduled;
+    // One for ingestQueues, one while the queue is scheduled.
+    int refs;
+    // Held by whoever takes values off the queue.
+    pthread_mutex_t lock;
+    // Values taken off the queue but not applied yet, sorted by value with
+    // no two equal.
+    struct Centroid *batch;
+    int batchSize;
+    int batchValues;
+    // The rest is only touched with the GIL held. The queue's key in
+    // ingestQueues, which is its db number followed by its name.
+    char *k;
+    size_t len;
+    // The next queue in ingestNames for a key of the same name in another db.
+    struct IngestQueue *sameName;
+    // The number of values queued or batched and the sum of their counts.
+    int queued;
+    unsigned long long queuedTotal;
+};
+
+// Adds are queued for sketches with at least this many centroids, if it's
+// not negative.
+static long long ingestMinCentroids = -1;
+// Queues by key (see pendingKey).
+static RedisModuleDict *ingestQueues;
+// Lists of queues, linked by sameName, by key name alone, so the command
+// filter can look an argument up once for every db.
+static RedisModuleDict *ingestNames;
+// Queues with values for the background thread to take.
+static struct Mpsc readyQueues;
+static int numReadyQueues;
+static pthread_mutex_t ingestMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ingestCond = PTHREAD_COND_INITIALIZER;
+
+static int ingestingAdds(RedisModuleCtx *ctx) {
+    return ingestMinCentroids >= 0 &&
+        !(RedisModule_GetContextFlags(ctx) &
+          (REDISMODULE_CTX_FLAGS_MULTI | REDISMODULE_CTX_FLAGS_LUA |
+           REDISMODULE_CTX_FLAGS_REPLICATED | REDISMODULE_CTX_FLAGS_LOADING));
+}
+
+static void releaseIngestQueue(struct IngestQueue *q) {
+    if (__atomic_sub_fetch(&q->refs, 1, __ATOMIC_ACQ_REL) > 0) { return; }
+    struct MpscNode *n;
+    while ((n = mpscPop(&q->values)) != NULL) { RedisModule_Free(n); }
+    RedisModule_Free(q->batch);
+    pthread_mutex_destroy(&q->lock);
+    RedisModule_Free(q->k);
+    RedisModule_Free(q);
+}
+
+// Start tracking q, a new queue for a key with no other.
+static void addIngestQueue(struct IngestQueue *q) {
+    char *name = q->k + sizeof(int);
+    size_t len = q->len - sizeof(int);
+    RedisModule_DictSetC(ingestQueues, q->k, q->len, q);
+    struct IngestQueue *p = RedisModule_DictGetC(ingestNames, name, len, NULL);
+    if (p == NULL) {
+        RedisModule_DictSetC(ingestNames, name, len, q);
+        return;
+    }
+    while (p->sameName != NULL) { p = p->sameName; }
+    p->sameName = q;
+}
+
+// Stop tracking q, which has nothing queued, unless it's been replaced.
+static void removeIngestQueue(struct IngestQueue *q) {
+    int nokey;
+    if (RedisModule_DictGetC(ingestQueues, q->k, q->len, &nokey) != q) {
+        return;
+    }
+    RedisModule_DictDelC(ingestQueues, q->k, q->len, NULL);
+    char *name = q->k + sizeof(int);
+    size_t len = q->len - sizeof(int);
+    struct IngestQueue *p = RedisModule_DictGetC(ingestNames, name, len, NULL);
+    if (p == q) {
+        RedisModule_DictDelC(ingestNames, name, len, NULL);
+        if (q->sameName != NULL) {
+            RedisModule_DictSetC(ingestNames, name, len, q->sameName);
+        }
+    } else {
+        while (p->sameName != q) { p = p->sameName; }
+        p->sameName = q->sameName;
+    }
+    releaseIngestQueue(q);
+}
+
+static void scheduleIngestQueue(struct IngestQueue *q) {
+    if (__atomic_exchange_n(&q->scheduled, 1, __ATOMIC_SEQ_CST)) { return; }
+    __atomic_add_fetch(&q->refs, 1, __ATOMIC_ACQ_REL);
+    mpscPush(&readyQueues, &q->ready);
+    pthread_mutex_lock(&ingestMutex);
+    numReadyQueues++;
+    pthread_cond_signal(&ingestCond);
+    pthread_mutex_unlock(&ingestMutex);
+}
+
+// Take up to max values off q, or all of them if max is 0, and add them to its
+// batch. Returns whether any values are left. q's lock must be held.
+static int takeIngestValues(struct IngestQueue *q, int max) {
+    struct MpscNode *n;
+    int taken = 0;
+    while ((max == 0 || taken < max) && (n = mpscPop(&q->values)) != NULL) {
+        struct IngestValues *v = (struct IngestValues *)n;
+        q->batch = RedisModule_Realloc(
+            q->batch, (q->batchSize + v->n) * sizeof(struct Centroid));
+        memcpy(q->batch + q->batchSize, v->cs, v->n * sizeof(struct Centroid));
+        q->batchSize += v->n;
+        q->batchValues += v->n;
+        taken += v->n;
+        RedisModule_Free(v);
+    }
+    if (taken > 0) {
+        qsort(q->batch, q->batchSize, sizeof(struct Centroid), sortCentroids);
+        int j = 0;
+        for (int i = 1; i < q->batchSize; i++) {
+            if (q->batch[i].value == q->batch[j].value) {
+                q->batch[j].count += q->batch[i].count;
+            } else {
+                q->batch[++j] = q->batch[i];
+            }
+        }
+        q->batchSize = j + 1;
+    }
+    return max != 0 && taken >= max;
+}
+
+// Add q's batch to h, the sketch in key, a value at a time, replicating it as
+// a HISTK.ADD to keyname if verbatim is set. Returns the sketch key holds
+// afterwards.
+static struct HistK *addIngestBatch(RedisModuleCtx *ctx, RedisModuleKey *key,
+                                    RedisModuleString *keyname,
+                                    struct HistK *h,
+                                    const struct IngestQueue *q,
+                                    int verbatim) {
+    RedisModuleString *args[2 * HISTK_INGEST_MERGE_MIN];
+    for (int i = 0; i < q->batchSize; i++) {
+        int err;
+        while ((err = histkAdd(h, q->batch[i].value, q->batch[i].count)) !=
+               HISTK_OK) {
+            h = makeRoom(key, h, err, h->numCentroids + 1);
+        }
+        if (verbatim) {
+            char buf[32];
+            int len = snprintf(buf, sizeof(buf), "%.17g", q->batch[i].value);
+            args[2 * i] = RedisModule_CreateString(ctx, buf, len);
+            len = snprintf(buf, sizeof(buf), "%lld", q->batch[i].count);
+            args[2 * i + 1] = RedisModule_CreateString(ctx, buf, len);
+        }
+    }
+    if (verbatim) {
+        RedisModule_Replicate(ctx, "HISTK.ADD", "sv", keyname, args,
+                              (size_t)(2 * q->batchSize));
+        for (int i = 0; i < 2 * q->batchSize; i++) {
+            RedisModule_FreeString(ctx, args[i]);
+        }
+    }
+    return h;
+}
+
+// Merge q's batch into h, the sketch in key, replicating it as a
+// HISTK.MERGEBLOB to keyname if verbatim is set. The batch is merged as the
+// sketches the HISTK.MERGEBLOB carries, so a replica running it ends up with
+// the same sketch. Returns the sketch key holds afterwards.
+static struct HistK *mergeIngestBatch(RedisModuleCtx *ctx, RedisModuleKey *key,
+                                      RedisModuleString *keyname,
+                                      struct HistK *h,
+                                      const struct IngestQueue *q,
+                                      int verbatim) {
+    int numBlobs = (q->batchSize + HISTK_MAX_NUM_CENTROIDS - 1) /
+        HISTK_MAX_NUM_CENTROIDS;
+    RedisModuleString **blobs = RedisModule_Alloc(numBlobs * sizeof(*blobs));
+    struct MergeInput m;
+    beginMerge(&m, h);
+    for (int i = 0; i < numBlobs; i++) {
+        const struct Centroid *cs = q->batch + i * HISTK_MAX_NUM_CENTROIDS;
+        int n = q->batchSize - i * HISTK_MAX_NUM_CENTROIDS;
+        if (n > HISTK_MAX_NUM_CENTROIDS) { n = HISTK_MAX_NUM_CENTROIDS; }
+        // The sketch is only needed for a moment, so it's a scratch one.
+        struct HistK *bh = allocScratchHistK(n, HISTK_VALUES_DOUBLE, 8);
+        bh->maxCentroids = n;
+        setCentroids(bh, cs, n);
+        bh->min = cs[0].value;
+        bh->max = cs[n - 1].value;
+        addToMerge(&m, bh);
+        if (verbatim) {
+            size_t len;
+            unsigned char *buf = dumpHistK(bh, &len);
+            blobs[i] = RedisModule_CreateString(ctx, (const char *)buf, len);
+            RedisModule_Free(buf);
+        }
+        freeHistK(bh);
+    }
+    h = finishMerge(key, h, &m);
+    if (verbatim) {
+        RedisModule_Replicate(ctx, "HISTK.MERGEBLOB", "sv", keyname, blobs,
+                              (size_t)numBlobs);
+        for (int i = 0; i < numBlobs; i++) {
+            RedisModule_FreeString(ctx, blobs[i]);
+        }
+    }
+    RedisModule_Free(blobs);
     return h;
 }
 
-void freeHistK(struct HistK *o) {
-    RedisModule_Free(o->cs);
-    RedisModule_Free(o);
+// Apply q's batch to the sketch in key, whose name is keyname, and replicate
+// the change. The GIL and q's lock must be held.
+static void applyIngestBatch(RedisModuleCtx *ctx, RedisModuleKey *key,
+                             RedisModuleString *keyname,
+                             struct IngestQueue *q) {
+    if (q->batchValues == 0) { return; }
+    int keytype = RedisModule_KeyType(key);
+    if (keytype == REDISMODULE_KEYTYPE_EMPTY ||
+        RedisModule_ModuleTypeGetType(key) == HistKType) {
+        beginSlabWrite(ctx);
+        struct HistK *h = NULL, *before = NULL;
+        if (keytype != REDISMODULE_KEYTYPE_EMPTY) { h = expandHistK(key); }
+        // Batches are coalesced like any other adds.
+        int defer = deferringAdds(ctx);
+        if (defer) {
+            deferHistK(ctx, keyname, h);
+        } else {
+            flushHistK(ctx, keyname);
+            before = snapshotHistK(h);
+        }
+        if (h == NULL) {
+            h = newHistK(HISTK_DEFAULT_NUM_CENTROIDS, HISTK_VALUES_DOUBLE);
+            RedisModule_ModuleTypeSetValue(key, HistKType, h);
+        }
+        int verbatim = !defer && !replicateEffects;
+        if (q->batchSize < HISTK_INGEST_MERGE_MIN) {
+            h = addIngestBatch(ctx, key, keyname, h, q, verbatim);
+        } else {
+            h = mergeIngestBatch(ctx, key, keyname, h, q, verbatim);
+        }
+        if (!defer && !verbatim) { replicateHistK(ctx, keyname, before, h); }
+    }
+    unsigned long long total = 0;
+    for (int i = 0; i < q->batchSize; i++) { total += q->batch[i].count; }
+    q->queued -= q->batchValues;
+    q->queuedTotal -= total;
+    q->batchSize = q->batchValues = 0;
+}
+
+// Apply q's batch, and every value on it too if all is set. The GIL must be
+// held. The key is opened before q is locked: opening it can expire it, and
+// dropping the values queued for a key that expires takes the lock too.
+static void drainIngestQueue(RedisModuleCtx *ctx, struct IngestQueue *q,
+                             int all) {
+    __atomic_add_fetch(&q->refs, 1, __ATOMIC_ACQ_REL);
+    int db;
+    memcpy(&db, q->k, sizeof(db));
+    if (RedisModule_GetSelectedDb(ctx) != db) {
+        RedisModule_SelectDb(ctx, db);
+    }
+    RedisModuleString *keyname = RedisModule_CreateString(
+        ctx, q->k + sizeof(db), q->len - sizeof(db));
+    RedisModuleKey *key = RedisModule_OpenKey(
+        ctx, keyname, REDISMODULE_READ|REDISMODULE_WRITE);
+    pthread_mutex_lock(&q->lock);
+    if (all) { takeIngestValues(q, 0); }
+    applyIngestBatch(ctx, key, keyname, q);
+    pthread_mutex_unlock(&q->lock);
+    RedisModule_CloseKey(key);
+    RedisModule_FreeString(ctx, keyname);
+    if (q->queued == 0) { removeIngestQueue(q); }
+    releaseIngestQueue(q);
+}
+
+// Return the queue for keyname in the db selected in ctx, or NULL if there
+// isn't one.
+static struct IngestQueue *findIngestQueue(RedisModuleCtx *ctx,
+                                           RedisModuleString *keyname) {
+    if (ingestQueues == NULL || RedisModule_DictSize(ingestQueues) == 0) {
+        return NULL;
+    }
+    size_t len;
+    char *k = pendingKey(RedisModule_GetSelectedDb(ctx), keyname, &len);
+    struct IngestQueue *q = RedisModule_DictGetC(ingestQueues, k, len, NULL);
+    RedisModule_Free(k);
+    return q;
+}
+
+// Whether values may be queued for keyname in the db selected in ctx.
+static int hasQueuedValues(RedisModuleCtx *ctx, RedisModuleString *keyname) {
+    return findIngestQueue(ctx, keyname) != NULL;
+}
+
+// Apply everything queued for keyname in the db selected in ctx.
+static void drainHistK(RedisModuleCtx *ctx, RedisModuleString *keyname) {
+    struct IngestQueue *q = findIngestQueue(ctx, keyname);
+    if (q != NULL) { drainIngestQueue(ctx, q, 1); }
+}
+
+// Return the sketch in key, which is open for reading and either empty or
+// holds a histogram sketch, with everything queued for keyname applied, for
+// a read-only command to read and give back with releaseHistK. Read-only
+// commands can't write the key, so queued values are applied to a scratch
+// copy, the way they would be applied to the key all at once. Returns NULL
+// if the key is empty and nothing is queued for it.
+static struct HistK *readQueuedHistK(RedisModuleCtx *ctx, RedisModuleKey *key,
+                                     RedisModuleString *keyname) {
+    const struct HistK *h = RedisModule_KeyType(key) ==
+        REDISMODULE_KEYTYPE_EMPTY ? NULL : RedisModule_ModuleTypeGetValue(key);
+    struct IngestQueue *q = findIngestQueue(ctx, keyname);
+    if (q != NULL) {
+        pthread_mutex_lock(&q->lock);
+        takeIngestValues(q, 0);
+        if (q->batchSize == 0) {
+            pthread_mutex_unlock(&q->lock);
+            q = NULL;
+        }
+    }
+    if (q == NULL) { return h != NULL ? readHistK(key) : NULL; }
+
+    // With 8-byte counts and room for every centroid, the copy never has to
+    // be replaced while the batch is applied.
+    struct HistK *c;
+    if (h != NULL) {
+        c = scratchCopyHistK(h, h->maxCentroids, 8);
+    } else {
+        c = allocScratchHistK(HISTK_DEFAULT_NUM_CENTROIDS,
+                              HISTK_VALUES_DOUBLE, 8);
+        c->totalCount = 0;
+        c->numCentroids = 0;
+        c->min = DBL_MAX;
+        c->max = DBL_MIN;
+        c->maxCentroids = HISTK_DEFAULT_NUM_CENTROIDS;
+    }
+    if (q->batchSize < HISTK_INGEST_MERGE_MIN) {
+        for (int i = 0; i < q->batchSize; i++) {
+            histkAdd(c, q->batch[i].value, q->batch[i].count);
+        }
+    } else {
+        int n = c->numCentroids + q->batchSize;
+        struct Centroid *cs = RedisModule_Alloc(n * sizeof(*cs));
+        getCentroids(c, cs);
+        memcpy(cs + c->numCentroids, q->batch, q->batchSize * sizeof(*cs));
+        n = mergeCentroidList(cs, n, cs, c->maxCentroids);
+        setCentroids(c, cs, n);
+        RedisModule_Free(cs);
+        if (q->batch[0].value < c->min) { c->min = q->batch[0].value; }
+        if (q->batch[q->batchSize - 1].value > c->max) {
+            c->max = q->batch[q->batchSize - 1].value;
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+    return c;
+}
+
+static void drainAllHistKsNow(void) {
+    uint64_t n = RedisModule_DictSize(ingestQueues);
+    struct IngestQueue **qs = RedisModule_Alloc(n * sizeof(*qs));
+    RedisModuleDictIter *it =
+        RedisModule_DictIteratorStartC(ingestQueues, "^", NULL, 0);
+    for (uint64_t i = 0; i < n; i++) {
+        RedisModule_DictNextC(it, NULL, (void **)&qs[i]);
+        __atomic_add_fetch(&qs[i]->refs, 1, __ATOMIC_ACQ_REL);
+    }
+    RedisModule_DictIteratorStop(it);
+    RedisModuleCtx *ctx = RedisModule_GetThreadSafeContext(NULL);
+    for (uint64_t i = 0; i < n; i++) {
+        drainIngestQueue(ctx, qs[i], 1);
+        releaseIngestQueue(qs[i]);
+    }
+    RedisModule_FreeThreadSafeContext(ctx);
+    RedisModule_Free(qs);
+}
+
+// Values queued for a key that expired or was evicted go with it.
+static int onIngestKeyspaceEvent(RedisModuleCtx *ctx, int type,
+                                 const char *event,
+                                 RedisModuleString *keyname) {
+    UNUSED(type);
+    UNUSED(event);
+    if (RedisModule_DictSize(ingestQueues) == 0) { return REDISMODULE_OK; }
+    size_t len;
+    char *k = pendingKey(RedisModule_GetSelectedDb(ctx), keyname, &len);
+    int nokey;
+    struct IngestQueue *q = RedisModule_DictGetC(ingestQueues, k, len, &nokey);
+    RedisModule_Free(k);
+    if (nokey) { return REDISMODULE_OK; }
+    pthread_mutex_lock(&q->lock);
+    takeIngestValues(q, 0);
+    q->batchSize = q->batchValues = q->queued = 0;
+    q->queuedTotal = 0;
+    pthread_mutex_unlock(&q->lock);
+    removeIngestQueue(q);
+    return REDISMODULE_OK;
+}
+
+// Whether cmd, a command len bytes long, may read or change keys it doesn't
+// name: it works on whole dbs, or, for EXEC, runs commands that were queued
+// before it.
+static int touchesKeyspace(const char *cmd, size_t len) {
+    static const char *const cmds[] = {
+        "save", "bgsave", "bgrewriteaof", "flushall", "flushdb", "swapdb",
+        "shutdown", "debug", "sync", "psync", "replicaof", "slaveof",
+        "failover", "keys", "scan", "dbsize", "randomkey", "exec"
+    };
+    for (size_t i = 0; i < sizeof(cmds) / sizeof(cmds[0]); i++) {
+        if (len == strlen(cmds[i]) && strncasecmp(cmd, cmds[i], len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Commands other than the module's might read or change keys with values
+// queued. Filters can't tell which arguments are keys (GetCommandKeys is
+// newer than the module API this builds against), so what's queued for any
+// key an argument names, in any db, is applied before the command runs, and
+// commands that touch keys without naming them apply every queue first. An
+// argument costs one lookup in ingestNames, so commands like PING, or a GET
+// of a key with nothing queued, leave the queues be cheaply. SORT's BY and
+// GET patterns reach keys without naming them, but only read strings and
+// hashes, which queued values never are.
+static void filterIngestCommands(RedisModuleCommandFilterCtx *fctx) {
+    if (RedisModule_DictSize(ingestQueues) == 0) { return; }
+    size_t len;
+    const char *cmd = RedisModule_StringPtrLen(
+        (RedisModuleString *)RedisModule_CommandFilterArgGet(fctx, 0), &len);
+    if (len >= 6 && strncasecmp(cmd, "histk.", 6) == 0) { return; }
+    if (touchesKeyspace(cmd, len)) {
+        drainAllHistKsNow();
+        return;
+    }
+    RedisModuleCtx *ctx = NULL;
+    int argc = RedisModule_CommandFilterArgsCount(fctx);
+    for (int i = 1; i < argc; i++) {
+        const char *name = RedisModule_StringPtrLen(
+            (RedisModuleString *)RedisModule_CommandFilterArgGet(fctx, i),
+            &len);
+        struct IngestQueue *q =
+            RedisModule_DictGetC(ingestNames, (void *)name, len, NULL);
+        if (q != NULL && ctx == NULL) {
+            ctx = RedisModule_GetThreadSafeContext(NULL);
+        }
+        while (q != NULL) {
+            // Draining q removes it from the list, but not the rest.
+            struct IngestQueue *next = q->sameName;
+            drainIngestQueue(ctx, q, 1);
+            q = next;
+        }
+    }
+    if (ctx != NULL) { RedisModule_FreeThreadSafeContext(ctx); }
+}
+
+static void *ingestThread(void *arg) {
+    UNUSED(arg);
+    RedisModuleCtx *ctx = RedisModule_GetThreadSafeContext(NULL);
+    struct IngestQueue *qs[HISTK_INGEST_ROUND_MAX];
+    while (1) {
+        pthread_mutex_lock(&ingestMutex);
+        while (numReadyQueues == 0) {
+            pthread_cond_wait(&ingestCond, &ingestMutex);
+        }
+        pthread_mutex_unlock(&ingestMutex);
+        // Batch up every queue that's ready, then apply the batches with one
+        // lock of the GIL, which the main thread has to wait for.
+        int n = 0;
+        struct IngestQueue *q;
+        while (n < HISTK_INGEST_ROUND_MAX &&
+               (q = (struct IngestQueue *)mpscPop(&readyQueues)) != NULL) {
+            // Values pushed from here on schedule the queue again.
+            __atomic_store_n(&q->scheduled, 0, __ATOMIC_SEQ_CST);
+            pthread_mutex_lock(&q->lock);
+            int more = takeIngestValues(q, HISTK_INGEST_BATCH_MAX);
+            pthread_mutex_unlock(&q->lock);
+            if (more) { scheduleIngestQueue(q); }
+            qs[n++] = q;
+        }
+        if (n == 0) { continue; }
+        pthread_mutex_lock(&ingestMutex);
+        numReadyQueues -= n;
+        pthread_mutex_unlock(&ingestMutex);
+        RedisModule_ThreadSafeContextLock(ctx);
+        for (int i = 0; i < n; i++) { drainIngestQueue(ctx, qs[i], 0); }
+        RedisModule_ThreadSafeContextUnlock(ctx);
+        for (int i = 0; i < n; i++) { releaseIngestQueue(qs[i]); }
+    }
+    return NULL;
 }
 
-// Merge the centroid at cs[i+1] into the centroid at h->cs[i].
-inline void mergeCentroidWithNext(struct Centroid *cs, unsigned int i) {
-    long long s = cs[i].count + cs[i+1].count;
-    cs[i].value = ((cs[i].value * cs[i].count) +
-                   (cs[i+1].value * cs[i+1].count)) / s;
-    cs[i].count = s;
+// HISTK.ADD with ASYNC-ADDS: if the sketch in key, which is open for reading,
+// is big enough or already has values queued, queue the values in argv for it
+// and reply with the total count the sketch will have. Otherwise, returns
+// REDISMODULE_ERR without doing anything.
+static int queueAddCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+                           int argc, RedisModuleKey *key) {
+    const struct HistK *h = RedisModule_KeyType(key) ==
+        REDISMODULE_KEYTYPE_EMPTY ? NULL : RedisModule_ModuleTypeGetValue(key);
+    size_t len;
+    char *k = pendingKey(RedisModule_GetSelectedDb(ctx), argv[1], &len);
+    int nokey;
+    struct IngestQueue *q = RedisModule_DictGetC(ingestQueues, k, len, &nokey);
+    if (nokey && (h != NULL ? h->numCentroids : 0) < ingestMinCentroids) {
+        RedisModule_Free(k);
+        return REDISMODULE_ERR;
+    }
+
+    struct IngestValues *v = RedisModule_Alloc(
+        sizeof(*v) + (argc - 2) * sizeof(struct Centroid));
+    int n = 0;
+    unsigned long long total = 0;
+    const char *errmsg = NULL;
+    for (int iarg = 2; iarg < argc && errmsg == NULL;) {
+        struct Centroid c;
+        if ((errmsg = parseAddArg(argv, argc, &iarg, &c)) == NULL) {
+            v->cs[n++] = c;
+            total += c.count;
+        }
+    }
+    v->n = n;
+    if (nokey && n > 0) {
+        q = RedisModule_Alloc(sizeof(*q));
+        memset(q, 0, sizeof(*q));
+        mpscInit(&q->values);
+        pthread_mutex_init(&q->lock, NULL);
+        q->refs = 1;
+        q->k = k;
+        q->len = len;
+        addIngestQueue(q);
+    } else {
+        RedisModule_Free(k);
+    }
+    if (n > 0) {
+        q->queued += n;
+        q->queuedTotal += total;
+        mpscPush(&q->values, &v->node);
+    } else {
+        RedisModule_Free(v);
+    }
+
+    if (errmsg != NULL) {
+        RedisModule_ReplyWithError(ctx, errmsg);
+    } else {
+        RedisModule_ReplyWithLongLong(
+            ctx, (h != NULL ? h->totalCount : 0) + q->queuedTotal);
+    }
+    if (n == 0) {
+        return REDISMODULE_OK;
+    } else if (q->queued > HISTK_INGEST_QUEUE_MAX) {
+        drainIngestQueue(ctx, q, 1);
+    } else {
+        scheduleIngestQueue(q);
+    }
+    return REDISMODULE_OK;
+}
+
+// Worker pool. When the module is loaded with WORKERS <threads> <centroids>,
+// HISTK.MERGESTORE, HISTK.MERGEBLOB and HISTK.RESIZE commands that merge at
+// least <centroids> centroids block their client and leave the merge, which
+// costs O(n log n) in the number of centroids, to one of <threads> threads.
+// The main thread only takes snapshots of the sketches the command reads (see
+// takeSnapshot), which the worker collects centroids from and merges without
+// the GIL. The worker then locks the GIL and checks that every key still holds
+// the sketch it has a snapshot of. If so, it stores its result, otherwise it
+// runs the command again there and then. Either way, the worker replies and
+// replicates through a thread-safe context tied to the blocked client, so the
+// command takes effect even if its client disconnects. At most
+// HISTK_POOL_QUEUE_MAX commands wait for a worker at a time; beyond that, and
+// inside MULTI or scripts, commands run on the main thread.
+#define HISTK_POOL_QUEUE_MAX 1024
+#define HISTK_POOL_THREADS_MAX 64
+
+static int poolThreads;
+static long long poolMinCentroids;
+static pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolCond = PTHREAD_COND_INITIALIZER;
+static struct MergeJob *poolHead, *poolTail;
+// Everything below is guarded by poolMutex. The number of jobs waiting for a
+// worker and the number being worked on.
+static int poolQueued;
+static int poolBusy;
+// Jobs done, jobs whose sketches changed before they were stored, and
+// commands that ran on the main thread because too many jobs were waiting.
+static long long poolJobs;
+static long long poolReruns;
+static long long poolOverflows;
+// Microseconds workers have spent on jobs, and when the pool started.
+static long long poolBusyUs;
+static long long poolStartUs;
+
+static long long monotonicUs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// A sketch that a command merging centroids reads.
+struct MergeSource {
+    // The argument naming the key the sketch is in, or 0 for a sketch given
+    // in the command itself.
+    int arg;
+    // The sketch, or NULL if the key is empty.
+    const struct HistK *h;
+    // Whether h is a copy that's freed with the source (see readHistK).
+    int owned;
+    // The snapshot h belongs to, for commands that run on a worker.
+    struct HistKSnapshot *snapshot;
+};
+
+// What a command merging centroids reads and how it merges it.
+struct MergePlan {
+    // The sketch being merged into, then the sketches merged into it. There
+    // are no sources if there's nothing to merge.
+    struct MergeSource *sources;
+    int numSources;
+    // The most centroids the merge may leave.
+    int maxCentroids;
+    // Whether values are rounded to floats before they're merged.
+    int toFloat;
+    // The number of centroids to merge.
+    long long cost;
+};
+
+static void initMergePlan(struct MergePlan *p, int maxSources) {
+    p->sources = RedisModule_Alloc(maxSources * sizeof(*p->sources));
+    p->numSources = 0;
+    p->maxCentroids = HISTK_DEFAULT_NUM_CENTROIDS;
+    p->toFloat = 0;
+    p->cost = 0;
+}
+
+// Add h, the sketch in argv[arg] or one given in the command if arg is 0, to
+// the sketches p reads. h may be NULL if the key is empty.
+static void addMergeSource(struct MergePlan *p, int arg, const struct HistK *h,
+                           int owned) {
+    struct MergeSource *s = &p->sources[p->numSources++];
+    s->arg = arg;
+    s->h = h;
+    s->owned = owned;
+    s->snapshot = NULL;
+    if (h != NULL) { p->cost += h->numCentroids; }
+}
+
+// Add the sketch in key, named by argv[arg], to the sketches p reads.
+static void addMergeKey(struct MergePlan *p, int arg, RedisModuleKey *key) {
+    if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY) {
+        addMergeSource(p, arg, NULL, 0);
+        return;
+    }
+    struct HistK *h = readHistK(key);
+    addMergeSource(p, arg, h, h != RedisModule_ModuleTypeGetValue(key));
+}
+
+static void releaseMergePlan(struct MergePlan *p) {
+    for (int i = 0; i < p->numSources; i++) {
+        struct MergeSource *s = &p->sources[i];
+        if (s->snapshot != NULL) {
+            releaseSnapshot(s->snapshot);
+        } else if (s->owned) {
+            freeHistK((struct HistK *)s->h);
+        }
+    }
+    RedisModule_Free(p->sources);
+}
+
+// Replace the sketches p reads with snapshots that a worker can read without
+// the GIL.
+static void snapshotMergePlan(RedisModuleCtx *ctx, RedisModuleString **argv,
+                              struct MergePlan *p) {
+    for (int i = 0; i < p->numSources; i++) {
+        struct MergeSource *s = &p->sources[i];
+        if (s->h == NULL) { continue; }
+        if (s->arg == 0) {
+            // Sketches given in the command are already copies.
+            s->snapshot = wrapSnapshot((struct HistK *)s->h);
+        } else {
+            if (s->owned) { freeHistK((struct HistK *)s->h); }
+            s->snapshot = takeSnapshot(
+                RedisModule_OpenKey(ctx, argv[s->arg], REDISMODULE_READ));
+        }
+        s->h = s->snapshot->h;
+        s->owned = 0;
+    }
+}
+
+// Whether every key p read from still holds the sketch p read. Must be called
+// under the GIL.
+static int mergePlanCurrent(RedisModuleCtx *ctx, RedisModuleString **argv,
+                            const struct MergePlan *p) {
+    for (int i = 0; i < p->numSources; i++) {
+        const struct MergeSource *s = &p->sources[i];
+        if (s->arg == 0) { continue; }
+        RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[s->arg],
+                                                  REDISMODULE_READ);
+        const struct HistK *h = NULL;
+        if (RedisModule_KeyType(key) != REDISMODULE_KEYTYPE_EMPTY) {
+            if (RedisModule_ModuleTypeGetType(key) != HistKType) { return 0; }
+            h = RedisModule_ModuleTypeGetValue(key);
+        }
+        if (s->snapshot == NULL ? h != NULL :
+            !isSnapshotOf(s->snapshot, h)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Gather the centroids of the sketches p reads into m, to merge into the
+// first of them.
+static void collectMerge(const struct MergePlan *p, struct MergeInput *m) {
+    if (p->numSources == 0) {
+        m->centroids = NULL;
+        m->count = m->maxSize = 0;
+        m->min = m->max = 0;
+        return;
+    }
+    beginMerge(m, p->sources[0].h);
+    for (int i = 1; i < p->numSources; i++) {
+        if (p->sources[i].h != NULL) { addToMerge(m, p->sources[i].h); }
+    }
+    if (p->toFloat) {
+        for (int i = 0; i < m->count; i++) {
+            m->centroids[i].value = toFloatValue(m->centroids[i].value);
+        }
+    }
+}
+
+// A write command that merges centroids, split into the parts that need the
+// GIL and the merge, which doesn't.
+struct MergeCommand {
+    // Validate argv and plan what the command merges into p. Replies with an
+    // error and returns REDISMODULE_ERR if the command fails.
+    int (*plan)(RedisModuleCtx *ctx, RedisModuleString **argv, int argc,
+                struct MergePlan *p);
+    // Store the n centroids that m's centroids merged into, which m holds
+    // now, then free them and reply. Returns the sketch the command changed,
+    // and a snapshot of it from before into *before (see snapshotHistK).
+    struct HistK *(*store)(RedisModuleCtx *ctx, RedisModuleString **argv,
+                           int argc, struct MergeInput *m, int n,
+                           struct HistK **before);
+};
+
+// Merge what p reads and store it for the command in ctx, on the current
+// thread, which must hold the GIL. Returns the sketch the command changed.
+static struct HistK *mergePlanned(RedisModuleCtx *ctx,
+                                  RedisModuleString **argv, int argc,
+                                  const struct MergeCommand *command,
+                                  struct MergePlan *p, struct HistK **before) {
+    struct MergeInput m;
+    collectMerge(p, &m);
+    int n = mergeCentroidList(m.centroids, m.count, m.centroids,
+                              p->maxCentroids);
+    releaseMergePlan(p);
+    return command->store(ctx, argv, argc, &m, n, before);
+}
+
+struct MergeJob {
+    struct MergeJob *next;
+    const struct MergeCommand *command;
+    RedisModuleBlockedClient *bc;
+    RedisModuleString **argv;
+    int argc;
+    struct MergePlan plan;
+};
+
+// Replicate a command that ran from a worker. Worker contexts aren't tied to
+// a command, so the command is replicated by name.
+static void replicatePooled(RedisModuleCtx *ctx, RedisModuleString **argv,
+                            int argc, struct HistK *before,
+                            const struct HistK *after) {
+    if (replicateEffects) {
+        replicateHistK(ctx, argv[1], before, after);
+        return;
+    }
+    RedisModule_Replicate(ctx, RedisModule_StringPtrLen(argv[0], NULL), "v",
+                          argv + 1, (size_t)(argc - 1));
+}
+
+// Merge what job's command reads, then store it. lock is a context the
+// worker locks the GIL with.
+static void runMergeJob(struct MergeJob *job, RedisModuleCtx *lock) {
+    struct MergeInput m;
+    collectMerge(&job->plan, &m);
+    int n = mergeCentroidList(m.centroids, m.count, m.centroids,
+                              job->plan.maxCentroids);
+
+    RedisModule_ThreadSafeContextLock(lock);
+    RedisModuleCtx *ctx = RedisModule_GetThreadSafeContext(job->bc);
+    RedisModule_AutoMemory(ctx);
+    struct HistK *h, *before = NULL;
+    if (mergePlanCurrent(ctx, job->argv, &job->plan)) {
+        h = job->command->store(ctx, job->argv, job->argc, &m, n, &before);
+    } else {
+        RedisModule_Free(m.centroids);
+        pthread_mutex_lock(&poolMutex);
+        poolReruns++;
+        pthread_mutex_unlock(&poolMutex);
+        struct MergePlan p;
+        h = job->command->plan(ctx, job->argv, job->argc, &p) ==
+            REDISMODULE_OK ?
+            mergePlanned(ctx, job->argv, job->argc, job->command, &p, &before) :
+            NULL;
+    }
+    if (h != NULL) { replicatePooled(ctx, job->argv, job->argc, before, h); }
+    RedisModule_FreeThreadSafeContext(ctx);
+    RedisModule_ThreadSafeContextUnlock(lock);
+    RedisModule_UnblockClient(job->bc, NULL);
+
+    releaseMergePlan(&job->plan);
+    for (int i = 0; i < job->argc; i++) {
+        RedisModule_FreeString(NULL, job->argv[i]);
+    }
+    RedisModule_Free(job->argv);
+    RedisModule_Free(job);
 }
 
-// Find index i where |h->cs[i].value - h->cs[i+1].value| is minimized. If there
-// are multiple nearly equal minimums, we'll choose one uniformly at random.
-int findMinimumCentroidPair(const struct Centroid *cs, int cn) {
-    unsigned int mi = cn - 1;
-    double md = DBL_MAX;
-    unsigned int n = 1;
-    for(int i = 0; i < cn - 1; i++) {
-        double d = fabs(cs[i+1].value - cs[i].value);
-        if (d < md || (fabs(d - md) < HISTK_EPSILON && rand() * n++ < 1.0)) {
-            mi = i;
-            md = d;
+static void *poolThread(void *arg) {
+    UNUSED(arg);
+    RedisModuleCtx *lock = RedisModule_GetThreadSafeContext(NULL);
+    while (1) {
+        pthread_mutex_lock(&poolMutex);
+        while (poolHead == NULL) {
+            pthread_cond_wait(&poolCond, &poolMutex);
         }
-    }
-    return mi;
-}
+        struct MergeJob *job = poolHead;
+        if ((poolHead = job->next) == NULL) { poolTail = NULL; }
+        poolQueued--;
+        poolBusy++;
+        pthread_mutex_unlock(&poolMutex);
 
-// Add <count> <value>s to the sketch.
-void add(struct HistK *h, double value, unsigned long long count) {
-    if (value < h->min) { h->min = value; }
-    if (value > h->max) { h->max = value; }
+        long long start = monotonicUs();
+        runMergeJob(job, lock);
 
-    // Find the index k in the sorted list of centroids where (value, count)
-    // belongs.
-    int i = h->numCentroids - 1;
-    unsigned char exact_match = 0;
-    for (; i >= 0; i--) {
-        if (h->cs[i].value == value) {
-            exact_match = 1;
-	    break;
-	} else if (h->cs[i].value < value) {
-            break;
-        }
-        h->cs[i+1] = h->cs[i];
+        pthread_mutex_lock(&poolMutex);
+        poolBusy--;
+        poolJobs++;
+        poolBusyUs += monotonicUs() - start;
+        pthread_mutex_unlock(&poolMutex);
     }
-    h->cs[i+1].value = value;
-    h->cs[i+1].count = count;
-    h->numCentroids++;
-    h->totalCount += count;
+    return NULL;
+}
 
-    if (h->numCentroids <= h->maxCentroids && !exact_match) {
-        return;
+// Block the client of the command in ctx and queue a job for a worker to
+// merge what p reads, if the pool should take the command. Takes over p if
+// it does.
+static int queueMergeJob(RedisModuleCtx *ctx, RedisModuleString **argv,
+                         int argc, const struct MergeCommand *command,
+                         struct MergePlan *p) {
+    if (poolThreads == 0 || p->cost == 0 || p->cost < poolMinCentroids ||
+        (RedisModule_GetContextFlags(ctx) &
+         (REDISMODULE_CTX_FLAGS_MULTI | REDISMODULE_CTX_FLAGS_LUA |
+          REDISMODULE_CTX_FLAGS_REPLICATED | REDISMODULE_CTX_FLAGS_LOADING |
+          REDISMODULE_CTX_FLAGS_DENY_BLOCKING))) {
+        return REDISMODULE_ERR;
     }
-
-    // Find closest pair of centroids and merge them together.
-    int mi = findMinimumCentroidPair(h->cs, h->numCentroids);
-    mergeCentroidWithNext(h->cs, mi);
-    h->numCentroids--;
-    for(int i = mi + 1; i < h->numCentroids; i++) {
-      h->cs[i] = h->cs[i+1];
-    }
-}
-
-// Populate ci and cj with the two centroids in h before and after index i. If
-// i is 0, we populate ci with a dummy centroid holding the min value observed
-// by the sketch. If i is h->numCentroids, we populate cj with a dummy centroid
-// holding the max value observed by the sketch. Using dummy centroids like
-// this makes the quantiles and counts at extreme values more accurate.
-void getBorderingCentroids(const struct HistK *h, unsigned int i,
-                           struct Centroid *ci, struct Centroid *cj) {
-    if (i == 0) {
-        ci->value = h->min;
-        ci->count = 0;
-        *cj = h->cs[0];
-    } else if (i == h->numCentroids) {
-        *ci = h->cs[h->numCentroids-1];
-        cj->value = h->max;
-        cj->count = 0;
+    pthread_mutex_lock(&poolMutex);
+    int full = poolQueued >= HISTK_POOL_QUEUE_MAX;
+    if (full) {
+        poolOverflows++;
     } else {
-        *ci = h->cs[i-1];
-        *cj = h->cs[i];
-    }
-}
-
-// Return an estimate of the smallest value V observed by the sketch such that
-// q * h->totalCount elements observed were less than or equal to V. q must be
-// in the range [0.0, 1.0].
-double quantile(const struct HistK *h, double q) {
-    double t = q * h->totalCount;
-    int i = 0;
-    double s = 0.0;
-    double pv = 0.0;
-    for(; i < h->numCentroids; i++) {
-        double v = h->cs[i].count / 2.0;
-        if (s + v + pv > t) {
-            break;
-        }
-        s += v + pv;
-        pv = v;
-    }
-
-    struct Centroid ci, cj;
-    getBorderingCentroids(h, i, &ci, &cj);
-
-    // Solve for u such that
-    // t - s = (ci.count + mu) / 2 * (u-ci.value) / (cj.value - ci.value), where
-    // mu = ci.count + (u-ci.value) * (cj.count-ci.count) / (cj.value-ci.value).
-    // You can solve for such a u using the quadratic formula as long as
-    // ci.count != cj.count. See Algorithm 4 and its description in the
-    // Ben-Haim/Tom-Tov paper.
-    double d = t - s;
-    double a = cj.count - ci.count;
-    if (a == 0.0) {
-        return ci.value + (cj.value - ci.value) * (d / ci.count);
-    }
-    double b = 2.0 * ci.count;
-    double c = -2.0 * d;
-    double z = (-b + sqrt(b * b - 4 * a * c)) / (2 * a);
-    return ci.value + (cj.value - ci.value) * z;
-}
-
-// Return an estimate of the number of values observed by the sketch that are
-// less than or equal to <v>. This is essentially the "Sum" procedure described
-// in Ben-Haim and Tom-Tov's paper.
-long long countLessThanOrEqual(const struct HistK *h, double v) {
-    if (v >= h->max) {
-        return h->totalCount;
-    } else if (v < h->min) {
-        return 0;
-    }
-    int i = h->numCentroids - 1;
-    for (; i >= 0; i--) {
-        if (h->cs[i].value <= v) {
-            break;
-        }
-    }
-
-    struct Centroid ci, cj;
-    getBorderingCentroids(h, i + 1, &ci, &cj);
-
-    double s = 0;
-    for (int j = 0; j < i; j++) {
-        s += h->cs[j].count;
-    }
-    double x = (v - ci.value) / (cj.value - ci.value);
-    double b = ci.count + (cj.count - ci.count) * x;
-    double est = s + ci.count / 2.0 + (ci.count + b) * x / 2.0;
-    return (long long)round(est);
-}
-
-// qsort comparator for Centroid.
-static int sortCentroids(const void *x, const void *y) {
-    const struct Centroid *cx = x, *cy = y;
-    if (cx->value > cy->value) {
-        return 1;
-    } else if (cx->value < cy->value) {
-        return -1;
+        poolQueued++;
+    }
+    pthread_mutex_unlock(&poolMutex);
+    if (full) { return REDISMODULE_ERR; }
+
+    snapshotMergePlan(ctx, argv, p);
+    struct MergeJob *job = RedisModule_Alloc(sizeof(*job));
+    job->next = NULL;
+    job->command = command;
+    job->argc = argc;
+    job->argv = RedisModule_Alloc(argc * sizeof(*job->argv));
+    for (int i = 0; i < argc; i++) {
+        job->argv[i] = RedisModule_CreateStringFromString(NULL, argv[i]);
+    }
+    job->plan = *p;
+    job->bc = RedisModule_BlockClient(ctx, NULL, NULL, NULL, 0);
+    pthread_mutex_lock(&poolMutex);
+    if (poolTail != NULL) {
+        poolTail->next = job;
     } else {
-        return 0;
+        poolHead = job;
     }
+    poolTail = job;
+    pthread_cond_signal(&poolCond);
+    pthread_mutex_unlock(&poolMutex);
+    return REDISMODULE_OK;
 }
 
-// Reduce the Centroid array cs, of length cn, to a Centroid array rs, of length
-// rn, by computing the optimal merge into min{cn, rn} centroids. The merged
-// array that is generated is optimal in the sense that it minimizes the sum of
-// distances of each centroid in cs to the centroid its merged into in rs over
-// all choices of an m centroid decomposition. Returns the total number of
-// centroids stored in rs.
-//
-// The input array cs is used as a workspace and is modified by this method.
-int mergeCentroidList(struct Centroid *cs, int cn,
-                      struct Centroid *rs, int rn) {
-    if (cn < 1) { return 0; }
-    qsort(cs, cn, sizeof(struct Centroid), sortCentroids);
-
-    // Merging centroids with the same value is easy: just sum the counts. Do
-    // this first.
-    int f = 0;
-    for (int i = 1; i < cn; i++) {
-        if (cs[i].value == cs[i-1].value) {
-            cs[f].count += cs[i].count;
-        } else {
-            f++;
-            cs[f] = cs[i];
-        }
+// Run a command that merges centroids, on a worker if it's worth it.
+static int runMergeCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+                           int argc, const struct MergeCommand *command) {
+    struct MergePlan p;
+    if (command->plan(ctx, argv, argc, &p) != REDISMODULE_OK) {
+        return REDISMODULE_OK;
+    }
+    if (queueMergeJob(ctx, argv, argc, command, &p) == REDISMODULE_OK) {
+        return REDISMODULE_OK;
     }
-    cn = f + 1;
+    struct HistK *before = NULL;
+    struct HistK *h = mergePlanned(ctx, argv, argc, command, &p, &before);
+    replicateHistK(ctx, argv[1], before, h);
+    return REDISMODULE_OK;
+}
 
-    while (cn > rn) {
-        // Find closest pair of centroids and merge them together.
-        int mi = findMinimumCentroidPair(cs, cn);
-        mergeCentroidWithNext(cs, mi);
-        cn--;
-        for(int i = mi + 1; i < cn; i++) {
-            cs[i] = cs[i+1];
+static void histkInfo(RedisModuleInfoCtx *ctx, int for_crash_report) {
+    UNUSED(for_crash_report);
+    if (poolThreads == 0) { return; }
+    pthread_mutex_lock(&snapshotMutex);
+    long long live = RedisModule_DictSize(snapshots);
+    pthread_mutex_unlock(&snapshotMutex);
+    pthread_mutex_lock(&poolMutex);
+    long long elapsed = monotonicUs() - poolStartUs;
+    RedisModule_InfoAddSection(ctx, "workers");
+    RedisModule_InfoAddFieldLongLong(ctx, "threads", poolThreads);
+    RedisModule_InfoAddFieldLongLong(ctx, "queued", poolQueued);
+    RedisModule_InfoAddFieldLongLong(ctx, "busy", poolBusy);
+    RedisModule_InfoAddFieldLongLong(ctx, "jobs", poolJobs);
+    RedisModule_InfoAddFieldLongLong(ctx, "reruns", poolReruns);
+    RedisModule_InfoAddFieldLongLong(ctx, "overflows", poolOverflows);
+    RedisModule_InfoAddFieldLongLong(ctx, "snapshots", live);
+    RedisModule_InfoAddFieldDouble(
+        ctx, "utilization",
+        elapsed > 0 ? (double)poolBusyUs / elapsed / poolThreads : 0);
+    pthread_mutex_unlock(&poolMutex);
+}
+
+// Plan HISTK.MERGESTORE: merge the sketch in the destination with every
+// source.
+static int planMergeStore(RedisModuleCtx *ctx, RedisModuleString **argv,
+                          int argc, struct MergePlan *p) {
+    if (argc < 3) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_ERR;
+    }
+    // Values queued for the sources count too.
+    for (int iarg = 1; iarg < argc; iarg++) {
+        drainHistK(ctx, argv[iarg]);
+    }
+    // Check the sources before changing anything.
+    for (int iarg = 1; iarg < argc; iarg++) {
+        RedisModuleKey *akey = RedisModule_OpenKey(ctx, argv[iarg],
+                                                   REDISMODULE_READ);
+        if (RedisModule_KeyType(akey) != REDISMODULE_KEYTYPE_EMPTY &&
+            RedisModule_ModuleTypeGetType(akey) != HistKType) {
+            RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+            return REDISMODULE_ERR;
         }
     }
-
-    // Copy merged centroids over to results.
-    for (int i = 0; i < cn; i++) {
-        rs[i] = cs[i];
+    initMergePlan(p, argc - 1);
+    for (int iarg = 1; iarg < argc; iarg++) {
+        addMergeKey(p, iarg, RedisModule_OpenKey(ctx, argv[iarg],
+                                                 REDISMODULE_READ));
     }
-    return cn;
+    if (p->sources[0].h != NULL) {
+        p->maxCentroids = p->sources[0].h->maxCentroids;
+    }
+    return REDISMODULE_OK;
 }
 
-// Add Centroid c to the array of Centroids cs at index i. cs has max length n,
-// and if i >= n, resize the underlying array so that c can be added at index i.
-// Returns the max size of the array after c has been added to index i.
-int addToDynamicCentroidArray(struct Centroid **cs, int i, int n,
-                              const struct Centroid c) {
-    while (i >= n) {
-        struct Centroid *newCs =
-            RedisModule_Alloc(n * 2 * sizeof(struct Centroid));
-        for (int j = 0; j < n; j++) {
-            newCs[j] = (*cs)[j];
-        }
-        n *= 2;
-        RedisModule_Free(*cs);
-        *cs = newCs;
+static struct HistK *storeMergeStore(RedisModuleCtx *ctx,
+                                     RedisModuleString **argv, int argc,
+                                     struct MergeInput *m, int n,
+                                     struct HistK **before) {
+    beginSlabWrite(ctx);
+    RedisModuleKey *key = RedisModule_OpenKey(
+        ctx, argv[1], REDISMODULE_READ|REDISMODULE_WRITE);
+    // Replicas read the sources too.
+    for (int iarg = 1; iarg < argc; iarg++) {
+        flushHistK(ctx, argv[iarg]);
+    }
+    struct HistK *h;
+    if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY) {
+        h = newHistK(HISTK_DEFAULT_NUM_CENTROIDS, HISTK_VALUES_DOUBLE);
+        RedisModule_ModuleTypeSetValue(key, HistKType, h);
+    } else {
+        h = expandHistK(key);
+        *before = snapshotHistK(h);
     }
-    (*cs)[i] = c;
-    return n;
+    h = storeMerge(key, h, m, n);
+    RedisModule_ReplyWithLongLong(ctx, h->totalCount);
+    return h;
 }
 
-/* HISTK.ADD <KEY> <VALUE1> [<COUNT1>] [<VALUE2> <COUNT2>, ...]
-   Add values to the sketch. Returns the total number of values observed by the
+static const struct MergeCommand mergeStoreCommand = {
+    planMergeStore, storeMergeStore
+};
+
+/* HISTK.MERGESTORE <KEY> HIST1 [HIST2] ... [HISTN]
+   Merge HIST1 ... HISTN, store results in KEY. If there's already a histogram
+   sketch in KEY before this command is called, the results are merged into that
    sketch.
 */
-int AddCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+int MergeStoreCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_AutoMemory(ctx);
+    if (argc >= 3 && anyEngineSketch(ctx, argv + 1, argc - 1)) {
+        return mergeEngineSketches(ctx, argv, argc);
+    }
+    return runMergeCommand(ctx, argv, argc, &mergeStoreCommand);
+}
 
-    if (argc < 3) return RedisModule_WrongArity(ctx);
-    RedisModuleKey *key = RedisModule_OpenKey(
-        ctx, argv[1], REDISMODULE_READ|REDISMODULE_WRITE);
-    int keytype = RedisModule_KeyType(key);
-    if (keytype != REDISMODULE_KEYTYPE_EMPTY &&
+// Plan HISTK.MERGEBLOB: merge the sketch in the destination with every
+// serialized sketch.
+static int planMergeBlob(RedisModuleCtx *ctx, RedisModuleString **argv,
+                         int argc, struct MergePlan *p) {
+    if (argc < 3) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_ERR;
+    }
+    drainHistK(ctx, argv[1]);
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+    if (RedisModule_KeyType(key) != REDISMODULE_KEYTYPE_EMPTY &&
         RedisModule_ModuleTypeGetType(key) != HistKType) {
-        return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
+        RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+        return REDISMODULE_ERR;
+    }
+    // Decode every sketch before changing anything. The sketches only live
+    // as long as the command, so they're kept out of slabs.
+    initMergePlan(p, argc - 1);
+    addMergeKey(p, 1, key);
+    for (int iarg = 2; iarg < argc; iarg++) {
+        size_t len;
+        const char *buf = RedisModule_StringPtrLen(argv[iarg], &len);
+        struct HistK *h = restoreScratchHistK((const unsigned char *)buf, len);
+        if (h == NULL) {
+            releaseMergePlan(p);
+            RedisModule_ReplyWithError(ctx, HISTK_ERRORMSG_BADSERIALIZED);
+            return REDISMODULE_ERR;
+        }
+        addMergeSource(p, 0, h, 1);
     }
+    if (p->sources[0].h != NULL) {
+        p->maxCentroids = p->sources[0].h->maxCentroids;
+    }
+    return REDISMODULE_OK;
+}
 
+static struct HistK *storeMergeBlob(RedisModuleCtx *ctx,
+                                    RedisModuleString **argv, int argc,
+                                    struct MergeInput *m, int n,
+                                    struct HistK **before) {
+    UNUSED(argc);
+    beginSlabWrite(ctx);
+    RedisModuleKey *key = RedisModule_OpenKey(
+        ctx, argv[1], REDISMODULE_READ|REDISMODULE_WRITE);
+    flushHistK(ctx, argv[1]);
     struct HistK *h;
-    if (keytype == REDISMODULE_KEYTYPE_EMPTY) {
-        h = createHistK(HISTK_DEFAULT_NUM_CENTROIDS);
+    if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY) {
+        h = newHistK(HISTK_DEFAULT_NUM_CENTROIDS, HISTK_VALUES_DOUBLE);
         RedisModule_ModuleTypeSetValue(key, HistKType, h);
     } else {
-        h = RedisModule_ModuleTypeGetValue(key);
-    }
-
-    for (int iarg = 2; iarg < argc;) {
-        double value;
-        if (RedisModule_StringToDouble(argv[iarg++], &value) !=
-            REDISMODULE_OK) {
-            return RedisModule_ReplyWithError(ctx,
-                                              HISTK_ERRORMSG_VALUENOTDOUBLE);
-        }
-        long long count = 1;
-        if (argc > iarg && RedisModule_StringToLongLong(argv[iarg++], &count) !=
-            REDISMODULE_OK) {
-            return RedisModule_ReplyWithError(ctx, HISTK_ERRORMSG_COUNTNOTINT);
-        }
-        add(h, value, count);
+        h = expandHistK(key);
+        *before = snapshotHistK(h);
     }
-
+    h = storeMerge(key, h, m, n);
     RedisModule_ReplyWithLongLong(ctx, h->totalCount);
-    RedisModule_ReplicateVerbatim(ctx);
-    return REDISMODULE_OK;
+    return h;
 }
 
-/* HISTK.QUANTILE <KEY> <Q>
-   Returns the q-quantile for any 0.0 <= Q <= 1.0
- */
-int QuantileCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+static const struct MergeCommand mergeBlobCommand = {
+    planMergeBlob, storeMergeBlob
+};
+
+/* HISTK.MERGEBLOB <KEY> <SERIALIZED1> [<SERIALIZED2>] ... [<SERIALIZEDN>]
+   Merge sketches serialized by HISTK.DUMP into the sketch in KEY the same way
+   HISTK.MERGESTORE merges sketches from other keys, without storing them in
+   keys first. Returns the total number of values observed by the sketch.
+*/
+int MergeBlobCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_AutoMemory(ctx);
-    if (argc != 3) return RedisModule_WrongArity(ctx);
-    double q;
-    if (RedisModule_StringToDouble(argv[2], &q) == REDISMODULE_ERR) {
-        return RedisModule_ReplyWithError(ctx, HISTK_ERRORMSG_VALUENOTDOUBLE);
+    return runMergeCommand(ctx, argv, argc, &mergeBlobCommand);
+}
+
+// Parse the arguments of HISTK.RESIZE, replying with an error if they're
+// invalid. *valueType is left alone if no precision is given.
+static int parseResize(RedisModuleCtx *ctx, RedisModuleString **argv,
+                       int argc, long long *newSize,
+                       unsigned char *valueType) {
+    if (argc < 3 || argc > 4) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[2], newSize) != REDISMODULE_OK) {
+        RedisModule_ReplyWithError(ctx, HISTK_ERRORMSG_COUNTNOTINT);
+        return REDISMODULE_ERR;
     }
-    if (q < 0.0 || q > 1.0) {
-        return RedisModule_ReplyWithError(ctx, HISTK_ERRORMSG_BADQUANTILE);
+    if (*newSize > HISTK_MAX_NUM_CENTROIDS) {
+        RedisModule_ReplyWithError(ctx, HISTK_ERRORMSG_CENTROIDLIMIT);
+        return REDISMODULE_ERR;
+    } else if (*newSize < 1) {
+        RedisModule_ReplyWithError(ctx, HISTK_ERRORMSG_CENTROIDMIN);
+        return REDISMODULE_ERR;
     }
+    if (argc == 4 && parseValueType(argv[3], valueType) != REDISMODULE_OK) {
+        RedisModule_ReplyWithError(ctx, HISTK_ERRORMSG_BADPRECISION);
+        return REDISMODULE_ERR;
+    }
+    return REDISMODULE_OK;
+}
 
-    RedisModuleKey *key = RedisModule_OpenKey(ctx,argv[1],
-                                              REDISMODULE_READ);
+// Plan HISTK.RESIZE: nothing to merge, unless the sketch has more centroids
+// than it's being resized to, in which case they're merged in the precision
+// it's being switched to.
+static int planResize(RedisModuleCtx *ctx, RedisModuleString **argv,
+                      int argc, struct MergePlan *p) {
+    long long newSize;
+    unsigned char valueType = HISTK_VALUES_DOUBLE;
+    if (parseResize(ctx, argv, argc, &newSize, &valueType) !=
+        REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    drainHistK(ctx, argv[1]);
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
     int keytype = RedisModule_KeyType(key);
     if (keytype != REDISMODULE_KEYTYPE_EMPTY &&
         RedisModule_ModuleTypeGetType(key) != HistKType) {
-        return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
+        RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+        return REDISMODULE_ERR;
     }
+    initMergePlan(p, 1);
+    p->maxCentroids = newSize;
+    p->toFloat = argc == 4 && valueType == HISTK_VALUES_FLOAT;
+    if (keytype != REDISMODULE_KEYTYPE_EMPTY &&
+        ((const struct HistK *)RedisModule_ModuleTypeGetValue(key))->
+        numCentroids > newSize) {
+        addMergeKey(p, 1, key);
+    }
+    return REDISMODULE_OK;
+}
 
-    if (keytype == REDISMODULE_KEYTYPE_EMPTY) {
-        return RedisModule_ReplyWithError(ctx, HISTK_ERRORMSG_EMPTYSKETCH);
+static struct HistK *storeResize(RedisModuleCtx *ctx,
+                                 RedisModuleString **argv, int argc,
+                                 struct MergeInput *m, int n,
+                                 struct HistK **before) {
+    long long newSize;
+    unsigned char valueType = HISTK_VALUES_DOUBLE;
+    parseResize(ctx, argv, argc, &newSize, &valueType);
+    beginSlabWrite(ctx);
+    RedisModuleKey *key = RedisModule_OpenKey(
+        ctx, argv[1], REDISMODULE_READ|REDISMODULE_WRITE);
+    flushHistK(ctx, argv[1]);
+    struct HistK *h;
+    if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY) {
+        h = newHistK(newSize, argc == 4 ? valueType : HISTK_VALUES_DOUBLE);
+        RedisModule_ModuleTypeSetValue(key, HistKType, h);
+    } else {
+        h = expandHistK(key);
+        *before = snapshotHistK(h);
+        struct HistK *nh;
+        if (argc == 4 && (nh = convertHistK(h, valueType)) != NULL) {
+            replaceHistK(key, nh);
+            h = nh;
+        }
+        if (h->numCentroids > newSize) {
+            int err;
+            while ((err = setCentroids(h, m->centroids, n)) != HISTK_OK) {
+                h = makeRoom(key, h, err, n);
+            }
+        }
+        h->maxCentroids = newSize;
+        if ((nh = shrinkHistK(h)) != NULL) {
+            replaceHistK(key, nh);
+            h = nh;
+        }
     }
-    struct HistK *h = RedisModule_ModuleTypeGetValue(key);
-    return RedisModule_ReplyWithDouble(ctx, quantile(h, q));
+    RedisModule_Free(m->centroids);
+    RedisModule_ReplyWithLongLong(ctx, newSize);
+    return h;
 }
 
-/* HISTK.COUNT <KEY> [<V>]
-   Returns an estimate of of the number of values <= V in the sketch. If V is
-   omitted, returns the total number of values observed by the sketch so far.
+static const struct MergeCommand resizeCommand = {
+    planResize, storeResize
+};
+
+/* HISTK.RESIZE <KEY> <CENTROIDS> [COMPACT|FULL]
+   Resize the sketch to a <CENTROIDS> centroids. In most cases, this should be
+   called once before values are added to the sketch. If called on an existing
+   sketch with a smaller number of centroids, some centroids will be merged.
+   COMPACT switches the sketch to storing values as floats, FULL switches it
+   back to doubles. By default the sketch keeps its precision.
 */
-int CountCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+int ResizeCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_AutoMemory(ctx);
-    if (argc < 2 || argc > 3) return RedisModule_WrongArity(ctx);
+    return runMergeCommand(ctx, argv, argc, &resizeCommand);
+}
+
+/* HISTK.DUMP <KEY>
+   Returns the exact state of the sketch in KEY as a versioned, portable byte
+   string that HISTK.RESTORE reads back, or nil if KEY doesn't exist.
+*/
+int DumpCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    if (argc != 2) return RedisModule_WrongArity(ctx);
     RedisModuleKey *key = RedisModule_OpenKey(ctx,argv[1],
                                               REDISMODULE_READ);
     int keytype = RedisModule_KeyType(key);
-    if (keytype != REDISMODULE_KEYTYPE_EMPTY &&
+    struct EngineSketch *es = getEngineSketch(key);
+    if (es == NULL && keytype != REDISMODULE_KEYTYPE_EMPTY &&
         RedisModule_ModuleTypeGetType(key) != HistKType) {
         return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
     }
 
-    if (keytype == REDISMODULE_KEYTYPE_EMPTY) {
-        return RedisModule_ReplyWithError(ctx, HISTK_ERRORMSG_EMPTYSKETCH);
-    }
-    struct HistK *h = RedisModule_ModuleTypeGetValue(key);
-    if (argc == 2) {
-        return RedisModule_ReplyWithLongLong(ctx, h->totalCount);
-    }
-    double v;
-    if (RedisModule_StringToDouble(argv[2], &v) == REDISMODULE_ERR) {
-        return RedisModule_ReplyWithError(ctx, HISTK_ERRORMSG_VALUENOTDOUBLE);
+    // Packed sketches with nothing queued are dumped as they are, without
+    // being unpacked.
+    size_t len;
+    unsigned char *buf;
+    if (es != NULL) {
+        buf = dumpEngineSketch(es, &len);
+    } else if (!hasQueuedValues(ctx, argv[1])) {
+        if (keytype == REDISMODULE_KEYTYPE_EMPTY) {
+            return RedisModule_ReplyWithNull(ctx);
+        }
+        buf = dumpHistK(RedisModule_ModuleTypeGetValue(key), &len);
+    } else {
+        struct HistK *h = readQueuedHistK(ctx, key, argv[1]);
+        if (h == NULL) { return RedisModule_ReplyWithNull(ctx); }
+        buf = dumpHistK(h, &len);
+        releaseHistK(key, h);
     }
-    return RedisModule_ReplyWithLongLong(ctx, countLessThanOrEqual(h, v));
+    RedisModule_ReplyWithStringBuffer(ctx, (const char *)buf, len);
+    RedisModule_Free(buf);
+    return REDISMODULE_OK;
 }
 
-/* HISTK.MERGESTORE <KEY> HIST1 [HIST2] ... [HISTN]
-   Merge HIST1 ... HISTN, store results in KEY. If there's already a histogram
-   sketch in KEY before this command is called, the results are merged into that
-   sketch.
+/* HISTK.RESTORE <KEY> <SERIALIZED> [REPLACE]
+   Create a sketch in KEY from SERIALIZED, the exact state of a sketch as
+   HISTK.DUMP returns it. KEY must not already exist unless REPLACE is given,
+   in which case whatever KEY holds is replaced, along with its TTL. AOF
+   rewrites use this to restore each sketch with a single command.
 */
-int MergeStoreCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+int RestoreCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_AutoMemory(ctx);
-    if (argc < 3) return RedisModule_WrongArity(ctx);
+    beginSlabWrite(ctx);
+    if (argc < 3 || argc > 4) return RedisModule_WrongArity(ctx);
+    size_t len;
+    const char *buf;
+    if (argc == 4) {
+        buf = RedisModule_StringPtrLen(argv[3], &len);
+        if (len != 7 || strncasecmp(buf, "replace", len) != 0) {
+            return RedisModule_ReplyWithError(ctx, HISTK_ERRORMSG_SYNTAX);
+        }
+    }
+    drainHistK(ctx, argv[1]);
     RedisModuleKey *key = RedisModule_OpenKey(
         ctx, argv[1], REDISMODULE_READ|REDISMODULE_WRITE);
-    int keytype = RedisModule_KeyType(key);
-    if (keytype != REDISMODULE_KEYTYPE_EMPTY &&
-        RedisModule_ModuleTypeGetType(key) != HistKType) {
-        return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
+    if (argc == 3 && RedisModule_KeyType(key) != REDISMODULE_KEYTYPE_EMPTY) {
+        return RedisModule_ReplyWithError(ctx, HISTK_ERRORMSG_BUSYKEY);
     }
-
-    struct HistK *h;
-    if (keytype == REDISMODULE_KEYTYPE_EMPTY) {
-        h = createHistK(HISTK_DEFAULT_NUM_CENTROIDS);
-        RedisModule_ModuleTypeSetValue(key, HistKType, h);
+    // The sketch stays packed, so it's restored without decoding a centroid.
+    buf = RedisModule_StringPtrLen(argv[2], &len);
+    struct HistK *h = NULL;
+    struct EngineSketch *es = NULL;
+    if (len > 0 && (unsigned char)buf[0] == HISTK_ENGINE_DUMP_VERSION) {
+        es = restoreEngineSketch((const unsigned char *)buf, len);
     } else {
-        h = RedisModule_ModuleTypeGetValue(key);
-    }
-    int count = 0;
-    int maxSize = HISTK_DEFAULT_MERGE_ARRAY_SIZE;
-    struct Centroid* centroids = RedisModule_Alloc(
-        HISTK_DEFAULT_MERGE_ARRAY_SIZE * sizeof(struct Centroid));
-    for (int i = 0; i < h->numCentroids; i++) {
-        maxSize = addToDynamicCentroidArray(&centroids, count++, maxSize,
-                                            h->cs[i]);
+        h = restoreHistK((const unsigned char *)buf, len, 1);
     }
-    double min = h->min;
-    double max = h->max;
-    for (int iarg = 2; iarg < argc; iarg++) {
-        RedisModuleKey *akey = RedisModule_OpenKey(ctx, argv[iarg],
-                                                   REDISMODULE_READ);
-        int akeytype = RedisModule_KeyType(akey);
-        if (akeytype == REDISMODULE_KEYTYPE_EMPTY) {
-            continue;
-        } else if (akeytype != REDISMODULE_KEYTYPE_EMPTY &&
-            RedisModule_ModuleTypeGetType(akey) != HistKType) {
-            return RedisModule_ReplyWithError(ctx,
-                                              REDISMODULE_ERRORMSG_WRONGTYPE);
-        }
-        struct HistK *ah = RedisModule_ModuleTypeGetValue(akey);
-        for (int i = 0; i < ah->numCentroids; i++) {
-            maxSize = addToDynamicCentroidArray(&centroids, count++, maxSize,
-                                                ah->cs[i]);
-        }
-        if (ah->min < min) min = ah->min;
-        if (ah->max > max) max = ah->max;
+    if (h == NULL && es == NULL) {
+        return RedisModule_ReplyWithError(ctx, HISTK_ERRORMSG_BADSERIALIZED);
     }
-
-    int numMerged = mergeCentroidList(centroids, count, h->cs, h->maxCentroids);
-    RedisModule_Free(centroids);
-
-    h->numCentroids = numMerged;
-    h->min = min;
-    h->max = max;
-    h->totalCount = 0;
-    for (int i = 0; i < h->numCentroids; i++) {
-        h->totalCount += h->cs[i].count;
+    flushHistK(ctx, argv[1]);
+    if (es != NULL) {
+        RedisModule_ModuleTypeSetValue(key, EngineType, es);
+    } else {
+        RedisModule_ModuleTypeSetValue(key, HistKType, h);
     }
-
-    RedisModule_ReplyWithLongLong(ctx, h->totalCount);
+    RedisModule_SetExpire(key, REDISMODULE_NO_EXPIRE);
+    RedisModule_ReplyWithSimpleString(ctx, "OK");
     RedisModule_ReplicateVerbatim(ctx);
     return REDISMODULE_OK;
 }
 
-/* HISTK.RESIZE <KEY> <CENTROIDS>
-   Resize the sketch to a <CENTROIDS> centroids. In most cases, this should be
-   called once before values are added to the sketch. If called on an existing
-   sketch with a smaller number of centroids, some centroids will be merged.
+/* HISTK.PATCH <KEY> <PATCH>
+   Apply PATCH, a description of how a write command changed the sketch in KEY.
+   When the module is loaded with REPLICATION EFFECTS, write commands send
+   these to replicas and the AOF in place of themselves.
 */
-int ResizeCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+int PatchCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_AutoMemory(ctx);
-    if (argc < 3) return RedisModule_WrongArity(ctx);
-    long long newSize;
-    if (RedisModule_StringToLongLong(argv[2], &newSize) != REDISMODULE_OK) {
-        return RedisModule_ReplyWithError(ctx, HISTK_ERRORMSG_COUNTNOTINT);
-    }
-    if (newSize > HISTK_MAX_NUM_CENTROIDS) {
-        return RedisModule_ReplyWithError(ctx, HISTK_ERRORMSG_CENTROIDLIMIT);
-    }
-
+    beginSlabWrite(ctx);
+    if (argc != 3) return RedisModule_WrongArity(ctx);
+    drainHistK(ctx, argv[1]);
     RedisModuleKey *key = RedisModule_OpenKey(
         ctx, argv[1], REDISMODULE_READ|REDISMODULE_WRITE);
     int keytype = RedisModule_KeyType(key);
@@ -501,31 +2661,107 @@ int ResizeCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
         RedisModule_ModuleTypeGetType(key) != HistKType) {
         return RedisModule_ReplyWithError(ctx,REDISMODULE_ERRORMSG_WRONGTYPE);
     }
-    struct HistK *h = createHistK(newSize);
+    size_t len;
+    const char *buf = RedisModule_StringPtrLen(argv[2], &len);
+    struct HistKPatch patch;
+    if (parseHistKPatch((const unsigned char *)buf, len, &patch) != HISTK_OK) {
+        return RedisModule_ReplyWithError(ctx, HISTK_ERRORMSG_BADPATCH);
+    }
+
+    flushHistK(ctx, argv[1]);
+    const struct HistK *ph = &patch.header;
+    struct HistK *h = NULL;
+    int n = 0;
     if (keytype != REDISMODULE_KEYTYPE_EMPTY) {
-        struct HistK *oldh = RedisModule_ModuleTypeGetValue(key);
-        for (int i = 0; i < oldh->numCentroids; i++) {
-            add(h, oldh->cs[i].value, oldh->cs[i].count);
-        }
+        h = expandHistK(key);
+        n = h->numCentroids;
     }
-    RedisModule_ModuleTypeSetValue(key, HistKType, h);
-    RedisModule_ReplyWithLongLong(ctx, newSize);
+    // Centroids the patch keeps have to be stored the way the patch says.
+    int keeps = patch.removed < n;
+    if (patch.expected != n ||
+        (keeps && (h->valueType != ph->valueType ||
+                   h->countWidth > ph->countWidth)) ||
+        (h == NULL && patch.total != ph->totalCount)) {
+        return RedisModule_ReplyWithError(ctx, HISTK_ERRORMSG_PATCHMISMATCH);
+    }
+    int patched = n - patch.removed + ph->numCentroids;
+    if (h == NULL) {
+        h = allocHistK(patched, ph->valueType, ph->countWidth);
+        h->numCentroids = 0;
+        h->totalCount = 0;
+        RedisModule_ModuleTypeSetValue(key, HistKType, h);
+    } else if (h->valueType != ph->valueType ||
+               h->countWidth != ph->countWidth || h->capacity < patched) {
+        h = copyHistK(h, patched, ph->valueType, ph->countWidth);
+        replaceHistK(key, h);
+    }
+    if (applyHistKPatch(h, &patch) != HISTK_OK) {
+        return RedisModule_ReplyWithError(ctx, HISTK_ERRORMSG_PATCHMISMATCH);
+    }
+    RedisModule_ReplyWithSimpleString(ctx, "OK");
     RedisModule_ReplicateVerbatim(ctx);
     return REDISMODULE_OK;
 }
 
+/* HISTK.SLABS
+   Returns statistics on each of the slabs sketches are allocated from when the
+   module is loaded with SLABS: the size of its slots, whether it's in the hot
+   or cold pool, how many slots it has and how many are used, and how many
+   writes its sketches have seen in all and while a fork child was running.
+*/
+int SlabsCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    UNUSED(argv);
+    if (argc != 1) return RedisModule_WrongArity(ctx);
+    RedisModule_ReplyWithArray(ctx, numSlabs);
+    for (int i = 0; i < numSlabs; i++) {
+        const struct Slab *s = slabs[i];
+        RedisModule_ReplyWithArray(ctx, 12);
+        RedisModule_ReplyWithSimpleString(ctx, "size");
+        RedisModule_ReplyWithLongLong(ctx, s->slotSize);
+        RedisModule_ReplyWithSimpleString(ctx, "pool");
+        RedisModule_ReplyWithSimpleString(
+            ctx, s->pool == HISTK_SLAB_HOT ? "hot" : "cold");
+        RedisModule_ReplyWithSimpleString(ctx, "slots");
+        RedisModule_ReplyWithLongLong(ctx, s->numSlots);
+        RedisModule_ReplyWithSimpleString(ctx, "used");
+        RedisModule_ReplyWithLongLong(ctx, s->used);
+        RedisModule_ReplyWithSimpleString(ctx, "writes");
+        RedisModule_ReplyWithLongLong(ctx, s->writes);
+        RedisModule_ReplyWithSimpleString(ctx, "fork-writes");
+        RedisModule_ReplyWithLongLong(ctx, s->forkWrites);
+    }
+    return REDISMODULE_OK;
+}
+
 void *HistKRdbLoad(RedisModuleIO *rdb, int encver) {
+    // Loaded sketches start out cold.
+    slabPool = HISTK_SLAB_COLD;
     if (encver > HISTK_ENCODING_VERSION) {
     // TODO: Use RedisModule_Log to log a warning if/when RedisModule_Log exists
         return NULL;
     }
-    unsigned int maxCentroids = RedisModule_LoadUnsigned(rdb);
-    struct HistK *h = createHistK(maxCentroids);
-    h->numCentroids = RedisModule_LoadUnsigned(rdb);
+    if (encver == 1) {
+        // Sketches are loaded packed, so a restart doesn't pay to decode
+        // sketches that are never read again, and saving a sketch that
+        // hasn't been touched since writes back the bytes it was loaded from.
+        size_t len;
+        char *buf = RedisModule_LoadStringBuffer(rdb, &len);
+        struct HistK *h = deserializePackedHistK((unsigned char *)buf, len);
+        RedisModule_Free(buf);
+        return h;
+    }
+    uint64_t layout = RedisModule_LoadUnsigned(rdb);
+    unsigned char valueType = (layout >> HISTK_RDB_VALUETYPE_SHIFT) & 0xff;
+    unsigned char countWidth = (layout >> HISTK_RDB_COUNTWIDTH_SHIFT) & 0xff;
+    if (countWidth == 0) { countWidth = 8; }
+    unsigned int numCentroids = RedisModule_LoadUnsigned(rdb);
+    struct HistK *h = allocHistK(numCentroids, valueType, countWidth);
+    h->maxCentroids = layout & 0xffff;
+    h->numCentroids = numCentroids;
     h->totalCount = RedisModule_LoadUnsigned(rdb);
     for(int i = 0; i < h->numCentroids; i++) {
-        h->cs[i].value = RedisModule_LoadDouble(rdb);
-        h->cs[i].count = RedisModule_LoadSigned(rdb);
+        setValue(h, i, RedisModule_LoadDouble(rdb));
+        setCount(h, i, RedisModule_LoadSigned(rdb));
     }
     h->min = RedisModule_LoadDouble(rdb);
     h->max = RedisModule_LoadDouble(rdb);
@@ -534,28 +2770,20 @@ void *HistKRdbLoad(RedisModuleIO *rdb, int encver) {
 
 void HistKRdbSave(RedisModuleIO *rdb, void *value) {
     struct HistK *h = value;
-    RedisModule_SaveUnsigned(rdb, h->maxCentroids);
-    RedisModule_SaveUnsigned(rdb, h->numCentroids);
-    RedisModule_SaveUnsigned(rdb, h->totalCount);
-    for (int i = 0; i < h->numCentroids; i++) {
-        RedisModule_SaveDouble(rdb, h->cs[i].value);
-        RedisModule_SaveSigned(rdb, h->cs[i].count);
-    }
-    RedisModule_SaveDouble(rdb, h->min);
-    RedisModule_SaveDouble(rdb, h->max);
+    unsigned char *buf = RedisModule_Alloc(serializedSize(h));
+    size_t len = serializeHistK(h, buf);
+    RedisModule_SaveStringBuffer(rdb, (const char *)buf, len);
+    RedisModule_Free(buf);
 }
 
 void HistKAofRewrite(RedisModuleIO *aof, RedisModuleString *key, void *value) {
   struct HistK *h = value;
-  // Run a RESIZE first to ensure the regenerated histk is the right size.
-  RedisModule_EmitAOF(aof, "HISTK.RESIZE", "sl", key, h->numCentroids);
-  // http://stackoverflow.com/a/1701272
-  char buf[3 + DBL_MANT_DIG - DBL_MIN_EXP];
-  for (unsigned int i = 0; i < h->numCentroids; i++) {
-    int nbuf = snprintf(buf, sizeof(buf), "%f", h->cs[i].value);
-    RedisModule_EmitAOF(aof, "HISTK.ADD", "sbl", key, buf, nbuf,
-                        h->cs[i].count);
-  }
+  // One RESTORE recreates the sketch exactly, down to the bits of each value,
+  // without replaying any merges.
+  size_t len;
+  unsigned char *buf = dumpHistK(h, &len);
+  RedisModule_EmitAOF(aof, "HISTK.RESTORE", "sb", key, (const char *)buf, len);
+  RedisModule_Free(buf);
 }
 
 void HistKDigest(RedisModuleDigest *digest, void *value) {
@@ -564,22 +2792,232 @@ void HistKDigest(RedisModuleDigest *digest, void *value) {
     UNUSED(value);
 }
 
+size_t HistKMemUsage(const void *value) {
+    return histkMemUsage(value);
+}
+
 void HistKFree(void *value) {
-    freeHistK(value);
+    dropHistK(value);
+}
+
+// Engine sketches are saved as their engine's id, then the sketch as the
+// engine serializes it.
+#define HISTK_ENGINE_ENCODING_VERSION 1
+
+void *EngineRdbLoad(RedisModuleIO *rdb, int encver) {
+    if (encver > HISTK_ENGINE_ENCODING_VERSION) {
+        return NULL;
+    }
+    const struct HistKEngine *e = findEngine(RedisModule_LoadUnsigned(rdb));
+    size_t len;
+    char *buf = RedisModule_LoadStringBuffer(rdb, &len);
+    void *s = e != NULL ? e->deserialize((unsigned char *)buf, len) : NULL;
+    RedisModule_Free(buf);
+    return s != NULL ? newEngineSketch(e, s) : NULL;
+}
+
+void EngineRdbSave(RedisModuleIO *rdb, void *value) {
+    struct EngineSketch *es = value;
+    unsigned char *buf = RedisModule_Alloc(
+        es->engine->serializedSize(es->s));
+    size_t len = es->engine->serialize(es->s, buf);
+    RedisModule_SaveUnsigned(rdb, es->engine->id);
+    RedisModule_SaveStringBuffer(rdb, (const char *)buf, len);
+    RedisModule_Free(buf);
+}
+
+void EngineAofRewrite(RedisModuleIO *aof, RedisModuleString *key,
+                      void *value) {
+    size_t len;
+    unsigned char *buf = dumpEngineSketch(value, &len);
+    RedisModule_EmitAOF(aof, "HISTK.RESTORE", "sb", key, (const char *)buf,
+                        len);
+    RedisModule_Free(buf);
+}
+
+size_t EngineMemUsage(const void *value) {
+    const struct EngineSketch *es = value;
+    return sizeof(*es) + es->engine->memUsage(es->s);
+}
+
+void EngineFree(void *value) {
+    freeEngineSketch(value);
+}
+
+// Idle compaction. When the module is loaded with IDLE-COMPACT <seconds>, a
+// timer walks the keyspace a few keys at a time and packs every sketch that
+// hasn't been touched for that long (see packHistK). The next command that
+// updates the sketch unpacks it again; commands that only read it unpack a
+// temporary copy. Idle times come from Redis's LRU clock, so nothing is
+// packed under an LFU maxmemory-policy.
+#define HISTK_COMPACT_PERIOD_MS 100
+#define HISTK_COMPACT_SCAN_STEPS 64
+
+static mstime_t compactIdleMs;
+static RedisModuleScanCursor *compactCursor;
+static int compactDb;
+
+struct CompactBatch {
+    RedisModuleString **keys;
+    int n;
+    int size;
+};
+
+static void findIdleHistK(RedisModuleCtx *ctx, RedisModuleString *keyname,
+                          RedisModuleKey *key, void *privdata) {
+    struct CompactBatch *b = privdata;
+    mstime_t idle;
+    if (RedisModule_ModuleTypeGetType(key) != HistKType ||
+        isPacked(RedisModule_ModuleTypeGetValue(key)) ||
+        RedisModule_GetLRU(key, &idle) != REDISMODULE_OK ||
+        idle < compactIdleMs) {
+        return;
+    }
+    if (b->n == b->size) {
+        b->size = b->size ? b->size * 2 : 16;
+        b->keys = RedisModule_Realloc(b->keys, b->size * sizeof(*b->keys));
+    }
+    b->keys[b->n++] = RedisModule_CreateStringFromString(ctx, keyname);
+}
+
+// Pack the idle sketches among the next few keys of the scan. Keys are only
+// collected during the scan and packed afterwards, since opening a key for
+// writing can expire it and change the keyspace under the cursor.
+static void compactIdleHistKs(RedisModuleCtx *ctx, void *data) {
+    UNUSED(data);
+    RedisModule_AutoMemory(ctx);
+    if (RedisModule_SelectDb(ctx, compactDb) != REDISMODULE_OK) {
+        compactDb = 0;
+        RedisModule_SelectDb(ctx, compactDb);
+    }
+    struct CompactBatch b = {NULL, 0, 0};
+    int more = 1;
+    for (int i = 0; more && i < HISTK_COMPACT_SCAN_STEPS; i++) {
+        more = RedisModule_Scan(ctx, compactCursor, findIdleHistK, &b);
+    }
+    if (!more) {
+        RedisModule_ScanCursorRestart(compactCursor);
+        compactDb++;
+    }
+    for (int i = 0; i < b.n; i++) {
+        RedisModuleKey *key = RedisModule_OpenKey(ctx, b.keys[i],
+                                                  REDISMODULE_WRITE);
+        if (RedisModule_ModuleTypeGetType(key) != HistKType) { continue; }
+        struct HistK *h = RedisModule_ModuleTypeGetValue(key);
+        struct HistK *ph;
+        // Replacing the value rather than setting it keeps the key's TTL and
+        // doesn't count as a write: packing changes how the sketch is
+        // stored, not what it holds.
+        if (!isPacked(h) && (ph = packHistK(h)) != NULL) {
+            RedisModule_ModuleTypeReplaceValue(key, HistKType, ph, NULL);
+            dropHistK(h);
+        }
+    }
+    RedisModule_Free(b.keys);
+    RedisModule_CreateTimer(ctx, HISTK_COMPACT_PERIOD_MS, compactIdleHistKs,
+                            NULL);
+}
+
+// Parse the arguments the module was loaded with: an optional
+// IDLE-COMPACT <seconds>, REPLICATION EFFECTS|VERBATIM, COALESCE-ADDS <ms>,
+// SLABS <seconds>, ASYNC-ADDS <centroids> and WORKERS <threads> <centroids>.
+static int parseModuleArgs(RedisModuleCtx *ctx, RedisModuleString **argv,
+                           int argc) {
+    for (int i = 0; i < argc; i++) {
+        size_t len;
+        const char *arg = RedisModule_StringPtrLen(argv[i], &len);
+        long long seconds, ms, centroids, threads;
+        const char *mode = NULL;
+        if (len == 12 && strncasecmp(arg, "idle-compact", len) == 0 &&
+            i + 1 < argc &&
+            RedisModule_StringToLongLong(argv[++i], &seconds) ==
+            REDISMODULE_OK && seconds >= 0) {
+            compactIdleMs = seconds * 1000;
+        } else if (len == 13 && strncasecmp(arg, "coalesce-adds", len) == 0 &&
+                   i + 1 < argc &&
+                   RedisModule_StringToLongLong(argv[++i], &ms) ==
+                   REDISMODULE_OK && ms >= 0) {
+            coalesceMs = ms;
+        } else if (len == 5 && strncasecmp(arg, "slabs", len) == 0 &&
+                   i + 1 < argc &&
+                   RedisModule_StringToLongLong(argv[++i], &seconds) ==
+                   REDISMODULE_OK && seconds >= 0) {
+            useSlabs = 1;
+            slabHotSeconds = seconds;
+        } else if (len == 10 && strncasecmp(arg, "async-adds", len) == 0 &&
+                   i + 1 < argc &&
+                   RedisModule_StringToLongLong(argv[++i], &centroids) ==
+                   REDISMODULE_OK && centroids >= 0) {
+            ingestMinCentroids = centroids;
+        } else if (len == 7 && strncasecmp(arg, "workers", len) == 0 &&
+                   i + 2 < argc &&
+                   RedisModule_StringToLongLong(argv[++i], &threads) ==
+                   REDISMODULE_OK && threads >= 1 &&
+                   threads <= HISTK_POOL_THREADS_MAX &&
+                   RedisModule_StringToLongLong(argv[++i], &centroids) ==
+                   REDISMODULE_OK && centroids >= 0) {
+            poolThreads = threads;
+            poolMinCentroids = centroids;
+        } else if (len == 11 && strncasecmp(arg, "replication", len) == 0 &&
+                   i + 1 < argc &&
+                   (mode = RedisModule_StringPtrLen(argv[++i], &len)) &&
+                   ((len == 7 && strncasecmp(mode, "effects", len) == 0) ||
+                    (len == 8 && strncasecmp(mode, "verbatim", len) == 0))) {
+            replicateEffects = len == 7;
+        } else {
+            RedisModule_Log(ctx, "warning", "histk: bad module argument '%s'",
+                            arg);
+            return REDISMODULE_ERR;
+        }
+    }
+    return REDISMODULE_OK;
 }
 
 /* Registering the module */
-int RedisModule_OnLoad(RedisModuleCtx *ctx) {
+int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv,
+                       int argc) {
   if (RedisModule_Init(ctx, "histk", HISTK_MODULE_VERSION, REDISMODULE_APIVER_1)
       == REDISMODULE_ERR) {
       return REDISMODULE_ERR;
     }
+    // Sketches live in Redis's memory, and those stored in keys in slabs.
+    struct HistKAllocator a = {
+        RedisModule_Alloc, RedisModule_Realloc, RedisModule_Free,
+        slabAlloc, slabFree
+    };
+    histkSetAllocator(&a);
+    if (parseModuleArgs(ctx, argv, argc) == REDISMODULE_ERR) {
+        return REDISMODULE_ERR;
+    }
+    RedisModuleTypeMethods tm = {
+        .version = REDISMODULE_TYPE_METHOD_VERSION,
+        .rdb_load = HistKRdbLoad,
+        .rdb_save = HistKRdbSave,
+        .aof_rewrite = HistKAofRewrite,
+        .mem_usage = HistKMemUsage,
+        .digest = HistKDigest,
+        .free = HistKFree
+    };
     HistKType = RedisModule_CreateDataType(ctx, "aaw-histk",
-                                           HISTK_ENCODING_VERSION,
-                                           HistKRdbLoad, HistKRdbSave,
-                                           HistKAofRewrite, HistKDigest,
-                                           HistKFree);
+                                           HISTK_ENCODING_VERSION, &tm);
     if (HistKType == NULL) return REDISMODULE_ERR;
+    RedisModuleTypeMethods etm = {
+        .version = REDISMODULE_TYPE_METHOD_VERSION,
+        .rdb_load = EngineRdbLoad,
+        .rdb_save = EngineRdbSave,
+        .aof_rewrite = EngineAofRewrite,
+        .mem_usage = EngineMemUsage,
+        .free = EngineFree
+    };
+    EngineType = RedisModule_CreateDataType(ctx, "histk-eng",
+                                            HISTK_ENGINE_ENCODING_VERSION,
+                                            &etm);
+    if (EngineType == NULL) return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx, "histk.create", CreateCommand,
+                                  "write deny-oom", 1,1,1) ==
+        REDISMODULE_ERR) {
+      return REDISMODULE_ERR;
+    }
     if (RedisModule_CreateCommand(ctx, "histk.add", AddCommand,
                                   "write", 1,1,1) == REDISMODULE_ERR) {
       return REDISMODULE_ERR;
@@ -596,9 +3034,96 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx) {
                                   "write", 1,1,1) == REDISMODULE_ERR) {
       return REDISMODULE_ERR;
     }
+    if (RedisModule_CreateCommand(ctx, "histk.mergeblob", MergeBlobCommand,
+                                  "write", 1,1,1) == REDISMODULE_ERR) {
+      return REDISMODULE_ERR;
+    }
     if (RedisModule_CreateCommand(ctx, "histk.resize", ResizeCommand,
                                   "write", 1,1,1) == REDISMODULE_ERR) {
       return REDISMODULE_ERR;
     }
+    if (RedisModule_CreateCommand(ctx, "histk.dump", DumpCommand,
+                                  "readonly", 1,1,1) == REDISMODULE_ERR) {
+      return REDISMODULE_ERR;
+    }
+    if (RedisModule_CreateCommand(ctx, "histk.restore", RestoreCommand,
+                                  "write", 1,1,1) == REDISMODULE_ERR) {
+      return REDISMODULE_ERR;
+    }
+    if (RedisModule_CreateCommand(ctx, "histk.patch", PatchCommand,
+                                  "write", 1,1,1) == REDISMODULE_ERR) {
+      return REDISMODULE_ERR;
+    }
+    if (RedisModule_CreateCommand(ctx, "histk.slabs", SlabsCommand,
+                                  "readonly", 0,0,0) == REDISMODULE_ERR) {
+      return REDISMODULE_ERR;
+    }
+    if (compactIdleMs > 0) {
+        if (RedisModule_Scan == NULL || RedisModule_GetLRU == NULL ||
+            RedisModule_ModuleTypeReplaceValue == NULL) {
+            RedisModule_Log(ctx, "warning",
+                            "histk: IDLE-COMPACT needs Redis 6.0 or later");
+            return REDISMODULE_ERR;
+        }
+        compactCursor = RedisModule_ScanCursorCreate();
+        RedisModule_CreateTimer(ctx, HISTK_COMPACT_PERIOD_MS,
+                                compactIdleHistKs, NULL);
+    }
+    if (coalesceMs >= 0) {
+        if (RedisModule_SubscribeToServerEvent == NULL ||
+            RedisModule_SubscribeToServerEvent(
+                ctx, RedisModuleEvent_SwapDB, onServerEvent) ==
+            REDISMODULE_ERR) {
+            RedisModule_Log(ctx, "warning",
+                            "histk: COALESCE-ADDS needs Redis 6.2 or later");
+            return REDISMODULE_ERR;
+        }
+        RedisModule_SubscribeToServerEvent(ctx, RedisModuleEvent_Persistence,
+                                           onServerEvent);
+        RedisModule_SubscribeToServerEvent(ctx, RedisModuleEvent_FlushDB,
+                                           onServerEvent);
+        RedisModule_SubscribeToKeyspaceEvents(ctx, REDISMODULE_NOTIFY_ALL,
+                                              onKeyspaceEvent);
+        RedisModule_RegisterCommandFilter(ctx, filterFlushingCommands, 0);
+        pendingHistKs = RedisModule_CreateDict(NULL);
+    }
+    if (ingestMinCentroids >= 0) {
+        if (RedisModule_RegisterCommandFilter == NULL ||
+            RedisModule_ThreadSafeContextLock == NULL) {
+            RedisModule_Log(ctx, "warning",
+                            "histk: ASYNC-ADDS needs Redis 5.0 or later");
+            return REDISMODULE_ERR;
+        }
+        ingestQueues = RedisModule_CreateDict(NULL);
+        ingestNames = RedisModule_CreateDict(NULL);
+        mpscInit(&readyQueues);
+        RedisModule_SubscribeToKeyspaceEvents(
+            ctx, REDISMODULE_NOTIFY_EXPIRED|REDISMODULE_NOTIFY_EVICTED,
+            onIngestKeyspaceEvent);
+        RedisModule_RegisterCommandFilter(ctx, filterIngestCommands, 0);
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, ingestThread, NULL) != 0) {
+            return REDISMODULE_ERR;
+        }
+        pthread_detach(tid);
+    }
+    if (poolThreads > 0) {
+        if (RedisModule_BlockClient == NULL ||
+            RedisModule_RegisterInfoFunc == NULL) {
+            RedisModule_Log(ctx, "warning",
+                            "histk: WORKERS needs Redis 6.0 or later");
+            return REDISMODULE_ERR;
+        }
+        RedisModule_RegisterInfoFunc(ctx, histkInfo);
+        snapshots = RedisModule_CreateDict(NULL);
+        poolStartUs = monotonicUs();
+        for (int i = 0; i < poolThreads; i++) {
+            pthread_t tid;
+            if (pthread_create(&tid, NULL, poolThread, NULL) != 0) {
+                return REDISMODULE_ERR;
+            }
+            pthread_detach(tid);
+        }
+    }
     return REDISMODULE_OK;
 }
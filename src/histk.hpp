@@ -0,0 +1,370 @@
+/* histk::Sketch: the histogram sketch of libhistk as a C++ class template,
+ * with its size and types fixed at compile time. It needs nothing but this
+ * header and libhistk.h, and never allocates, except to return a dump as a
+ * std::string.
+ */
+
+#ifndef HISTK_HPP
+#define HISTK_HPP
+
+#include <cfloat>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <type_traits>
+
+#include "libhistk.h"
+
+namespace histk {
+
+// A sketch with room for N centroids that stores values as Value, double or
+// float, and counts as Count, an unsigned integer type. Its centroids are held
+// inline, so it can live on the stack, in a struct or in an array, and
+// copying it copies the sketch. add, quantile and countLessThanOrEqual give
+// the same results as histkAdd, histkQuantile and histkCountLessThanOrEqual on
+// a struct HistK with N maxCentroids and the same value type, and dump writes
+// the bytes HISTK.DUMP would return for that sketch, for HISTK.MERGEBLOB or
+// HISTK.RESTORE. Unlike a struct HistK, a Sketch can't widen its counts: add
+// fails if a count would no longer fit in a Count.
+template <unsigned int N, typename Value = double, typename Count = uint64_t>
+class Sketch {
+    static_assert(N >= 1 && N <= HISTK_MAX_NUM_CENTROIDS,
+                  "N must be between 1 and HISTK_MAX_NUM_CENTROIDS");
+    static_assert(std::is_same<Value, double>::value ||
+                  std::is_same<Value, float>::value,
+                  "Value must be double or float");
+    static_assert(std::is_unsigned<Count>::value &&
+                  !std::is_same<Count, bool>::value && sizeof(Count) <= 8,
+                  "Count must be an unsigned integer type of at most 64 bits");
+
+public:
+    // The most bytes dump writes.
+    static constexpr size_t maxDumpSize = 1 + (3 + 3 + 1 + 1 + 10 + 8 + 8) +
+        N * (1 + 8 + 10);
+
+    Sketch() : total(0), lo(DBL_MAX), hi(DBL_MIN), n(0) {
+        for (unsigned int i = 0; i <= slots; i++) {
+            values[i] = std::numeric_limits<Value>::infinity();
+        }
+    }
+
+    uint64_t totalCount() const { return total; }
+    double min() const { return lo; }
+    double max() const { return hi; }
+    int numCentroids() const { return n; }
+    double value(int i) const { return values[i]; }
+    Count count(int i) const { return counts[i]; }
+
+    // Add count occurrences of value. Returns false, without changing the
+    // sketch, if a count would no longer fit in a Count.
+    bool add(double value, uint64_t count = 1) {
+        // Float sketches round values to floats, but min and max are exact.
+        double v = isFloat ? toFloatValue(value) : value;
+        const uint64_t limit = std::numeric_limits<Count>::max();
+        int k = lastCentroidAtMost(v);
+        if (k >= 0 && values[k] == v) {
+            if (count > limit - counts[k]) { return false; }
+            counts[k] += count;
+        } else if (n < (int)N) {
+            if (count > limit) { return false; }
+            moveCentroids(k + 1, n, 1);
+            values[k + 1] = v;
+            counts[k + 1] = count;
+            n++;
+        } else {
+            // As in histkAdd: merge the two closest of the N + 1 centroids
+            // we'd have, working out which before moving anything.
+            double md;
+            int mi = findMinimumCentroidPair(k, &md);
+            double dl = k >= 0 ? v - values[k] : DBL_MAX;
+            double dr = k + 1 < n ? values[k + 1] - v : DBL_MAX;
+            if (N < 2 || mi < 0 || dl <= md || dr <= md) {
+                // Only merge into a neighbor that exists, and into a neighbor
+                // too when there's no finite pair to merge (mi is -1), as in
+                // histkAdd. N < 2 says so to the compiler for Sketch<1>.
+                int j = k < 0 ? k + 1 : k + 1 >= n ? k : dl <= dr ? k : k + 1;
+                if (count > limit - counts[j]) { return false; }
+                values[j] = merged(values[j], counts[j], v, count);
+                counts[j] += count;
+            } else {
+                if (counts[mi + 1] > limit - counts[mi] || count > limit) {
+                    return false;
+                }
+                double mv = merged(values[mi], counts[mi], values[mi + 1],
+                                   counts[mi + 1]);
+                Count mc = counts[mi] + counts[mi + 1];
+                if (mi < k) {
+                    moveCentroids(mi + 2, k + 1, -1);
+                    k--;
+                } else {
+                    moveCentroids(k + 1, mi + 1, 1);
+                    mi++;
+                }
+                values[mi] = mv;
+                counts[mi] = mc;
+                values[k + 1] = v;
+                counts[k + 1] = count;
+            }
+        }
+        if (value < lo) { lo = value; }
+        if (value > hi) { hi = value; }
+        total += count;
+        return true;
+    }
+
+    // Return an estimate of the q-quantile of the values added.
+    double quantile(double q) const {
+        double t = q * total;
+        int i = 0;
+        double s = 0.0, pv = 0.0;
+        for (; i < n; i++) {
+            double v = counts[i] / 2.0;
+            if (s + v + pv > t) { break; }
+            s += v + pv;
+            pv = v;
+        }
+        double civ, cic, cjv, cjc;
+        borderingCentroids(i, &civ, &cic, &cjv, &cjc);
+        // See histkQuantile.
+        double d = t - s;
+        double a = cjc - cic;
+        if (a == 0.0) { return civ + (cjv - civ) * (d / cic); }
+        double b = 2.0 * cic;
+        double c = -2.0 * d;
+        double z = (-b + std::sqrt(b * b - 4 * a * c)) / (2 * a);
+        return civ + (cjv - civ) * z;
+    }
+
+    // Return an estimate of the number of values added that are at most v.
+    long long countLessThanOrEqual(double v) const {
+        if (v >= hi) {
+            return total;
+        } else if (v < lo) {
+            return 0;
+        }
+        int i = lastCentroidAtMost(v);
+        double civ, cic, cjv, cjc;
+        borderingCentroids(i + 1, &civ, &cic, &cjv, &cjc);
+        uint64_t sum = 0;
+        for (int j = 0; j < i; j++) { sum += counts[j]; }
+        double s = sum;
+        double x = (v - civ) / (cjv - civ);
+        double b = cic + (cjc - cic) * x;
+        double est = s + cic / 2.0 + (cic + b) * x / 2.0;
+        return (long long)std::round(est);
+    }
+
+    // Write the sketch to buf, which must have room for maxDumpSize bytes, as
+    // HISTK.DUMP returns it (see dumpHistK). Counts are written as wide as
+    // the largest one needs, as a struct HistK would store them. Returns the
+    // number of bytes written.
+    size_t dump(unsigned char *buf) const {
+        unsigned char *p = buf;
+        *p++ = HISTK_DUMP_VERSION;
+        p = putVarint(p, N);
+        p = putVarint(p, n);
+        *p++ = isFloat ? HISTK_VALUES_FLOAT : HISTK_VALUES_DOUBLE;
+        *p++ = countWidth();
+        p = putVarint(p, total);
+        p = putDouble(p, lo);
+        p = putDouble(p, hi);
+        uint64_t prev = 0;
+        for (int i = 0; i < n; i++) {
+            uint64_t k = valueKey(values[i]);
+            p = putDelta(p, k - prev);
+            p = putVarint(p, counts[i]);
+            prev = k;
+        }
+        return p - buf;
+    }
+
+    std::string dump() const {
+        unsigned char buf[maxDumpSize];
+        return std::string((const char *)buf, dump(buf));
+    }
+
+private:
+    static constexpr bool isFloat = std::is_same<Value, float>::value;
+
+    // Scans look at values a block at a time: ways vectors of lanes doubles
+    // each, kept apart so that comparing one needn't wait on the last. Two
+    // doubles fill an SSE2 register; wider units take two vectors at once.
+    static constexpr int lanes = 2;
+    static constexpr int ways = 4;
+    static constexpr unsigned int block = lanes * ways;
+    typedef double Lanes __attribute__((vector_size(lanes * sizeof(double))));
+    typedef long long Indexes
+        __attribute__((vector_size(lanes * sizeof(long long))));
+    // N rounded up to a whole number of blocks.
+    static constexpr unsigned int slots = (N + block - 1) / block * block;
+
+    // Values are followed by infinities, so that scans can look at every
+    // slot, plus one, without checking where the centroids end.
+    Value values[slots + 1];
+    Count counts[N];
+    uint64_t total;
+    double lo;
+    double hi;
+    int n;
+
+    // Return the index of the last centroid whose value is at most v, or -1
+    // if there isn't one. Values are sorted, so that's one less than the
+    // number of them that are at most v, which we count a few lanes at a
+    // time. Unused slots hold infinity and count as greater than any v but
+    // infinity itself.
+    int lastCentroidAtMost(double v) const {
+        Indexes greater[ways] = {};
+        for (unsigned int i = 0; i < slots; i += block) {
+#pragma GCC unroll 4
+            for (int w = 0; w < ways; w++) {
+                Lanes l;
+                loadLanes(i + w * lanes, &l);
+                // Comparisons give -1 where they hold.
+                greater[w] += l > v;
+            }
+        }
+        int k = slots - 1;
+        for (int w = 0; w < ways; w++) {
+            for (int j = 0; j < lanes; j++) { k += greater[w][j]; }
+        }
+        return k < n - 1 ? k : n - 1;
+    }
+
+    // Return the index i, other than skip, of the first of the closest pair
+    // of neighboring centroids i and i + 1, and store the gap between them in
+    // md. Returns -1 if there's no such pair. Where histkAdd breaks near ties
+    // at random (with odds of about one in 2^31), this takes the first.
+    // The smallest gap is found a few lanes at a time, and then where it is.
+    // Gaps next to unused slots are infinite or NaN, so they're never the
+    // smallest.
+    int findMinimumCentroidPair(int skip, double *md) const {
+        // Indexes are compared as doubles, which SSE2 can do two at a time,
+        // unlike 64-bit integers.
+        Lanes m[ways], is[ways], skips;
+        for (int j = 0; j < lanes; j++) {
+            skips[j] = skip;
+            for (int w = 0; w < ways; w++) {
+                m[w][j] = DBL_MAX;
+                is[w][j] = w * lanes + j;
+            }
+        }
+        for (unsigned int i = 0; i < slots; i += block) {
+#pragma GCC unroll 4
+            for (int w = 0; w < ways; w++) {
+                Lanes a, b;
+                loadLanes(i + w * lanes, &a);
+                loadLanes(i + w * lanes + 1, &b);
+                Lanes d = b - a;
+                d = is[w] == skips ? m[w] : d;
+                m[w] = d < m[w] ? d : m[w];
+                is[w] += block;
+            }
+        }
+        double mm = DBL_MAX;
+        for (int w = 0; w < ways; w++) {
+            for (int j = 0; j < lanes; j++) {
+                mm = m[w][j] < mm ? m[w][j] : mm;
+            }
+        }
+        *md = mm;
+        if (mm == DBL_MAX) { return -1; }
+        // Find the first vector it's in, then where in the vector.
+        unsigned int i = 0;
+        for (;; i += lanes) {
+            Lanes a, b;
+            loadLanes(i, &a);
+            loadLanes(i + 1, &b);
+            Indexes found = b - a == mm;
+            long long any = 0;
+            for (int j = 0; j < lanes; j++) { any |= found[j]; }
+            if (any) { break; }
+        }
+        while ((int)i == skip || (double)values[i + 1] - values[i] != mm) {
+            i++;
+        }
+        return i;
+    }
+
+    // Like getBorderingCentroids.
+    void borderingCentroids(int i, double *civ, double *cic, double *cjv,
+                            double *cjc) const {
+        *civ = i == 0 ? lo : (double)values[i - 1];
+        *cic = i == 0 ? 0 : (double)counts[i - 1];
+        *cjv = i == n ? hi : (double)values[i];
+        *cjc = i == n ? 0 : (double)counts[i];
+    }
+
+    // Set *l to values i to i + lanes - 1, as doubles.
+    void loadLanes(unsigned int i, Lanes *l) const {
+        for (int j = 0; j < lanes; j++) { (*l)[j] = values[i + j]; }
+    }
+
+    void moveCentroids(int from, int to, int delta) {
+        if (to <= from) { return; }
+        std::memmove(values + from + delta, values + from,
+                     (to - from) * sizeof(Value));
+        std::memmove(counts + from + delta, counts + from,
+                     (to - from) * sizeof(Count));
+    }
+
+    // Return the value of the centroid that merging (vi, ci) and (vj, cj)
+    // gives, rounded as it'll be stored.
+    static Value merged(double vi, uint64_t ci, double vj, uint64_t cj) {
+        double v = (vi * (double)(long long)ci + vj * (double)(long long)cj) /
+            (double)(long long)(ci + cj);
+        // Kept between vi and vj, as mergeCentroids does.
+        double lo = std::fmin(vi, vj), hi = std::fmax(vi, vj);
+        v = v < lo ? lo : v > hi ? hi : v;
+        return isFloat ? toFloatValue(v) : v;
+    }
+
+    unsigned char countWidth() const {
+        Count m = 0;
+        for (int i = 0; i < n; i++) { m = counts[i] > m ? counts[i] : m; }
+        unsigned char w = 1;
+        while (w < 8 && m > countLimit(w)) { w *= 2; }
+        return w;
+    }
+
+    // The serialization helpers of libhistk.c.
+    static uint64_t valueKey(Value v) {
+        if (isFloat) {
+            uint32_t b;
+            std::memcpy(&b, &v, sizeof(b));
+            return b & 0x80000000u ? ~b : b | 0x80000000u;
+        }
+        uint64_t b;
+        std::memcpy(&b, &v, sizeof(b));
+        return b & 0x8000000000000000ull ? ~b : b | 0x8000000000000000ull;
+    }
+
+    static unsigned char *putVarint(unsigned char *p, uint64_t v) {
+        for (; v >= 0x80; v >>= 7) { *p++ = v | 0x80; }
+        *p++ = v;
+        return p;
+    }
+
+    static unsigned char *putDelta(unsigned char *p, uint64_t d) {
+        int skip = d == 0 ? 0 : __builtin_ctzll(d) / 8;
+        int len = 0;
+        d >>= 8 * skip;
+        for (uint64_t t = d; t != 0; t >>= 8) { len++; }
+        *p++ = skip << 4 | len;
+        for (int i = 0; i < len; i++) { *p++ = d >> 8 * i; }
+        return p;
+    }
+
+    static unsigned char *putDouble(unsigned char *p, double v) {
+        uint64_t b;
+        std::memcpy(&b, &v, sizeof(b));
+        for (int i = 0; i < 8; i++) { *p++ = b >> 8 * i; }
+        return p;
+    }
+};
+
+}  // namespace histk
+
+#endif
@@ -0,0 +1,310 @@
+/* A client that pre-aggregates values for histk keys; see histkclient.h. */
+
+#include "errno.h"
+#include "netdb.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "time.h"
+#include "unistd.h"
+#include "sys/socket.h"
+
+#include "histkclient.h"
+#include "libhistk.h"
+
+#define HISTK_CLIENT_INITIAL_BUCKETS 16
+#define HISTK_CLIENT_READ_SIZE 4096
+
+// The sketch for one key, in a chain of keys that hash to the same bucket.
+struct HistKClientKey {
+    struct HistKClientKey *next;
+    struct HistK *h;
+    size_t keylen;
+    char key[];
+};
+
+struct HistKClient {
+    struct HistKClientOptions options;
+    // A hash table of the keys recorded since the last flush, chained, with a
+    // power of two buckets.
+    struct HistKClientKey **buckets;
+    size_t numBuckets;
+    size_t numKeys;
+    long long values;
+    long long lastFlush;
+    // Reused from flush to flush: the commands to send, and one sketch as
+    // HISTK.DUMP encodes it.
+    char *out;
+    size_t outCap;
+    unsigned char *dump;
+    size_t dumpCap;
+};
+
+static long long millis(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// FNV-1a.
+static size_t hashKey(const char *key, size_t keylen) {
+    uint64_t x = 14695981039346656037ULL;
+    for (size_t i = 0; i < keylen; i++) {
+        x = (x ^ (unsigned char)key[i]) * 1099511628211ULL;
+    }
+    return x;
+}
+
+struct HistKClient *createHistKClient(const struct HistKClientOptions *o) {
+    struct HistKClient *c = calloc(1, sizeof(*c));
+    c->options = *o;
+    if (c->options.maxCentroids == 0) {
+        c->options.maxCentroids = HISTK_DEFAULT_NUM_CENTROIDS;
+    }
+    c->numBuckets = HISTK_CLIENT_INITIAL_BUCKETS;
+    c->buckets = calloc(c->numBuckets, sizeof(*c->buckets));
+    c->lastFlush = millis();
+    return c;
+}
+
+// Forget every key recorded since the last flush.
+static void clearKeys(struct HistKClient *c) {
+    for (size_t i = 0; i < c->numBuckets; i++) {
+        struct HistKClientKey *k = c->buckets[i];
+        while (k != NULL) {
+            struct HistKClientKey *next = k->next;
+            freeHistK(k->h);
+            free(k);
+            k = next;
+        }
+        c->buckets[i] = NULL;
+    }
+    c->numKeys = 0;
+    c->values = 0;
+}
+
+void freeHistKClient(struct HistKClient *c) {
+    clearKeys(c);
+    free(c->buckets);
+    free(c->out);
+    free(c->dump);
+    free(c);
+}
+
+// Double the number of buckets once there are more keys than buckets.
+static void growBuckets(struct HistKClient *c) {
+    size_t n = c->numBuckets * 2;
+    struct HistKClientKey **buckets = calloc(n, sizeof(*buckets));
+    for (size_t i = 0; i < c->numBuckets; i++) {
+        struct HistKClientKey *k = c->buckets[i];
+        while (k != NULL) {
+            struct HistKClientKey *next = k->next;
+            size_t b = hashKey(k->key, k->keylen) & (n - 1);
+            k->next = buckets[b];
+            buckets[b] = k;
+            k = next;
+        }
+    }
+    free(c->buckets);
+    c->buckets = buckets;
+    c->numBuckets = n;
+}
+
+// Return the entry for key, adding one with an empty sketch if there's none.
+static struct HistKClientKey *lookupKey(struct HistKClient *c,
+                                        const char *key, size_t keylen) {
+    size_t b = hashKey(key, keylen) & (c->numBuckets - 1);
+    for (struct HistKClientKey *k = c->buckets[b]; k != NULL; k = k->next) {
+        if (k->keylen == keylen && memcmp(k->key, key, keylen) == 0) {
+            return k;
+        }
+    }
+    if (c->numKeys >= c->numBuckets) {
+        growBuckets(c);
+        b = hashKey(key, keylen) & (c->numBuckets - 1);
+    }
+    struct HistKClientKey *k = malloc(sizeof(*k) + keylen);
+    k->h = createHistK(c->options.maxCentroids, c->options.valueType);
+    k->keylen = keylen;
+    memcpy(k->key, key, keylen);
+    k->next = c->buckets[b];
+    c->buckets[b] = k;
+    c->numKeys++;
+    return k;
+}
+
+static int flushDue(const struct HistKClient *c) {
+    if (c->values == 0) { return 0; }
+    if (c->options.flushValues > 0 && c->values >= c->options.flushValues) {
+        return 1;
+    }
+    return c->options.flushMillis > 0 &&
+        millis() - c->lastFlush >= c->options.flushMillis;
+}
+
+int histkClientRecord(struct HistKClient *c, const char *key, size_t keylen,
+                      double value, unsigned long long count) {
+    struct HistKClientKey *k = lookupKey(c, key, keylen);
+    int e;
+    while ((e = histkAdd(k->h, value, count)) != HISTK_OK) {
+        struct HistK *nh = e == HISTK_ERR_FULL ?
+            growHistK(k->h, k->h->numCentroids + 1) : widenHistK(k->h);
+        freeHistK(k->h);
+        k->h = nh;
+    }
+    c->values++;
+    return histkClientPoll(c);
+}
+
+int histkClientPoll(struct HistKClient *c) {
+    return flushDue(c) ? histkClientFlush(c) : 0;
+}
+
+// Make room for n more bytes in the commands to send.
+static void reserveOut(struct HistKClient *c, size_t used, size_t n) {
+    if (used + n <= c->outCap) { return; }
+    c->outCap = c->outCap * 2 > used + n ? c->outCap * 2 : used + n;
+    c->out = realloc(c->out, c->outCap);
+}
+
+// Append a RESP bulk string holding the len bytes at s.
+static size_t appendBulk(struct HistKClient *c, size_t used, const void *s,
+                         size_t len) {
+    reserveOut(c, used, len + 32);
+    used += sprintf(c->out + used, "$%zu\r\n", len);
+    memcpy(c->out + used, s, len);
+    used += len;
+    c->out[used++] = '\r';
+    c->out[used++] = '\n';
+    return used;
+}
+
+// Encode HISTK.MERGEBLOB key <sketch> for k.
+static size_t appendMergeBlob(struct HistKClient *c, size_t used,
+                              const struct HistKClientKey *k) {
+    size_t n = 1 + serializedSize(k->h);
+    if (n > c->dumpCap) {
+        c->dumpCap = n;
+        c->dump = realloc(c->dump, n);
+    }
+    c->dump[0] = HISTK_DUMP_VERSION;
+    n = 1 + serializeHistK(k->h, c->dump + 1);
+    reserveOut(c, used, 4);
+    used += sprintf(c->out + used, "*3\r\n");
+    used = appendBulk(c, used, "HISTK.MERGEBLOB", 15);
+    used = appendBulk(c, used, k->key, k->keylen);
+    return appendBulk(c, used, c->dump, n);
+}
+
+int histkClientFlush(struct HistKClient *c) {
+    c->lastFlush = millis();
+    if (c->numKeys == 0) { return 0; }
+    size_t used = 0;
+    for (size_t i = 0; i < c->numBuckets; i++) {
+        for (struct HistKClientKey *k = c->buckets[i]; k != NULL;
+             k = k->next) {
+            used = appendMergeBlob(c, used, k);
+        }
+    }
+    int commands = c->numKeys;
+    clearKeys(c);
+    return c->options.send(c->options.sendArg, c->out, used, commands);
+}
+
+int histkClientConnect(const char *host, int port) {
+    struct addrinfo hints = {0}, *res;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &res) != 0) { return -1; }
+    int fd = -1;
+    for (struct addrinfo *a = res; a != NULL; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd == -1) { continue; }
+        if (connect(fd, a->ai_addr, a->ai_addrlen) == 0) { break; }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+// Buffered reads of replies from a socket.
+struct ReplyReader {
+    int fd;
+    char buf[HISTK_CLIENT_READ_SIZE];
+    size_t pos;
+    size_t len;
+};
+
+// Return the next byte from r, or -1 if the socket fails.
+static int readByte(struct ReplyReader *r) {
+    if (r->pos == r->len) {
+        ssize_t n;
+        do {
+            n = read(r->fd, r->buf, sizeof(r->buf));
+        } while (n == -1 && errno == EINTR);
+        if (n <= 0) { return -1; }
+        r->pos = 0;
+        r->len = n;
+    }
+    return (unsigned char)r->buf[r->pos++];
+}
+
+// Read up to the next CRLF, keeping the first size - 1 bytes of the line in
+// line. Returns 0, or -1 if the socket fails.
+static int readLine(struct ReplyReader *r, char *line, size_t size) {
+    size_t n = 0;
+    int b, prev = 0;
+    while ((b = readByte(r)) != -1) {
+        if (prev == '\r' && b == '\n') {
+            line[n > 0 ? n - 1 : 0] = '\0';
+            return 0;
+        }
+        if (n < size - 1) { line[n++] = b; }
+        prev = b;
+    }
+    return -1;
+}
+
+// Read one reply, setting *failed if it is or holds an error. Returns 0, or
+// -1 if the socket fails.
+static int readReply(struct ReplyReader *r, int *failed) {
+    char line[64];
+    if (readLine(r, line, sizeof(line)) == -1) { return -1; }
+    long long n = atoll(line + 1);
+    switch (line[0]) {
+    case '-':
+        *failed = 1;
+        return 0;
+    case '$':
+        for (long long i = 0; i < n + 2; i++) {
+            if (readByte(r) == -1) { return -1; }
+        }
+        return 0;
+    case '*':
+        for (long long i = 0; i < n; i++) {
+            if (readReply(r, failed) == -1) { return -1; }
+        }
+        return 0;
+    default:
+        return 0;
+    }
+}
+
+int histkClientSendFd(void *fd, const char *buf, size_t len, int commands) {
+    struct ReplyReader r = {.fd = *(int *)fd};
+    while (len > 0) {
+        ssize_t n = write(r.fd, buf, len);
+        if (n == -1 && errno == EINTR) { continue; }
+        if (n <= 0) { return -1; }
+        buf += n;
+        len -= n;
+    }
+    int failed = 0;
+    for (int i = 0; i < commands; i++) {
+        if (readReply(&r, &failed) == -1) { return -1; }
+    }
+    return failed ? -1 : 0;
+}
@@ -0,0 +1,84 @@
+/* histkclient: pre-aggregates values for histk keys in the process that
+ * records them and ships them to Redis in batches. Each key's values go into
+ * a libhistk sketch of its own, and a flush sends every sketch to its key
+ * with HISTK.MERGEBLOB, all in one pipeline, so Redis merges a few dozen
+ * centroids per key instead of running HISTK.ADD once per value.
+ *
+ * The client doesn't open connections or start threads: it hands each flush
+ * to a send function as RESP-encoded commands. histkClientSendFd sends over
+ * a socket from histkClientConnect, and histkClientSendHiredis, declared when
+ * hiredis.h is included first, over a hiredis connection. A client isn't
+ * safe to use from several threads at once.
+ */
+
+#ifndef HISTKCLIENT_H
+#define HISTKCLIENT_H
+
+#include "stddef.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct HistKClientOptions {
+    // The size and value type of each key's sketch, as in createHistK.
+    // A maxCentroids of 0 means HISTK_DEFAULT_NUM_CENTROIDS.
+    unsigned short int maxCentroids;
+    unsigned char valueType;
+    // Flush once this many milliseconds have passed since the last flush, or
+    // once this many values have been recorded since then. 0 turns either
+    // off. Both are checked by histkClientRecord and histkClientPoll.
+    long long flushMillis;
+    long long flushValues;
+    // Send the len bytes at buf, which hold `commands` RESP-encoded commands,
+    // and read their replies. Returns 0 if every command succeeded.
+    int (*send)(void *arg, const char *buf, size_t len, int commands);
+    void *sendArg;
+};
+
+struct HistKClient;
+
+struct HistKClient *createHistKClient(const struct HistKClientOptions *o);
+// Free c and every value it hasn't flushed yet.
+void freeHistKClient(struct HistKClient *c);
+// Record count occurrences of value in the sketch in key, then flush if one
+// is due. Returns 0, or what send returned if a flush failed.
+int histkClientRecord(struct HistKClient *c, const char *key, size_t keylen,
+                      double value, unsigned long long count);
+// Flush if one is due. Clients that record in bursts should call this from
+// a timer, since nothing else flushes values recorded before a quiet spell.
+int histkClientPoll(struct HistKClient *c);
+// Send what has been recorded since the last flush and start over. Values are
+// dropped if send fails, since some of the commands may have succeeded.
+// Returns 0, or what send returned.
+int histkClientFlush(struct HistKClient *c);
+
+// Return a blocking TCP socket connected to Redis at host:port, or -1.
+int histkClientConnect(const char *host, int port);
+// A send function for sockets: fd points to an int holding the socket.
+// Returns -1 if the socket fails or any command replies with an error.
+int histkClientSendFd(void *fd, const char *buf, size_t len, int commands);
+
+#ifdef __cplusplus
+}
+#endif
+
+// hiredis takes RESP-encoded commands as they are, so a flush goes out as
+// one write. Pass the redisContext as sendArg.
+#ifdef __HIREDIS_H
+static inline int histkClientSendHiredis(void *ctx, const char *buf,
+                                         size_t len, int commands) {
+    redisContext *c = (redisContext *)ctx;
+    if (redisAppendFormattedCommand(c, buf, len) != REDIS_OK) { return -1; }
+    int err = 0;
+    for (int i = 0; i < commands; i++) {
+        redisReply *r;
+        if (redisGetReply(c, (void **)&r) != REDIS_OK) { return -1; }
+        if (r->type == REDIS_REPLY_ERROR) { err = -1; }
+        freeReplyObject(r);
+    }
+    return err;
+}
+#endif
+
+#endif
@@ -0,0 +1,503 @@
+/* KLL sketches; see kll.h. */
+
+#include "float.h"
+#include "math.h"
+#include "stdlib.h"
+#include "string.h"
+
+#include "encoding.h"
+#include "kll.h"
+
+// Nonzero, as xorshift needs.
+#define KLL_SEED 88172645463325252ULL
+
+// The capacity of a level with depth levels above it: k * (2/3)^depth,
+// rounded, and at least KLL_MIN_LEVEL_CAPACITY.
+static uint32_t depthCapacity(int k, int depth) {
+    // k * (2/3)^31 is below the minimum for every k.
+    if (depth > 30) { return KLL_MIN_LEVEL_CAPACITY; }
+    uint64_t pow3 = 1;
+    for (int i = 0; i < depth; i++) { pow3 *= 3; }
+    uint64_t c = ((((uint64_t)2 * k) << depth) / pow3 + 1) >> 1;
+    return c > KLL_MIN_LEVEL_CAPACITY ? c : KLL_MIN_LEVEL_CAPACITY;
+}
+
+static uint32_t levelCapacity(int k, int numLevels, int h) {
+    return depthCapacity(k, numLevels - h - 1);
+}
+
+static uint32_t totalCapacity(int k, int numLevels) {
+    uint32_t total = 0;
+    for (int d = 0; d < numLevels; d++) { total += depthCapacity(k, d); }
+    return total;
+}
+
+static int coinFlip(struct KLLSketch *s) {
+    s->random ^= s->random << 13;
+    s->random ^= s->random >> 7;
+    s->random ^= s->random << 17;
+    return s->random >> 63;
+}
+
+static int compareDoubles(const void *x, const void *y) {
+    double a = *(const double *)x, b = *(const double *)y;
+    return a < b ? -1 : a > b;
+}
+
+static struct KLLSketch *allocKLLSketch(int k, int numLevels) {
+    struct KLLSketch *s = histkAllocator()->alloc(sizeof(*s));
+    s->k = k;
+    s->numLevels = numLevels;
+    s->totalCount = 0;
+    s->min = DBL_MAX;
+    s->max = -DBL_MAX;
+    s->random = KLL_SEED;
+    s->capacity = totalCapacity(k, numLevels);
+    s->items = histkAllocator()->alloc(s->capacity * sizeof(double));
+    s->levels = histkAllocator()->alloc((numLevels + 1) * sizeof(uint32_t));
+    return s;
+}
+
+struct KLLSketch *createKLLSketch(int k) {
+    struct KLLSketch *s = allocKLLSketch(k, 1);
+    s->levels[0] = s->levels[1] = s->capacity;
+    return s;
+}
+
+struct KLLSketch *copyKLLSketch(const struct KLLSketch *s) {
+    struct KLLSketch *c = allocKLLSketch(s->k, s->numLevels);
+    c->totalCount = s->totalCount;
+    c->min = s->min;
+    c->max = s->max;
+    c->random = s->random;
+    memcpy(c->items, s->items, s->capacity * sizeof(double));
+    memcpy(c->levels, s->levels, (s->numLevels + 1) * sizeof(uint32_t));
+    return c;
+}
+
+void freeKLLSketch(struct KLLSketch *s) {
+    histkAllocator()->free(s->items);
+    histkAllocator()->free(s->levels);
+    histkAllocator()->free(s);
+}
+
+size_t kllMemUsage(const struct KLLSketch *s) {
+    return sizeof(*s) + s->capacity * sizeof(double) +
+        (s->numLevels + 1) * sizeof(uint32_t);
+}
+
+static uint32_t levelSize(const struct KLLSketch *s, int h) {
+    return s->levels[h + 1] - s->levels[h];
+}
+
+static uint32_t numRetained(const struct KLLSketch *s) {
+    return s->levels[s->numLevels] - s->levels[0];
+}
+
+// Add an empty level on top, growing the items to make room for it below
+// level 0.
+static void addTopLevel(struct KLLSketch *s) {
+    uint32_t capacity = totalCapacity(s->k, s->numLevels + 1);
+    uint32_t delta = capacity - s->capacity;
+    s->items = histkAllocator()->realloc(s->items, capacity * sizeof(double));
+    memmove(s->items + s->levels[0] + delta, s->items + s->levels[0],
+            numRetained(s) * sizeof(double));
+    s->levels = histkAllocator()->realloc(
+        s->levels, (s->numLevels + 2) * sizeof(uint32_t));
+    for (int h = 0; h <= s->numLevels; h++) { s->levels[h] += delta; }
+    s->levels[++s->numLevels] = capacity;
+    s->capacity = capacity;
+}
+
+// Keep every other one of the n items from start, starting with the first or
+// second at random, in the first (down) or last (up) n / 2 places.
+static void halveDown(struct KLLSketch *s, double *items, uint32_t n) {
+    for (uint32_t i = 0, j = coinFlip(s); i < n / 2; i++, j += 2) {
+        items[i] = items[j];
+    }
+}
+
+static void halveUp(struct KLLSketch *s, double *items, uint32_t n) {
+    for (uint32_t i = n, j = n - coinFlip(s); i > n - n / 2; i--, j -= 2) {
+        items[i - 1] = items[j - 1];
+    }
+}
+
+// Merge the sorted na items at a and nb at b into out, which may overlap b
+// as long as it starts no later than b - na.
+static void mergeSorted(const double *a, uint32_t na, const double *b,
+                        uint32_t nb, double *out) {
+    uint32_t i = 0, j = 0;
+    while (i < na && j < nb) {
+        *out++ = b[j] < a[i] ? b[j++] : a[i++];
+    }
+    while (i < na) { *out++ = a[i++]; }
+    while (j < nb) { *out++ = b[j++]; }
+}
+
+// Compact level h of the items in in, given by levels, which has room for
+// the level above the top: the odd item out, if any, is left in its place,
+// and half the rest move up into level h + 1. Returns how many items went.
+static uint32_t compactLevel(struct KLLSketch *s, double *in,
+                             uint32_t *levels, int h, int sorted) {
+    uint32_t begin = levels[h], end = levels[h + 1];
+    uint32_t above = levels[h + 2] - end;
+    uint32_t odd = (end - begin) & 1, n = end - begin - odd;
+    double *items = in + begin + odd;
+    if (!sorted) { qsort(items, n, sizeof(*items), compareDoubles); }
+    if (above == 0) {
+        halveUp(s, items, n);
+    } else {
+        halveDown(s, items, n);
+        mergeSorted(items, n / 2, in + end, above, items + n / 2);
+    }
+    levels[h + 1] -= n / 2;
+    return n / 2;
+}
+
+// Make room in a full sketch by compacting its lowest level that's at or
+// over capacity, as there must be one. That's never level 63: its items each
+// stand for 2^63 values, and the total count can't reach 2^64, so it holds
+// at most one, and no level above it is ever added.
+static void compress(struct KLLSketch *s) {
+    int h = 0;
+    while (levelSize(s, h) < levelCapacity(s->k, s->numLevels, h)) { h++; }
+    if (h == s->numLevels - 1) { addTopLevel(s); }
+    uint32_t begin = s->levels[h], odd = levelSize(s, h) & 1;
+    uint32_t freed = compactLevel(s, s->items, s->levels, h, h > 0);
+    // The odd item out, if any, stays just below level h + 1.
+    s->levels[h] = s->levels[h + 1] - odd;
+    if (odd) { s->items[s->levels[h]] = s->items[begin]; }
+    // Move the levels below up into the space that freed.
+    if (h > 0) {
+        memmove(s->items + s->levels[0] + freed, s->items + s->levels[0],
+                (begin - s->levels[0]) * sizeof(double));
+        for (int i = 0; i < h; i++) { s->levels[i] += freed; }
+    }
+}
+
+// Add value as an item of level h, standing for 2^h values.
+static void insert(struct KLLSketch *s, double value, int h) {
+    while (s->numLevels <= h) { addTopLevel(s); }
+    if (s->levels[0] == 0) { compress(s); }
+    if (h == 0) {
+        s->items[--s->levels[0]] = value;
+        return;
+    }
+    // Move the levels below h down to free the place before level h, then
+    // insert value where it goes in order.
+    memmove(s->items + s->levels[0] - 1, s->items + s->levels[0],
+            (s->levels[h] - s->levels[0]) * sizeof(double));
+    for (int i = 0; i <= h; i++) { s->levels[i]--; }
+    uint32_t i = s->levels[h];
+    for (; i + 1 < s->levels[h + 1] && s->items[i + 1] < value; i++) {
+        s->items[i] = s->items[i + 1];
+    }
+    s->items[i] = value;
+}
+
+// A count is added as one item at each level whose bit is set in it.
+void kllAdd(struct KLLSketch *s, double value, unsigned long long count) {
+    if (count > UINT64_MAX - s->totalCount) {
+        count = UINT64_MAX - s->totalCount;
+    }
+    s->totalCount += count;
+    if (value < s->min) { s->min = value; }
+    if (value > s->max) { s->max = value; }
+    for (int h = 0; count > 0; h++, count >>= 1) {
+        if (count & 1) { insert(s, value, h); }
+    }
+}
+
+int kllMerge(struct KLLSketch *dst, const struct KLLSketch *src) {
+    if (dst->k != src->k) { return HISTK_ERR_INVALID; }
+    if (src->totalCount == 0) { return HISTK_OK; }
+    if (src->totalCount > UINT64_MAX - dst->totalCount) {
+        return HISTK_ERR_OVERFLOW;
+    }
+    // Gather both sketches' items level by level, keeping levels above 0
+    // sorted, with room in levels for two levels above the top.
+    int numLevels = dst->numLevels > src->numLevels ?
+        dst->numLevels : src->numLevels;
+    uint32_t n = numRetained(dst) + numRetained(src);
+    double *in = histkAllocator()->alloc(n * sizeof(double));
+    double *out = histkAllocator()->alloc(n * sizeof(double));
+    uint32_t levels[KLL_MAX_LEVELS + 3], outLevels[KLL_MAX_LEVELS + 2];
+    levels[0] = 0;
+    for (int h = 0; h < numLevels; h++) {
+        const double *a = dst->items, *b = src->items;
+        uint32_t na = 0, nb = 0;
+        if (h < dst->numLevels) {
+            a += dst->levels[h];
+            na = levelSize(dst, h);
+        }
+        if (h < src->numLevels) {
+            b += src->levels[h];
+            nb = levelSize(src, h);
+        }
+        if (h == 0) {
+            memcpy(in, a, na * sizeof(double));
+            memcpy(in + na, b, nb * sizeof(double));
+        } else {
+            mergeSorted(a, na, b, nb, in + levels[h]);
+        }
+        levels[h + 1] = levels[h] + na + nb;
+    }
+
+    // Going up from level 0, compact each level at or over capacity while
+    // the items don't fit, into out.
+    uint32_t target = totalCapacity(dst->k, numLevels);
+    outLevels[0] = 0;
+    for (int h = 0; h < numLevels; h++) {
+        if (h == numLevels - 1) { levels[h + 2] = levels[h + 1]; }
+        uint32_t begin = levels[h], size = levels[h + 1] - begin;
+        if (n < target || size < levelCapacity(dst->k, numLevels, h) ||
+            h == KLL_MAX_LEVELS - 1) {
+            memcpy(out + outLevels[h], in + begin, size * sizeof(double));
+            outLevels[h + 1] = outLevels[h] + size;
+            continue;
+        }
+        // The odd item out, if any, stays.
+        if (size & 1) { out[outLevels[h]] = in[begin]; }
+        outLevels[h + 1] = outLevels[h] + (size & 1);
+        n -= compactLevel(dst, in, levels, h, h > 0);
+        if (h == numLevels - 1) {
+            numLevels++;
+            target += depthCapacity(dst->k, numLevels - 1);
+        }
+    }
+
+    // Place the items at the top of dst's items.
+    uint32_t capacity = totalCapacity(dst->k, numLevels);
+    uint32_t free = capacity - n;
+    histkAllocator()->free(dst->items);
+    dst->items = histkAllocator()->alloc(capacity * sizeof(double));
+    memcpy(dst->items + free, out, n * sizeof(double));
+    dst->levels = histkAllocator()->realloc(
+        dst->levels, (numLevels + 1) * sizeof(uint32_t));
+    for (int h = 0; h <= numLevels; h++) {
+        dst->levels[h] = outLevels[h] + free;
+    }
+    dst->numLevels = numLevels;
+    dst->capacity = capacity;
+    dst->totalCount += src->totalCount;
+    if (src->min < dst->min) { dst->min = src->min; }
+    if (src->max > dst->max) { dst->max = src->max; }
+    histkAllocator()->free(in);
+    histkAllocator()->free(out);
+    return HISTK_OK;
+}
+
+struct KLLWeighted {
+    double value;
+    uint64_t weight;
+};
+
+static int compareWeighted(const void *x, const void *y) {
+    const struct KLLWeighted *a = x, *b = y;
+    return a->value < b->value ? -1 : a->value > b->value;
+}
+
+void kllQuantiles(const struct KLLSketch *s, const double *qs, int n,
+                  double *out) {
+    // Sort the items with their weights, then sum the weights up so each
+    // holds the number of values up to its item.
+    uint32_t r = numRetained(s);
+    struct KLLWeighted *ws = histkAllocator()->alloc(r * sizeof(*ws));
+    for (int h = 0, i = 0; h < s->numLevels; h++) {
+        for (uint32_t j = s->levels[h]; j < s->levels[h + 1]; j++, i++) {
+            ws[i].value = s->items[j];
+            ws[i].weight = (uint64_t)1 << h;
+        }
+    }
+    qsort(ws, r, sizeof(*ws), compareWeighted);
+    for (uint32_t i = 1; i < r; i++) { ws[i].weight += ws[i - 1].weight; }
+    // Each quantile is the first item with q * totalCount values up to it.
+    for (int i = 0; i < n; i++) {
+        if (s->totalCount == 0) {
+            out[i] = NAN;
+            continue;
+        }
+        double rank = qs[i] * s->totalCount;
+        uint32_t lo = 0, hi = r - 1;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (ws[mid].weight < rank) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        out[i] = qs[i] <= 0 ? s->min : qs[i] >= 1 ? s->max : ws[lo].value;
+    }
+    histkAllocator()->free(ws);
+}
+
+double kllQuantile(const struct KLLSketch *s, double q) {
+    double v;
+    kllQuantiles(s, &q, 1, &v);
+    return v;
+}
+
+long long kllCountLessThanOrEqual(const struct KLLSketch *s, double v) {
+    if (s->totalCount == 0 || v < s->min) { return 0; }
+    if (v >= s->max) { return s->totalCount; }
+    uint64_t count = 0;
+    for (int h = 0; h < s->numLevels; h++) {
+        for (uint32_t j = s->levels[h]; j < s->levels[h + 1]; j++) {
+            count += (uint64_t)(s->items[j] <= v) << h;
+        }
+    }
+    return count;
+}
+
+// A sketch is serialized as k, its number of levels, its total count and
+// its random state as varints, its min and max, then the size of each
+// level as a varint followed by its items.
+size_t kllSerializedSize(const struct KLLSketch *s) {
+    return 4 * HISTK_VARINT_MAX + 8 + 8 +
+        s->numLevels * HISTK_VARINT_MAX + numRetained(s) * 8;
+}
+
+size_t serializeKLLSketch(const struct KLLSketch *s, unsigned char *buf) {
+    unsigned char *p = putVarint(buf, s->k);
+    p = putVarint(p, s->numLevels);
+    p = putVarint(p, s->totalCount);
+    p = putVarint(p, s->random);
+    p = putDouble(p, s->min);
+    p = putDouble(p, s->max);
+    for (int h = 0; h < s->numLevels; h++) {
+        p = putVarint(p, levelSize(s, h));
+        for (uint32_t j = s->levels[h]; j < s->levels[h + 1]; j++) {
+            p = putDouble(p, s->items[j]);
+        }
+    }
+    return p - buf;
+}
+
+struct KLLSketch *deserializeKLLSketch(const unsigned char *buf, size_t len) {
+    const unsigned char *p = buf, *end = buf + len;
+    uint64_t k, numLevels, total, random;
+    double min, max;
+    if ((p = getVarintBounded(p, end, &k)) == NULL ||
+        (p = getVarintBounded(p, end, &numLevels)) == NULL ||
+        (p = getVarintBounded(p, end, &total)) == NULL ||
+        (p = getVarintBounded(p, end, &random)) == NULL ||
+        (p = getDoubleBounded(p, end, &min)) == NULL ||
+        (p = getDoubleBounded(p, end, &max)) == NULL ||
+        k < KLL_MIN_K || k > KLL_MAX_K || numLevels < 1 ||
+        numLevels > KLL_MAX_LEVELS || random == 0 ||
+        (total > 0 && !(min <= max))) {
+        return NULL;
+    }
+    struct KLLSketch *s = allocKLLSketch(k, numLevels);
+    s->totalCount = total;
+    s->min = min;
+    s->max = max;
+    s->random = random;
+    // Read the levels into the bottom of the items, then move them up.
+    uint32_t n = 0;
+    uint64_t count = 0;
+    for (int h = 0; p != NULL && h < s->numLevels; h++) {
+        uint64_t size;
+        s->levels[h] = n;
+        // The items can't stand for more values than a count can hold.
+        if ((p = getVarintBounded(p, end, &size)) == NULL ||
+            size > s->capacity - n || size > (UINT64_MAX - count) >> h ||
+            (size_t)(end - p) < size * 8) {
+            p = NULL;
+            break;
+        }
+        for (uint32_t i = 0; i < size; i++, n++) {
+            p = getDouble(p, &s->items[n]);
+            // Levels above 0 are sorted, and only hold values in range.
+            if (!(s->items[n] >= min && s->items[n] <= max) ||
+                (h > 0 && i > 0 && s->items[n] < s->items[n - 1])) {
+                p = NULL;
+                break;
+            }
+        }
+        count += size << h;
+    }
+    if (p == NULL || p != end || count != total) {
+        freeKLLSketch(s);
+        return NULL;
+    }
+    uint32_t free = s->capacity - n;
+    memmove(s->items + free, s->items, n * sizeof(double));
+    for (int h = 0; h < s->numLevels; h++) { s->levels[h] += free; }
+    s->levels[s->numLevels] = s->capacity;
+    return s;
+}
+
+// The engine.
+
+static const struct HistKEngineOption kllOptions[] = {
+    {"K", KLL_MIN_K, KLL_MAX_K, KLL_DEFAULT_K, 1}
+};
+
+static void *engineCreate(const double *options) {
+    return createKLLSketch(options[0]);
+}
+
+static void *engineCopy(const void *s) {
+    return copyKLLSketch(s);
+}
+
+static void engineFree(void *s) {
+    freeKLLSketch(s);
+}
+
+static size_t engineMemUsage(const void *s) {
+    return kllMemUsage(s);
+}
+
+static void engineAdd(void *s, double value, unsigned long long count) {
+    kllAdd(s, value, count);
+}
+
+static unsigned long long engineTotalCount(const void *s) {
+    return ((const struct KLLSketch *)s)->totalCount;
+}
+
+static double engineQuantile(const void *s, double q) {
+    return kllQuantile(s, q);
+}
+
+static void engineQuantiles(const void *s, const double *qs, int n,
+                            double *out) {
+    kllQuantiles(s, qs, n, out);
+}
+
+static long long engineCount(const void *s, double v) {
+    return kllCountLessThanOrEqual(s, v);
+}
+
+static const char *engineMerge(void *dst, const void *src) {
+    switch (kllMerge(dst, src)) {
+    case HISTK_ERR_INVALID:
+        return "ERR can't merge KLL sketches with different K.";
+    case HISTK_ERR_OVERFLOW:
+        return "ERR the merged KLL sketch would count too many values.";
+    }
+    return NULL;
+}
+
+static size_t engineSerializedSize(const void *s) {
+    return kllSerializedSize(s);
+}
+
+static size_t engineSerialize(const void *s, unsigned char *buf) {
+    return serializeKLLSketch(s, buf);
+}
+
+static void *engineDeserialize(const unsigned char *buf, size_t len) {
+    return deserializeKLLSketch(buf, len);
+}
+
+const struct HistKEngine kllEngine = {
+    "kll", 4, kllOptions, 1,
+    engineCreate, engineCopy, engineFree, engineMemUsage, engineAdd,
+    engineTotalCount, engineQuantile, engineQuantiles, engineCount,
+    engineMerge, engineSerializedSize, engineSerialize, engineDeserialize
+};
@@ -0,0 +1,88 @@
+/* KLL sketches, as described in Karnin, Lang and Liberty's "Optimal Quantile
+ * Approximation in Streams" (https://arxiv.org/abs/1603.05346), with the
+ * layout and lazy compaction of the Apache DataSketches implementation, and
+ * the module's "kll" engine.
+ *
+ * A sketch keeps a stack of compactors, or levels: items at level h stand for
+ * 2^h values each. Values are added to level 0, and once the sketch is full
+ * the lowest level at or over its capacity is compacted: it's sorted, and
+ * every other item, starting at random, moves up a level while the rest are
+ * dropped. Level h has capacity about k * (2/3)^(depth), where depth counts
+ * the levels above it, so the sketch keeps about 3k items, and every rank is
+ * within about 1.65 / k of the true one (1.65% at the default k of 200) with
+ * high probability, whatever the values.
+ *
+ * All the levels share one array of items, with level 0 at the bottom, just
+ * above the free space, and levels above it sorted, so compacting a level
+ * only moves the ones below it up. The coin flips come from a generator kept
+ * in the sketch, so a sketch and its copies, replicas and restored dumps
+ * compact the same way.
+ */
+
+#ifndef KLL_H
+#define KLL_H
+
+#include "stddef.h"
+#include "stdint.h"
+
+#include "engine.h"
+#include "libhistk.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define KLL_DEFAULT_K 200
+#define KLL_MIN_K 8
+#define KLL_MAX_K 65535
+// The least capacity of any level.
+#define KLL_MIN_LEVEL_CAPACITY 8
+// Level 64 would hold items for 2^64 values.
+#define KLL_MAX_LEVELS 64
+
+struct KLLSketch {
+    int k;
+    int numLevels;
+    uint64_t totalCount;
+    // Only meaningful once the sketch holds values.
+    double min;
+    double max;
+    // The state of the xorshift coin flips come from.
+    uint64_t random;
+    // The number of items there's room for, and items. Level h is
+    // items[levels[h]] to items[levels[h + 1] - 1], and levels[numLevels] is
+    // capacity.
+    uint32_t capacity;
+    double *items;
+    uint32_t *levels;
+};
+
+struct KLLSketch *createKLLSketch(int k);
+struct KLLSketch *copyKLLSketch(const struct KLLSketch *s);
+void freeKLLSketch(struct KLLSketch *s);
+size_t kllMemUsage(const struct KLLSketch *s);
+
+// Counts past a total of 2^64 - 1 values are dropped.
+void kllAdd(struct KLLSketch *s, double value, unsigned long long count);
+// Add everything in src to dst, which may be src. Returns HISTK_OK, or,
+// leaving dst as it was, HISTK_ERR_INVALID if the two don't have the same k
+// or HISTK_ERR_OVERFLOW if together they count 2^64 or more values.
+int kllMerge(struct KLLSketch *dst, const struct KLLSketch *src);
+double kllQuantile(const struct KLLSketch *s, double q);
+// Sets out[i] to the qs[i]-quantile for each of the n qs, sorting the items
+// once for all of them.
+void kllQuantiles(const struct KLLSketch *s, const double *qs, int n,
+                  double *out);
+long long kllCountLessThanOrEqual(const struct KLLSketch *s, double v);
+
+size_t kllSerializedSize(const struct KLLSketch *s);
+size_t serializeKLLSketch(const struct KLLSketch *s, unsigned char *buf);
+struct KLLSketch *deserializeKLLSketch(const unsigned char *buf, size_t len);
+
+extern const struct HistKEngine kllEngine;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
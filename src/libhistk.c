@@ -0,0 +1,1333 @@
+/* An implementation of the Histogram Sketch data structure described in
+ * Ben-Haim and Tom-Tov's "A Streaming Parallel Decision Tree Algorithm" in
+ * Journal of Machine Learning Research 11
+ * (http://www.jmlr.org/papers/volume11/ben-haim10a/ben-haim10a.pdf).
+ *
+ * The histogram sketch consists of a fixed number of (value, count) centroids
+ * sorted by increasing value. Each time a value V is added to the sketch, it's
+ * either merged into an existing centroid with the same value or added as a
+ * (V, 1) centroid and then the two centroids in the sketch that have values
+ * closest together are merged. Quantiles and counts are estimated by finding
+ * the two centroids (V1, C1) and (V2, C2) in the sketch bordering the desired
+ * value and using the area under the trapezoid defined by (V1, 0), (V1, C1),
+ * (V2, 0), (V2, C2) to guide the estimate.
+ *
+ * This is the sketch itself, without Redis; see libhistk.h.
+ */
+
+#include "math.h"
+#include "pthread.h"
+#include "stdlib.h"
+#include "string.h"
+
+#include "encoding.h"
+#include "libhistk.h"
+
+#define HISTK_INITIAL_CAPACITY 4
+#define HISTK_EPSILON 10e-7
+
+static struct HistKAllocator allocator = {
+    malloc, realloc, free, malloc, free
+};
+
+void histkSetAllocator(const struct HistKAllocator *a) {
+    allocator = *a;
+    if (allocator.allocSketch == NULL) { allocator.allocSketch = a->alloc; }
+    if (allocator.freeSketch == NULL) { allocator.freeSketch = a->free; }
+}
+
+const struct HistKAllocator *histkAllocator(void) {
+    return &allocator;
+}
+
+// Return the number of bytes a sketch with room for n centroids needs.
+static size_t histkBytes(unsigned int n, unsigned char valueType,
+                         unsigned char countWidth) {
+    return sizeof(struct HistK) + countsOffset(valueType, n) + n * countWidth;
+}
+
+// Return the number of bytes to allocate for a sketch that needs b bytes.
+// jemalloc rounds every allocation up to a size class, four classes per
+// doubling above 64 bytes, so we ask for the whole class and use the slack for
+// extra centroids. Classes below 1KB are only used when they're multiples of
+// 64 bytes, which keeps the allocation aligned to a cache line.
+static size_t histkAllocSize(size_t b) {
+    size_t step = 64;
+    for (size_t p = 256; p < b; p *= 2) {
+        if (p / 4 > step) { step = p / 4; }
+    }
+    return (b + step - 1) / step * step;
+}
+
+// Allocate a sketch with room for at least n centroids in the given layout
+// with alloc. Only the layout fields of the header are initialized.
+static struct HistK *allocHistKWith(void *(*alloc)(size_t), unsigned int n,
+                                    unsigned char valueType,
+                                    unsigned char countWidth) {
+    size_t size = histkAllocSize(histkBytes(n, valueType, countWidth));
+    struct HistK *h = alloc(size);
+    unsigned int c = (size - sizeof(*h)) / (valueSize(valueType) + countWidth);
+    while (histkBytes(c, valueType, countWidth) > size) { c--; }
+    h->capacity = c;
+    h->valueType = valueType;
+    h->countWidth = countWidth;
+    return h;
+}
+
+struct HistK *allocHistK(unsigned int n, unsigned char valueType,
+                         unsigned char countWidth) {
+    return allocHistKWith(allocator.allocSketch, n, valueType, countWidth);
+}
+
+struct HistK *allocScratchHistK(unsigned int n, unsigned char valueType,
+                                unsigned char countWidth) {
+    return allocHistKWith(allocator.alloc, n, valueType, countWidth);
+}
+
+// Return a copy of the unpacked sketch h, allocated with alloc, with room for
+// at least n centroids in the given layout.
+static struct HistK *copyHistKWith(void *(*alloc)(size_t),
+                                   const struct HistK *h, unsigned int n,
+                                   unsigned char valueType,
+                                   unsigned char countWidth) {
+    if (n < h->numCentroids) { n = h->numCentroids; }
+    struct HistK *nh = allocHistKWith(alloc, n, valueType, countWidth);
+    nh->totalCount = h->totalCount;
+    nh->min = h->min;
+    nh->max = h->max;
+    nh->numCentroids = h->numCentroids;
+    nh->maxCentroids = h->maxCentroids;
+    if (valueType == h->valueType) {
+        memcpy(histkValues(nh), histkValues(h),
+               h->numCentroids * valueSize(valueType));
+    } else {
+        for (int i = 0; i < h->numCentroids; i++) {
+            setValue(nh, i, getValue(h, i));
+        }
+    }
+    if (countWidth == h->countWidth) {
+        memcpy(histkCounts(nh), histkCounts(h), h->numCentroids * countWidth);
+    } else {
+        for (int i = 0; i < h->numCentroids; i++) {
+            setCount(nh, i, getCount(h, i));
+        }
+    }
+    return nh;
+}
+
+// Return a copy of h with room for at least n centroids in the given layout.
+// h is left as is for the caller to free.
+struct HistK *copyHistK(const struct HistK *h, unsigned int n,
+                        unsigned char valueType, unsigned char countWidth) {
+    return copyHistKWith(allocator.allocSketch, h, n, valueType, countWidth);
+}
+
+struct HistK *createHistK(unsigned short int maxCentroids,
+                          unsigned char valueType) {
+    // Most sketches never see more than a few distinct values, so start small
+    // and let growHistK make room on demand.
+    struct HistK *h = allocHistK(maxCentroids < HISTK_INITIAL_CAPACITY ?
+                                 maxCentroids : HISTK_INITIAL_CAPACITY,
+                                 valueType, 1);
+    h->totalCount = 0;
+    h->numCentroids = 0;
+    h->min = DBL_MAX;
+    h->max = DBL_MIN;
+    h->maxCentroids = maxCentroids;
+    return h;
+}
+
+void freeHistK(struct HistK *h) {
+    if (isPacked(h)) {
+        allocator.free(h);
+    } else {
+        allocator.freeSketch(h);
+    }
+}
+
+// Return a copy of h with room for at least n centroids, where n is more than
+// h->capacity but at most h->maxCentroids. Capacity grows geometrically so
+// that filling a sketch only takes a logarithmic number of copies. h is left
+// as is for the caller to free.
+struct HistK *growHistK(const struct HistK *h, unsigned int n) {
+    unsigned int c = h->capacity * 2;
+    if (c < n) { c = n; }
+    if (c > h->maxCentroids) { c = h->maxCentroids; }
+    return copyHistK(h, c, h->valueType, h->countWidth);
+}
+
+// Return a copy of h with counts twice as wide, up to 64 bits. h is left as is
+// for the caller to free.
+struct HistK *widenHistK(const struct HistK *h) {
+    unsigned char countWidth = h->countWidth < 8 ? h->countWidth * 2 : 8;
+    return copyHistK(h, h->capacity, h->valueType, countWidth);
+}
+
+// Return a copy of h whose capacity is trimmed to what h->maxCentroids needs,
+// or NULL if h is already as small as its size class allows. h is left as is
+// for the caller to free.
+struct HistK *shrinkHistK(const struct HistK *h) {
+    if (histkAllocSize(histkBytes(h->maxCentroids, h->valueType,
+                                  h->countWidth)) >=
+        histkAllocSize(histkBytes(h->capacity, h->valueType,
+                                  h->countWidth))) {
+        return NULL;
+    }
+    return copyHistK(h, h->maxCentroids, h->valueType, h->countWidth);
+}
+
+// Return a copy of h that stores values as the given type, or NULL if it
+// already does. h is left as is for the caller to free.
+struct HistK *convertHistK(const struct HistK *h, unsigned char valueType) {
+    if (valueType == h->valueType) { return NULL; }
+    return copyHistK(h, h->numCentroids, valueType, h->countWidth);
+}
+
+// A sketch that's going to sit idle for a while can be packed into a smaller,
+// variable-length encoding of its centroids. A packed sketch keeps its header,
+// with a capacity of 0, followed by one entry per centroid: the difference
+// between its value and the previous centroid's, then its count as a varint.
+// Values are differenced as order-preserving integer keys (see valueKey), so
+// the differences between sorted values are small. Each difference is stored
+// as a length byte followed by its significant bytes, least significant first,
+// with any whole trailing zero bytes dropped: the low nibble of the length
+// byte is the number of bytes that follow and the high nibble is the number
+// of zero bytes dropped. Packed sketches have to be unpacked before they can
+// be read or updated.
+#define HISTK_PACKED_CENTROID_MAX (1 + 8 + 10)
+
+// Return the bits of the ith value of h as an unsigned integer that sorts in
+// the same order as the value.
+static inline uint64_t valueKey(const struct HistK *h, int i) {
+    if (h->valueType == HISTK_VALUES_FLOAT) {
+        uint32_t b;
+        memcpy(&b, (const float *)histkValues(h) + i, sizeof(b));
+        return b & 0x80000000u ? ~b : b | 0x80000000u;
+    }
+    uint64_t b;
+    memcpy(&b, (const double *)histkValues(h) + i, sizeof(b));
+    return b & 0x8000000000000000ull ? ~b : b | 0x8000000000000000ull;
+}
+
+// Return the value of the given type whose key (see valueKey) is k.
+static inline double keyValue(unsigned char valueType, uint64_t k) {
+    if (valueType == HISTK_VALUES_FLOAT) {
+        uint32_t b = k;
+        float f;
+        b = b & 0x80000000u ? b & 0x7fffffffu : ~b;
+        memcpy(&f, &b, sizeof(f));
+        return f;
+    }
+    double v;
+    k = k & 0x8000000000000000ull ? k & 0x7fffffffffffffffull : ~k;
+    memcpy(&v, &k, sizeof(v));
+    return v;
+}
+
+// Set the ith value of h to the value whose key (see valueKey) is k.
+static inline void setValueKey(struct HistK *h, int i, uint64_t k) {
+    setValue(h, i, keyValue(h->valueType, k));
+}
+
+static unsigned char *putDelta(unsigned char *p, uint64_t d) {
+    int skip = d == 0 ? 0 : __builtin_ctzll(d) / 8;
+    int n = 0;
+    d >>= 8 * skip;
+    for (uint64_t t = d; t != 0; t >>= 8) { n++; }
+    *p++ = skip << 4 | n;
+    for (int i = 0; i < n; i++) { *p++ = d >> 8 * i; }
+    return p;
+}
+
+static const unsigned char *getDelta(const unsigned char *p, uint64_t *d) {
+    int skip = *p >> 4;
+    int n = *p++ & 0xf;
+    *d = 0;
+    for (int i = 0; i < n; i++) { *d |= (uint64_t)*p++ << 8 * i; }
+    *d <<= 8 * skip;
+    return p;
+}
+
+// Return the number of bytes of packed centroids that follow the header of
+// the packed sketch h.
+static size_t packedBytes(const struct HistK *h) {
+    const unsigned char *p = h->data;
+    for (int i = 0; i < h->numCentroids; i++) {
+        p += 1 + (*p & 0xf);
+        while (*p++ & 0x80) {}
+    }
+    return p - h->data;
+}
+
+// Return the number of bytes h takes up.
+size_t histkMemUsage(const struct HistK *h) {
+    if (isPacked(h)) { return sizeof(*h) + packedBytes(h); }
+    return histkAllocSize(histkBytes(h->capacity, h->valueType,
+                                     h->countWidth));
+}
+
+// Write centroids [from, to) of the unpacked sketch h to p in packed form. p
+// must have room for HISTK_PACKED_CENTROID_MAX bytes per centroid. Returns a
+// pointer just past the last byte written.
+static unsigned char *packCentroids(const struct HistK *h, int from, int to,
+                                    unsigned char *p) {
+    uint64_t prev = 0;
+    for (int i = from; i < to; i++) {
+        uint64_t k = valueKey(h, i);
+        p = putDelta(p, k - prev);
+        p = putVarint(p, getCount(h, i));
+        prev = k;
+    }
+    return p;
+}
+
+// Read n packed centroids from p into the unpacked sketch h, starting at
+// centroid from. Returns a pointer just past the last byte read.
+static const unsigned char *unpackCentroids(struct HistK *h, int from, int n,
+                                            const unsigned char *p) {
+    uint64_t k = 0;
+    for (int i = from; i < from + n; i++) {
+        uint64_t d, c;
+        p = getDelta(p, &d);
+        p = getVarint(p, &c);
+        k += d;
+        setValueKey(h, i, k);
+        setCount(h, i, c);
+    }
+    return p;
+}
+
+// Return a packed copy of h, or NULL if packing h wouldn't make it any
+// smaller. h is left as is for the caller to free.
+struct HistK *packHistK(const struct HistK *h) {
+    struct HistK *ph = allocator.alloc(
+        sizeof(*h) + h->numCentroids * HISTK_PACKED_CENTROID_MAX);
+    memcpy(ph, h, sizeof(*h));
+    ph->capacity = 0;
+    size_t size = packCentroids(h, 0, h->numCentroids, ph->data) -
+        (unsigned char *)ph;
+    if (size >= histkMemUsage(h)) {
+        allocator.free(ph);
+        return NULL;
+    }
+    return allocator.realloc(ph, size);
+}
+
+// Return an unpacked copy of the packed sketch h, allocated with alloc, with
+// room for at least n centroids and counts countWidth bytes wide, which must
+// be at least as wide as h's.
+static struct HistK *unpackHistKWith(void *(*alloc)(size_t),
+                                     const struct HistK *h, unsigned int n,
+                                     unsigned char countWidth) {
+    if (n < h->numCentroids) { n = h->numCentroids; }
+    struct HistK *nh = allocHistKWith(alloc, n, h->valueType, countWidth);
+    nh->totalCount = h->totalCount;
+    nh->min = h->min;
+    nh->max = h->max;
+    nh->numCentroids = h->numCentroids;
+    nh->maxCentroids = h->maxCentroids;
+    unpackCentroids(nh, 0, h->numCentroids, h->data);
+    return nh;
+}
+
+// Return an unpacked copy of the packed sketch h, with room for just the
+// centroids it has. h is left as is for the caller to free.
+struct HistK *unpackHistK(const struct HistK *h) {
+    return unpackHistKWith(allocator.allocSketch, h, h->numCentroids,
+                           h->countWidth);
+}
+
+// Return an unpacked scratch copy of h, packed or not, with room for at least
+// n centroids and counts countWidth bytes wide, which must be at least as wide
+// as h's. h is left as is for the caller to free.
+struct HistK *scratchCopyHistK(const struct HistK *h, unsigned int n,
+                               unsigned char countWidth) {
+    return isPacked(h) ? unpackHistKWith(allocator.alloc, h, n, countWidth) :
+        copyHistKWith(allocator.alloc, h, n, h->valueType, countWidth);
+}
+
+// Like getDelta, but return NULL rather than read past end.
+static const unsigned char *getDeltaBounded(const unsigned char *p,
+                                            const unsigned char *end,
+                                            uint64_t *d) {
+    if (p >= end) { return NULL; }
+    int skip = *p >> 4;
+    int n = *p & 0xf;
+    if (skip + n > 8 || end - p - 1 < n) { return NULL; }
+    return getDelta(p, d);
+}
+
+// Check that h->numCentroids packed centroids start at p and end by end, with
+// increasing values that aren't NaNs, from h->min to h->max, and counts that
+// fit in h->countWidth bytes. Sets *total to the sum of their counts. Returns
+// a pointer just past them, or NULL if they don't check out.
+static const unsigned char *checkPackedCentroids(const struct HistK *h,
+                                                 const unsigned char *p,
+                                                 const unsigned char *end,
+                                                 uint64_t *total) {
+    // The keys of -inf and inf (see valueKey); NaNs are outside them.
+    uint64_t lo = 0x000fffffffffffffull, hi = 0xfff0000000000000ull;
+    if (h->valueType == HISTK_VALUES_FLOAT) {
+        lo = 0x007fffffu;
+        hi = 0xff800000u;
+    }
+    uint64_t k = 0, first = 0;
+    *total = 0;
+    for (int i = 0; i < h->numCentroids; i++) {
+        uint64_t d, c;
+        // Keys strictly increase, so every delta is positive and none wraps.
+        if ((p = getDeltaBounded(p, end, &d)) == NULL ||
+            (p = getVarintBounded(p, end, &c)) == NULL ||
+            d == 0 || k + d < k || k + d < lo || k + d > hi ||
+            c == 0 || c > countLimit(h->countWidth)) {
+            return NULL;
+        }
+        k += d;
+        if (i == 0) { first = k; }
+        // Like totalCount, this wraps if the counts add up past UINT64_MAX.
+        *total += c;
+    }
+    if (h->numCentroids > 0) {
+        // Float sketches round values, but not min and max, to floats.
+        double min = h->min, max = h->max;
+        if (h->valueType == HISTK_VALUES_FLOAT) {
+            min = toFloatValue(min);
+            max = toFloatValue(max);
+        }
+        if (!(keyValue(h->valueType, first) >= min &&
+              keyValue(h->valueType, k) <= max)) {
+            return NULL;
+        }
+    }
+    return p;
+}
+
+// The most bytes serializeHistK writes before a sketch's packed centroids.
+#define HISTK_SERIALIZED_HEADER_MAX (3 + 3 + 1 + 1 + 10 + 8 + 8)
+
+// Write the header of h to p as serializeHistK does, but with numCentroids
+// set to n. Returns a pointer just past the last byte written.
+static unsigned char *putSerializedHeader(unsigned char *p,
+                                          const struct HistK *h, int n) {
+    p = putVarint(p, h->maxCentroids);
+    p = putVarint(p, n);
+    *p++ = h->valueType;
+    *p++ = h->countWidth;
+    p = putVarint(p, h->totalCount);
+    p = putDouble(p, h->min);
+    p = putDouble(p, h->max);
+    return p;
+}
+
+// Return the most bytes serializeHistK can write for h.
+size_t serializedSize(const struct HistK *h) {
+    return HISTK_SERIALIZED_HEADER_MAX + (isPacked(h) ? packedBytes(h) :
+        (size_t)h->numCentroids * HISTK_PACKED_CENTROID_MAX);
+}
+
+// Write h, packed or not, to buf as a byte string that deserializeHistK can
+// read back on any platform: maxCentroids and numCentroids as varints, the
+// value type and count width as a byte each, totalCount as a varint, min and
+// max as little-endian doubles, then the packed centroids (see packHistK).
+// buf must have room for serializedSize(h) bytes. Returns the number of bytes
+// written.
+size_t serializeHistK(const struct HistK *h, unsigned char *buf) {
+    unsigned char *p = putSerializedHeader(buf, h, h->numCentroids);
+    if (isPacked(h)) {
+        size_t n = packedBytes(h);
+        memcpy(p, h->data, n);
+        p += n;
+    } else {
+        p = packCentroids(h, 0, h->numCentroids, p);
+    }
+    return p - buf;
+}
+
+// Read a header written by putSerializedHeader from the bytes in [p, end)
+// into h, which is marked packed. Returns a pointer just past the header, or
+// NULL if it isn't valid.
+static const unsigned char *getSerializedHeader(const unsigned char *p,
+                                                const unsigned char *end,
+                                                struct HistK *h) {
+    uint64_t maxCentroids, numCentroids, totalCount;
+    if ((p = getVarintBounded(p, end, &maxCentroids)) == NULL ||
+        (p = getVarintBounded(p, end, &numCentroids)) == NULL ||
+        end - p < 2) {
+        return NULL;
+    }
+    h->valueType = *p++;
+    h->countWidth = *p++;
+    if ((p = getVarintBounded(p, end, &totalCount)) == NULL ||
+        end - p < 16 || maxCentroids < 1 ||
+        maxCentroids > HISTK_MAX_NUM_CENTROIDS ||
+        numCentroids > maxCentroids || h->valueType > HISTK_VALUES_FLOAT ||
+        (h->countWidth != 1 && h->countWidth != 2 && h->countWidth != 4 &&
+         h->countWidth != 8)) {
+        return NULL;
+    }
+    h->maxCentroids = maxCentroids;
+    h->numCentroids = numCentroids;
+    h->totalCount = totalCount;
+    h->capacity = 0;
+    p = getDouble(p, &h->min);
+    p = getDouble(p, &h->max);
+    return p;
+}
+
+// Read the header that serializeHistK writes from the len bytes at buf into
+// h, and check the packed centroids that follow it. Returns a pointer to the
+// packed centroids, or NULL if the bytes don't hold a valid sketch.
+static const unsigned char *parseSerializedHistK(const unsigned char *buf,
+                                                 size_t len,
+                                                 struct HistK *h) {
+    const unsigned char *p, *end = buf + len;
+    uint64_t total;
+    if ((p = getSerializedHeader(buf, end, h)) == NULL ||
+        checkPackedCentroids(h, p, end, &total) != end ||
+        total != h->totalCount) {
+        return NULL;
+    }
+    return p;
+}
+
+// Return the unpacked sketch serialized in the len bytes at buf, allocated
+// with alloc, or NULL if they don't hold a valid sketch.
+static struct HistK *deserializeHistKWith(void *(*alloc)(size_t),
+                                          const unsigned char *buf,
+                                          size_t len) {
+    struct HistK hdr;
+    const unsigned char *p = parseSerializedHistK(buf, len, &hdr);
+    if (p == NULL) { return NULL; }
+    struct HistK *h = allocHistKWith(alloc, hdr.numCentroids, hdr.valueType,
+                                     hdr.countWidth);
+    unsigned short capacity = h->capacity;
+    memcpy(h, &hdr, sizeof(hdr));
+    h->capacity = capacity;
+    unpackCentroids(h, 0, h->numCentroids, p);
+    return h;
+}
+
+// Return the unpacked sketch serialized in the len bytes at buf, or NULL if
+// they don't hold a valid sketch.
+struct HistK *deserializeHistK(const unsigned char *buf, size_t len) {
+    return deserializeHistKWith(allocator.allocSketch, buf, len);
+}
+
+// Like deserializeHistK, but return the sketch packed: its centroids are
+// copied as they are and only decoded once the sketch is unpacked.
+struct HistK *deserializePackedHistK(const unsigned char *buf, size_t len) {
+    struct HistK hdr;
+    const unsigned char *p = parseSerializedHistK(buf, len, &hdr);
+    if (p == NULL) { return NULL; }
+    size_t n = buf + len - p;
+    struct HistK *h = allocator.alloc(sizeof(hdr) + n);
+    memcpy(h, &hdr, sizeof(hdr));
+    memcpy(h->data, p, n);
+    return h;
+}
+
+// Return h encoded as HISTK.DUMP returns it, in a buffer the caller frees with
+// the allocator's free, and set *len to the number of bytes in it.
+unsigned char *dumpHistK(const struct HistK *h, size_t *len) {
+    unsigned char *buf = allocator.alloc(1 + serializedSize(h));
+    buf[0] = HISTK_DUMP_VERSION;
+    *len = 1 + serializeHistK(h, buf + 1);
+    return buf;
+}
+
+// Return the sketch that the len bytes at buf, taken from HISTK.DUMP, hold,
+// packed or not, or NULL if they don't hold a sketch in a version this module
+// reads.
+struct HistK *restoreHistK(const unsigned char *buf, size_t len, int packed) {
+    if (len == 0 || buf[0] != HISTK_DUMP_VERSION) { return NULL; }
+    buf++;
+    len--;
+    return packed ? deserializePackedHistK(buf, len) :
+                    deserializeHistK(buf, len);
+}
+
+// Like restoreHistK, but return an unpacked scratch sketch.
+struct HistK *restoreScratchHistK(const unsigned char *buf, size_t len) {
+    if (len == 0 || buf[0] != HISTK_DUMP_VERSION) { return NULL; }
+    return deserializeHistKWith(allocator.alloc, buf + 1, len - 1);
+}
+
+// Copy the centroids of h to cs, which must have room for h->numCentroids.
+void getCentroids(const struct HistK *h, struct Centroid *cs) {
+    for (int i = 0; i < h->numCentroids; i++) {
+        cs[i].value = getValue(h, i);
+        cs[i].count = getCount(h, i);
+    }
+}
+
+// Replace the centroids of h with the n centroids in cs, which must be sorted
+// by increasing value, and recompute the total count. Returns HISTK_OK, or
+// HISTK_ERR_FULL or HISTK_ERR_OVERFLOW, leaving h unchanged, if cs doesn't
+// fit in h.
+int setCentroids(struct HistK *h, const struct Centroid *cs, int n) {
+    if (n > h->capacity) { return HISTK_ERR_FULL; }
+    for (int i = 0; i < n; i++) {
+        if ((unsigned long long)cs[i].count > countLimit(h->countWidth)) {
+            return HISTK_ERR_OVERFLOW;
+        }
+    }
+    h->totalCount = 0;
+    for (int i = 0; i < n; i++) {
+        setValue(h, i, cs[i].value);
+        setCount(h, i, cs[i].count);
+        h->totalCount += cs[i].count;
+    }
+    h->numCentroids = n;
+    return HISTK_OK;
+}
+
+// Merge the centroid cj into the centroid ci.
+static inline void mergeCentroids(struct Centroid *ci, const struct Centroid *cj) {
+    long long s = ci->count + cj->count;
+    double v = ((ci->value * ci->count) + (cj->value * cj->count)) / s;
+    // Rounding, or overflow with huge values, can put the mean just outside
+    // the two values, which would take it out of order with the neighbors.
+    double lo = fmin(ci->value, cj->value), hi = fmax(ci->value, cj->value);
+    ci->value = v < lo ? lo : v > hi ? hi : v;
+    ci->count = s;
+}
+
+// Return the index of the last centroid in h whose value is at most v, or -1
+// if there isn't one.
+static int lastCentroidAtMost(const struct HistK *h, double v) {
+    int i = h->numCentroids - 1;
+    if (h->valueType == HISTK_VALUES_FLOAT) {
+        const float *vs = histkValues(h);
+        while (i >= 0 && vs[i] > v) { i--; }
+    } else {
+        const double *vs = histkValues(h);
+        while (i >= 0 && vs[i] > v) { i--; }
+    }
+    return i;
+}
+
+// Near ties are broken with a xorshift per thread rather than rand(), which
+// takes a lock that recorders flushing shards on many threads would fight
+// over. Like rand(), it gives 31 bits.
+static __thread uint64_t tieBreakState = 0x9e3779b97f4a7c15ull;
+
+static inline uint32_t nextTieBreak(void) {
+    tieBreakState ^= tieBreakState << 13;
+    tieBreakState ^= tieBreakState >> 7;
+    tieBreakState ^= tieBreakState << 17;
+    return tieBreakState >> 33;
+}
+
+// Find index i, other than skip, where |values[i] - values[i+1]| is minimized
+// and store that difference in md. Returns -1 if there's no such index. If
+// there are multiple nearly equal minimums, we'll choose one uniformly at
+// random.
+#define HISTK_FIND_MINIMUM_PAIR(T) do {                                      \
+    const T *vs = histkValues(h);                                            \
+    for (int i = 0; i < h->numCentroids - 1; i++) {                          \
+        double d = fabs((double)vs[i+1] - vs[i]);                            \
+        if (i == skip) {                                                     \
+            continue;                                                        \
+        }                                                                    \
+        if (d < *md || (fabs(d - *md) < HISTK_EPSILON &&                     \
+                        nextTieBreak() * n++ < 1.0)) {                       \
+            mi = i;                                                          \
+            *md = d;                                                         \
+        }                                                                    \
+    }                                                                        \
+} while (0)
+
+int findMinimumCentroidPair(const struct HistK *h, int skip, double *md) {
+    int mi = -1;
+    unsigned int n = 1;
+    *md = DBL_MAX;
+    if (h->valueType == HISTK_VALUES_FLOAT) {
+        HISTK_FIND_MINIMUM_PAIR(float);
+    } else {
+        HISTK_FIND_MINIMUM_PAIR(double);
+    }
+    return mi;
+}
+
+// Move the centroids in [from, to) of h by delta positions.
+static void moveCentroids(struct HistK *h, int from, int to, int delta) {
+    if (to <= from) { return; }
+    size_t vs = valueSize(h->valueType);
+    unsigned char *values = histkValues(h);
+    unsigned char *counts = histkCounts(h);
+    size_t cw = h->countWidth;
+    memmove(values + (from + delta) * vs, values + from * vs,
+            (to - from) * vs);
+    memmove(counts + (from + delta) * cw, counts + from * cw,
+            (to - from) * cw);
+}
+
+// Add <count> <value>s to the sketch. Returns HISTK_OK, or, without changing
+// the sketch, HISTK_ERR_FULL if h needs room for another centroid or
+// HISTK_ERR_OVERFLOW if a count would no longer fit in h->countWidth bytes.
+int histkAdd(struct HistK *h, double value, unsigned long long count) {
+    // Compact sketches round values to floats, but min and max are exact.
+    double v = value;
+    if (h->valueType == HISTK_VALUES_FLOAT) { v = toFloatValue(value); }
+    unsigned long long limit = countLimit(h->countWidth);
+    int n = h->numCentroids;
+
+    // Find the index k of the last centroid in the sorted list of centroids
+    // that (value, count) belongs after.
+    int k = lastCentroidAtMost(h, v);
+    if (k >= 0 && getValue(h, k) == v) {
+        unsigned long long c = getCount(h, k) + count;
+        if (c > limit) { return HISTK_ERR_OVERFLOW; }
+        setCount(h, k, c);
+    } else if (n < h->maxCentroids) {
+        if (n >= h->capacity) { return HISTK_ERR_FULL; }
+        if (count > limit) { return HISTK_ERR_OVERFLOW; }
+        moveCentroids(h, k + 1, n, 1);
+        setValue(h, k + 1, v);
+        setCount(h, k + 1, count);
+        h->numCentroids++;
+    } else {
+        // Adding (value, count) as a new centroid would put us over the limit,
+        // so we merge the two closest centroids of the n + 1 we'd have. The
+        // new centroid splits the gap between centroids k and k + 1, so that's
+        // either the new centroid and one of its neighbors or some other pair
+        // of existing centroids. Working out which before touching the array
+        // means we never shift more centroids than we have to.
+        struct Centroid c = {v, count};
+        double md;
+        int mi = findMinimumCentroidPair(h, k, &md);
+        double dl = k >= 0 ? v - getValue(h, k) : DBL_MAX;
+        double dr = k + 1 < n ? getValue(h, k + 1) - v : DBL_MAX;
+        if (mi < 0 || dl <= md || dr <= md) {
+            // Only merge into a neighbor that exists: with a single centroid
+            // md is DBL_MAX too and ties the sentinel for the missing side.
+            // When every other gap is infinite there's no pair to merge at
+            // all (mi is -1), so the new value joins a neighbor then too.
+            int j = k < 0 ? k + 1 : k + 1 >= n ? k : dl <= dr ? k : k + 1;
+            struct Centroid cj = {getValue(h, j), getCount(h, j)};
+            mergeCentroids(&cj, &c);
+            if ((unsigned long long)cj.count > limit) {
+                return HISTK_ERR_OVERFLOW;
+            }
+            setValue(h, j, cj.value);
+            setCount(h, j, cj.count);
+        } else {
+            struct Centroid ci = {getValue(h, mi), getCount(h, mi)};
+            struct Centroid cj = {getValue(h, mi + 1), getCount(h, mi + 1)};
+            mergeCentroids(&ci, &cj);
+            if ((unsigned long long)ci.count > limit || count > limit) {
+                return HISTK_ERR_OVERFLOW;
+            }
+            // Centroid mi + 1 is gone, which either frees up a spot for the
+            // new centroid just before k + 1 or shifts it after.
+            if (mi < k) {
+                moveCentroids(h, mi + 2, k + 1, -1);
+                k--;
+            } else {
+                moveCentroids(h, k + 1, mi + 1, 1);
+                mi++;
+            }
+            setValue(h, mi, ci.value);
+            setCount(h, mi, ci.count);
+            setValue(h, k + 1, v);
+            setCount(h, k + 1, count);
+        }
+    }
+
+    if (value < h->min) { h->min = value; }
+    if (value > h->max) { h->max = value; }
+    h->totalCount += count;
+    return HISTK_OK;
+}
+
+// Populate ci and cj with the two centroids in h before and after index i. If
+// i is 0, we populate ci with a dummy centroid holding the min value observed
+// by the sketch. If i is h->numCentroids, we populate cj with a dummy centroid
+// holding the max value observed by the sketch. Using dummy centroids like
+// this makes the quantiles and counts at extreme values more accurate.
+void getBorderingCentroids(const struct HistK *h, unsigned int i,
+                           struct Centroid *ci, struct Centroid *cj) {
+    if (i == 0) {
+        ci->value = h->min;
+        ci->count = 0;
+    } else {
+        ci->value = getValue(h, i - 1);
+        ci->count = getCount(h, i - 1);
+    }
+    if (i == h->numCentroids) {
+        cj->value = h->max;
+        cj->count = 0;
+    } else {
+        cj->value = getValue(h, i);
+        cj->count = getCount(h, i);
+    }
+}
+
+// Scan forward through the counts of h for the first centroid i such that the
+// area under the trapezoids up to its midpoint exceeds t. s is set to the area
+// up to the midpoint of centroid i-1.
+#define HISTK_QUANTILE_SCAN(T) do {                                          \
+    const T *cs = histkCounts(h);                                            \
+    for (; i < h->numCentroids; i++) {                                       \
+        double v = cs[i] / 2.0;                                              \
+        if (*s + v + pv > t) {                                               \
+            break;                                                           \
+        }                                                                    \
+        *s += v + pv;                                                        \
+        pv = v;                                                              \
+    }                                                                        \
+} while (0)
+
+static int quantileIndex(const struct HistK *h, double t, double *s) {
+    int i = 0;
+    double pv = 0.0;
+    *s = 0.0;
+    switch (h->countWidth) {
+    case 1: HISTK_QUANTILE_SCAN(uint8_t); break;
+    case 2: HISTK_QUANTILE_SCAN(uint16_t); break;
+    case 4: HISTK_QUANTILE_SCAN(uint32_t); break;
+    default: HISTK_QUANTILE_SCAN(uint64_t); break;
+    }
+    return i;
+}
+
+// Return the sum of the counts of the first n centroids in h.
+#define HISTK_SUM_COUNTS(T) do {                                             \
+    const T *cs = histkCounts(h);                                            \
+    for (int j = 0; j < n; j++) {                                            \
+        s += cs[j];                                                          \
+    }                                                                        \
+} while (0)
+
+static double sumCounts(const struct HistK *h, int n) {
+    unsigned long long s = 0;
+    switch (h->countWidth) {
+    case 1: HISTK_SUM_COUNTS(uint8_t); break;
+    case 2: HISTK_SUM_COUNTS(uint16_t); break;
+    case 4: HISTK_SUM_COUNTS(uint32_t); break;
+    default: HISTK_SUM_COUNTS(uint64_t); break;
+    }
+    return s;
+}
+
+// Return an estimate of the smallest value V observed by the sketch such that
+// q * h->totalCount elements observed were less than or equal to V. q must be
+// in the range [0.0, 1.0].
+double histkQuantile(const struct HistK *h, double q) {
+    double t = q * h->totalCount;
+    double s;
+    int i = quantileIndex(h, t, &s);
+
+    struct Centroid ci, cj;
+    getBorderingCentroids(h, i, &ci, &cj);
+
+    // Solve for u such that
+    // t - s = (ci.count + mu) / 2 * (u-ci.value) / (cj.value - ci.value), where
+    // mu = ci.count + (u-ci.value) * (cj.count-ci.count) / (cj.value-ci.value).
+    // You can solve for such a u using the quadratic formula as long as
+    // ci.count != cj.count. See Algorithm 4 and its description in the
+    // Ben-Haim/Tom-Tov paper.
+    double d = t - s;
+    double a = cj.count - ci.count;
+    if (a == 0.0) {
+        return ci.value + (cj.value - ci.value) * (d / ci.count);
+    }
+    double b = 2.0 * ci.count;
+    double c = -2.0 * d;
+    double z = (-b + sqrt(b * b - 4 * a * c)) / (2 * a);
+    return ci.value + (cj.value - ci.value) * z;
+}
+
+// Return an estimate of the number of values observed by the sketch that are
+// less than or equal to <v>. This is essentially the "Sum" procedure described
+// in Ben-Haim and Tom-Tov's paper.
+long long histkCountLessThanOrEqual(const struct HistK *h, double v) {
+    if (v >= h->max) {
+        return h->totalCount;
+    } else if (v < h->min) {
+        return 0;
+    }
+    int i = lastCentroidAtMost(h, v);
+
+    struct Centroid ci, cj;
+    getBorderingCentroids(h, i + 1, &ci, &cj);
+
+    double s = sumCounts(h, i);
+    double x = (v - ci.value) / (cj.value - ci.value);
+    double b = ci.count + (cj.count - ci.count) * x;
+    double est = s + ci.count / 2.0 + (ci.count + b) * x / 2.0;
+    return (long long)round(est);
+}
+
+// qsort comparator for Centroid.
+int sortCentroids(const void *x, const void *y) {
+    const struct Centroid *cx = x, *cy = y;
+    if (cx->value > cy->value) {
+        return 1;
+    } else if (cx->value < cy->value) {
+        return -1;
+    } else {
+        return 0;
+    }
+}
+
+// An entry in the min-heap of gaps between neighboring centroids used by
+// reduceCentroids. Centroids i and j were neighbors with generations gi and gj
+// when the entry was pushed; the entry is stale if either has been merged
+// since then.
+struct CentroidGap {
+    double d;
+    int i, j;
+    unsigned int gi, gj;
+};
+
+static int gapLessThan(const struct CentroidGap *x,
+                       const struct CentroidGap *y) {
+    return x->d < y->d || (x->d == y->d && x->i < y->i);
+}
+
+static void pushGap(struct CentroidGap *heap, int *hn, struct CentroidGap g) {
+    int k = (*hn)++;
+    while (k > 0) {
+        int p = (k - 1) / 2;
+        if (!gapLessThan(&g, &heap[p])) break;
+        heap[k] = heap[p];
+        k = p;
+    }
+    heap[k] = g;
+}
+
+static struct CentroidGap popGap(struct CentroidGap *heap, int *hn) {
+    struct CentroidGap top = heap[0];
+    struct CentroidGap last = heap[--(*hn)];
+    int k = 0;
+    for (;;) {
+        int c = 2 * k + 1;
+        if (c >= *hn) break;
+        if (c + 1 < *hn && gapLessThan(&heap[c+1], &heap[c])) c++;
+        if (!gapLessThan(&heap[c], &last)) break;
+        heap[k] = heap[c];
+        k = c;
+    }
+    heap[k] = last;
+    return top;
+}
+
+// Greedily merge the closest pair of neighboring centroids in the sorted array
+// cs, of length cn, until at most rn centroids remain. This is the same
+// reduction that histkAdd() performs one centroid at a time, but done in bulk
+// it only costs O(cn log cn): neighbors are tracked in a linked list and gaps
+// in a min-heap, so we never rescan or shift the array between merges. Returns
+// the number of centroids left at the front of cs.
+static int reduceCentroids(struct Centroid *cs, int cn, int rn) {
+    if (cn <= rn || cn < 2) { return cn; }
+    int *next = allocator.alloc(cn * sizeof(int));
+    int *prev = allocator.alloc(cn * sizeof(int));
+    unsigned int *gen = allocator.alloc(cn * sizeof(unsigned int));
+    // Each merge pushes at most two new gaps.
+    struct CentroidGap *heap =
+        allocator.alloc(3 * cn * sizeof(struct CentroidGap));
+    int hn = 0;
+    for (int i = 0; i < cn; i++) {
+        prev[i] = i - 1;
+        next[i] = i + 1 < cn ? i + 1 : -1;
+        gen[i] = 0;
+    }
+    for (int i = 0; i < cn - 1; i++) {
+        struct CentroidGap g = {cs[i+1].value - cs[i].value, i, i + 1, 0, 0};
+        pushGap(heap, &hn, g);
+    }
+
+    int n = cn;
+    while (n > rn && hn > 0) {
+        struct CentroidGap g = popGap(heap, &hn);
+        int i = g.i, j = g.j;
+        if (next[i] != j || gen[i] != g.gi || gen[j] != g.gj) {
+            continue;
+        }
+        mergeCentroids(&cs[i], &cs[j]);
+        gen[i]++;
+        gen[j]++;
+        next[i] = next[j];
+        if (next[j] >= 0) { prev[next[j]] = i; }
+        next[j] = -1;
+        n--;
+        if (prev[i] >= 0) {
+            int p = prev[i];
+            struct CentroidGap pg = {cs[i].value - cs[p].value, p, i,
+                                     gen[p], gen[i]};
+            pushGap(heap, &hn, pg);
+        }
+        if (next[i] >= 0) {
+            int q = next[i];
+            struct CentroidGap ng = {cs[q].value - cs[i].value, i, q,
+                                     gen[i], gen[q]};
+            pushGap(heap, &hn, ng);
+        }
+    }
+
+    // Centroids are always merged into their left neighbor, so cs[0] survives
+    // and heads the list of remaining centroids.
+    int k = 0;
+    for (int i = 0; i >= 0; i = next[i]) {
+        cs[k++] = cs[i];
+    }
+    allocator.free(heap);
+    allocator.free(gen);
+    allocator.free(prev);
+    allocator.free(next);
+    return k;
+}
+
+// Reduce the Centroid array cs, of length cn, to a Centroid array rs, of length
+// rn, by computing the optimal merge into min{cn, rn} centroids. The merged
+// array that is generated is optimal in the sense that it minimizes the sum of
+// distances of each centroid in cs to the centroid its merged into in rs over
+// all choices of an m centroid decomposition. Returns the total number of
+// centroids stored in rs.
+//
+// The input array cs is used as a workspace and is modified by this method. rs
+// may be the same array as cs.
+int mergeCentroidList(struct Centroid *cs, int cn,
+                      struct Centroid *rs, int rn) {
+    if (cn < 1) { return 0; }
+    qsort(cs, cn, sizeof(struct Centroid), sortCentroids);
+
+    // Merging centroids with the same value is easy: just sum the counts. Do
+    // this first.
+    int f = 0;
+    for (int i = 1; i < cn; i++) {
+        if (cs[i].value == cs[i-1].value) {
+            cs[f].count += cs[i].count;
+        } else {
+            f++;
+            cs[f] = cs[i];
+        }
+    }
+    cn = reduceCentroids(cs, f + 1, rn);
+
+    // Copy merged centroids over to results.
+    for (int i = 0; i < cn; i++) {
+        rs[i] = cs[i];
+    }
+    return cn;
+}
+
+// Add Centroid c to the array of Centroids cs at index i. cs has max length n,
+// and if i >= n, resize the underlying array so that c can be added at index i.
+// Returns the max size of the array after c has been added to index i.
+int addToDynamicCentroidArray(struct Centroid **cs, int i, int n,
+                              const struct Centroid c) {
+    while (i >= n) {
+        struct Centroid *newCs =
+            allocator.alloc(n * 2 * sizeof(struct Centroid));
+        for (int j = 0; j < n; j++) {
+            newCs[j] = (*cs)[j];
+        }
+        n *= 2;
+        allocator.free(*cs);
+        *cs = newCs;
+    }
+    (*cs)[i] = c;
+    return n;
+}
+
+// Return the most bytes writeHistKPatch can write for a patch to after.
+size_t patchSize(const struct HistK *after) {
+    return 3 * 3 + HISTK_SERIALIZED_HEADER_MAX +
+        (size_t)after->numCentroids * HISTK_PACKED_CENTROID_MAX;
+}
+
+// Return whether centroid i of h and centroid j of g are the same, bit for
+// bit. h and g store values the same way.
+static inline int sameCentroid(const struct HistK *h, int i,
+                               const struct HistK *g, int j) {
+    return valueKey(h, i) == valueKey(g, j) && getCount(h, i) == getCount(g, j);
+}
+
+// Write a patch that turns before into after to buf, which must have room for
+// patchSize(after) bytes. before is NULL if the sketch didn't exist. Neither
+// sketch can be packed. The patch only carries the centroids between the
+// ones the two sketches start and end with in common. Returns the number of
+// bytes written.
+size_t writeHistKPatch(const struct HistK *before, const struct HistK *after,
+                       unsigned char *buf) {
+    int nb = before ? before->numCentroids : 0;
+    int na = after->numCentroids;
+    int prefix = 0, suffix = 0;
+    if (before && before->valueType == after->valueType) {
+        while (prefix < nb && prefix < na &&
+               sameCentroid(before, prefix, after, prefix)) {
+            prefix++;
+        }
+        while (suffix < nb - prefix && suffix < na - prefix &&
+               sameCentroid(before, nb - 1 - suffix, after, na - 1 - suffix)) {
+            suffix++;
+        }
+    }
+    unsigned char *p = buf;
+    p = putVarint(p, prefix);
+    p = putVarint(p, nb - prefix - suffix);
+    p = putVarint(p, nb);
+    p = putSerializedHeader(p, after, na - prefix - suffix);
+    p = packCentroids(after, prefix, na - suffix, p);
+    return p - buf;
+}
+
+// Parse the len bytes at buf into patch. Returns HISTK_ERR_INVALID if they
+// don't hold a valid patch.
+int parseHistKPatch(const unsigned char *buf, size_t len,
+                    struct HistKPatch *patch) {
+    const unsigned char *p = buf, *end = buf + len;
+    uint64_t from, removed, expected;
+    if ((p = getVarintBounded(p, end, &from)) == NULL ||
+        (p = getVarintBounded(p, end, &removed)) == NULL ||
+        (p = getVarintBounded(p, end, &expected)) == NULL ||
+        expected > HISTK_MAX_NUM_CENTROIDS || from + removed > expected ||
+        (p = getSerializedHeader(p, end, &patch->header)) == NULL ||
+        expected - removed + patch->header.numCentroids >
+        patch->header.maxCentroids) {
+        return HISTK_ERR_INVALID;
+    }
+    patch->from = from;
+    patch->removed = removed;
+    patch->expected = expected;
+    patch->centroids = p;
+    if (checkPackedCentroids(&patch->header, p, end, &patch->total) != end) {
+        return HISTK_ERR_INVALID;
+    }
+    return HISTK_OK;
+}
+
+// Apply patch to h, which must have patch->expected centroids, room for the
+// patched ones and the same layout as the patch. Returns HISTK_ERR_INVALID,
+// without changing h, if the patched counts wouldn't add up to the patched
+// total.
+int applyHistKPatch(struct HistK *h, const struct HistKPatch *patch) {
+    uint64_t removed = 0;
+    for (int i = patch->from; i < patch->from + patch->removed; i++) {
+        removed += getCount(h, i);
+    }
+    if (h->totalCount - removed + patch->total !=
+        patch->header.totalCount) {
+        return HISTK_ERR_INVALID;
+    }
+    int inserted = patch->header.numCentroids;
+    moveCentroids(h, patch->from + patch->removed, h->numCentroids,
+                  inserted - patch->removed);
+    unpackCentroids(h, patch->from, inserted, patch->centroids);
+    h->numCentroids += inserted - patch->removed;
+    h->maxCentroids = patch->header.maxCentroids;
+    h->totalCount = patch->header.totalCount;
+    h->min = patch->header.min;
+    h->max = patch->header.max;
+    return HISTK_OK;
+}
+
+// Recording from many threads. Each thread that records to a recorder gets a
+// shard of its own: a sketch, and a batch of the values it recorded since it
+// last added them to the sketch. Recording a value only appends it to the
+// thread's batch, which no other thread touches, so it takes no locks or
+// atomic instructions. A full batch is added to the thread's sketch under a
+// lock that only readers ever contend for. Readers merge every thread's sketch
+// into a new one, and the sketch of a thread that exits is merged into the
+// recorder's.
+#define HISTK_RECORDER_BATCH 256
+
+// Adding a value scans every centroid in the sketch, so batches for sketches
+// at least this big are merged into them in one step instead, the way
+// mergeCentroidList merges sketches. The centroids come out a little
+// different.
+#define HISTK_RECORDER_MERGE_MIN 256
+
+struct HistKShard {
+    struct HistKRecorder *recorder;
+    struct HistKShard *prev;
+    struct HistKShard *next;
+    // Guards h.
+    pthread_mutex_t lock;
+    struct HistK *h;
+    // The values recorded since the last flush, with room after them for
+    // the centroids they're merged with.
+    struct Centroid *batch;
+    int batchSize;
+};
+
+struct HistKRecorder {
+    unsigned short int maxCentroids;
+    unsigned char valueType;
+    pthread_key_t key;
+    // Guards shards and retired.
+    pthread_mutex_t lock;
+    struct HistKShard *shards;
+    // What threads that have exited recorded.
+    struct HistK *retired;
+};
+
+// Copy the centroids of h to cs + n, widen [*min, *max] to take in h's values
+// and return the number of centroids in cs afterwards.
+static int appendCentroids(const struct HistK *h, struct Centroid *cs, int n,
+                           double *min, double *max) {
+    getCentroids(h, cs + n);
+    if (h->numCentroids > 0) {
+        if (h->min < *min) { *min = h->min; }
+        if (h->max > *max) { *max = h->max; }
+    }
+    return n + h->numCentroids;
+}
+
+// Merge the n centroids in cs, whose values lie in [min, max], into h. cs
+// must have room for h's centroids after its own. Returns h, or the copy of
+// it that the merged centroids fit in, in which case h is freed.
+static struct HistK *mergeIntoHistK(struct HistK *h, struct Centroid *cs,
+                                    int n, double min, double max) {
+    if (n == 0) { return h; }
+    appendCentroids(h, cs, n, &min, &max);
+    n = mergeCentroidList(cs, n + h->numCentroids, cs, h->maxCentroids);
+    int err;
+    while ((err = setCentroids(h, cs, n)) != HISTK_OK) {
+        struct HistK *nh = err == HISTK_ERR_FULL ? growHistK(h, n) :
+                                                   widenHistK(h);
+        freeHistK(h);
+        h = nh;
+    }
+    h->min = min;
+    h->max = max;
+    return h;
+}
+
+// Add the batch of s to its sketch. Only the thread that owns s may call
+// this.
+static void flushShard(struct HistKShard *s) {
+    if (s->batchSize == 0) { return; }
+    if (s->h->maxCentroids < HISTK_RECORDER_MERGE_MIN) {
+        pthread_mutex_lock(&s->lock);
+        for (int i = 0; i < s->batchSize; i++) {
+            int err;
+            while ((err = histkAdd(s->h, s->batch[i].value,
+                                   s->batch[i].count)) != HISTK_OK) {
+                struct HistK *nh = err == HISTK_ERR_FULL ?
+                    growHistK(s->h, s->h->numCentroids + 1) :
+                    widenHistK(s->h);
+                freeHistK(s->h);
+                s->h = nh;
+            }
+        }
+        pthread_mutex_unlock(&s->lock);
+        s->batchSize = 0;
+        return;
+    }
+    double min = DBL_MAX, max = -DBL_MAX;
+    for (int i = 0; i < s->batchSize; i++) {
+        if (s->batch[i].value < min) { min = s->batch[i].value; }
+        if (s->batch[i].value > max) { max = s->batch[i].value; }
+    }
+    pthread_mutex_lock(&s->lock);
+    s->h = mergeIntoHistK(s->h, s->batch, s->batchSize, min, max);
+    pthread_mutex_unlock(&s->lock);
+    s->batchSize = 0;
+}
+
+static void freeShard(struct HistKShard *s) {
+    pthread_mutex_destroy(&s->lock);
+    freeHistK(s->h);
+    allocator.free(s->batch);
+    allocator.free(s);
+}
+
+// Called when a thread that recorded to a recorder exits, with its shard.
+static void retireShard(void *p) {
+    struct HistKShard *s = p;
+    struct HistKRecorder *r = s->recorder;
+    flushShard(s);
+    double min = DBL_MAX, max = -DBL_MAX;
+    int n = appendCentroids(s->h, s->batch, 0, &min, &max);
+    pthread_mutex_lock(&r->lock);
+    if (s->prev != NULL) { s->prev->next = s->next; }
+    else { r->shards = s->next; }
+    if (s->next != NULL) { s->next->prev = s->prev; }
+    r->retired = mergeIntoHistK(r->retired, s->batch, n, min, max);
+    pthread_mutex_unlock(&r->lock);
+    freeShard(s);
+}
+
+static struct HistKShard *addShard(struct HistKRecorder *r) {
+    struct HistKShard *s = allocator.alloc(sizeof(*s));
+    s->recorder = r;
+    s->prev = NULL;
+    pthread_mutex_init(&s->lock, NULL);
+    s->h = createHistK(r->maxCentroids, r->valueType);
+    // A batch is merged with the thread's sketch, and when the thread exits,
+    // the thread's sketch with the recorder's.
+    int room = HISTK_RECORDER_BATCH > r->maxCentroids ?
+        HISTK_RECORDER_BATCH : r->maxCentroids;
+    s->batch = allocator.alloc((room + r->maxCentroids) * sizeof(*s->batch));
+    s->batchSize = 0;
+    pthread_mutex_lock(&r->lock);
+    s->next = r->shards;
+    if (s->next != NULL) { s->next->prev = s; }
+    r->shards = s;
+    pthread_mutex_unlock(&r->lock);
+    pthread_setspecific(r->key, s);
+    return s;
+}
+
+struct HistKRecorder *createHistKRecorder(unsigned short int maxCentroids,
+                                          unsigned char valueType) {
+    struct HistKRecorder *r = allocator.alloc(sizeof(*r));
+    if (pthread_key_create(&r->key, retireShard) != 0) {
+        allocator.free(r);
+        return NULL;
+    }
+    r->maxCentroids = maxCentroids;
+    r->valueType = valueType;
+    pthread_mutex_init(&r->lock, NULL);
+    r->shards = NULL;
+    r->retired = createHistK(maxCentroids, valueType);
+    return r;
+}
+
+void freeHistKRecorder(struct HistKRecorder *r) {
+    pthread_key_delete(r->key);
+    while (r->shards != NULL) {
+        struct HistKShard *s = r->shards;
+        r->shards = s->next;
+        freeShard(s);
+    }
+    pthread_mutex_destroy(&r->lock);
+    freeHistK(r->retired);
+    allocator.free(r);
+}
+
+void histkRecord(struct HistKRecorder *r, double value,
+                 unsigned long long count) {
+    struct HistKShard *s = pthread_getspecific(r->key);
+    if (s == NULL) { s = addShard(r); }
+    s->batch[s->batchSize].value = value;
+    s->batch[s->batchSize].count = count;
+    if (++s->batchSize == HISTK_RECORDER_BATCH) { flushShard(s); }
+}
+
+void histkFlushRecorder(struct HistKRecorder *r) {
+    struct HistKShard *s = pthread_getspecific(r->key);
+    if (s != NULL) { flushShard(s); }
+}
+
+struct HistK *collectHistKRecorder(struct HistKRecorder *r) {
+    struct HistK *h = createHistK(r->maxCentroids, r->valueType);
+    double min = DBL_MAX, max = -DBL_MAX;
+    pthread_mutex_lock(&r->lock);
+    int n = 1;
+    for (struct HistKShard *s = r->shards; s != NULL; s = s->next) { n++; }
+    struct Centroid *cs = allocator.alloc(n * r->maxCentroids * sizeof(*cs));
+    n = appendCentroids(r->retired, cs, 0, &min, &max);
+    for (struct HistKShard *s = r->shards; s != NULL; s = s->next) {
+        pthread_mutex_lock(&s->lock);
+        n = appendCentroids(s->h, cs, n, &min, &max);
+        pthread_mutex_unlock(&s->lock);
+    }
+    pthread_mutex_unlock(&r->lock);
+    h = mergeIntoHistK(h, cs, n, min, max);
+    allocator.free(cs);
+    return h;
+}
@@ -0,0 +1,281 @@
+/* libhistk: the Ben-Haim/Tom-Tov histogram sketch behind the histk Redis
+ * module, as a standalone C library. Services can build sketches with it
+ * locally and ship them to Redis with HISTK.MERGEBLOB: dumpHistK writes the
+ * same bytes HISTK.DUMP returns, and serializeHistK the same bytes the module
+ * saves to RDB files.
+ *
+ * Sketches aren't safe to use from several threads at once, except to read.
+ * Functions that need room in a sketch to succeed return HISTK_ERR_FULL or
+ * HISTK_ERR_OVERFLOW instead of reallocating it, since the caller may have
+ * pointers to it elsewhere: make room with growHistK or widenHistK, free the
+ * old sketch and try again. See the module's makeRoom for an example.
+ */
+
+#ifndef LIBHISTK_H
+#define LIBHISTK_H
+
+#include "float.h"
+#include "stddef.h"
+#include "stdint.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HISTK_DEFAULT_NUM_CENTROIDS 64
+#define HISTK_MAX_NUM_CENTROIDS 2048
+
+// dumpHistK writes a byte holding this version followed by the sketch as
+// serializeHistK writes it, so the encoding can change without breaking
+// dumps that were taken before.
+#define HISTK_DUMP_VERSION 1
+
+
+// Return codes for operations that may need a sketch to be reallocated before
+// they can succeed. These operations check before changing anything, so the
+// caller can make room (see growHistK and widenHistK) and try again.
+#define HISTK_OK 0
+#define HISTK_ERR_FULL 1
+#define HISTK_ERR_OVERFLOW 2
+// Returned when input to parse isn't valid.
+#define HISTK_ERR_INVALID 3
+
+// How a sketch stores centroid values. Compact sketches store them as floats,
+// which is plenty of precision for things like latencies.
+#define HISTK_VALUES_DOUBLE 0
+#define HISTK_VALUES_FLOAT 1
+
+// A (value, count) pair. Sketches store their centroids in a more compact
+// layout (see struct HistK); this is the form they're exchanged in when
+// merging, saving and loading sketches.
+struct Centroid {
+    double value;
+    long long count;
+};
+
+// A sketch is a single allocation: this 32-byte header followed by its
+// centroids. Allocations are rounded up to size classes that are multiples of
+// the 64-byte cache line (see histkAllocSize), so reads never chase a pointer.
+//
+// Centroid values and counts are stored in separate arrays so that scans over
+// one of them, like the scan over values in histkAdd() or over counts in
+// histkQuantile(), touch as few cache lines as possible. Compact sketches store
+// values as floats instead of doubles. Counts are stored in the narrowest of
+// 8, 16, 32 or 64 bits that fits them all: most centroids in most sketches
+// never count past 255, and the whole array is widened the first time a count
+// would overflow.
+struct HistK {
+    // Total number of values observed by the sketch.
+    unsigned long long totalCount;
+    // Minimum value observed by the sketch.
+    double min;
+    // Maximum value observed by the sketch.
+    double max;
+    // Current number of centroids in the sketch.
+    unsigned short int numCentroids;
+    // Maximum number of centroids allowed in the sketch.
+    unsigned short int maxCentroids;
+    // Number of centroids the data array has room for. It starts small and
+    // grows as values are added, up to at least maxCentroids. Packed sketches
+    // have a capacity of 0 (see packHistK).
+    unsigned short int capacity;
+    // HISTK_VALUES_DOUBLE or HISTK_VALUES_FLOAT.
+    unsigned char valueType;
+    // Size in bytes of each count: 1, 2, 4 or 8.
+    unsigned char countWidth;
+    // capacity values, sorted in increasing order, then capacity counts. See
+    // histkValues and histkCounts.
+    unsigned char data[];
+};
+
+static inline size_t valueSize(unsigned char valueType) {
+    return valueType == HISTK_VALUES_FLOAT ? sizeof(float) : sizeof(double);
+}
+
+// Return the offset of the counts array within the data array of a sketch:
+// just past the values, rounded up so that counts are 8-byte aligned.
+static inline size_t countsOffset(unsigned char valueType,
+                                  unsigned int capacity) {
+    return (capacity * valueSize(valueType) + 7) & ~(size_t)7;
+}
+
+static inline void *histkValues(const struct HistK *h) {
+    return (void *)h->data;
+}
+
+static inline void *histkCounts(const struct HistK *h) {
+    return (void *)(h->data + countsOffset(h->valueType, h->capacity));
+}
+
+// Round v to the nearest float, clamping values that are out of range.
+static inline double toFloatValue(double v) {
+    if (v > FLT_MAX) { return FLT_MAX; }
+    if (v < -FLT_MAX) { return -FLT_MAX; }
+    return (float)v;
+}
+
+static inline double getValue(const struct HistK *h, int i) {
+    if (h->valueType == HISTK_VALUES_FLOAT) {
+        return ((const float *)histkValues(h))[i];
+    }
+    return ((const double *)histkValues(h))[i];
+}
+
+static inline void setValue(struct HistK *h, int i, double v) {
+    if (h->valueType == HISTK_VALUES_FLOAT) {
+        ((float *)histkValues(h))[i] = toFloatValue(v);
+    } else {
+        ((double *)histkValues(h))[i] = v;
+    }
+}
+
+static inline unsigned long long getCount(const struct HistK *h, int i) {
+    switch (h->countWidth) {
+    case 1: return ((const uint8_t *)histkCounts(h))[i];
+    case 2: return ((const uint16_t *)histkCounts(h))[i];
+    case 4: return ((const uint32_t *)histkCounts(h))[i];
+    default: return ((const uint64_t *)histkCounts(h))[i];
+    }
+}
+
+static inline void setCount(struct HistK *h, int i, unsigned long long c) {
+    switch (h->countWidth) {
+    case 1: ((uint8_t *)histkCounts(h))[i] = c; break;
+    case 2: ((uint16_t *)histkCounts(h))[i] = c; break;
+    case 4: ((uint32_t *)histkCounts(h))[i] = c; break;
+    default: ((uint64_t *)histkCounts(h))[i] = c; break;
+    }
+}
+
+// Return the largest count that fits in width bytes.
+static inline unsigned long long countLimit(unsigned char width) {
+    return width >= 8 ? UINT64_MAX : (1ULL << (8 * width)) - 1;
+}
+
+// Whether h is packed (see packHistK).
+static inline int isPacked(const struct HistK *h) {
+    return h->capacity == 0;
+}
+
+// Where the library gets memory. Unpacked sketches come from allocSketch and
+// go back to freeSketch, which lets an application place them apart from
+// everything else; the rest of the library's memory comes from alloc, realloc
+// and free. Every function must be safe to call from any thread that uses the
+// library. By default, all of them are the C library's.
+struct HistKAllocator {
+    void *(*alloc)(size_t size);
+    void *(*realloc)(void *p, size_t size);
+    void (*free)(void *p);
+    void *(*allocSketch)(size_t size);
+    void (*freeSketch)(void *p);
+};
+
+// Use a for all allocations from now on. Call it before creating any sketch.
+void histkSetAllocator(const struct HistKAllocator *a);
+// The allocator in use, for code that builds on the library.
+const struct HistKAllocator *histkAllocator(void);
+
+// Creating, copying and freeing sketches.
+struct HistK *createHistK(unsigned short int maxCentroids,
+                          unsigned char valueType);
+struct HistK *allocHistK(unsigned int n, unsigned char valueType,
+                         unsigned char countWidth);
+struct HistK *copyHistK(const struct HistK *h, unsigned int n,
+                        unsigned char valueType, unsigned char countWidth);
+struct HistK *growHistK(const struct HistK *h, unsigned int n);
+struct HistK *widenHistK(const struct HistK *h);
+struct HistK *shrinkHistK(const struct HistK *h);
+struct HistK *convertHistK(const struct HistK *h, unsigned char valueType);
+struct HistK *packHistK(const struct HistK *h);
+struct HistK *unpackHistK(const struct HistK *h);
+void freeHistK(struct HistK *h);
+size_t histkMemUsage(const struct HistK *h);
+// Scratch sketches are unpacked but come from the allocator's alloc rather
+// than allocSketch, for copies an application keeps apart from the sketches
+// it places, such as ones it only needs for a moment. freeHistK frees them
+// when freeSketch can free what alloc returns, as it can by default.
+struct HistK *allocScratchHistK(unsigned int n, unsigned char valueType,
+                                unsigned char countWidth);
+struct HistK *scratchCopyHistK(const struct HistK *h, unsigned int n,
+                               unsigned char countWidth);
+
+// Updating and querying sketches.
+int histkAdd(struct HistK *h, double value, unsigned long long count);
+double histkQuantile(const struct HistK *h, double q);
+long long histkCountLessThanOrEqual(const struct HistK *h, double v);
+void getCentroids(const struct HistK *h, struct Centroid *cs);
+int sortCentroids(const void *x, const void *y);
+int setCentroids(struct HistK *h, const struct Centroid *cs, int n);
+int mergeCentroidList(struct Centroid *cs, int cn, struct Centroid *rs,
+                      int rn);
+int findMinimumCentroidPair(const struct HistK *h, int skip, double *md);
+void getBorderingCentroids(const struct HistK *h, unsigned int i,
+                           struct Centroid *ci, struct Centroid *cj);
+int addToDynamicCentroidArray(struct Centroid **cs, int i, int n,
+                              const struct Centroid c);
+
+// Serializing sketches.
+size_t serializedSize(const struct HistK *h);
+size_t serializeHistK(const struct HistK *h, unsigned char *buf);
+struct HistK *deserializeHistK(const unsigned char *buf, size_t len);
+struct HistK *deserializePackedHistK(const unsigned char *buf, size_t len);
+unsigned char *dumpHistK(const struct HistK *h, size_t *len);
+struct HistK *restoreHistK(const unsigned char *buf, size_t len, int packed);
+struct HistK *restoreScratchHistK(const unsigned char *buf, size_t len);
+
+// A patch describes how a command changed a sketch, so that replicas can
+// apply the change instead of repeating the command (see HISTK.PATCH). It
+// says to replace centroids [from, from + removed) of a sketch that has
+// expected centroids with the centroids in the patch, and gives the sketch's
+// new header. A patch is written as from, removed and expected as varints,
+// then the rest as a serialized sketch (see serializeHistK) whose centroids
+// are the ones inserted.
+struct HistKPatch {
+    int from;
+    int removed;
+    int expected;
+    // Packed centroids to insert, and the sum of their counts.
+    const unsigned char *centroids;
+    uint64_t total;
+    // The header of the patched sketch, except that numCentroids is the
+    // number of centroids to insert.
+    struct HistK header;
+};
+
+size_t patchSize(const struct HistK *after);
+size_t writeHistKPatch(const struct HistK *before, const struct HistK *after,
+                       unsigned char *buf);
+int parseHistKPatch(const unsigned char *buf, size_t len,
+                    struct HistKPatch *patch);
+int applyHistKPatch(struct HistK *h, const struct HistKPatch *patch);
+
+// Recording from many threads. A recorder is a sketch that any number of
+// threads can add values to at once without waiting on each other: each
+// thread adds to a sketch of its own, and collectHistKRecorder merges them.
+// Values a thread records are only collected once it has recorded a batch of
+// them (currently 256), calls histkFlushRecorder or exits, so threads that
+// record rarely should flush after each unit of work. Every recorder uses a
+// pthread key while it exists.
+struct HistKRecorder;
+
+// Return a new recorder whose sketches have the given size and value type, or
+// NULL if no more pthread keys are available.
+struct HistKRecorder *createHistKRecorder(unsigned short int maxCentroids,
+                                          unsigned char valueType);
+// Free r. No thread may record to r, or exit having recorded to it, while
+// this runs, and none may record to r afterwards.
+void freeHistKRecorder(struct HistKRecorder *r);
+// Record count occurrences of value in r from the calling thread.
+void histkRecord(struct HistKRecorder *r, double value,
+                 unsigned long long count);
+// Make everything the calling thread recorded in r visible to collectors.
+void histkFlushRecorder(struct HistKRecorder *r);
+// Return a sketch of everything recorded in r and flushed so far, which the
+// caller frees.
+struct HistK *collectHistKRecorder(struct HistKRecorder *r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
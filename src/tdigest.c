@@ -0,0 +1,394 @@
+/* A merging t-digest; see tdigest.h. */
+
+#include "float.h"
+#include "math.h"
+#include "stdlib.h"
+#include "string.h"
+
+#include "encoding.h"
+#include "tdigest.h"
+
+static int tdigestCapacity(double compression) {
+    return 2 * (int)ceil(compression) + 2;
+}
+
+struct TDigest *createTDigest(double compression) {
+    int capacity = tdigestCapacity(compression);
+    int bufferSize = capacity;
+    struct TDigest *t = histkAllocator()->alloc(
+        sizeof(*t) + (capacity + bufferSize) * sizeof(struct Centroid));
+    t->compression = compression;
+    t->totalCount = 0;
+    t->min = DBL_MAX;
+    t->max = -DBL_MAX;
+    t->numCentroids = 0;
+    t->numBuffered = 0;
+    t->capacity = capacity;
+    t->bufferSize = bufferSize;
+    return t;
+}
+
+size_t tdigestMemUsage(const struct TDigest *t) {
+    return sizeof(*t) + (t->capacity + t->bufferSize) * sizeof(struct Centroid);
+}
+
+struct TDigest *copyTDigest(const struct TDigest *t) {
+    struct TDigest *c = histkAllocator()->alloc(tdigestMemUsage(t));
+    memcpy(c, t, tdigestMemUsage(t));
+    return c;
+}
+
+void freeTDigest(struct TDigest *t) {
+    histkAllocator()->free(t);
+}
+
+static inline struct Centroid *tdigestBuffer(const struct TDigest *t) {
+    return (struct Centroid *)t->data + t->capacity;
+}
+
+// The scale function k1 maps the quantile of a centroid's left edge to the
+// largest quantile its right edge may reach: one unit of
+// k(q) = compression / pi * asin(2q - 1) further on. That's twice the units
+// of the paper's k1, for about as many centroids as the compression, and a
+// greedy merge leaves fewer than twice that.
+static double quantileLimit(double compression, double q) {
+    double k = asin(2 * q - 1) + M_PI / compression;
+    return k >= M_PI / 2 ? 1 : (sin(k) + 1) / 2;
+}
+
+// Merge the na centroids at a and nb at b, both sorted by value, into as few
+// centroids as the scale function allows, writing them to out, which has
+// room for capacity. Returns the number written.
+static int mergeCentroidRuns(const struct Centroid *a, int na,
+                             const struct Centroid *b, int nb,
+                             double compression, uint64_t total,
+                             struct Centroid *out, int capacity) {
+    int i = 0, j = 0, n = 0;
+    double before = 0, limit = 0;
+    struct Centroid cur = {0, 0};
+    while (i < na || j < nb) {
+        struct Centroid c = j == nb || (i < na && a[i].value <= b[j].value) ?
+            a[i++] : b[j++];
+        if (cur.count == 0) {
+            cur = c;
+            limit = quantileLimit(compression, before / total) * total;
+        } else if (before + cur.count + c.count <= limit ||
+                   n == capacity - 1) {
+            cur.count += c.count;
+            cur.value += (c.value - cur.value) * c.count / cur.count;
+        } else {
+            out[n++] = cur;
+            before += cur.count;
+            cur = c;
+            limit = quantileLimit(compression, before / total) * total;
+        }
+    }
+    if (cur.count > 0) { out[n++] = cur; }
+    return n;
+}
+
+void compressTDigest(struct TDigest *t) {
+    if (t->numBuffered == 0) { return; }
+    struct Centroid *buffer = tdigestBuffer(t);
+    qsort(buffer, t->numBuffered, sizeof(*buffer), sortCentroids);
+    struct Centroid *out = histkAllocator()->alloc(
+        t->capacity * sizeof(*out));
+    t->numCentroids = mergeCentroidRuns(
+        t->data, t->numCentroids, buffer, t->numBuffered, t->compression,
+        t->totalCount, out, t->capacity);
+    memcpy(t->data, out, t->numCentroids * sizeof(*out));
+    histkAllocator()->free(out);
+    t->numBuffered = 0;
+}
+
+void tdigestAdd(struct TDigest *t, double value, unsigned long long count) {
+    if (t->numBuffered == t->bufferSize) { compressTDigest(t); }
+    struct Centroid c = {value, count};
+    tdigestBuffer(t)[t->numBuffered++] = c;
+    t->totalCount += count;
+    if (value < t->min) { t->min = value; }
+    if (value > t->max) { t->max = value; }
+}
+
+// Merge the na centroids at a and nb at b, both sorted by value, into out.
+static void mergeSortedRuns(const struct Centroid *a, int na,
+                            const struct Centroid *b, int nb,
+                            struct Centroid *out) {
+    int i = 0, j = 0;
+    while (i < na || j < nb) {
+        *out++ = j == nb || (i < na && a[i].value <= b[j].value) ?
+            a[i++] : b[j++];
+    }
+}
+
+// Merging puts dst's and src's centroids in one sorted run and their
+// buffered values, sorted once, in another, and merges the two in one pass,
+// rather than adding them to dst one at a time, which would compress dst
+// every bufferSize of them.
+void tdigestMerge(struct TDigest *dst, const struct TDigest *src) {
+    int nc = dst->numCentroids + src->numCentroids;
+    int nb = dst->numBuffered + src->numBuffered;
+    struct Centroid *cs = histkAllocator()->alloc((nc + nb) * sizeof(*cs));
+    struct Centroid *buffer = cs + nc;
+    mergeSortedRuns(dst->data, dst->numCentroids, src->data,
+                    src->numCentroids, cs);
+    memcpy(buffer, tdigestBuffer(dst), dst->numBuffered * sizeof(*cs));
+    memcpy(buffer + dst->numBuffered, tdigestBuffer(src),
+           src->numBuffered * sizeof(*cs));
+    qsort(buffer, nb, sizeof(*cs), sortCentroids);
+    // src may be dst, so it's only read before dst changes.
+    if (src->min < dst->min) { dst->min = src->min; }
+    if (src->max > dst->max) { dst->max = src->max; }
+    dst->totalCount += src->totalCount;
+    dst->numCentroids = mergeCentroidRuns(
+        cs, nc, buffer, nb, dst->compression, dst->totalCount, dst->data,
+        dst->capacity);
+    dst->numBuffered = 0;
+    histkAllocator()->free(cs);
+}
+
+// Return every centroid and buffered value of t sorted by value and set *n
+// to their number. Queries read this rather than merging the buffer, so they
+// don't change the digest. Without buffered values, that's t's centroids;
+// otherwise it's an array the caller frees with releaseSortedCentroids.
+static const struct Centroid *sortedCentroids(const struct TDigest *t,
+                                              int *n) {
+    *n = t->numCentroids + t->numBuffered;
+    if (t->numBuffered == 0) { return t->data; }
+    struct Centroid *cs = histkAllocator()->alloc(*n * sizeof(*cs));
+    struct Centroid *buffer = cs;
+    memcpy(buffer, tdigestBuffer(t), t->numBuffered * sizeof(*cs));
+    qsort(buffer, t->numBuffered, sizeof(*cs), sortCentroids);
+    // Merge the two runs from the back, which never overtakes the sorted
+    // buffer at the front.
+    int i = t->numCentroids - 1, j = t->numBuffered - 1;
+    for (int k = *n - 1; i >= 0; k--) {
+        cs[k] = j < 0 || t->data[i].value > buffer[j].value ?
+            t->data[i--] : buffer[j--];
+    }
+    return cs;
+}
+
+static void releaseSortedCentroids(const struct TDigest *t,
+                                   const struct Centroid *cs) {
+    if (cs != t->data) { histkAllocator()->free((void *)cs); }
+}
+
+// Quantiles are interpolated between the midpoints of the centroids: a
+// centroid holding c values at v is taken to have as many below v as above,
+// and the extremes to lie at rank 0 and the total count.
+static double quantileOf(const struct TDigest *t, const struct Centroid *cs,
+                         int n, double q) {
+    if (q <= 0) { return t->min; }
+    if (q >= 1) { return t->max; }
+    double rank = q * t->totalCount;
+    double v = t->min, r = 0, before = 0, next = t->max,
+        nextRank = t->totalCount;
+    for (int i = 0; i < n; i++) {
+        double mid = before + cs[i].count / 2.0;
+        if (rank <= mid) {
+            next = cs[i].value;
+            nextRank = mid;
+            break;
+        }
+        v = cs[i].value;
+        r = mid;
+        before += cs[i].count;
+    }
+    return nextRank > r ? v + (next - v) * (rank - r) / (nextRank - r) : next;
+}
+
+void tdigestQuantiles(const struct TDigest *t, const double *qs, int n,
+                      double *out) {
+    if (t->totalCount == 0) {
+        for (int i = 0; i < n; i++) { out[i] = NAN; }
+        return;
+    }
+    int m;
+    const struct Centroid *cs = sortedCentroids(t, &m);
+    for (int i = 0; i < n; i++) { out[i] = quantileOf(t, cs, m, qs[i]); }
+    releaseSortedCentroids(t, cs);
+}
+
+double tdigestQuantile(const struct TDigest *t, double q) {
+    double v;
+    tdigestQuantiles(t, &q, 1, &v);
+    return v;
+}
+
+long long tdigestCountLessThanOrEqual(const struct TDigest *t, double v) {
+    if (t->totalCount == 0 || v < t->min) { return 0; }
+    if (v >= t->max) { return t->totalCount; }
+    int n;
+    const struct Centroid *cs = sortedCentroids(t, &n);
+    double prev = t->min, r = 0, before = 0, next = t->max,
+        nextRank = t->totalCount;
+    for (int i = 0; i < n; i++) {
+        double mid = before + cs[i].count / 2.0;
+        if (v < cs[i].value) {
+            next = cs[i].value;
+            nextRank = mid;
+            break;
+        }
+        prev = cs[i].value;
+        r = mid;
+        before += cs[i].count;
+    }
+    releaseSortedCentroids(t, cs);
+    // prev <= v < next.
+    return llround(r + (nextRank - r) * (v - prev) / (next - prev));
+}
+
+// A digest is serialized as its compression, total count, min and max, then
+// the number of centroids and of buffered values as varints, followed by
+// each of them as a double and a varint count.
+#define TDIGEST_ENTRY_MAX (8 + HISTK_VARINT_MAX)
+
+size_t tdigestSerializedSize(const struct TDigest *t) {
+    return 8 + HISTK_VARINT_MAX + 8 + 8 + 2 * HISTK_VARINT_MAX +
+        (t->numCentroids + t->numBuffered) * TDIGEST_ENTRY_MAX;
+}
+
+static unsigned char *putCentroids(unsigned char *p, const struct Centroid *cs,
+                                   int n) {
+    for (int i = 0; i < n; i++) {
+        p = putDouble(p, cs[i].value);
+        p = putVarint(p, cs[i].count);
+    }
+    return p;
+}
+
+size_t serializeTDigest(const struct TDigest *t, unsigned char *buf) {
+    unsigned char *p = putDouble(buf, t->compression);
+    p = putVarint(p, t->totalCount);
+    p = putDouble(p, t->min);
+    p = putDouble(p, t->max);
+    p = putVarint(p, t->numCentroids);
+    p = putVarint(p, t->numBuffered);
+    p = putCentroids(p, t->data, t->numCentroids);
+    p = putCentroids(p, tdigestBuffer(t), t->numBuffered);
+    return p - buf;
+}
+
+// Read n centroids from p into cs, adding their counts to *total. If sorted,
+// their values must not decrease. Returns a pointer past them or NULL if
+// they aren't valid.
+static const unsigned char *getTDigestCentroids(const unsigned char *p,
+                                                const unsigned char *end,
+                                                struct Centroid *cs, int n,
+                                                int sorted, uint64_t *total) {
+    for (int i = 0; i < n; i++) {
+        uint64_t c;
+        if ((p = getDoubleBounded(p, end, &cs[i].value)) == NULL ||
+            (p = getVarintBounded(p, end, &c)) == NULL ||
+            isnan(cs[i].value) || c == 0 ||
+            (sorted && i > 0 && cs[i].value < cs[i - 1].value)) {
+            return NULL;
+        }
+        cs[i].count = c;
+        *total += c;
+    }
+    return p;
+}
+
+struct TDigest *deserializeTDigest(const unsigned char *buf, size_t len) {
+    const unsigned char *p = buf, *end = buf + len;
+    double compression, min, max;
+    uint64_t total, numCentroids, numBuffered;
+    if ((p = getDoubleBounded(p, end, &compression)) == NULL ||
+        !(compression >= TDIGEST_MIN_COMPRESSION &&
+          compression <= TDIGEST_MAX_COMPRESSION) ||
+        (p = getVarintBounded(p, end, &total)) == NULL ||
+        (p = getDoubleBounded(p, end, &min)) == NULL ||
+        (p = getDoubleBounded(p, end, &max)) == NULL ||
+        (p = getVarintBounded(p, end, &numCentroids)) == NULL ||
+        (p = getVarintBounded(p, end, &numBuffered)) == NULL) {
+        return NULL;
+    }
+    struct TDigest *t = createTDigest(compression);
+    uint64_t sum = 0;
+    if (numCentroids > (uint64_t)t->capacity ||
+        numBuffered > (uint64_t)t->bufferSize ||
+        (p = getTDigestCentroids(p, end, t->data, numCentroids, 1,
+                                 &sum)) == NULL ||
+        (p = getTDigestCentroids(p, end, tdigestBuffer(t), numBuffered, 0,
+                                 &sum)) == NULL ||
+        p != end || sum != total || (total > 0 && !(min <= max))) {
+        freeTDigest(t);
+        return NULL;
+    }
+    t->totalCount = total;
+    t->min = min;
+    t->max = max;
+    t->numCentroids = numCentroids;
+    t->numBuffered = numBuffered;
+    return t;
+}
+
+// The engine.
+
+static const struct HistKEngineOption tdigestOptions[] = {
+    {"COMPRESSION", TDIGEST_MIN_COMPRESSION, TDIGEST_MAX_COMPRESSION,
+     TDIGEST_DEFAULT_COMPRESSION, 0}
+};
+
+static void *engineCreate(const double *options) {
+    return createTDigest(options[0]);
+}
+
+static void *engineCopy(const void *s) {
+    return copyTDigest(s);
+}
+
+static void engineFree(void *s) {
+    freeTDigest(s);
+}
+
+static size_t engineMemUsage(const void *s) {
+    return tdigestMemUsage(s);
+}
+
+static void engineAdd(void *s, double value, unsigned long long count) {
+    tdigestAdd(s, value, count);
+}
+
+static unsigned long long engineTotalCount(const void *s) {
+    return ((const struct TDigest *)s)->totalCount;
+}
+
+static double engineQuantile(const void *s, double q) {
+    return tdigestQuantile(s, q);
+}
+
+static void engineQuantiles(const void *s, const double *qs, int n,
+                            double *out) {
+    tdigestQuantiles(s, qs, n, out);
+}
+
+static long long engineCount(const void *s, double v) {
+    return tdigestCountLessThanOrEqual(s, v);
+}
+
+static const char *engineMerge(void *dst, const void *src) {
+    tdigestMerge(dst, src);
+    return NULL;
+}
+
+static size_t engineSerializedSize(const void *s) {
+    return tdigestSerializedSize(s);
+}
+
+static size_t engineSerialize(const void *s, unsigned char *buf) {
+    return serializeTDigest(s, buf);
+}
+
+static void *engineDeserialize(const unsigned char *buf, size_t len) {
+    return deserializeTDigest(buf, len);
+}
+
+const struct HistKEngine tdigestEngine = {
+    "tdigest", 1, tdigestOptions, 1,
+    engineCreate, engineCopy, engineFree, engineMemUsage, engineAdd,
+    engineTotalCount, engineQuantile, engineQuantiles, engineCount,
+    engineMerge, engineSerializedSize, engineSerialize, engineDeserialize
+};
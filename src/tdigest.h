@@ -0,0 +1,78 @@
+/* A merging t-digest, as described in Dunning and Ertl's "Computing Extremely
+ * Accurate Quantiles Using t-Digests" (https://arxiv.org/abs/1902.04023), and
+ * the module's "tdigest" engine.
+ *
+ * Like the histogram sketch, a t-digest is a list of (value, count)
+ * centroids sorted by value, but it merges centroids so that they're small
+ * near the extremes and large in the middle, which keeps tail quantiles
+ * accurate. Values are added to a buffer, and once it fills up it's sorted
+ * and merged into the centroids in one pass, which costs O(1) per value
+ * amortized, besides the sort, instead of a scan of every centroid.
+ *
+ * The compression, between TDIGEST_MIN_COMPRESSION and
+ * TDIGEST_MAX_COMPRESSION, bounds the number of centroids: a digest keeps
+ * about as many as the compression and never more than twice that plus 2,
+ * with a buffer for as many values again.
+ */
+
+#ifndef TDIGEST_H
+#define TDIGEST_H
+
+#include "stddef.h"
+#include "stdint.h"
+
+#include "engine.h"
+#include "libhistk.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TDIGEST_DEFAULT_COMPRESSION 100
+#define TDIGEST_MIN_COMPRESSION 10
+#define TDIGEST_MAX_COMPRESSION 10000
+
+struct TDigest {
+    double compression;
+    uint64_t totalCount;
+    // Only meaningful once the digest holds values.
+    double min;
+    double max;
+    // Centroids merged so far, sorted by value.
+    int numCentroids;
+    // Values added since the last merge, in the order they were added.
+    int numBuffered;
+    int capacity;
+    int bufferSize;
+    // Room for capacity centroids, then bufferSize buffered values.
+    struct Centroid data[];
+};
+
+struct TDigest *createTDigest(double compression);
+struct TDigest *copyTDigest(const struct TDigest *t);
+void freeTDigest(struct TDigest *t);
+size_t tdigestMemUsage(const struct TDigest *t);
+
+void tdigestAdd(struct TDigest *t, double value, unsigned long long count);
+// Merge the buffered values into the centroids.
+void compressTDigest(struct TDigest *t);
+// Add everything in src to dst, which may be src.
+void tdigestMerge(struct TDigest *dst, const struct TDigest *src);
+double tdigestQuantile(const struct TDigest *t, double q);
+// Sets out[i] to the qs[i]-quantile for each of the n qs, sorting the buffer
+// once for all of them.
+void tdigestQuantiles(const struct TDigest *t, const double *qs, int n,
+                      double *out);
+long long tdigestCountLessThanOrEqual(const struct TDigest *t, double v);
+
+size_t tdigestSerializedSize(const struct TDigest *t);
+size_t serializeTDigest(const struct TDigest *t, unsigned char *buf);
+struct TDigest *deserializeTDigest(const unsigned char *buf, size_t len);
+
+extern const struct HistKEngine tdigestEngine;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
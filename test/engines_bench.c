@@ -0,0 +1,205 @@
+/* Benchmark for the sketch engines against the histogram sketch. Build and
+ * run it with `make bench-lib`.
+ *
+ * For each distribution, each engine, with its default options, is given the
+ * same BENCH_VALUES values, and we report the time per add, the time to merge
+ * the sketch into another, the memory the sketch uses and the relative error
+ * of a few quantiles against the exact ones, which come from sorting the
+ * values.
+ */
+
+#include "math.h"
+#include "stdint.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "time.h"
+
+#include "ddsketch.h"
+#include "engine.h"
+#include "hdrhistogram.h"
+#include "kll.h"
+#include "libhistk.h"
+#include "tdigest.h"
+
+#define BENCH_VALUES 1000000
+#define BENCH_MERGES 1000
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Uniformly distributed values in (0, 1), from a xorshift.
+static double nextUniform(uint64_t *x) {
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return (*x >> 11) * 0x1.0p-53 + 0x1.0p-54;
+}
+
+static double nextExponential(uint64_t *x) {
+    return -log(nextUniform(x)) * 1000;
+}
+
+static double nextLognormal(uint64_t *x) {
+    // Box-Muller.
+    double u = nextUniform(x), v = nextUniform(x);
+    return exp(sqrt(-2 * log(u)) * cos(2 * M_PI * v) + 5);
+}
+
+static double nextUniformMs(uint64_t *x) {
+    return nextUniform(x) * 1000;
+}
+
+static const struct {
+    const char *name;
+    double (*next)(uint64_t *x);
+} distributions[] = {
+    {"exponential", nextExponential},
+    {"lognormal", nextLognormal},
+    {"uniform", nextUniformMs},
+};
+
+// The histogram sketch as an engine. Sketches grow and widen as the module
+// makes them, which replaces them, so they're kept behind a pointer.
+static void *bhttCreate(const double *options) {
+    (void)options;
+    struct HistK **h = malloc(sizeof(*h));
+    *h = createHistK(HISTK_DEFAULT_NUM_CENTROIDS, HISTK_VALUES_DOUBLE);
+    return h;
+}
+
+static void bhttFree(void *s) {
+    freeHistK(*(struct HistK **)s);
+    free(s);
+}
+
+static void bhttAdd(void *s, double value, unsigned long long count) {
+    struct HistK **h = s;
+    int err;
+    while ((err = histkAdd(*h, value, count)) != HISTK_OK) {
+        struct HistK *nh = err == HISTK_ERR_FULL ?
+            growHistK(*h, (*h)->numCentroids + 1) : widenHistK(*h);
+        freeHistK(*h);
+        *h = nh;
+    }
+}
+
+static void *bhttCopy(const void *s) {
+    struct HistK *const *h = s;
+    struct HistK **c = malloc(sizeof(*c));
+    *c = copyHistK(*h, (*h)->numCentroids, (*h)->valueType,
+                   (*h)->countWidth);
+    return c;
+}
+
+// Merge as HISTK.MERGESTORE does.
+static const char *bhttMerge(void *dst, const void *src) {
+    struct HistK **h = dst, *const *o = src;
+    int n = (*h)->numCentroids + (*o)->numCentroids;
+    struct Centroid *cs = malloc(n * sizeof(*cs));
+    getCentroids(*h, cs);
+    getCentroids(*o, cs + (*h)->numCentroids);
+    n = mergeCentroidList(cs, n, cs, (*h)->maxCentroids);
+    struct HistK *nh = allocHistK(n, HISTK_VALUES_DOUBLE, 8);
+    nh->maxCentroids = (*h)->maxCentroids;
+    setCentroids(nh, cs, n);
+    nh->min = fmin((*h)->min, (*o)->min);
+    nh->max = fmax((*h)->max, (*o)->max);
+    freeHistK(*h);
+    *h = nh;
+    free(cs);
+    return NULL;
+}
+
+static double bhttQuantile(const void *s, double q) {
+    return histkQuantile(*(struct HistK *const *)s, q);
+}
+
+static size_t bhttMemUsage(const void *s) {
+    return histkMemUsage(*(struct HistK *const *)s);
+}
+
+static const struct HistKEngine bhttEngine = {
+    .name = "bhtt",
+    .create = bhttCreate,
+    .copy = bhttCopy,
+    .free = bhttFree,
+    .add = bhttAdd,
+    .quantile = bhttQuantile,
+    .merge = bhttMerge,
+    .memUsage = bhttMemUsage,
+};
+
+static const struct HistKEngine *engines[] = {
+    &bhttEngine,
+    &tdigestEngine,
+    &ddsketchEngine,
+    &hdrEngine,
+    &kllEngine
+};
+
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+#define BENCH_QUANTILES (sizeof(quantiles) / sizeof(quantiles[0]))
+
+static int compareDoubles(const void *x, const void *y) {
+    double a = *(const double *)x, b = *(const double *)y;
+    return a < b ? -1 : a > b;
+}
+
+static void benchEngine(const struct HistKEngine *e, const double *values,
+                        const double *exact) {
+    double options[HISTK_ENGINE_MAX_OPTIONS];
+    for (int i = 0; i < e->numOptions; i++) {
+        options[i] = e->options[i].defaultValue;
+    }
+    void *s = e->create(options);
+    double start = now();
+    for (int i = 0; i < BENCH_VALUES; i++) { e->add(s, values[i], 1); }
+    double elapsed = now() - start;
+    void *m = e->copy(s);
+    start = now();
+    for (int i = 0; i < BENCH_MERGES; i++) { e->merge(m, s); }
+    double merging = now() - start;
+    e->free(m);
+    printf("  %-10s %10.1f %10.0f %10zu", e->name,
+           elapsed * 1e9 / BENCH_VALUES, merging * 1e9 / BENCH_MERGES,
+           e->memUsage(s));
+    for (size_t i = 0; i < BENCH_QUANTILES; i++) {
+        printf(" %9.4f%%",
+               fabs(e->quantile(s, quantiles[i]) - exact[i]) / exact[i] * 100);
+    }
+    printf("\n");
+    e->free(s);
+}
+
+int main(void) {
+    double *values = malloc(BENCH_VALUES * sizeof(*values));
+    double *sorted = malloc(BENCH_VALUES * sizeof(*sorted));
+    printf("%d values, relative error of each quantile\n", BENCH_VALUES);
+    for (size_t d = 0; d < sizeof(distributions) / sizeof(distributions[0]);
+         d++) {
+        uint64_t x = 88172645463325252ULL;
+        for (int i = 0; i < BENCH_VALUES; i++) {
+            values[i] = sorted[i] = distributions[d].next(&x);
+        }
+        qsort(sorted, BENCH_VALUES, sizeof(*sorted), compareDoubles);
+        double exact[BENCH_QUANTILES];
+        for (size_t i = 0; i < BENCH_QUANTILES; i++) {
+            exact[i] = sorted[(int)(quantiles[i] * (BENCH_VALUES - 1))];
+        }
+        printf("%s\n  %-10s %10s %10s %10s", distributions[d].name, "",
+               "ns/add", "ns/merge", "bytes");
+        for (size_t i = 0; i < BENCH_QUANTILES; i++) {
+            printf(" %9gq", quantiles[i]);
+        }
+        printf("\n");
+        for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+            benchEngine(engines[i], values, exact);
+        }
+    }
+    free(values);
+    free(sorted);
+    return 0;
+}
@@ -0,0 +1,424 @@
+/* Unit tests for the sketch engines. Build and run them with `make test-lib`.
+ *
+ * testEngine runs every engine through the same checks, using only its struct
+ * HistKEngine, as the module does; the rest test each engine on its own.
+ */
+
+#include "assert.h"
+#include "math.h"
+#include "stdint.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+#include "ddsketch.h"
+#include "encoding.h"
+#include "engine.h"
+#include "hdrhistogram.h"
+#include "kll.h"
+#include "tdigest.h"
+
+static const struct HistKEngine *engines[] = {
+    &tdigestEngine,
+    &ddsketchEngine,
+    &hdrEngine,
+    &kllEngine
+};
+
+// Uniformly distributed values in [0, 1), from a xorshift.
+static double nextUniform(uint64_t *x) {
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return (*x >> 11) * 0x1.0p-53;
+}
+
+static void *createDefault(const struct HistKEngine *e) {
+    double options[HISTK_ENGINE_MAX_OPTIONS];
+    assert(e->numOptions <= HISTK_ENGINE_MAX_OPTIONS);
+    for (int i = 0; i < e->numOptions; i++) {
+        assert(e->options[i].min <= e->options[i].defaultValue);
+        assert(e->options[i].defaultValue <= e->options[i].max);
+        assert(!e->options[i].integer ||
+               e->options[i].defaultValue == floor(e->options[i].defaultValue));
+        options[i] = e->options[i].defaultValue;
+    }
+    return e->create(options);
+}
+
+// Quantiles within 1% of the true ones, on 1 to 100000 added out of order.
+static void checkUniform(const struct HistKEngine *e, const void *s,
+                         double n) {
+    assert(e->totalCount(s) == n);
+    assert(e->quantile(s, 0) == 1 && e->quantile(s, 1) == n);
+    for (double q = 0.1; q < 1; q += 0.1) {
+        assert(fabs(e->quantile(s, q) - q * n) < n / 100);
+        assert(fabs(e->countLessThanOrEqual(s, q * n) - q * n) < n / 100);
+    }
+    assert(e->countLessThanOrEqual(s, 0) == 0);
+    assert(e->countLessThanOrEqual(s, n) == n);
+}
+
+static void testEngine(const struct HistKEngine *e) {
+    void *s = createDefault(e);
+    assert(e->totalCount(s) == 0);
+    // Each of 1 to 100000, in the order of a permutation.
+    for (uint64_t i = 0; i < 100000; i++) {
+        e->add(s, (i * 7919) % 100000 + 1, 1);
+    }
+    checkUniform(e, s, 100000);
+    if (e->quantiles != NULL) {
+        double qs[] = {0.9, 0, 0.5, 1, 0.1}, out[5];
+        e->quantiles(s, qs, 5, out);
+        for (int i = 0; i < 5; i++) {
+            assert(out[i] == e->quantile(s, qs[i]));
+        }
+    }
+
+    void *c = e->copy(s);
+    assert(e->merge(c, s) == NULL);
+    assert(e->totalCount(c) == 200000);
+    assert(e->merge(c, c) == NULL);
+    assert(e->totalCount(c) == 400000);
+    assert(fabs(e->quantile(c, 0.5) - 50000) < 1000);
+
+    // serializedSize is only a bound on the size.
+    unsigned char *buf = malloc(e->serializedSize(s));
+    size_t len = e->serialize(s, buf);
+    assert(len <= e->serializedSize(s));
+    void *d = e->deserialize(buf, len);
+    assert(d != NULL);
+    checkUniform(e, d, 100000);
+    for (size_t i = 0; i < len; i++) {
+        assert(e->deserialize(buf, i) == NULL);
+    }
+    assert(e->memUsage(s) > 0);
+    free(buf);
+    e->free(d);
+    e->free(c);
+    e->free(s);
+}
+
+static void testTDigestTails(void) {
+    struct TDigest *t = createTDigest(TDIGEST_DEFAULT_COMPRESSION);
+    uint64_t x = 88172645463325252ULL;
+    for (int i = 0; i < 1000000; i++) { tdigestAdd(t, nextUniform(&x), 1); }
+    compressTDigest(t);
+    assert(t->numBuffered == 0);
+    assert(t->numCentroids <= t->capacity);
+    // Centroids are smaller in the tails, and quantiles more accurate there.
+    assert(t->data[0].count < 1000);
+    assert(t->data[t->numCentroids - 1].count < 1000);
+    assert(fabs(tdigestQuantile(t, 0.999) - 0.999) < 5e-4);
+    assert(fabs(tdigestQuantile(t, 0.001) - 0.001) < 5e-4);
+    assert(fabs(tdigestQuantile(t, 0.5) - 0.5) < 5e-3);
+    freeTDigest(t);
+}
+
+static void testTDigestCounts(void) {
+    struct TDigest *t = createTDigest(TDIGEST_MIN_COMPRESSION);
+    tdigestAdd(t, 5, 3);
+    assert(tdigestQuantile(t, 0) == 5 && tdigestQuantile(t, 1) == 5);
+    assert(tdigestCountLessThanOrEqual(t, 4) == 0);
+    assert(tdigestCountLessThanOrEqual(t, 5) == 3);
+    for (int i = 0; i < 1000; i++) { tdigestAdd(t, i, 1ULL << 40); }
+    assert(t->totalCount == 1000 * (1ULL << 40) + 3);
+    assert(t->min == 0 && t->max == 999);
+    freeTDigest(t);
+}
+
+static void testTDigestMergeCompressions(void) {
+    struct TDigest *a = createTDigest(50), *b = createTDigest(500);
+    for (int i = 0; i < 10000; i++) {
+        tdigestAdd(a, i, 1);
+        tdigestAdd(b, -i, 1);
+    }
+    // The merge keeps dst's compression and leaves nothing buffered.
+    tdigestMerge(a, b);
+    assert(a->compression == 50 && a->totalCount == 20000);
+    assert(a->numBuffered == 0 && a->numCentroids <= a->capacity);
+    assert(a->min == -9999 && a->max == 9999);
+    assert(fabs(tdigestQuantile(a, 0.5)) < 200);
+    freeTDigest(a);
+    freeTDigest(b);
+}
+
+static int compareDoubles(const void *x, const void *y) {
+    double a = *(const double *)x, b = *(const double *)y;
+    return a < b ? -1 : a > b;
+}
+
+static void testDDSketchRelativeError(void) {
+    struct DDSketch *d = createDDSketch(0.01, DDSKETCH_DEFAULT_BUCKETS);
+    // Values from 1e-3 to 1e6, their negatives and 0.
+    int n = 0;
+    double *values = malloc(50000 * sizeof(*values));
+    for (double v = 1e-3; v < 1e6; v *= 1.001) {
+        values[n++] = v;
+        values[n++] = -v;
+    }
+    values[n++] = 0;
+    uint64_t x = 88172645463325252ULL;
+    for (int i = n - 1; i > 0; i--) {
+        int j = nextUniform(&x) * (i + 1);
+        double t = values[i];
+        values[i] = values[j];
+        values[j] = t;
+    }
+    for (int i = 0; i < n; i++) { ddsketchAdd(d, values[i], 1); }
+    assert(d->zeroCount == 1 && d->totalCount == (uint64_t)n);
+    assert(d->positive.dense && d->negative.dense);
+    qsort(values, n, sizeof(*values), compareDoubles);
+    for (double q = 0.001; q < 1; q += 0.001) {
+        double v = values[(int)(q * (n - 1))];
+        assert(fabs(ddsketchQuantile(d, q) - v) <= 0.01 * fabs(v) * 1.000001);
+    }
+    assert(ddsketchQuantile(d, 0.5) == 0);
+    assert(ddsketchCountLessThanOrEqual(d, -1e7) == 0);
+    assert(ddsketchCountLessThanOrEqual(d, 0) == n / 2 + 1);
+    assert(ddsketchCountLessThanOrEqual(d, 1e7) == n);
+    free(values);
+    freeDDSketch(d);
+}
+
+static void testDDSketchStores(void) {
+    struct DDSketch *d = createDDSketch(0.01, DDSKETCH_MIN_BUCKETS);
+    // Two values far apart start out sparse, and collapse once they're more
+    // than maxBuckets indexes apart.
+    ddsketchAdd(d, 1, 1);
+    ddsketchAdd(d, 1.2, 1);
+    assert(!d->positive.dense && d->positive.numBuckets == 2);
+    ddsketchAdd(d, 1.25, 1);
+    assert(!d->positive.dense && d->positive.numBuckets == 3);
+    ddsketchAdd(d, 1000, 1);
+    assert(!d->positive.dense && d->positive.numBuckets == 2);
+    // The three smallest values are now one bucket 15 indexes below 1000's.
+    double collapsed = ddsketchQuantile(d, 0.5);
+    assert(fabs(collapsed - 1000 * pow(1.01 / 0.99, -15)) < 10);
+    assert(ddsketchQuantile(d, 0.1) == collapsed);
+    // Once its indexes are close enough together, the store becomes dense.
+    for (double v = 1000; v < 1250; v *= 1.01) { ddsketchAdd(d, v, 1); }
+    assert(d->positive.dense && d->positive.numBuckets == DDSKETCH_MIN_BUCKETS);
+    assert(d->positive.counts[0] >= 3);
+    assert(d->totalCount == 4 + 23);
+
+    // Merges collapse into dst's number of buckets too.
+    struct DDSketch *big = createDDSketch(0.01, DDSKETCH_DEFAULT_BUCKETS);
+    for (double v = 1; v < 1e4; v *= 1.02) { ddsketchAdd(big, v, 1); }
+    assert(ddsketchMerge(d, big) == HISTK_OK);
+    assert(d->positive.numBuckets == DDSKETCH_MIN_BUCKETS);
+    assert(ddsketchMerge(big, d) == HISTK_OK);
+    assert(big->totalCount == 2 * 466 + 27);
+    struct DDSketch *other = createDDSketch(0.02, DDSKETCH_DEFAULT_BUCKETS);
+    assert(ddsketchMerge(big, other) == HISTK_ERR_INVALID);
+    freeDDSketch(other);
+    freeDDSketch(big);
+    freeDDSketch(d);
+}
+
+static void testHdrRelativeError(void) {
+    struct HdrHistogram *h = createHdrHistogram(
+        HDR_DEFAULT_LOWEST, HDR_DEFAULT_HIGHEST, 3);
+    assert(h != NULL);
+    // Every value from 1 to 1000000: the q-quantile is about q * 1000000, to
+    // 3 significant digits.
+    for (int v = 1; v <= 1000000; v++) { hdrAdd(h, v, 1); }
+    for (double q = 0.0001; q < 1; q += 0.0001) {
+        double v = llround(q * 1000000);
+        assert(fabs(hdrQuantile(h, q) - v) <= v / 1000);
+        assert(fabs(hdrCountLessThanOrEqual(h, v) - v) <= v / 1000);
+    }
+    freeHdrHistogram(h);
+}
+
+static void testHdrRange(void) {
+    assert(createHdrHistogram(10, 15, 2) == NULL);
+    assert(createHdrHistogram(0, 15, 2) == NULL);
+    assert(createHdrHistogram(1, 1000, HDR_MAX_SIGNIFICANT_DIGITS + 1) ==
+           NULL);
+    struct HdrHistogram *h = createHdrHistogram(1, 1000, 2);
+    // Values are rounded and clamped to the range, but min and max aren't.
+    hdrAdd(h, -5, 1);
+    hdrAdd(h, 0.4, 1);
+    hdrAdd(h, 7.6, 2);
+    hdrAdd(h, 1e9, 1);
+    assert(h->totalCount == 5 && h->min == -5 && h->max == 1e9);
+    assert(h->counts[0] == 2 && h->counts[8] == 2);
+    assert(hdrQuantile(h, 0.2) == 0 && hdrQuantile(h, 0.6) == 8);
+    assert(fabs(hdrQuantile(h, 0.99) - 1000) < 10);
+    assert(hdrCountLessThanOrEqual(h, 7) == 2);
+    assert(hdrCountLessThanOrEqual(h, 8) == 4);
+    assert(hdrCountLessThanOrEqual(h, 1000) == 4);
+
+    // Mostly empty histograms serialize to a few bytes.
+    unsigned char *buf = malloc(hdrSerializedSize(h));
+    size_t len = serializeHdrHistogram(h, buf);
+    assert(len < 40);
+    struct HdrHistogram *d = deserializeHdrHistogram(buf, len);
+    assert(d != NULL && hdrMemUsage(d) == hdrMemUsage(h));
+    assert(memcmp(d->counts, h->counts, h->numCounts * sizeof(uint64_t)) ==
+           0);
+    free(buf);
+
+    assert(hdrMerge(d, h) == HISTK_OK);
+    assert(d->totalCount == 10 && d->counts[8] == 4);
+    struct HdrHistogram *other = createHdrHistogram(1, 1000, 3);
+    assert(hdrMerge(d, other) == HISTK_ERR_INVALID);
+    assert(d->totalCount == 10);
+    freeHdrHistogram(other);
+    freeHdrHistogram(d);
+    freeHdrHistogram(h);
+}
+
+// A serialized 1 to 1000, 2 digit histogram holding total counts, with the
+// given signed varints as its body.
+static size_t hdrBlob(unsigned char *buf, uint64_t total, const int64_t *body,
+                      int n) {
+    unsigned char *p = putVarint(putVarint(putVarint(buf, 1), 1000), 2);
+    p = putVarint(putDouble(putDouble(p, 5), 5), total);
+    for (int i = 0; i < n; i++) { p = putSignedVarint(p, body[i]); }
+    return p - buf;
+}
+
+static void testHdrAdversarialRuns(void) {
+    struct HdrHistogram *h = createHdrHistogram(1, 1000, 2);
+    int64_t m = h->numCounts;
+    freeHdrHistogram(h);
+    unsigned char buf[256];
+    // A run may stop just short of the end, but not reach or pass it.
+    int64_t last[] = {-(m - 1), 1};
+    h = deserializeHdrHistogram(buf, hdrBlob(buf, 1, last, 2));
+    assert(h != NULL && h->counts[m - 1] == 1);
+    freeHdrHistogram(h);
+    int64_t past[][2] = {{-m, 1}, {INT64_MIN, 1}, {INT64_MIN + 1, 1}};
+    for (int i = 0; i < 3; i++) {
+        assert(deserializeHdrHistogram(buf, hdrBlob(buf, 1, past[i], 2)) ==
+               NULL);
+    }
+    // Random bodies mixing huge runs and counts never write out of bounds.
+    int64_t picks[] = {INT64_MIN, INT64_MIN + 1, -m, -(m - 1), -1, -7, 1, 3,
+                       INT64_MAX};
+    uint64_t x = 42;
+    for (int t = 0; t < 100000; t++) {
+        int64_t body[12];
+        int n = 1 + (int)(nextUniform(&x) * 12);
+        for (int i = 0; i < n; i++) {
+            body[i] = picks[(int)(nextUniform(&x) * 9)];
+        }
+        for (uint64_t total = 0; total < 4; total++) {
+            freeHdrHistogram(
+                deserializeHdrHistogram(buf, hdrBlob(buf, total, body, n)));
+        }
+    }
+}
+
+// The largest difference between the rank of each quantile and the true
+// one, as a fraction of n, for a sketch of a permutation of 1 to n.
+static double kllRankError(const struct KLLSketch *s, int n) {
+    double qs[999], out[999], worst = 0;
+    for (int i = 0; i < 999; i++) { qs[i] = (i + 1) / 1000.0; }
+    kllQuantiles(s, qs, 999, out);
+    for (int i = 0; i < 999; i++) {
+        double err = fabs(out[i] - qs[i] * n) / n;
+        if (err > worst) { worst = err; }
+    }
+    return worst;
+}
+
+static void testKLLRankError(void) {
+    struct KLLSketch *s = createKLLSketch(KLL_DEFAULT_K);
+    int n = 1000000;
+    for (uint64_t i = 0; i < (uint64_t)n; i++) {
+        kllAdd(s, (i * 7919) % n + 1, 1);
+    }
+    assert(s->totalCount == (uint64_t)n);
+    assert(kllRankError(s, n) < 0.0165);
+    // The sketch keeps about 3k items, levels above 0 sorted.
+    assert(s->capacity < (uint32_t)(3 * KLL_DEFAULT_K + s->numLevels * 8));
+    for (int h = 1; h < s->numLevels; h++) {
+        for (uint32_t j = s->levels[h] + 1; j < s->levels[h + 1]; j++) {
+            assert(s->items[j - 1] <= s->items[j]);
+        }
+    }
+    for (int i = 1; i < 10; i++) {
+        assert(llabs(kllCountLessThanOrEqual(s, i * n / 10) - i * n / 10) <
+               0.0165 * n);
+    }
+    freeKLLSketch(s);
+}
+
+static void testKLLCounts(void) {
+    struct KLLSketch *s = createKLLSketch(KLL_MIN_K);
+    // Counts add an item at each of their bits' levels.
+    kllAdd(s, 5, 1000);
+    assert(s->totalCount == 1000 && s->numLevels == 10);
+    assert(kllQuantile(s, 0.5) == 5 && kllCountLessThanOrEqual(s, 5) == 1000);
+    kllAdd(s, 1, 1000);
+    kllAdd(s, 9, 2000);
+    assert(kllQuantile(s, 0.2) == 1 && kllQuantile(s, 0.3) == 5);
+    assert(kllQuantile(s, 0.6) == 9);
+    assert(kllCountLessThanOrEqual(s, 5) == 2000);
+    freeKLLSketch(s);
+}
+
+static void testKLLSaturatedCounts(void) {
+    struct KLLSketch *s = createKLLSketch(KLL_MIN_K);
+    for (int i = 0; i < 655; i++) { kllAdd(s, i, INT64_MAX); }
+    assert(s->totalCount == UINT64_MAX && s->numLevels <= KLL_MAX_LEVELS);
+    assert(kllQuantile(s, 0.5) >= 0 && kllQuantile(s, 0.5) <= 654);
+    unsigned char *buf = malloc(kllSerializedSize(s));
+    size_t len = serializeKLLSketch(s, buf);
+    struct KLLSketch *d = deserializeKLLSketch(buf, len);
+    assert(d != NULL && d->totalCount == UINT64_MAX);
+    assert(kllQuantile(d, 0.5) == kllQuantile(s, 0.5));
+    free(buf);
+    assert(kllMerge(d, s) == HISTK_ERR_OVERFLOW);
+    assert(d->totalCount == UINT64_MAX);
+    freeKLLSketch(d);
+    freeKLLSketch(s);
+}
+
+static void testKLLMerge(void) {
+    // A permutation of 1 to n, over 100 sketches merged together.
+    int n = 1000000;
+    struct KLLSketch *s = createKLLSketch(KLL_DEFAULT_K);
+    for (int i = 0; i < 100; i++) {
+        struct KLLSketch *p = createKLLSketch(KLL_DEFAULT_K);
+        for (uint64_t j = i * (n / 100); j < (i + 1) * (uint64_t)(n / 100);
+             j++) {
+            kllAdd(p, (j * 7919) % n + 1, 1);
+        }
+        assert(kllMerge(s, p) == HISTK_OK);
+        freeKLLSketch(p);
+    }
+    assert(s->totalCount == (uint64_t)n && s->min == 1 && s->max == n);
+    assert(kllRankError(s, n) < 0.0165);
+    assert(s->capacity < (uint32_t)(3 * KLL_DEFAULT_K + s->numLevels * 8));
+    assert(kllMerge(s, s) == HISTK_OK);
+    assert(s->totalCount == 2 * (uint64_t)n);
+    assert(kllRankError(s, n) < 0.0165);
+    struct KLLSketch *other = createKLLSketch(100);
+    assert(kllMerge(s, other) == HISTK_ERR_INVALID);
+    freeKLLSketch(other);
+    freeKLLSketch(s);
+}
+
+int main(void) {
+    for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+        testEngine(engines[i]);
+    }
+    testTDigestTails();
+    testTDigestCounts();
+    testTDigestMergeCompressions();
+    testDDSketchRelativeError();
+    testDDSketchStores();
+    testHdrRelativeError();
+    testHdrRange();
+    testHdrAdversarialRuns();
+    testKLLRankError();
+    testKLLCounts();
+    testKLLSaturatedCounts();
+    testKLLMerge();
+    printf("engines: all tests passed\n");
+    return 0;
+}
@@ -0,0 +1,109 @@
+/* Benchmarks for histk.hpp. Build and run them with `make bench-lib`.
+ *
+ * Adds the same values to a histk::Sketch and a struct HistK of each size and
+ * reports the time per add, the best of a few runs, and per quantile.
+ */
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "histk.hpp"
+
+static const int benchValues = 1 << 19;
+static const int benchQuantiles = 1 << 16;
+
+static double now() {
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Latency-like values: exponentially distributed.
+static std::vector<double> makeValues() {
+    std::vector<double> vs(benchValues);
+    uint64_t x = 88172645463325252ull;
+    for (double &v : vs) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        v = -std::log(std::ldexp(x >> 11, -53) + std::ldexp(1, -54)) * 1000;
+    }
+    return vs;
+}
+
+static const int benchRuns = 3;
+
+// Return the seconds per add of the quickest of benchRuns runs of adding vs
+// to a Sketch<N>, and the seconds per quantile of the last one.
+template <unsigned int N>
+static double benchSketch(const std::vector<double> &vs, double *quantile) {
+    double best = 1e9;
+    volatile double sink = 0;
+    for (int r = 0; r < benchRuns; r++) {
+        histk::Sketch<N> s;
+        double start = now();
+        for (double v : vs) { s.add(v); }
+        double t = (now() - start) / vs.size();
+        if (t < best) { best = t; }
+        start = now();
+        for (int i = 0; i < benchQuantiles; i++) {
+            sink = sink + s.quantile(i / (double)benchQuantiles);
+        }
+        *quantile = (now() - start) / benchQuantiles;
+    }
+    return best;
+}
+
+// Like benchSketch, for a struct HistK with N maxCentroids.
+template <unsigned int N>
+static double benchCore(const std::vector<double> &vs, double *quantile) {
+    double best = 1e9;
+    volatile double sink = 0;
+    for (int r = 0; r < benchRuns; r++) {
+        struct HistK *h = createHistK(N, HISTK_VALUES_DOUBLE);
+        double start = now();
+        for (double v : vs) {
+            int err;
+            while ((err = histkAdd(h, v, 1)) != HISTK_OK) {
+                struct HistK *nh = err == HISTK_ERR_FULL ?
+                    growHistK(h, h->numCentroids + 1) : widenHistK(h);
+                freeHistK(h);
+                h = nh;
+            }
+        }
+        double t = (now() - start) / vs.size();
+        if (t < best) { best = t; }
+        start = now();
+        for (int i = 0; i < benchQuantiles; i++) {
+            sink = sink + histkQuantile(h, i / (double)benchQuantiles);
+        }
+        *quantile = (now() - start) / benchQuantiles;
+        freeHistK(h);
+    }
+    return best;
+}
+
+template <unsigned int N>
+static void bench(const std::vector<double> &vs) {
+    double coreQuantile, sketchQuantile;
+    double coreAdd = benchCore<N>(vs, &coreQuantile);
+    double sketchAdd = benchSketch<N>(vs, &sketchQuantile);
+    printf("%-6u %12.1f %12.1f %7.2fx %12.1f %12.1f %7.2fx\n", N,
+           coreAdd * 1e9, sketchAdd * 1e9, coreAdd / sketchAdd,
+           coreQuantile * 1e9, sketchQuantile * 1e9,
+           coreQuantile / sketchQuantile);
+}
+
+int main() {
+    std::vector<double> vs = makeValues();
+    printf("histk::Sketch<N> against struct HistK, ns per operation\n");
+    printf("%-6s %12s %12s %8s %12s %12s %8s\n", "N", "C add", "C++ add",
+           "speedup", "C quantile", "C++ quantile", "speedup");
+    bench<16>(vs);
+    bench<64>(vs);
+    bench<128>(vs);
+    bench<1024>(vs);
+    return 0;
+}
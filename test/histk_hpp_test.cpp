@@ -0,0 +1,112 @@
+/* Unit tests for histk.hpp. Build and run them with `make test-lib`. */
+
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "histk.hpp"
+
+// Add value to the sketch at *h, making room as the module does.
+static void add(struct HistK **h, double value, unsigned long long count) {
+    int err;
+    while ((err = histkAdd(*h, value, count)) != HISTK_OK) {
+        struct HistK *nh = err == HISTK_ERR_FULL ?
+            growHistK(*h, (*h)->numCentroids + 1) : widenHistK(*h);
+        freeHistK(*h);
+        *h = nh;
+    }
+}
+
+// Feed the same values to a Sketch and a struct HistK and check that they
+// come out the same, down to their dumps.
+template <unsigned int N, typename Value>
+static void testSameAsCore(unsigned char valueType, unsigned int seed) {
+    histk::Sketch<N, Value> s;
+    struct HistK *h = createHistK(N, valueType);
+    srand(seed);
+    for (int i = 0; i < 20000; i++) {
+        // Some repeated values, some spread out, some far away.
+        double v = i % 7 == 0 ? i % 50 : rand() / (double)RAND_MAX * 1000;
+        if (i % 1000 == 999) { v = -v * 1e6; }
+        unsigned long long c = 1 + rand() % 3;
+        assert(s.add(v, c));
+        add(&h, v, c);
+    }
+    assert(s.totalCount() == h->totalCount);
+    assert(s.numCentroids() == h->numCentroids);
+    for (int i = 0; i < s.numCentroids(); i++) {
+        assert(s.value(i) == getValue(h, i) && s.count(i) == getCount(h, i));
+    }
+    for (double q = 0; q <= 1; q += 0.01) {
+        assert(s.quantile(q) == histkQuantile(h, q));
+    }
+    for (double v = -1e9; v < 2000; v = v < 0 ? v / 2 + 1 : v + 17) {
+        assert(s.countLessThanOrEqual(v) == histkCountLessThanOrEqual(h, v));
+    }
+    size_t len;
+    unsigned char *buf = dumpHistK(h, &len);
+    std::string d = s.dump();
+    assert(d.size() == len && memcmp(d.data(), buf, len) == 0);
+    free(buf);
+    freeHistK(h);
+}
+
+static void testCounts() {
+    histk::Sketch<4, double, uint8_t> s;
+    assert(s.add(1, 255));
+    assert(!s.add(1, 1));
+    assert(!s.add(2, 256));
+    assert(s.totalCount() == 255 && s.numCentroids() == 1);
+    for (int i = 2; i <= 4; i++) { assert(s.add(i, 200)); }
+    // Merging 1 and 2 would overflow.
+    assert(!s.add(1.4, 1));
+    assert(s.totalCount() == 855 && s.numCentroids() == 4);
+}
+
+static void testInfinitiesAtOneCentroid() {
+    for (double inf : {-INFINITY, INFINITY}) {
+        histk::Sketch<1> s;
+        assert(s.add(1) && s.add(inf));
+        assert(s.numCentroids() == 1 && s.count(0) == 2);
+        assert(s.totalCount() == 2);
+        assert(s.min() == std::fmin(1, inf) && s.max() == std::fmax(1, inf));
+    }
+}
+
+static void testInfiniteGaps() {
+    histk::Sketch<2> s;
+    assert(s.add(-INFINITY) && s.add(INFINITY) && s.add(5));
+    assert(s.numCentroids() == 2 && s.totalCount() == 3);
+    assert(s.value(0) == -INFINITY && s.count(0) == 2);
+    assert(s.value(1) == INFINITY && s.count(1) == 1);
+}
+
+static void testRestore() {
+    histk::Sketch<16, float, uint32_t> s;
+    for (int i = 0; i < 100; i++) { s.add(i * 0.1, 100000); }
+    unsigned char buf[decltype(s)::maxDumpSize];
+    size_t len = s.dump(buf);
+    struct HistK *h = restoreHistK(buf, len, 0);
+    assert(h != NULL && h->valueType == HISTK_VALUES_FLOAT);
+    assert(h->countWidth == 4 && h->maxCentroids == 16);
+    assert(h->totalCount == s.totalCount() && h->min == s.min());
+    assert(histkQuantile(h, 0.5) == s.quantile(0.5));
+    freeHistK(h);
+}
+
+int main() {
+    testSameAsCore<8, double>(HISTK_VALUES_DOUBLE, 1);
+    testSameAsCore<64, double>(HISTK_VALUES_DOUBLE, 2);
+    testSameAsCore<64, float>(HISTK_VALUES_FLOAT, 3);
+    testSameAsCore<128, double>(HISTK_VALUES_DOUBLE, 4);
+    testSameAsCore<1024, float>(HISTK_VALUES_FLOAT, 5);
+    testCounts();
+    testInfinitiesAtOneCentroid();
+    testInfiniteGaps();
+    testRestore();
+    printf("histk.hpp: all tests passed\n");
+    return 0;
+}
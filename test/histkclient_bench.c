@@ -0,0 +1,155 @@
+/* Benchmark for histkclient against a redis-server that has the module
+ * loaded. `make bench-client` starts one and runs it; to use a server of
+ * your own, run `histkclient_bench <port>`.
+ *
+ * We record the same values for a number of keys twice: once sending each
+ * value to Redis with HISTK.ADD, pipelined a batch at a time, and once through
+ * a client that flushes after a batch of values. For each we report values
+ * recorded per second, bytes sent per value and the time Redis spent running
+ * the commands per value, as INFO commandstats counts it.
+ */
+
+#include "math.h"
+#include "stdint.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "time.h"
+#include "unistd.h"
+
+#include "histkclient.h"
+
+#define BENCH_KEYS 16
+#define BENCH_VALUES (1 << 20)
+#define BENCH_PIPELINE 1024
+
+static int fd;
+static size_t bytesSent;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Latency-like values: exponentially distributed, from a xorshift.
+static double nextValue(uint64_t *x) {
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return -log((*x >> 11) * ldexp(1, -53) + ldexp(1, -54)) * 1000;
+}
+
+static int countingSend(void *arg, const char *buf, size_t len,
+                        int commands) {
+    bytesSent += len;
+    return histkClientSendFd(arg, buf, len, commands);
+}
+
+// Return INFO commandstats in a buffer the caller frees.
+static char *commandStats(void) {
+    char buf[256];
+    const char cmd[] = "*2\r\n$4\r\nINFO\r\n$12\r\ncommandstats\r\n";
+    if (write(fd, cmd, sizeof(cmd) - 1) != sizeof(cmd) - 1) { exit(1); }
+    int n = 0;
+    while (n < 2 || buf[n - 2] != '\r' || buf[n - 1] != '\n') {
+        if (read(fd, buf + n++, 1) != 1) { exit(1); }
+    }
+    int len = atoi(buf + 1);
+    char *reply = malloc(len + 3);
+    for (int i = 0; i < len + 2; i += read(fd, reply + i, len + 2 - i)) {}
+    reply[len] = '\0';
+    return reply;
+}
+
+static void reset(void) {
+    const char cmd[] = "*1\r\n$8\r\nFLUSHALL\r\n"
+        "*2\r\n$6\r\nCONFIG\r\n$9\r\nRESETSTAT\r\n";
+    histkClientSendFd(&fd, cmd, sizeof(cmd) - 1, 2);
+}
+
+// Return the microseconds Redis has spent in histk commands.
+static long long serverMicros(void) {
+    char *info = commandStats();
+    long long usec = 0;
+    for (char *p = strstr(info, "cmdstat_histk."); p != NULL;
+         p = strstr(p + 1, "cmdstat_histk.")) {
+        usec += atoll(strstr(p, "usec=") + 5);
+    }
+    free(info);
+    return usec;
+}
+
+static void report(const char *name, double seconds) {
+    printf("%-12s %14.2f %14.1f %14.3f\n", name, BENCH_VALUES / seconds / 1e6,
+           (double)bytesSent / BENCH_VALUES,
+           (double)serverMicros() * 1000 / BENCH_VALUES);
+}
+
+// HISTK.ADD key value 1 for each value, BENCH_PIPELINE commands at a time.
+static void benchAdd(void) {
+    reset();
+    bytesSent = 0;
+    char *buf = malloc(BENCH_PIPELINE * 128);
+    uint64_t x = 88172645463325252ULL;
+    double start = now();
+    for (int i = 0; i < BENCH_VALUES; i += BENCH_PIPELINE) {
+        size_t len = 0;
+        for (int j = 0; j < BENCH_PIPELINE; j++) {
+            char key[16], value[32];
+            int kn = sprintf(key, "bench:%d", (i + j) % BENCH_KEYS);
+            int vn = sprintf(value, "%.17g", nextValue(&x));
+            len += sprintf(buf + len,
+                           "*4\r\n$9\r\nHISTK.ADD\r\n$%d\r\n%s\r\n$%d\r\n%s\r\n"
+                           "$1\r\n1\r\n", kn, key, vn, value);
+        }
+        countingSend(&fd, buf, len, BENCH_PIPELINE);
+    }
+    report("HISTK.ADD", now() - start);
+    free(buf);
+}
+
+static void benchClient(long long flushValues) {
+    reset();
+    bytesSent = 0;
+    struct HistKClientOptions o = {
+        .flushValues = flushValues,
+        .send = countingSend,
+        .sendArg = &fd,
+    };
+    struct HistKClient *c = createHistKClient(&o);
+    uint64_t x = 88172645463325252ULL;
+    double start = now();
+    for (int i = 0; i < BENCH_VALUES; i++) {
+        char key[16];
+        int kn = sprintf(key, "bench:%d", i % BENCH_KEYS);
+        histkClientRecord(c, key, kn, nextValue(&x), 1);
+    }
+    histkClientFlush(c);
+    char name[32];
+    sprintf(name, "client/%lld", flushValues);
+    report(name, now() - start);
+    freeHistKClient(c);
+}
+
+int main(int argc, char **argv) {
+    int port = argc > 1 ? atoi(argv[1]) : 6379;
+    for (int i = 0; i < 50; i++) {
+        if ((fd = histkClientConnect("127.0.0.1", port)) != -1) { break; }
+        usleep(100000);
+    }
+    if (fd == -1) {
+        fprintf(stderr, "histkclient: can't connect to port %d\n", port);
+        return 1;
+    }
+    printf("%d values over %d keys\n", BENCH_VALUES, BENCH_KEYS);
+    printf("%-12s %14s %14s %14s\n", "", "values (M/s)", "bytes/value",
+           "redis ns/value");
+    benchAdd();
+    benchClient(1000);
+    benchClient(10000);
+    benchClient(100000);
+    reset();
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,15 @@
+/* Compile-only check for histkClientSendHiredis, which histkclient.h only
+ * declares when hiredis.h is included first. `make test-lib` compiles this
+ * when hiredis is installed; nothing here is run.
+ */
+
+#include <hiredis/hiredis.h>
+
+#include "histkclient.h"
+
+struct HistKClient *createHiredisClient(redisContext *c) {
+    struct HistKClientOptions o = {0};
+    o.send = histkClientSendHiredis;
+    o.sendArg = c;
+    return createHistKClient(&o);
+}
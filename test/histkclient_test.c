@@ -0,0 +1,170 @@
+/* Integration tests for histkclient against a redis-server that has the
+ * module loaded. `make test-client` starts one and runs them; to use a
+ * server of your own, run `histkclient_test <port>`.
+ */
+
+#include "assert.h"
+#include "math.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "time.h"
+#include "unistd.h"
+
+#include "histkclient.h"
+#include "libhistk.h"
+
+static int fd;
+
+// Add value to the sketch at *h, making room as the module does.
+static void add(struct HistK **h, double value) {
+    int err;
+    while ((err = histkAdd(*h, value, 1)) != HISTK_OK) {
+        struct HistK *nh = err == HISTK_ERR_FULL ?
+            growHistK(*h, (*h)->numCentroids + 1) : widenHistK(*h);
+        freeHistK(*h);
+        *h = nh;
+    }
+}
+
+// Send argv as one command and return its reply, as a line or bulk string
+// without the type byte, in a static buffer.
+static const char *query(int argc, const char **argv) {
+    static char reply[256];
+    char cmd[1024];
+    int n = sprintf(cmd, "*%d\r\n", argc);
+    for (int i = 0; i < argc; i++) {
+        n += sprintf(cmd + n, "$%zu\r\n%s\r\n", strlen(argv[i]), argv[i]);
+    }
+    assert(write(fd, cmd, n) == n);
+    n = 0;
+    while (n < 2 || reply[n - 2] != '\r' || reply[n - 1] != '\n') {
+        assert(read(fd, reply + n, 1) == 1 && n < 255);
+        n++;
+    }
+    reply[n - 2] = '\0';
+    if (reply[0] == '$' && atoi(reply + 1) >= 0) {
+        int len = atoi(reply + 1);
+        assert(len < 254);
+        for (int i = 0; i < len + 2; i += read(fd, reply + i, len + 2 - i)) {}
+        reply[len] = '\0';
+        return reply;
+    }
+    return reply + 1;
+}
+
+static long long count(const char *key) {
+    const char *argv[] = {"HISTK.COUNT", key};
+    return atoll(query(2, argv));
+}
+
+static double quantile(const char *key, const char *q) {
+    const char *argv[] = {"HISTK.QUANTILE", key, q};
+    return atof(query(3, argv));
+}
+
+static void del(const char *key) {
+    const char *argv[] = {"DEL", key};
+    query(2, argv);
+}
+
+static struct HistKClient *newClient(long long flushMillis,
+                                     long long flushValues) {
+    struct HistKClientOptions o = {
+        .flushMillis = flushMillis,
+        .flushValues = flushValues,
+        .send = histkClientSendFd,
+        .sendArg = &fd,
+    };
+    return createHistKClient(&o);
+}
+
+static int record(struct HistKClient *c, const char *key, double value) {
+    return histkClientRecord(c, key, strlen(key), value, 1);
+}
+
+// Keys get what a sketch built locally would hold.
+static void testFlush(void) {
+    del("client:a");
+    del("client:b");
+    struct HistKClient *c = newClient(0, 0);
+    struct HistK *h = createHistK(HISTK_DEFAULT_NUM_CENTROIDS,
+                                  HISTK_VALUES_DOUBLE);
+    for (int i = 1; i <= 10000; i++) {
+        assert(record(c, "client:a", i) == 0);
+        add(&h, i);
+        if (i % 10 == 0) { assert(record(c, "client:b", -i) == 0); }
+    }
+    assert(count("client:a") == 0);
+    assert(histkClientFlush(c) == 0);
+    assert(count("client:a") == 10000 && count("client:b") == 1000);
+    assert(fabs(quantile("client:a", "0.5") - histkQuantile(h, 0.5)) < 1e-6);
+    assert(fabs(quantile("client:a", "0.99") - 9900) < 100);
+    assert(quantile("client:b", "0") == -10000);
+
+    // Later flushes merge into what's there.
+    assert(histkClientFlush(c) == 0);
+    assert(record(c, "client:a", 5) == 0);
+    assert(histkClientFlush(c) == 0);
+    assert(count("client:a") == 10001);
+    freeHistK(h);
+    freeHistKClient(c);
+}
+
+static void testFlushValues(void) {
+    del("client:a");
+    struct HistKClient *c = newClient(0, 100);
+    for (int i = 1; i < 100; i++) { assert(record(c, "client:a", i) == 0); }
+    assert(count("client:a") == 0);
+    assert(record(c, "client:a", 100) == 0);
+    assert(count("client:a") == 100);
+    freeHistKClient(c);
+}
+
+static void testFlushMillis(void) {
+    del("client:a");
+    struct HistKClient *c = newClient(50, 0);
+    assert(record(c, "client:a", 1) == 0);
+    assert(histkClientPoll(c) == 0);
+    assert(count("client:a") == 0);
+    struct timespec ts = {0, 60 * 1000000};
+    nanosleep(&ts, NULL);
+    assert(histkClientPoll(c) == 0);
+    assert(count("client:a") == 1);
+    freeHistKClient(c);
+}
+
+// A key that holds something else fails the flush, but not the keys
+// flushed with it.
+static void testWrongType(void) {
+    del("client:a");
+    const char *set[] = {"SET", "client:s", "x"};
+    query(3, set);
+    struct HistKClient *c = newClient(0, 0);
+    assert(record(c, "client:s", 1) == 0);
+    assert(record(c, "client:a", 1) == 0);
+    assert(histkClientFlush(c) == -1);
+    assert(count("client:a") == 1);
+    del("client:s");
+    freeHistKClient(c);
+}
+
+int main(int argc, char **argv) {
+    int port = argc > 1 ? atoi(argv[1]) : 6379;
+    // The server may still be starting.
+    for (int i = 0; i < 50; i++) {
+        if ((fd = histkClientConnect("127.0.0.1", port)) != -1) { break; }
+        usleep(100000);
+    }
+    if (fd == -1) {
+        fprintf(stderr, "histkclient: can't connect to port %d\n", port);
+        return 1;
+    }
+    testFlush();
+    testFlushValues();
+    testFlushMillis();
+    testWrongType();
+    close(fd);
+    printf("histkclient: all tests passed\n");
+    return 0;
+}
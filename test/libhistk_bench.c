@@ -0,0 +1,111 @@
+/* Benchmarks for libhistk. Build and run them with `make bench-lib`.
+ *
+ * recorder: 1 to 64 threads record values at once, each to a sketch shared
+ * behind a mutex and then to a HistKRecorder, and we report how many values
+ * per second they recorded together. Integer values, like latencies in whole
+ * milliseconds, leave many centroids equally far apart, so adds often break
+ * ties between them.
+ */
+
+#include "math.h"
+#include "pthread.h"
+#include "stdint.h"
+#include "stdio.h"
+#include "time.h"
+
+#include "libhistk.h"
+
+#define BENCH_MAX_THREADS 64
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Latency-like values: exponentially distributed, from a per-thread xorshift.
+static double nextValue(uint64_t *x) {
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return -log((*x >> 11) * 0x1.0p-53 + 0x1.0p-54) * 1000;
+}
+
+struct RecorderBench {
+    int values;
+    int integers;
+    pthread_mutex_t lock;
+    struct HistK *h;
+    struct HistKRecorder *r;
+};
+
+static double benchValue(const struct RecorderBench *b, uint64_t *x) {
+    double v = nextValue(x);
+    return b->integers ? round(v) : v;
+}
+
+static void *recordLocked(void *arg) {
+    struct RecorderBench *b = arg;
+    uint64_t x = (uintptr_t)&x | 1;
+    for (int i = 0; i < b->values; i++) {
+        double v = benchValue(b, &x);
+        pthread_mutex_lock(&b->lock);
+        int err;
+        while ((err = histkAdd(b->h, v, 1)) != HISTK_OK) {
+            struct HistK *nh = err == HISTK_ERR_FULL ?
+                growHistK(b->h, b->h->numCentroids + 1) : widenHistK(b->h);
+            freeHistK(b->h);
+            b->h = nh;
+        }
+        pthread_mutex_unlock(&b->lock);
+    }
+    return NULL;
+}
+
+static void *recordSharded(void *arg) {
+    struct RecorderBench *b = arg;
+    uint64_t x = (uintptr_t)&x | 1;
+    for (int i = 0; i < b->values; i++) {
+        histkRecord(b->r, benchValue(b, &x), 1);
+    }
+    return NULL;
+}
+
+// Run n threads of f(b) and return the values per second they recorded.
+static double run(int n, void *(*f)(void *), struct RecorderBench *b) {
+    pthread_t threads[BENCH_MAX_THREADS];
+    double start = now();
+    for (int i = 0; i < n; i++) { pthread_create(&threads[i], NULL, f, b); }
+    for (int i = 0; i < n; i++) { pthread_join(threads[i], NULL); }
+    return (double)n * b->values / (now() - start);
+}
+
+static void benchRecorder(unsigned short int centroids, int values,
+                          int integers) {
+    printf("recorder, %d centroids, %d %svalues per thread\n", centroids,
+           values, integers ? "integer " : "");
+    printf("%-8s %16s %16s %8s\n", "threads", "locked (M/s)",
+           "recorder (M/s)", "speedup");
+    for (int n = 1; n <= BENCH_MAX_THREADS; n *= 2) {
+        struct RecorderBench b = {.values = values, .integers = integers};
+        pthread_mutex_init(&b.lock, NULL);
+        b.h = createHistK(centroids, HISTK_VALUES_DOUBLE);
+        double locked = run(n, recordLocked, &b);
+        freeHistK(b.h);
+        pthread_mutex_destroy(&b.lock);
+
+        b.r = createHistKRecorder(centroids, HISTK_VALUES_DOUBLE);
+        double sharded = run(n, recordSharded, &b);
+        freeHistKRecorder(b.r);
+        printf("%-8d %16.2f %16.2f %7.1fx\n", n, locked / 1e6, sharded / 1e6,
+               sharded / locked);
+    }
+    printf("\n");
+}
+
+int main(void) {
+    benchRecorder(HISTK_DEFAULT_NUM_CENTROIDS, 1 << 17, 0);
+    benchRecorder(HISTK_DEFAULT_NUM_CENTROIDS, 1 << 17, 1);
+    benchRecorder(1024, 1 << 13, 0);
+    return 0;
+}
@@ -0,0 +1,353 @@
+/* Unit tests for libhistk. Build and run them with `make test-lib`. */
+
+#include "assert.h"
+#include "math.h"
+#include "pthread.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+#include "libhistk.h"
+
+// Add value to the sketch at *h, making room as the module does.
+static void add(struct HistK **h, double value, unsigned long long count) {
+    int err;
+    while ((err = histkAdd(*h, value, count)) != HISTK_OK) {
+        struct HistK *nh = err == HISTK_ERR_FULL ?
+            growHistK(*h, (*h)->numCentroids + 1) : widenHistK(*h);
+        freeHistK(*h);
+        *h = nh;
+    }
+}
+
+static int sameSketch(const struct HistK *a, const struct HistK *b) {
+    if (a->totalCount != b->totalCount || a->min != b->min ||
+        a->max != b->max || a->numCentroids != b->numCentroids ||
+        a->maxCentroids != b->maxCentroids) {
+        return 0;
+    }
+    for (int i = 0; i < a->numCentroids; i++) {
+        if (getValue(a, i) != getValue(b, i) ||
+            getCount(a, i) != getCount(b, i)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void testAddAndQuery(void) {
+    struct HistK *h = createHistK(HISTK_DEFAULT_NUM_CENTROIDS,
+                                  HISTK_VALUES_DOUBLE);
+    for (int i = 1; i <= 10000; i++) { add(&h, i, 1); }
+    assert(h->totalCount == 10000);
+    assert(h->numCentroids == HISTK_DEFAULT_NUM_CENTROIDS);
+    assert(h->min == 1 && h->max == 10000);
+    assert(fabs(histkQuantile(h, 0.5) - 5000) < 100);
+    assert(fabs(histkQuantile(h, 0.99) - 9900) < 100);
+    assert(histkQuantile(h, 0) == 1 && histkQuantile(h, 1) == 10000);
+    assert(llabs(histkCountLessThanOrEqual(h, 2500) - 2500) < 100);
+    assert(histkCountLessThanOrEqual(h, 0) == 0);
+    assert(histkCountLessThanOrEqual(h, 10000) == 10000);
+    freeHistK(h);
+}
+
+static void testCountsWiden(void) {
+    struct HistK *h = createHistK(4, HISTK_VALUES_DOUBLE);
+    assert(h->countWidth == 1);
+    assert(histkAdd(h, 1, 1ULL << 40) == HISTK_ERR_OVERFLOW);
+    assert(h->totalCount == 0);
+    add(&h, 1, 1ULL << 40);
+    assert(h->countWidth == 8);
+    assert(getCount(h, 0) == 1ULL << 40);
+    freeHistK(h);
+}
+
+// With a single centroid, an infinite value has only one neighbor to merge
+// into, whichever side it lands on.
+static void testInfinitiesAtOneCentroid(void) {
+    double infinities[] = {-INFINITY, INFINITY};
+    for (int i = 0; i < 2; i++) {
+        struct HistK *h = createHistK(1, HISTK_VALUES_DOUBLE);
+        add(&h, 1, 1);
+        add(&h, infinities[i], 1);
+        assert(h->numCentroids == 1 && h->maxCentroids == 1);
+        assert(h->totalCount == 2 && getCount(h, 0) == 2);
+        assert(h->min == (i == 0 ? -INFINITY : 1));
+        assert(h->max == (i == 0 ? 1 : INFINITY));
+        freeHistK(h);
+    }
+}
+
+static void testInfiniteGaps(void) {
+    // Every gap but the one 5 splits is infinite, so 5 can only join one of
+    // its neighbors.
+    struct HistK *h = createHistK(2, HISTK_VALUES_DOUBLE);
+    add(&h, -INFINITY, 1);
+    add(&h, INFINITY, 1);
+    add(&h, 5, 1);
+    assert(h->numCentroids == 2 && h->totalCount == 3);
+    assert(getValue(h, 0) == -INFINITY && getCount(h, 0) == 2);
+    assert(getValue(h, 1) == INFINITY && getCount(h, 1) == 1);
+    freeHistK(h);
+}
+
+static void testMergeCentroidList(void) {
+    struct Centroid cs[] = {{3, 1}, {1, 2}, {3, 4}, {10, 1}, {2, 1}};
+    struct Centroid rs[3];
+    assert(mergeCentroidList(cs, 5, rs, 3) == 3);
+    // The two 3s become one centroid, then 1 and 2 are closest.
+    assert(rs[0].count == 3 && fabs(rs[0].value - 4.0 / 3) < 1e-9);
+    assert(rs[1].value == 3 && rs[1].count == 5);
+    assert(rs[2].value == 10 && rs[2].count == 1);
+}
+
+static void testCopies(void) {
+    struct HistK *h = createHistK(100, HISTK_VALUES_DOUBLE);
+    for (int i = 0; i < 50; i++) { add(&h, i * 0.25, i + 1); }
+    struct HistK *f = convertHistK(h, HISTK_VALUES_FLOAT);
+    assert(f != NULL && f->valueType == HISTK_VALUES_FLOAT);
+    assert(sameSketch(h, f));
+    assert(convertHistK(f, HISTK_VALUES_FLOAT) == NULL);
+    struct HistK *p = packHistK(h);
+    assert(p != NULL && isPacked(p));
+    assert(histkMemUsage(p) < histkMemUsage(h));
+    struct HistK *u = unpackHistK(p);
+    assert(!isPacked(u) && sameSketch(h, u));
+    struct HistK *w = widenHistK(u);
+    assert(w->countWidth == 2 * u->countWidth && sameSketch(h, w));
+    freeHistK(f);
+    freeHistK(p);
+    freeHistK(u);
+    freeHistK(w);
+    freeHistK(h);
+}
+
+static void testSerialize(void) {
+    struct HistK *h = createHistK(HISTK_DEFAULT_NUM_CENTROIDS,
+                                  HISTK_VALUES_FLOAT);
+    for (int i = 0; i < 1000; i++) { add(&h, (i * 7919) % 1000 / 8.0, 3); }
+    unsigned char *buf = malloc(serializedSize(h));
+    size_t len = serializeHistK(h, buf);
+    struct HistK *d = deserializeHistK(buf, len);
+    assert(d != NULL && sameSketch(h, d));
+    assert(d->valueType == h->valueType);
+    assert(deserializeHistK(buf, len - 1) == NULL);
+    struct HistK *p = deserializePackedHistK(buf, len);
+    assert(p != NULL && isPacked(p));
+    struct HistK *u = unpackHistK(p);
+    assert(sameSketch(h, u));
+    free(buf);
+    freeHistK(d);
+    freeHistK(p);
+    freeHistK(u);
+    freeHistK(h);
+}
+
+// HISTK.DUMP of a key after HISTK.ADD key 1.5 1 2.5 3 10 1.
+static const unsigned char moduleDump[] = {
+    0x01, 0x40, 0x03, 0x00, 0x01, 0x05, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0xf8, 0x3f, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x24, 0x40, 0x62, 0xf8,
+    0xbf, 0x01, 0x61, 0x0c, 0x03, 0x61, 0x20, 0x01
+};
+
+static void testModuleDump(void) {
+    struct HistK *h = createHistK(HISTK_DEFAULT_NUM_CENTROIDS,
+                                  HISTK_VALUES_DOUBLE);
+    add(&h, 1.5, 1);
+    add(&h, 2.5, 3);
+    add(&h, 10, 1);
+    size_t len;
+    unsigned char *buf = dumpHistK(h, &len);
+    assert(len == sizeof(moduleDump) && memcmp(buf, moduleDump, len) == 0);
+    struct HistK *r = restoreHistK(moduleDump, sizeof(moduleDump), 0);
+    assert(r != NULL && sameSketch(h, r));
+    buf[0] = HISTK_DUMP_VERSION + 1;
+    assert(restoreHistK(buf, len, 0) == NULL);
+    free(buf);
+    // An empty sketch with room for no centroids.
+    unsigned char none[22] = {HISTK_DUMP_VERSION, 0x00, 0x00, 0x00, 0x01};
+    assert(restoreHistK(none, sizeof(none), 0) == NULL);
+    none[1] = 0x01;
+    struct HistK *e = restoreHistK(none, sizeof(none), 0);
+    assert(e != NULL && e->maxCentroids == 1 && e->totalCount == 0);
+    freeHistK(e);
+    freeHistK(r);
+    freeHistK(h);
+}
+
+static void testCorruptDumps(void) {
+    unsigned char buf[sizeof(moduleDump)];
+    // Values below min or above max.
+    memcpy(buf, moduleDump, sizeof(buf));
+    buf[13] = 0x40;
+    assert(restoreHistK(buf, sizeof(buf), 0) == NULL);
+    memcpy(buf, moduleDump, sizeof(buf));
+    buf[21] = 0x20;
+    assert(restoreHistK(buf, sizeof(buf), 0) == NULL);
+    // A delta that wraps the key of 2.5 around to a negative value's.
+    memcpy(buf, moduleDump, sizeof(buf));
+    buf[26] = 0x71;
+    buf[27] = 0x70;
+    assert(restoreHistK(buf, sizeof(buf), 0) == NULL);
+    // The same value twice.
+    memcpy(buf, moduleDump, 26);
+    buf[26] = 0x00;
+    memcpy(buf + 27, moduleDump + 28, 4);
+    assert(restoreHistK(buf, sizeof(buf) - 1, 0) == NULL);
+    // Float sketches round values but not min and max.
+    struct HistK *h = createHistK(8, HISTK_VALUES_FLOAT);
+    add(&h, 0.7, 1);
+    add(&h, -0.7, 1);
+    assert(getValue(h, 1) < h->max && getValue(h, 0) > h->min);
+    size_t len;
+    unsigned char *dump = dumpHistK(h, &len);
+    struct HistK *r = restoreHistK(dump, len, 0);
+    assert(r != NULL && sameSketch(h, r));
+    free(dump);
+    freeHistK(r);
+    freeHistK(h);
+}
+
+static void testPatch(void) {
+    struct HistK *h = createHistK(8, HISTK_VALUES_DOUBLE);
+    for (int i = 0; i < 8; i++) { add(&h, i, 1); }
+    struct HistK *before = copyHistK(h, h->capacity, h->valueType,
+                                     h->countWidth);
+    add(&h, 3.5, 2);
+    unsigned char *buf = malloc(patchSize(h));
+    size_t len = writeHistKPatch(before, h, buf);
+    struct HistKPatch patch;
+    assert(parseHistKPatch(buf, len, &patch) == HISTK_OK);
+    assert(applyHistKPatch(before, &patch) == HISTK_OK);
+    assert(sameSketch(h, before));
+    assert(parseHistKPatch(buf, 1, &patch) == HISTK_ERR_INVALID);
+    free(buf);
+    freeHistK(before);
+    freeHistK(h);
+}
+
+static long allocs, sketchAllocs;
+
+static void *countingAlloc(size_t size) {
+    allocs++;
+    return malloc(size);
+}
+
+static void countingFree(void *p) {
+    allocs--;
+    free(p);
+}
+
+static void *countingAllocSketch(size_t size) {
+    sketchAllocs++;
+    return malloc(size);
+}
+
+static void countingFreeSketch(void *p) {
+    sketchAllocs--;
+    free(p);
+}
+
+static void testAllocator(void) {
+    struct HistKAllocator a = {
+        countingAlloc, realloc, countingFree, countingAllocSketch,
+        countingFreeSketch
+    };
+    histkSetAllocator(&a);
+    struct HistK *h = createHistK(HISTK_DEFAULT_NUM_CENTROIDS,
+                                  HISTK_VALUES_DOUBLE);
+    assert(sketchAllocs == 1 && allocs == 0);
+    for (int i = 0; i < 1000; i++) { add(&h, i % 97, 1); }
+    assert(sketchAllocs == 1);
+    struct HistK *p = packHistK(h);
+    assert(p != NULL && allocs == 1);
+    size_t len;
+    unsigned char *buf = dumpHistK(h, &len);
+    assert(allocs == 2);
+    // Scratch sketches come from alloc, packed source or not.
+    struct HistK *s = scratchCopyHistK(p, h->maxCentroids, 8);
+    assert(allocs == 3 && sketchAllocs == 1 && sameSketch(h, s));
+    assert(s->capacity >= h->maxCentroids && s->countWidth == 8);
+    struct HistK *t = scratchCopyHistK(h, 0, h->countWidth);
+    assert(allocs == 4 && sketchAllocs == 1 && sameSketch(h, t));
+    struct HistK *r = restoreScratchHistK(buf, len);
+    assert(r != NULL && allocs == 5 && sketchAllocs == 1);
+    assert(!isPacked(r) && sameSketch(h, r));
+    assert(restoreScratchHistK(buf, len - 1) == NULL && allocs == 5);
+    countingFree(r);
+    countingFree(t);
+    countingFree(s);
+    countingFree(buf);
+    freeHistK(p);
+    freeHistK(h);
+    assert(allocs == 0 && sketchAllocs == 0);
+
+    // Without sketch functions, sketches come from alloc and free too.
+    struct HistKAllocator b = {countingAlloc, realloc, countingFree, NULL,
+                               NULL};
+    histkSetAllocator(&b);
+    h = createHistK(HISTK_DEFAULT_NUM_CENTROIDS, HISTK_VALUES_DOUBLE);
+    assert(allocs == 1);
+    freeHistK(h);
+    assert(allocs == 0);
+    struct HistKAllocator std = {malloc, realloc, free, NULL, NULL};
+    histkSetAllocator(&std);
+}
+
+#define RECORDER_THREADS 8
+#define RECORDER_VALUES 10000
+
+static void *recordValues(void *arg) {
+    struct HistKRecorder *r = arg;
+    for (int i = 1; i <= RECORDER_VALUES; i++) { histkRecord(r, i, 1); }
+    return NULL;
+}
+
+// Big sketches have batches merged into them rather than added.
+static void testRecorder(unsigned short int maxCentroids) {
+    struct HistKRecorder *r = createHistKRecorder(maxCentroids,
+                                                  HISTK_VALUES_DOUBLE);
+    assert(r != NULL);
+    histkRecord(r, 0.5, 5);
+    struct HistK *h = collectHistKRecorder(r);
+    assert(h->totalCount == 0);
+    freeHistK(h);
+    histkFlushRecorder(r);
+    h = collectHistKRecorder(r);
+    assert(h->totalCount == 5 && h->min == 0.5 && h->max == 0.5);
+    freeHistK(h);
+
+    // Threads that exit leave what they recorded behind.
+    pthread_t threads[RECORDER_THREADS];
+    for (int i = 0; i < RECORDER_THREADS; i++) {
+        assert(pthread_create(&threads[i], NULL, recordValues, r) == 0);
+    }
+    for (int i = 0; i < RECORDER_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    h = collectHistKRecorder(r);
+    assert(h->totalCount == 5 + RECORDER_THREADS * RECORDER_VALUES);
+    assert(h->numCentroids == maxCentroids);
+    assert(h->min == 0.5 && h->max == RECORDER_VALUES);
+    assert(fabs(histkQuantile(h, 0.5) - RECORDER_VALUES / 2) < 200);
+    freeHistK(h);
+    freeHistKRecorder(r);
+}
+
+int main(void) {
+    testAddAndQuery();
+    testCountsWiden();
+    testInfinitiesAtOneCentroid();
+    testInfiniteGaps();
+    testMergeCentroidList();
+    testCopies();
+    testSerialize();
+    testModuleDump();
+    testCorruptDumps();
+    testPatch();
+    testAllocator();
+    testRecorder(HISTK_DEFAULT_NUM_CENTROIDS);
+    testRecorder(1024);
+    printf("libhistk: all tests passed\n");
+    return 0;
+}
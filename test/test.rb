@@ -1,11 +1,12 @@
+require 'fileutils'
 require 'redis'
 require 'test/unit'
 
 require_relative 'lossless_histogram'
 require_relative 'box_muller'
 
-def restart_redis(args=nil)
-  `/bin/bash /opt/histk/restart_redis.sh #{args}`
+def restart_redis(args=nil, module_args=nil)
+  `HISTK_MODULE_ARGS='#{module_args}' /bin/bash /opt/histk/restart_redis.sh #{args}`
 end
 
 def rm_redis_file(conn, filename)
@@ -71,6 +72,41 @@ class TestHistk < Test::Unit::TestCase
     assert_equal(err, exception.message)
   end
 
+  def test_tiny_resize
+    exception = assert_raise(Redis::CommandError) do
+      @r.call(%w(histk.resize s 0))
+    end
+    err = 'ERR invalid size: number of centroids must be at least 1.'
+    assert_equal(err, exception.message)
+  end
+
+  def test_resize_shrink
+    @r.call(%w(histk.resize s 2048))
+    (1..1000).each { |i| @r.call(['histk.add', 's', i]) }
+    assert_equal(16, @r.call(%w(histk.resize s 16)))
+    assert_equal(1000, @r.call(%w(histk.count s)))
+    assert_equal('1', @r.call(%w(histk.quantile s 0.0)))
+    assert_equal('1000', @r.call(%w(histk.quantile s 1.0)))
+    error = 40  # Arbitrary
+    [0.1, 0.25, 0.5, 0.75, 0.9].each do |q|
+      actual = @r.call(['histk.quantile', 's', q]).to_f
+      assert_operator((1000 * q - actual).abs, :<, error)
+    end
+  end
+
+  def test_resize_grow
+    @r.call(%w(histk.resize s 8))
+    (1..8).each { |i| @r.call(['histk.add', 's', i]) }
+    args = [0.1, 0.25, 0.5, 0.75, 0.9]
+    qs = args.map{ |q| @r.call(['histk.quantile', 's', q]) }
+    assert_equal(256, @r.call(%w(histk.resize s 256)))
+    new_qs = args.map{ |q| @r.call(['histk.quantile', 's', q]) }
+    assert_equal(qs, new_qs)
+    @conn.expire('s', 100)
+    @r.call(%w(histk.resize s 4))
+    assert_operator(@conn.ttl('s'), :>, 0)
+  end
+
   def test_add
     assert_equal(1, @r.call(%w(histk.add s 100)))
     assert_equal(2, @r.call(%w(histk.add s 100)))
@@ -82,12 +118,79 @@ class TestHistk < Test::Unit::TestCase
     assert_equal('200', @r.call(%w(histk.quantile s 0.5)))
   end
 
+  def test_add_between_infinities
+    @r.call(%w(histk.create i centroids 2))
+    assert_equal(3, @r.call(%w(histk.add i -inf 1 inf 1 5 1)))
+    assert_equal(3, @r.call(%w(histk.count i)))
+  end
+
   def test_add_multi
     assert_equal(6, @r.call(['histk.add', 's', 100, 2, 200, 2, 300, 1, 400, 1]))
     assert_equal(6, @r.call(%w(histk.count s)))
     assert_equal('200', @r.call(%w(histk.quantile s 0.5)))
   end
 
+  def test_nonpositive_count
+    [0, -1].each do |count|
+      exception = assert_raise(Redis::CommandError) do
+        @r.call(['histk.add', 's', 1, count])
+      end
+      assert_equal('ERR count must be positive.', exception.message)
+    end
+  end
+
+  def test_bad_precision
+    exception = assert_raise(Redis::CommandError) do
+      @r.call(%w(histk.resize s 8 tiny))
+    end
+    assert_equal('ERR precision must be COMPACT or FULL.', exception.message)
+  end
+
+  def test_compact
+    assert_equal(64, @r.call(%w(histk.resize s 64 compact)))
+    assert_equal(1, @r.call(%w(histk.add s 0.1)))
+    assert_equal(0.1.to_f, @r.call(%w(histk.quantile s 0.5)).to_f.round(7))
+    assert_not_equal('0.1', @r.call(%w(histk.quantile s 0.5)))
+    assert_equal(3, @r.call(%w(histk.add s 0.1 2)))
+  end
+
+  def test_compact_count_overflow
+    @r.call(%w(histk.resize s 4 compact))
+    assert_equal(3000000000, @r.call(%w(histk.add s 1 3000000000)))
+    assert_equal(6000000000, @r.call(%w(histk.add s 1 3000000000)))
+    (2..10).each { |i| @r.call(['histk.add', 's', i, 3000000000]) }
+    assert_equal(33000000000, @r.call(%w(histk.count s)))
+    assert_equal('1', @r.call(%w(histk.quantile s 0.0)))
+    assert_equal('10', @r.call(%w(histk.quantile s 1.0)))
+  end
+
+  def test_count_widths
+    # Each add pushes a count past the limit of the narrower count widths.
+    [[1, 255], [1, 1], [2, 70000], [3, 5000000000]].each do |v, c|
+      @r.call(['histk.add', 's', v, c])
+    end
+    assert_equal(5000070256, @r.call(%w(histk.count s)))
+    assert_equal(128, @r.call(%w(histk.count s 1)))
+    assert_equal(35256, @r.call(%w(histk.count s 2)))
+    assert_in_delta(3, @r.call(%w(histk.quantile s 0.5)).to_f, 0.0001)
+    @r.call(['save'])
+    restart_redis
+    assert_equal(35256, @r.call(%w(histk.count s 2)))
+    assert_equal(5000070257, @r.call(%w(histk.add s 3)))
+  end
+
+  def test_resize_precision
+    (1..100).each { |i| @r.call(['histk.add', 's', i]) }
+    args = [0.1, 0.25, 0.5, 0.75, 0.9]
+    qs = args.map{ |q| @r.call(['histk.quantile', 's', q]).to_f }
+    @r.call(%w(histk.resize s 64 compact))
+    compact_qs = args.map{ |q| @r.call(['histk.quantile', 's', q]).to_f }
+    qs.zip(compact_qs).each { |x, y| assert_operator((x - y).abs, :<, 0.001) }
+    @r.call(%w(histk.resize s 64 full))
+    assert_equal(101, @r.call(%w(histk.add s 0.1)))
+    assert_equal('0.10000000000000001', @r.call(%w(histk.quantile s 0.0)))
+  end
+
   def test_count
     @r.call(%w(histk.resize s 8))
     count = 0
@@ -130,6 +233,20 @@ class TestHistk < Test::Unit::TestCase
     end
   end
 
+  def test_quantile_multi
+    (1..100).each do |i|
+      @r.call(['histk.add', 's', i])
+    end
+    qs = %w(0.9 0 0.5 1)
+    assert_equal(qs.map { |q| @r.call(['histk.quantile', 's', q]) },
+                 @r.call(%w(histk.quantile s) + qs))
+    exception = assert_raise(Redis::CommandError) do
+      @r.call(%w(histk.quantile s 0.5 1.1))
+    end
+    assert_equal('ERR argument must be in the range [0.0, 1.0].',
+                 exception.message)
+  end
+
   def test_count_uniform
     @r.call(%w(histk.resize s 32))
     (1..100).each do |i|
@@ -254,6 +371,89 @@ class TestHistk < Test::Unit::TestCase
     assert_equal(qs, new_qs)
   end
 
+  def test_rdb_compact
+    @r.call(%w(histk.resize s 8 compact))
+    (1..100).each { |i| @r.call(['histk.add', 's', i / 10.0]) }
+    args = [0.1, 0.25, 0.5, 0.75, 0.9, 0.99]
+    qs = args.map{ |q| @r.call(['histk.quantile', 's', q]) }
+    @r.call(['save'])
+    restart_redis
+    new_qs = args.map{ |q| @r.call(['histk.quantile', 's', q]) }
+    assert_equal(qs, new_qs)
+    # Still compact: merging everything into one centroid rounds its value.
+    @r.call(%w(histk.resize s 1))
+    mean = @r.call(%w(histk.quantile s 0.5)).to_f
+    assert_in_delta(5.05, mean, 0.001)
+    assert_equal([mean].pack('f').unpack('f').first, mean)
+  end
+
+  def test_idle_compact
+    restart_redis(nil, 'IDLE-COMPACT 1')
+    (1..1000).each { |i| @r.call(['histk.add', 's', i * 1.5, i % 7 + 1]) }
+    @r.call(%w(histk.resize t 16 compact))
+    (1..1000).each { |i| @r.call(['histk.add', 't', i / 10.0]) }
+    @conn.expire('s', 1000)
+    args = [0.0, 0.1, 0.25, 0.5, 0.75, 0.9, 0.99, 1.0]
+    qs = args.map{ |q| @r.call(['histk.quantile', 's', q]) }
+    tqs = args.map{ |q| @r.call(['histk.quantile', 't', q]) }
+    s_size = @r.call(%w(memory usage s))
+    t_size = @r.call(%w(memory usage t))
+    sleep 3
+    assert_operator(@r.call(%w(memory usage s)), :<, s_size)
+    assert_operator(@r.call(%w(memory usage t)), :<, t_size)
+    # Reads leave the sketch packed.
+    assert_equal(qs, args.map{ |q| @r.call(['histk.quantile', 's', q]) })
+    assert_equal(tqs, args.map{ |q| @r.call(['histk.quantile', 't', q]) })
+    assert_operator(@r.call(%w(memory usage s)), :<, s_size)
+    assert_operator(@conn.ttl('s'), :>, 900)
+    # Writes unpack it.
+    total = (1..1000).map { |i| i % 7 + 1 }.reduce(:+)
+    assert_equal(total + 1, @r.call(%w(histk.add s 5000)))
+    assert_equal(s_size, @r.call(%w(memory usage s)))
+    assert_equal('5000', @r.call(%w(histk.quantile s 1.0)))
+    @r.call(%w(histk.mergestore u s t))
+    assert_equal(total + 1001, @r.call(%w(histk.count u)))
+  end
+
+  def test_rdb_lazy
+    (1..500).each { |i| @r.call(['histk.add', 's', i * 0.37]) }
+    dump = @r.call(%w(dump s))
+    size = @r.call(%w(memory usage s))
+    qs = [0.1, 0.5, 0.9].map{ |q| @r.call(['histk.quantile', 's', q]) }
+    @r.call(['save'])
+    restart_redis
+    # The sketch stays packed until it's updated, and saves the same bytes.
+    assert_operator(@r.call(%w(memory usage s)), :<, size)
+    assert_equal(dump, @r.call(%w(dump s)))
+    assert_equal(qs, [0.1, 0.5, 0.9].map{ |q| @r.call(['histk.quantile', 's', q]) })
+    assert_operator(@r.call(%w(memory usage s)), :<, size)
+    assert_equal(501, @r.call(%w(histk.add s 1000)))
+    assert_equal(size, @r.call(%w(memory usage s)))
+  end
+
+  def test_rdb_v0
+    # v0.rdb was saved by the module before it switched to RDB encoding v1.
+    dir = @conn.config(:get, 'dir')['dir']
+    FileUtils.cp(File.join(__dir__, 'v0.rdb'), File.join(dir, 'dump.rdb'))
+    restart_redis
+    expected = {
+      'full' => [5000001500, '789.48822412572986', '999.99994287715094'],
+      'small' => [300, '0.5', '4.5'],
+      'compact' => [400, '5.5631262569611808', '28.554494984144814']
+    }
+    2.times do
+      expected.each do |key, (count, q1, q5)|
+        assert_equal(count, @r.call(['histk.count', key]))
+        assert_equal(q1, @r.call(['histk.quantile', key, 0.1]))
+        assert_equal(q5, @r.call(['histk.quantile', key, 0.5]))
+      end
+      @r.call(['save'])
+      assert_operator(File.size(File.join(dir, 'dump.rdb')), :<,
+                      File.size(File.join(__dir__, 'v0.rdb')))
+      restart_redis
+    end
+  end
+
   def test_aof
     restart_redis '--appendonly yes --appendfsync always'
     @r.call(%w(histk.add s 100))
@@ -288,6 +488,318 @@ class TestHistk < Test::Unit::TestCase
     assert_equal(qs, new_qs)
   end
 
+  def test_rewrite_aof_exact
+    restart_redis '--appendonly yes --aof-use-rdb-preamble no'
+    (1..300).each { |i| @r.call(['histk.add', 's', i * 1e-9, i % 3 + 1]) }
+    @r.call(%w(histk.resize t 16 compact))
+    (1..300).each { |i| @r.call(['histk.add', 't', -i / 7.0]) }
+    @conn.expire('t', 1000)
+    dumps = %w(s t).map { |k| @r.call(['dump', k]) }
+    @r.call(['bgrewriteaof'])
+    sleep 0.1 while @conn.info('persistence')['aof_rewrite_in_progress'] != '0' ||
+                    @conn.info('persistence')['aof_rewrite_scheduled'] != '0'
+    assert_equal('ok', @conn.info('persistence')['aof_last_bgrewrite_status'])
+    restart_redis '--appendonly yes --aof-use-rdb-preamble no'
+    assert_equal(dumps, %w(s t).map { |k| @r.call(['dump', k]) })
+    assert_operator(@conn.ttl('t'), :>, 900)
+    assert_equal('1.0000000000000001e-09', @r.call(%w(histk.quantile s 0.0)))
+  end
+
+  def test_restore
+    @r.call(%w(histk.add s 1))
+    exception = assert_raise(Redis::CommandError) do
+      @r.call(%w(histk.restore t garbage))
+    end
+    assert_equal('ERR invalid serialized sketch.', exception.message)
+    exception = assert_raise(Redis::CommandError) do
+      @r.call(%w(histk.restore s garbage))
+    end
+    assert_equal('BUSYKEY Target key name already exists.', exception.message)
+    # An empty sketch with room for no centroids.
+    none = "\x01\x00\x00\x00\x01\x00" + "\x00" * 16
+    exception = assert_raise(Redis::CommandError) do
+      @r.call(['histk.restore', 't', none])
+    end
+    assert_equal('ERR invalid serialized sketch.', exception.message)
+  end
+
+  def test_dump_restore
+    assert_nil(@r.call(%w(histk.dump s)))
+    (1..300).each { |i| @r.call(['histk.add', 's', Math.sqrt(i), i % 7 + 1]) }
+    @r.call(%w(histk.resize c 16 compact))
+    (1..40).each { |i| @r.call(['histk.add', 'c', -i * 1.5]) }
+    %w(s c).each do |k|
+      dump = @r.call(['histk.dump', k])
+      assert_equal(1, dump.getbyte(0))
+      assert_equal('OK', @r.call(['histk.restore', "#{k}2", dump]))
+      assert_equal(@r.call(['dump', k]), @r.call(['dump', "#{k}2"]))
+      assert_equal(dump, @r.call(['histk.dump', "#{k}2"]))
+    end
+    dump = @r.call(%w(histk.dump c))
+    exception = assert_raise(Redis::CommandError) do
+      @r.call(['histk.restore', 's', dump])
+    end
+    assert_equal('BUSYKEY Target key name already exists.', exception.message)
+    @r.call(%w(expire s 1000))
+    assert_equal('OK', @r.call(['histk.restore', 's', dump, 'REPLACE']))
+    assert_equal(@r.call(%w(dump c)), @r.call(%w(dump s)))
+    assert_equal(-1, @r.call(%w(ttl s)))
+    @r.call(%w(set str x))
+    assert_equal('OK', @r.call(['histk.restore', 'str', dump, 'replace']))
+    assert_equal('40', @r.call(%w(histk.count str)).to_s)
+    exception = assert_raise(Redis::CommandError) do
+      @r.call(['histk.restore', 't', dump, 'x'])
+    end
+    assert_equal('ERR syntax error.', exception.message)
+    exception = assert_raise(Redis::CommandError) do
+      @r.call(['histk.restore', 't', 2.chr + dump[1..-1]])
+    end
+    assert_equal('ERR invalid serialized sketch.', exception.message)
+    @r.call(%w(set str x))
+    exception = assert_raise(Redis::CommandError) do
+      @r.call(%w(histk.dump str))
+    end
+    assert_match(/WRONGTYPE/, exception.message)
+  end
+
+  def test_mergeblob
+    (1..200).each { |i| @r.call(['histk.add', 'a', i * 1.1]) }
+    @r.call(%w(histk.resize b 16 compact))
+    (1..100).each { |i| @r.call(['histk.add', 'b', -i * 0.3, 2]) }
+    @r.call(%w(histk.mergestore m1 a b))
+    blob_a, blob_b = %w(a b).map { |k| @r.call(['histk.dump', k]) }
+    assert_equal(400, @r.call(['histk.mergeblob', 'm2', blob_a, blob_b]))
+    assert_equal(@r.call(%w(histk.dump m1)), @r.call(%w(histk.dump m2)))
+    assert_equal(600, @r.call(['histk.mergeblob', 'm2', blob_a]))
+    @r.call(%w(histk.mergestore m1 a))
+    assert_equal(@r.call(%w(histk.dump m1)), @r.call(%w(histk.dump m2)))
+    exception = assert_raise(Redis::CommandError) do
+      @r.call(['histk.mergeblob', 'm2', blob_a, 'garbage'])
+    end
+    assert_equal('ERR invalid serialized sketch.', exception.message)
+    assert_equal(600, @r.call(%w(histk.count m2)))
+    @r.call(%w(set str x))
+    exception = assert_raise(Redis::CommandError) do
+      @r.call(['histk.mergeblob', 'str', blob_a])
+    end
+    assert_match(/WRONGTYPE/, exception.message)
+  end
+
+  def test_replicate_effects
+    # Replicated effects also go to the AOF, so replaying it applies patches.
+    args = '--appendonly yes --appendfsync always --aof-use-rdb-preamble no'
+    restart_redis(args, 'REPLICATION EFFECTS')
+    (1..200).each { |i| @r.call(['histk.add', 's', i * 0.7, i % 5 + 1]) }
+    @r.call(%w(histk.add s 1.4 3 2.1 1 1e-300 7))
+    assert_raise(Redis::CommandError) { @r.call(%w(histk.add s 55 1 x)) }
+    @r.call(%w(histk.add s 10 5000000000))
+    @r.call(%w(histk.resize t 8 compact))
+    (1..50).each { |i| @r.call(['histk.add', 't', -i]) }
+    @r.call(%w(histk.mergestore u s t))
+    @r.call(%w(histk.mergestore t s))
+    @r.call(['histk.mergeblob', 'u', @r.call(%w(histk.dump t))])
+    @r.call(%w(histk.resize s 16 compact))
+    dumps = %w(s t u).map { |k| @r.call(['dump', k]) }
+    restart_redis(args, 'REPLICATION EFFECTS')
+    assert_equal(dumps, %w(s t u).map { |k| @r.call(['dump', k]) })
+  end
+
+  def test_coalesce_adds
+    # Pending adds are flushed before other commands touch their keys, and at
+    # shutdown at the latest, so the AOF ends up with the same sketches.
+    args = '--appendonly yes --appendfsync always --aof-use-rdb-preamble no'
+    module_args = 'REPLICATION EFFECTS COALESCE-ADDS 60000'
+    restart_redis(args, module_args)
+    (1..300).each { |i| @r.call(['histk.add', 's', i * 0.3]) }
+    @r.call(%w(histk.add t 5 2))
+    @r.call(%w(multi))
+    @r.call(%w(histk.add t 6))
+    @r.call(%w(histk.add u 1))
+    @r.call(%w(exec))
+    @r.call(%w(histk.add u 2))
+    @r.call(%w(rename u v))
+    @r.call(%w(pexpire v 100000))
+    @r.call(%w(histk.add v 3))
+    @r.call(%w(histk.resize s 16))
+    (1..50).each { |i| @r.call(['histk.add', 's', -i]) }
+    @r.call(%w(histk.add w 1))
+    @r.call(%w(del w))
+    dumps = %w(s t v).map { |k| @r.call(['dump', k]) }
+    restart_redis(args, module_args)
+    assert_equal(dumps, %w(s t v).map { |k| @r.call(['dump', k]) })
+    assert_equal([0, 0], %w(u w).map { |k| @r.call(['exists', k]) })
+    assert_operator(@r.call(%w(pttl v)), :>, 0)
+    dir = @conn.config(:get, 'dir')['dir']
+    aof = File.binread(File.join(dir, 'appendonly.aof'))
+    assert_operator(aof.scan(/HISTK\./).size, :<, 20)
+  end
+
+  def test_slabs
+    restart_redis(nil, 'SLABS 60')
+    values = (1..100).flat_map { |i| [i, 1] }
+    (1..20).each { |k| @r.call(['histk.add', k] + values) }
+    slabs = @r.call(%w(histk.slabs)).map { |s| Hash[*s] }
+    assert_equal(['cold'], slabs.map { |s| s['pool'] }.uniq)
+    assert_equal(20, slabs.map { |s| s['used'] }.reduce(:+))
+    # A sketch that's written again soon is hot.
+    @r.call(%w(histk.add 1 50))
+    hot = @r.call(%w(histk.slabs)).map { |s| Hash[*s] }.
+            select { |s| s['pool'] == 'hot' }
+    assert_equal([1], hot.map { |s| s['used'] })
+    # Nothing moves while a child is saving.
+    @r.call(%w(config set rdb-key-save-delay 100000))
+    @r.call(%w(bgsave))
+    (1..10).each { |i| @r.call(['histk.add', '1', i]) }
+    @r.call(%w(histk.add 2 50))
+    slabs = @r.call(%w(histk.slabs)).map { |s| Hash[*s] }
+    hot = slabs.select { |s| s['pool'] == 'hot' }
+    cold = slabs - hot
+    assert_equal([1, 10], %w(used fork-writes).map { |f| hot[0][f] })
+    assert_equal(19, cold.map { |s| s['used'] }.reduce(:+))
+    assert_equal(1, cold.map { |s| s['fork-writes'] }.reduce(:+))
+    @r.call(%w(config set rdb-key-save-delay 0))
+    sleep 0.1 while @r.call(%w(info persistence)) =~ /rdb_bgsave_in_progress:1/
+    # Moving a sketch doesn't change it.
+    @r.call(['histk.add', 'r'] + values)
+    @r.call(%w(histk.add r 50))
+    (1..10).each { |i| @r.call(['histk.add', 'r', i]) }
+    assert_equal(@r.call(%w(histk.dump r)), @r.call(%w(histk.dump 1)))
+    assert_equal(2, @r.call(%w(histk.slabs)).map { |s| Hash[*s] }.
+                      select { |s| s['pool'] == 'hot' }.
+                      map { |s| s['used'] }.reduce(:+))
+    # Empty slabs are released, except one of each size for each pool.
+    @r.call(%w(flushall))
+    slabs = @r.call(%w(histk.slabs)).map { |s| Hash[*s] }
+    assert_equal([0], slabs.map { |s| s['used'] }.uniq)
+    assert_equal(slabs.size, slabs.map { |s| [s['size'], s['pool']] }.uniq.size)
+  end
+
+  def test_async_adds
+    # Queued values are applied before anything reads their keys, and batches
+    # reach the AOF as merges, so replaying it rebuilds the same sketches.
+    args = '--appendonly yes --appendfsync always --aof-use-rdb-preamble no'
+    restart_redis(args, 'ASYNC-ADDS 0')
+    (1..300).each do |i|
+      assert_equal(i, @r.call(['histk.add', 's', i * 0.3]))
+    end
+    assert_equal(300, @r.call(%w(histk.count s)))
+    assert_equal(90.0, @r.call(%w(histk.quantile s 1.0)).to_f)
+    assert_equal(304, @r.call(%w(histk.add s 0.1 3 0.2)))
+    values = (1..40).flat_map { |i| [i * 0.05, 1] }
+    assert_equal(344, @r.call(['histk.add', 's'] + values))
+    assert_raise(Redis::CommandError) { @r.call(%w(histk.add s 55 1 x)) }
+    assert_equal(345, @r.call(%w(histk.count s 100)))
+    # Read-only commands read queued values without applying them, so they
+    # work in read-only scripts too.
+    (1..50).each { |i| @r.call(['histk.add', 'ro', i]) }
+    count = "return redis.call('histk.count', KEYS[1])"
+    assert_equal(50, @r.call(['eval_ro', count, 1, 'ro']))
+    assert_equal(50.0, @r.call(%w(histk.quantile ro 1)).to_f)
+    assert_not_nil(@r.call(%w(histk.dump ro)))
+    @r.call(%w(multi))
+    @r.call(%w(histk.add t 6))
+    @r.call(%w(histk.add t 7 2))
+    @r.call(%w(exec))
+    (1..100).each { |i| @r.call(['histk.add', 't', -i]) }
+    @r.call(%w(histk.mergestore u s t))
+    assert_equal(448, @r.call(%w(histk.count u)))
+    @r.call(%w(histk.add e 1))
+    @r.call(%w(pexpire e 1))
+    sleep(0.01)
+    assert_equal(1, @r.call(%w(histk.add e 2)))
+    @r.call(%w(histk.add w 1))
+    @r.call(%w(del w))
+    assert_equal(0, @r.call(%w(exists w)))
+    # Other commands apply what's queued for the keys they name.
+    @r.call(%w(histk.add fresh 1))
+    assert_equal('PONG', @r.call(%w(ping)))
+    assert_equal(1, @r.call(%w(exists fresh)))
+    (1..5).each { |i| @r.call(['histk.add', 'q', i]) }
+    assert_not_nil(@r.call(%w(dump q)))
+    (6..7).each { |i| @r.call(['histk.add', 'q', i]) }
+    assert_equal(1, @r.call(%w(copy q q2)))
+    assert_equal(7, @r.call(%w(histk.count q2)))
+    @r.call(%w(histk.add q 8))
+    assert_equal('OK', @r.call(%w(rename q q3)))
+    assert_equal(0, @r.call(%w(exists q)))
+    assert_equal(8, @r.call(%w(histk.count q3)))
+    @r.call(%w(set str x))
+    exception = assert_raise(Redis::CommandError) do
+      @r.call(%w(histk.add str 1))
+    end
+    assert_match(/WRONGTYPE/, exception.message)
+    dumps = %w(s t u e).map { |k| @r.call(['dump', k]) }
+    restart_redis(args, 'ASYNC-ADDS 0')
+    assert_equal(dumps, %w(s t u e).map { |k| @r.call(['dump', k]) })
+  end
+
+  def test_workers
+    # Commands that run on workers end up with the same sketches and replies
+    # as ones that run on the main thread, and replaying the AOF rebuilds them.
+    keys = %w(d blob small)
+    run = lambda do
+      (1..300).each { |i| @r.call(['histk.add', 's', i * 0.3]) }
+      (1..200).each { |i| @r.call(['histk.add', 't', i * -0.7]) }
+      @r.call(%w(histk.resize s 256))
+      (1..300).each { |i| @r.call(['histk.add', 's', i * 0.3 + 0.1]) }
+      assert_equal(800, @r.call(%w(histk.mergestore d s t)))
+      assert_equal(64, @r.call(%w(histk.resize s 64 COMPACT)))
+      blob = @r.call(%w(histk.dump t))
+      assert_equal(400, @r.call(['histk.mergeblob', 'blob', blob, blob]))
+      @r.call(%w(histk.add small 1))
+      @r.call(%w(histk.resize small 8))
+      exception = assert_raise(Redis::CommandError) do
+        @r.call(%w(histk.mergeblob blob garbage))
+      end
+      assert_equal('ERR invalid serialized sketch.', exception.message)
+      @r.call(%w(set str x))
+      exception = assert_raise(Redis::CommandError) do
+        @r.call(%w(histk.mergestore d s str))
+      end
+      assert_match(/WRONGTYPE/, exception.message)
+      @r.call(%w(histk.resize big 512))
+      (1..400).each { |i| @r.call(['histk.add', 'big', i * 1.1]) }
+      reads = [@r.call(%w(histk.quantile big 0.3)),
+               @r.call(%w(histk.count big 200))]
+      @r.call(%w(histk.add big 50.05))
+      reads += [@r.call(%w(histk.quantile big 0.3)),
+                @r.call(%w(histk.count big 200)),
+                @r.call(%w(histk.count big))]
+      (%w(s t) + keys).map { |k| @r.call(['histk.dump', k]) } + reads
+    end
+    restart_redis
+    expected = run.call
+    args = '--appendonly yes --appendfsync always --aof-use-rdb-preamble no'
+    restart_redis(args, 'WORKERS 2 100')
+    @r.call(%w(flushall))
+    assert_equal(expected, run.call)
+    info = @r.call(%w(info histk_workers))
+    assert_match(/histk_threads:2/, info)
+    assert_match(/histk_queued:0/, info)
+    assert_match(/histk_jobs:3/, info)
+    assert_match(/histk_snapshots:0/, info)
+    assert_match(/histk_utilization:/, info)
+    restart_redis(args, 'WORKERS 2 100')
+    assert_equal(expected.take(5),
+                 (%w(s t) + keys).map { |k| @r.call(['histk.dump', k]) })
+  end
+
+  def test_patch_errors
+    exception = assert_raise(Redis::CommandError) do
+      @r.call(%w(histk.patch s garbage))
+    end
+    assert_equal('ERR invalid patch.', exception.message)
+    # A patch that turns an empty key into a sketch that has seen 1.0 once.
+    patch = [0, 0, 0, 64, 1, 0, 1, 1].pack('C*') + [1.0, 1.0].pack('EE') +
+            [0x62, 0xf0, 0xbf, 1].pack('C*')
+    assert_equal('OK', @r.call(['histk.patch', 't', patch]))
+    assert_equal('1', @r.call(%w(histk.quantile t 0.5)))
+    exception = assert_raise(Redis::CommandError) do
+      @r.call(['histk.patch', 't', patch])
+    end
+    assert_equal("ERR patch doesn't apply to the sketch.", exception.message)
+  end
+
   def test_rewrite_aof_with_resize
     restart_redis '--appendonly yes'
     @r.call(%w(histk.resize s 4))
@@ -309,4 +821,203 @@ class TestHistk < Test::Unit::TestCase
     new_qs = args.map{ |q| @r.call(['histk.quantile', 't', q]) }
     assert_equal(qs, new_qs)
   end
+
+  def test_create
+    assert_equal('OK', @r.call(%w(histk.create s)))
+    assert_equal('aaw-histk', @r.call(%w(type s)))
+    assert_equal('OK', @r.call(%w(histk.create b engine bhtt centroids 4)))
+    (1..100).each { |i| @r.call(['histk.add', 'b', i]) }
+    assert_equal(4, @r.call(%w(histk.resize b 4)))
+    assert_equal('OK', @r.call(%w(histk.create t ENGINE tdigest)))
+    assert_equal('histk-eng', @r.call(%w(type t)))
+    assert_equal('0', @r.call(%w(histk.count t)).to_s)
+    [[%w(histk.create s), 'BUSYKEY Target key name already exists.'],
+     [%w(histk.create u engine x), 'ERR unknown engine.'],
+     [%w(histk.create u engine tdigest centroids 8),
+      'ERR unknown option for this engine.'],
+     [%w(histk.create u engine tdigest compression 5),
+      'ERR COMPRESSION must be a number from 10 to 10000.'],
+     [%w(histk.create u compression), 'ERR syntax error.'],
+     [%w(histk.create u centroids 2.7),
+      'ERR CENTROIDS must be an integer from 1 to 2048.'],
+     [%w(histk.create u engine kll k 200.5),
+      'ERR K must be an integer from 8 to 65535.'],
+     [%w(histk.quantile t 0.5), 'ERR empty histogram.'],
+     [%w(histk.resize t 8),
+      'WRONGTYPE Operation against a key holding the wrong kind of value']
+    ].each do |cmd, err|
+      exception = assert_raise(Redis::CommandError) { @r.call(cmd) }
+      assert_equal(err, exception.message)
+    end
+  end
+
+  def test_tdigest
+    @r.call(%w(histk.create t engine tdigest compression 100))
+    values = (1..10000).to_a.shuffle(random: Random.new(1))
+    values.each_slice(100) do |vs|
+      @r.call(['histk.add', 't'] + vs.flat_map { |v| [v, 1] })
+    end
+    assert_equal('10000', @r.call(%w(histk.count t)).to_s)
+    assert_equal('1', @r.call(%w(histk.quantile t 0)))
+    assert_equal('10000', @r.call(%w(histk.quantile t 1)))
+    [0.01, 0.1, 0.5, 0.9, 0.99].each do |q|
+      assert_in_delta(q * 10000, @r.call(['histk.quantile', 't', q]).to_f, 50)
+      assert_in_delta(q * 10000, @r.call(['histk.count', 't', q * 10000]), 50)
+    end
+
+    (1..10000).each_slice(100) do |vs|
+      @r.call(['histk.add', 'u'] + vs.flat_map { |v| [v, 1] })
+    end
+    exception = assert_raise(Redis::CommandError) do
+      @r.call(%w(histk.mergestore t u))
+    end
+    assert_equal("ERR can't merge sketches from different engines.",
+                 exception.message)
+    assert_equal(20000, @r.call(%w(histk.mergestore m t nokey t)))
+    assert_equal('histk-eng', @r.call(%w(type m)))
+    assert_in_delta(5000, @r.call(%w(histk.quantile m 0.5)).to_f, 50)
+    assert_equal(40000, @r.call(%w(histk.mergestore m m)))
+  end
+
+  def test_tdigest_persistence
+    restart_redis '--appendonly yes'
+    @r.call(%w(histk.create t engine tdigest compression 10))
+    (1..1000).each { |i| @r.call(['histk.add', 't', i, i % 3 + 1]) }
+    args = [0.1, 0.25, 0.5, 0.75, 0.9, 0.99]
+    qs = args.map { |q| @r.call(['histk.quantile', 't', q]) }
+    dump = @r.call(%w(histk.dump t))
+    assert_equal(2, dump.getbyte(0))
+    assert_equal('OK', @r.call(['histk.restore', 'r', dump]))
+    assert_equal(dump, @r.call(%w(histk.dump r)))
+    @r.call(['save'])
+    restart_redis
+    assert_equal(qs, args.map { |q| @r.call(['histk.quantile', 't', q]) })
+    assert_equal(dump, @r.call(%w(histk.dump r)))
+    @r.call(['bgrewriteaof'])
+    while @conn.info('persistence')['aof_rewrite_scheduled'] != '0' && \
+          @conn.info('persistence')['aof_rewrite_in_progress'] != '0'
+      sleep 0.1
+    end
+    rm_redis_file(@conn, 'dump.rdb')
+    restart_redis '--appendonly yes'
+    assert_equal(qs, args.map { |q| @r.call(['histk.quantile', 't', q]) })
+    assert_equal('histk-eng', @r.call(%w(type r)))
+  end
+
+  def test_ddsketch
+    @r.call(%w(histk.create d engine ddsketch relative-accuracy 0.01))
+    values = (1..10000).map { |i| i * i * 0.001 }
+    values.shuffle(random: Random.new(1)).each_slice(100) do |vs|
+      @r.call(['histk.add', 'd'] + vs.flat_map { |v| [v, 1] })
+    end
+    @r.call(%w(histk.add d -5 10 0 10))
+    assert_equal('10020', @r.call(%w(histk.count d)).to_s)
+    assert_equal('-5', @r.call(%w(histk.quantile d 0)))
+    [0.01, 0.1, 0.5, 0.9, 0.99, 0.999].each do |q|
+      v = values[((q * 10019).floor - 20).clamp(0, 9999)]
+      assert_in_delta(v, @r.call(['histk.quantile', 'd', q]).to_f, v * 0.01)
+    end
+    assert_equal(10, @r.call(%w(histk.count d -1)))
+    assert_equal(20, @r.call(%w(histk.count d 0)))
+
+    @r.call(%w(histk.create e engine ddsketch relative-accuracy 0.02))
+    @r.call(%w(histk.add e 1))
+    exception = assert_raise(Redis::CommandError) do
+      @r.call(%w(histk.mergestore d e))
+    end
+    assert_equal("ERR can't merge DDSketches with different relative " \
+                 'accuracies.', exception.message)
+    exception = assert_raise(Redis::CommandError) do
+      @r.call(%w(histk.create f engine ddsketch buckets 8))
+    end
+    assert_equal('ERR BUCKETS must be an integer from 16 to 65536.',
+                 exception.message)
+    assert_equal(20040, @r.call(%w(histk.mergestore m d d)))
+
+    dump = @r.call(%w(histk.dump m))
+    @r.call(['save'])
+    restart_redis
+    assert_equal(dump, @r.call(%w(histk.dump m)))
+    assert_equal('OK', @r.call(['histk.restore', 'r', dump]))
+    assert_equal(@r.call(%w(histk.quantile m 0.5)),
+                 @r.call(%w(histk.quantile r 0.5)))
+  end
+
+  def test_hdr
+    @r.call(%w(histk.create h engine hdr lowest 1 highest 1000000))
+    (1..20000).to_a.shuffle(random: Random.new(1)).each_slice(100) do |vs|
+      @r.call(['histk.add', 'h'] + vs.flat_map { |v| [v, 1] })
+    end
+    assert_equal(20010, @r.call(%w(histk.add h 0.25 5 5000000 5)))
+    assert_equal('0.25', @r.call(%w(histk.quantile h 0)))
+    assert_equal('5000000', @r.call(%w(histk.quantile h 1)))
+    [0.01, 0.1, 0.5, 0.9, 0.99].each do |q|
+      v = (q * 20010).round - 5
+      assert_in_delta(v, @r.call(['histk.quantile', 'h', q]).to_f, v * 0.01)
+    end
+    assert_equal(5, @r.call(%w(histk.count h 0.5)))
+    assert_in_delta(10005, @r.call(%w(histk.count h 10000)), 50)
+    assert_equal(20005, @r.call(%w(histk.count h 999000)))
+
+    exception = assert_raise(Redis::CommandError) do
+      @r.call(%w(histk.create e engine hdr lowest 10 highest 15))
+    end
+    assert_equal('ERR invalid options for this engine.', exception.message)
+    assert_equal(0, @r.call(%w(exists e)))
+    @r.call(%w(histk.create e engine hdr significant-digits 3))
+    @r.call(%w(histk.add e 1))
+    exception = assert_raise(Redis::CommandError) do
+      @r.call(%w(histk.mergestore h e))
+    end
+    assert_equal("ERR can't merge HDR histograms with different ranges or " \
+                 'significant digits.', exception.message)
+    assert_equal(40020, @r.call(%w(histk.mergestore m h h)))
+
+    dump = @r.call(%w(histk.dump m))
+    @r.call(['save'])
+    restart_redis
+    assert_equal(dump, @r.call(%w(histk.dump m)))
+    assert_equal('OK', @r.call(['histk.restore', 'r', dump]))
+    assert_equal(@r.call(%w(histk.quantile m 0.5)),
+                 @r.call(%w(histk.quantile r 0.5)))
+  end
+
+  def test_kll
+    @r.call(%w(histk.create k engine kll k 200))
+    (1..20000).to_a.shuffle(random: Random.new(1)).each_slice(100) do |vs|
+      @r.call(['histk.add', 'k'] + vs.flat_map { |v| [v, 1] })
+    end
+    assert_equal(30000, @r.call(%w(histk.add k 0.5 5000 30000 5000)))
+    assert_equal('0.5', @r.call(%w(histk.quantile k 0)))
+    assert_equal('30000', @r.call(%w(histk.quantile k 1)))
+    qs = [0.25, 0.5, 0.75]
+    quantiles = @r.call(%w(histk.quantile k) + qs)
+    assert_equal(qs.map { |q| @r.call(['histk.quantile', 'k', q]) },
+                 quantiles)
+    # Ranks are within 1.65% of the true ones.
+    qs.zip(quantiles).each do |q, v|
+      assert_in_delta(q * 30000 - 5000, v.to_f, 30000 * 0.0165)
+    end
+    assert_in_delta(15000, @r.call(%w(histk.count k 10000)), 30000 * 0.0165)
+    assert_equal(30000, @r.call(%w(histk.count k 30000)))
+
+    @r.call(%w(histk.create e engine kll k 100))
+    @r.call(%w(histk.add e 1))
+    exception = assert_raise(Redis::CommandError) do
+      @r.call(%w(histk.mergestore k e))
+    end
+    assert_equal("ERR can't merge KLL sketches with different K.",
+                 exception.message)
+    assert_equal(60000, @r.call(%w(histk.mergestore m k k)))
+
+    dump = @r.call(%w(histk.dump m))
+    @r.call(['save'])
+    restart_redis
+    assert_equal(dump, @r.call(%w(histk.dump m)))
+    assert_equal('OK', @r.call(['histk.restore', 'r', dump]))
+    # Both compact the same way from here on.
+    @r.call(['histk.add', 'm'] + (1..5000).flat_map { |v| [v, 1] })
+    @r.call(['histk.add', 'r'] + (1..5000).flat_map { |v| [v, 1] })
+    assert_equal(@r.call(%w(histk.dump m)), @r.call(%w(histk.dump r)))
+  end
 end